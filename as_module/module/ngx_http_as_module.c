@@ -1,16 +1,19 @@
 #include <ngx_config.h>
 #include <ngx_core.h>
 #include <ngx_http.h>
+#include <nginx.h>
 
 #include <pthread.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <sys/mman.h>
 
 // aerospike includes.
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <math.h>
 
 #include <aerospike/aerospike.h>
 #include <aerospike/aerospike_key.h>
@@ -29,9 +32,108 @@
 #include <aerospike/as_record.h>
 #include <aerospike/as_record_iterator.h>
 #include <aerospike/as_val.h>
+#include <aerospike/as_boolean.h>
+#include <aerospike/as_integer.h>
+#include <aerospike/as_double.h>
+#include <aerospike/as_string.h>
+#include <aerospike/as_geojson.h>
+#include <aerospike/as_list.h>
+#include <aerospike/as_map.h>
+#include <aerospike/as_arraylist.h>
+#include <aerospike/as_hashmap.h>
+#include <aerospike/as_nil.h>
 #include <aerospike/as_policy.h>
+#include <aerospike/aerospike_batch.h>
+#include <aerospike/as_msgpack.h>
 
-#define MAX_L 4096
+#include <zstd.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#define NGX_HTTP_AS_HAVE_SSE2 1
+#endif
+
+// header holding the milliseconds the client waits for the response, which bounds the timeout of the transaction.
+#define NGX_HTTP_AS_DEADLINE_HEADER "X-Request-Timeout"
+
+// retries of reads on the next replica kept in reserve by the budget of as_replica_retry, each worth 100 tokens.
+#define NGX_HTTP_AS_REPLICA_RETRY_BURST 10
+
+// retries kept in reserve by the budget of as_retry, each worth 100 tokens.
+#define NGX_HTTP_AS_RETRY_BURST 10
+
+// milliseconds between two checks of a worker for the slots of as_limit given back by the other workers, while requests of the worker wait for one.
+#define NGX_HTTP_AS_LIMIT_POLL 2
+
+// workers, of the running and the exiting generations, which can hold the slots of an as_limit zone at once.
+#define NGX_HTTP_AS_LIMIT_WORKERS 256
+
+// seconds a client is asked to wait before retrying, when the cluster is unavailable or overloaded.
+#define NGX_HTTP_AS_RETRY_AFTER 1
+
+// states of the circuit breaker of a cluster (as_breaker).
+#define NGX_HTTP_AS_BREAKER_CLOSED 0
+#define NGX_HTTP_AS_BREAKER_OPEN 1
+#define NGX_HTTP_AS_BREAKER_HALF_OPEN 2
+
+// milliseconds a probe of an as_breaker circuit waits for the cluster to connect and to answer, at most.
+#define NGX_HTTP_AS_BREAKER_PROBE_TIMEOUT 200
+
+// requests of a worker a half open circuit of as_breaker lets through, which close it if they all succeed.
+#define NGX_HTTP_AS_BREAKER_TRIALS 5
+
+// circuits of as_breaker whose probes are shared by the workers, in the as_breaker zone.
+#define NGX_HTTP_AS_BREAKER_MAX 256
+
+// how reads use the secondary cluster of as_secondary.
+#define NGX_HTTP_AS_READS_FAILOVER 0
+#define NGX_HTTP_AS_READS_FASTEST 1
+
+// milliseconds between two connections to a secondary cluster, a shard or the cluster of as_connect which is down.
+#define NGX_HTTP_AS_SECONDARY_RECONNECT 1000
+
+// with reads=fastest, one read in this many goes to the slower cluster first, to keep its latency current.
+#define NGX_HTTP_AS_SECONDARY_PROBE 100
+
+// records written by a batch of the as_write_behind flusher.
+#define NGX_HTTP_AS_WRITE_BEHIND_BATCH 1000
+
+// the as_spool file starts with this magic number, and is replayed every NGX_HTTP_AS_SPOOL_TICK milliseconds.
+// a record of this length marks the end of the records before they wrap to the start of the file.
+#define NGX_HTTP_AS_SPOOL_MAGIC 0x4c4f4f53
+#define NGX_HTTP_AS_SPOOL_TICK 100
+#define NGX_HTTP_AS_SPOOL_WRAP 0xffffffff
+
+// records of an as_import body written by a batch, unless set by its batch parameter,
+// and errors of its records listed in the response.
+#define NGX_HTTP_AS_IMPORT_BATCH 1000
+#define NGX_HTTP_AS_IMPORT_MAX_ERRORS 100
+
+// bytes of an as_import body kept in its pool, after which the batch is written, even if it is not full, and the pool replaced.
+#define NGX_HTTP_AS_IMPORT_POOL_SIZE (4 * 1024 * 1024)
+
+// records of an op=scan request fetched and sent at a time, and the bytes after which a page is cut short.
+#define NGX_HTTP_AS_SCAN_PAGE 1000
+#define NGX_HTTP_AS_SCAN_PAGE_SIZE (1024 * 1024)
+
+// keys an op=mget request reads at most, and the size of its keys arguement.
+#define NGX_HTTP_AS_BATCH_MAX 100
+#define NGX_HTTP_AS_BATCH_KEYS 8192
+
+// size of the buffers of the response. a larger value gets a buffer of its own.
+#define NGX_HTTP_AS_RESPONSE_BUF_SIZE 4096
+
+// compressed values are stored as blobs starting with this header.
+// the four magic bytes are followed by the type of the original value.
+#define NGX_HTTP_AS_COMPRESS_MAGIC "ASZ\x01"
+#define NGX_HTTP_AS_COMPRESS_MAGIC_LEN 4
+#define NGX_HTTP_AS_COMPRESS_HEADER_LEN (NGX_HTTP_AS_COMPRESS_MAGIC_LEN + 1)
+
+// a compressed value is never larger than a record, whose largest size is the largest write-block-size of the server.
+#define NGX_HTTP_AS_COMPRESS_MAX_SIZE (8 * 1024 * 1024)
+
+// nor is a value of a request body, which bounds the strings and blobs of a body without a Content-Length.
+#define NGX_HTTP_AS_VALUE_MAX_SIZE (8 * 1024 * 1024)
 
 // aerospike include ends.
 typedef struct
@@ -41,27 +143,689 @@ typedef struct
 	int port[256];
 }ngx_http_as_hosts;
 
+/* This is a cluster other than the one of as_connect, the secondary of as_secondary or a shard of as_shard_group,
+ * which each worker connects to when it is first needed. hosts are parsed once, by its directive.
+ * latency is the moving average of the reads sent to it, in milliseconds times 8, as for the primary cluster.
+ */
+typedef struct
+{
+	aerospike *as;
+	ngx_http_as_hosts hosts;
+	bool connected;
+	ngx_msec_t next_connect;
+	ngx_uint_t reads;
+	ngx_uint_t latency;
+	ngx_uint_t probes;
+}ngx_http_as_cluster_t;
+
+/* This is the spool of as_spool, a file of each worker which the puts the cluster could not take are appended to, and replayed from in order.
+ * The file is mapped in the worker, and is synced to the disk on each put, every fsync_interval, or as the kernel sees fit.
+ */
+typedef struct
+{
+	ngx_str_t path;
+	size_t size;
+	bool fsync_always;
+	ngx_msec_t fsync_interval;
+	ngx_uint_t rate;
+	ngx_fd_t fd;
+	u_char *addr;
+	ngx_msec_t synced;
+	ngx_event_t event;
+}ngx_http_as_spool_t;
+
+/* This is the start of an as_spool file. The records are from head to tail, the offsets of the first and past the last of them,
+ * in a ring after the header. Records past the tail wrap to the start, and the spool is empty when the head is the tail.
+ */
+typedef struct
+{
+	uint32_t magic;
+	uint32_t reserved;
+	uint64_t head;
+	uint64_t tail;
+}ngx_http_as_spool_header_t;
+
+/* This is a record of an as_spool file, followed by len bytes of the namespace, set and key, each ending with '\0',
+ * and the bins, serialized in msgpack as those of as_write_behind. Records are aligned to 8 bytes.
+ */
+typedef struct
+{
+	uint32_t len;
+	uint32_t crc;
+}ngx_http_as_spool_record_t;
+
 typedef struct
 {
 	aerospike *as;
 	bool is_hosts_present;  // this is check if the hosts is same as prev. hosts
 	ngx_str_t default_hosts;
+	ngx_http_as_hosts hosts;  // the default hosts, parsed once by as_connect
 	char default_namespace [40];
 	ngx_http_as_hosts current_hosts; //store the current hosts to which as obj. is connected to
 	bool connected;
+	ngx_msec_t next_connect;  // the default hosts are not connected to again before, outside of a request url
 	bool use_server_conf;
+
+	bool compress;  // compress large string and blob bins on put (as_compress)
+	int compress_level;
+	size_t compress_min_size;
+
+	// templates for the namespace, set and key (as_namespace, as_set, as_key).
+	// if a template is not set, the value is parsed from the url arguements.
+	ngx_http_complex_value_t *namespace_template;
+	ngx_http_complex_value_t *set_template;
+	ngx_http_complex_value_t *key_template;
+
+	ngx_array_t *ops;  // operations of as_operate_ops, of type ngx_http_as_op_t
+
+	bool minimal_errors;  // send errors with an empty body (as_minimal_errors)
+
+	// timeouts and retries of transactions (as_timeout, as_socket_timeout, as_max_retries).
+	// if not set, the defaults of the client are used.
+	ngx_msec_t timeout;
+	ngx_msec_t socket_timeout;
+	ngx_int_t max_retries;
+
+	// reads timing out after replica_timeout milliseconds are tried again on the next replica (as_replica_retry).
+	// each read adds replica_budget tokens, up to NGX_HTTP_AS_REPLICA_RETRY_BURST retries, and each retry takes 100.
+	// the tokens are per worker, as the configuration is.
+	ngx_msec_t replica_timeout;
+	ngx_uint_t replica_budget;
+	ngx_uint_t replica_tokens;
+
+	// transactions failing with a transient error are tried again up to retry_attempts times, at once (as_retry).
+	// each request adds retry_budget tokens, up to NGX_HTTP_AS_RETRY_BURST retries, and each retry takes 100.
+	// the tokens are per worker, as the configuration is.
+	ngx_uint_t retry_attempts;
+	ngx_uint_t retry_budget;
+	ngx_uint_t retry_tokens;
+
+	// adaptive limit of the transactions in flight on the cluster, shared by the workers (as_limit).
+	// the limit grows while transactions are faster than limit_latency, and shrinks when they are slower or the cluster is overloaded.
+	ngx_shm_zone_t *limit_zone;
+	ngx_msec_t limit_latency;
+	ngx_msec_t limit_queue;
+	ngx_uint_t limit_min;
+	ngx_uint_t limit_max;
+
+	// circuit breaker of the cluster, per worker (as_breaker). it opens when breaker_threshold percent of the requests
+	// of an interval failed, and then fails requests at once, until a probe of the cluster, every interval, succeeds.
+	// a single worker probes the cluster each interval, and the others take its result from the slot breaker_index of breaker_zone,
+	// once its generation is past breaker_generation. it is half open after the probe, when it lets NGX_HTTP_AS_BREAKER_TRIALS
+	// requests through, breaker_trials of them so far, and closes once they all succeeded, or after an interval without failures.
+	ngx_msec_t breaker_interval;
+	ngx_uint_t breaker_threshold;
+	ngx_uint_t breaker_min_requests;
+	ngx_uint_t breaker_state;
+	ngx_uint_t breaker_requests;
+	ngx_uint_t breaker_failures;
+	ngx_uint_t breaker_trials;
+	ngx_uint_t breaker_successes;
+	ngx_event_t breaker_event;
+	ngx_shm_zone_t *breaker_zone;
+	ngx_uint_t breaker_index;
+	ngx_atomic_uint_t breaker_generation;
+
+	// reads fail over to the secondary cluster, or go to the faster of the two (as_secondary).
+	// latency is the moving average of the reads sent to the primary, in milliseconds times 8, each read weighing 1/8 as in tcp's srtt.
+	ngx_http_as_cluster_t *secondary;
+	ngx_uint_t latency;
+
+	// clusters the keys are spread over by their digest, of type ngx_http_as_cluster_t (as_shard_group).
+	// as_connect and as_secondary are not used then.
+	ngx_array_t *shards;
+
+	// puts are buffered in a shared zone and acknowledged at once, and the workers write them in batches
+	// every write_behind_interval (as_write_behind). puts of a buffered key are merged with it.
+	ngx_shm_zone_t *write_behind_zone;
+	ngx_msec_t write_behind_interval;
+	ngx_uint_t write_behind_max;
+	ngx_event_t write_behind_event;
+
+	// puts the cluster could not take are acknowledged and appended to a file of the worker,
+	// which is replayed once the circuit is closed (as_spool).
+	ngx_http_as_spool_t *spool;
+
+	// records of the body of an as_import request are written in batches of this many.
+	ngx_uint_t import_batch;
 	
 	ngx_pool_t *pool;
 }ngx_http_as_conf_t;
 
+/* This is the structure for an operation of the as_operate_ops directive.
+ * The operation, bin and value are parsed once at configuration time.
+ */
+typedef enum
+{
+	NGX_HTTP_AS_OP_READ,
+	NGX_HTTP_AS_OP_WRITE,
+	NGX_HTTP_AS_OP_INCR,
+	NGX_HTTP_AS_OP_APPEND,
+	NGX_HTTP_AS_OP_PREPEND,
+	NGX_HTTP_AS_OP_TOUCH,
+	NGX_HTTP_AS_OP_DELETE
+}ngx_http_as_op_type;
+
+typedef struct
+{
+	ngx_http_as_op_type type;
+	char bin[AS_BIN_NAME_MAX_SIZE];
+	bool is_str;
+	int64_t int_value;
+	char *str_value;
+}ngx_http_as_op_t;
+
+/* This is a bin declared in an as_schema block.
+ * index is the position of the bin in the block, which is the order bins are written in the response.
+ * json_name is the bin name as a json key, formatted once at configuration time.
+ */
+typedef struct
+{
+	char name[AS_BIN_NAME_MAX_SIZE];
+	size_t len;
+	as_val_t type;
+	ngx_uint_t index;
+	ngx_str_t json_name;
+}ngx_http_as_schema_bin_t;
+
+/* This is the schema of a set, declared by an as_schema block.
+ * bins holds the declared bins, of type ngx_http_as_schema_bin_t, and hash maps their names to them.
+ */
+typedef struct
+{
+	char set[AS_SET_MAX_SIZE];
+	ngx_array_t bins;
+	ngx_hash_t hash;
+}ngx_http_as_schema_t;
+
+/* This is the main configuration of the module, which holds the schemas of the as_schema blocks,
+ * and the configurations with an as_breaker, an as_write_behind or an as_spool, whose timers are started by each worker.
+ * limits holds the configurations with an as_limit, limit_waiters the requests of the worker waiting for a slot of one,
+ * and limit_event the timer of the worker checking for the slots given back by the other workers.
+ */
+typedef struct
+{
+	ngx_array_t schemas;
+	ngx_array_t breakers;
+	ngx_array_t write_behinds;
+	ngx_array_t spools;
+	ngx_array_t limits;
+	ngx_queue_t limit_waiters;
+	ngx_event_t limit_event;
+}ngx_http_as_main_conf_t;
+
+/* This is a bin of a record to be written in the response, with its declaration in the schema of the set, if any. */
+typedef struct
+{
+	const as_bin *bin;
+	ngx_http_as_schema_bin_t *decl;
+}ngx_http_as_ordered_bin_t;
+
+/* This is the structure for a bin and its value, to be put in a record.
+ * bin and value point into the parsed url arguements or request body.
+ */
 typedef struct 
 {
-	char bin[1000];
-	char value[1000];
+	char *bin;
+	char *value;
 	bool is_str;
 
 }ngx_http_binvalue;
 
+/* This is the request context of the module.
+ * For the as_rest directive, namespace, set and key hold the slices of the uri.
+ * body holds the request body of a put, as a null terminated string.
+ * json or msgpack is set if the request body of a put is in that format, which is parsed from the body buffers directly.
+ * limited is set once the request holds a slot of as_limit, limit_slot, and limit_deadline is the end of its wait for one, as limit_waiter.
+ * limit_start is the start of the first transaction of the request, whose time adapts the limit.
+ * import is the state of an as_import request, while its body is read, and scan the state of an op=scan request, while its records are sent.
+ */
+typedef struct ngx_http_as_import_s ngx_http_as_import_t;
+typedef struct ngx_http_as_scan_s ngx_http_as_scan_t;
+
+/* This is the slot of as_limit held by a request. It is given back once its transactions are done, or by the cleanup of its pool. */
+typedef struct
+{
+	ngx_http_request_t *r;
+	ngx_http_as_conf_t *as_conf;
+	bool released;
+}ngx_http_as_limit_slot_t;
+
+/* This is a request waiting for a slot of as_limit, in the queue of the worker. released is the count of slots given back when it was queued. */
+typedef struct
+{
+	ngx_queue_t queue;
+	ngx_http_request_t *r;
+	ngx_shm_zone_t *zone;
+	ngx_atomic_uint_t released;
+	bool queued;
+}ngx_http_as_limit_waiter_t;
+
+typedef struct
+{
+	bool rest;
+	ngx_str_t namespace;
+	ngx_str_t set;
+	ngx_str_t key;
+
+	ngx_str_t body;
+	bool json;
+	bool msgpack;
+
+	bool limited;
+	ngx_msec_t limit_deadline;
+	ngx_msec_t limit_start;
+	ngx_http_as_limit_slot_t *limit_slot;
+	ngx_http_as_limit_waiter_t *limit_waiter;
+
+	ngx_http_as_import_t *import;
+	ngx_http_as_scan_t *scan;
+}ngx_http_as_ctx_t;
+
+/* This is the share of the slots of an as_limit zone held by the worker of pid. */
+typedef struct
+{
+	ngx_atomic_t pid;
+	ngx_atomic_t inflight;
+}ngx_http_as_limit_worker_t;
+
+/* This is the state of as_limit in shared memory, for all the workers.
+ * limit is in thousandths of a transaction, so it can grow by a fraction at a time.
+ * inflight is the sum of the slots held by the workers, whose shares are kept so the slots of a worker which crashed are given back.
+ * released counts the slots given back, for the workers to wake up the requests waiting for one.
+ */
+typedef struct
+{
+	ngx_atomic_t inflight;
+	ngx_atomic_t limit;
+	ngx_atomic_t released;
+	ngx_http_as_limit_worker_t workers[NGX_HTTP_AS_LIMIT_WORKERS];
+}ngx_http_as_limit_sh_t;
+
+/* This is the probe of an as_breaker circuit in the as_breaker zone, shared by the workers.
+ * next is the time of the next probe, which the worker probing the cluster moves on, and generation counts the probes, the last of which found the cluster up or not.
+ */
+typedef struct
+{
+	ngx_atomic_t next;
+	ngx_atomic_t generation;
+	ngx_atomic_t up;
+}ngx_http_as_breaker_sh_t;
+
+/* This is the state of the retries of a transaction, for as_retry.
+ * total_timeout is the timeout of the first try, which the retries share.
+ */
+typedef struct
+{
+	ngx_uint_t attempt;
+	ngx_msec_t start;
+	uint32_t total_timeout;
+}ngx_http_as_retry_t;
+
+/* This is the state of an as_write_behind zone, in its shared memory.
+ * The buffered puts are in a tree by key, to merge puts of the same key, and in a queue in the order they are written.
+ * stamp counts the puts stored, and flusher is the pid of the worker flushing the zone, so a batch is never written
+ * while an older one of the same keys is still in flight.
+ */
+typedef struct
+{
+	ngx_rbtree_t rbtree;
+	ngx_rbtree_node_t sentinel;
+	ngx_queue_t queue;
+	ngx_uint_t count;
+	ngx_uint_t stamp;
+	ngx_atomic_t flusher;
+}ngx_http_as_write_behind_sh_t;
+
+/* This is a put buffered by as_write_behind. The key is the namespace, set and key, each ending with '\0',
+ * and the bins are a map of the bin names to their values, serialized in msgpack by the client.
+ * stamp is that of the zone when the bins were last stored.
+ */
+typedef struct
+{
+	ngx_str_node_t sn;
+	ngx_queue_t queue;
+	u_char *bins;
+	size_t size;
+	ngx_uint_t stamp;
+	u_char data[1];
+}ngx_http_as_write_behind_node_t;
+
+/* This is a put taken out of the zone by the flusher, copied into its pool. */
+typedef struct
+{
+	ngx_str_t key;
+	as_buffer bins;
+	as_map *map;
+	ngx_uint_t cluster;
+	uint32_t slot;
+}ngx_http_as_write_behind_entry_t;
+
+/* This is the response of a request, in the format accepted by the client.
+ * It is written to a chain of buffers from the request pool, which is sent as is.
+ * status is the http status it is sent with, 200 unless the request failed, and retry_after the seconds of its Retry-After header, if not 0.
+ * minimal is set if the client only wants the status of an error, which is then sent without a body,
+ * and ndjson if the json body is a record a line, as op=mget sends it.
+ * error is set if a buffer could not be allocated, in which case nothing more is written.
+ */
+typedef struct
+{
+	ngx_pool_t *pool;
+	ngx_chain_t *out;
+	ngx_chain_t **last;
+	ngx_buf_t *buf;
+	off_t size;
+	ngx_uint_t status;
+	time_t retry_after;
+	bool msgpack;
+	bool minimal;
+	bool ndjson;
+	bool error;
+}ngx_http_as_response_t;
+
+/* These are the errors whose response does not depend on the request. */
+typedef enum
+{
+	NGX_HTTP_AS_NOT_CONNECTED = 0,
+	NGX_HTTP_AS_INSTANCE_NULL,
+	NGX_HTTP_AS_INVALID_KEY,
+	NGX_HTTP_AS_BINS_AND_VALUES_MISMATCH,
+	NGX_HTTP_AS_UNKNOWN_OPERATION,
+	NGX_HTTP_AS_DEADLINE_EXCEEDED,
+	NGX_HTTP_AS_OVERLOADED,
+	NGX_HTTP_AS_CIRCUIT_OPEN,
+	NGX_HTTP_AS_INVALID_SCAN,
+	NGX_HTTP_AS_INVALID_BATCH,
+	NGX_HTTP_AS_CANNED_ERRORS
+}ngx_http_as_canned_error_e;
+
+/* This is the response of such an error. The json and msgpack bodies are formatted once the configuration is read,
+ * and every request failing with the error is sent the same read only buffer.
+ */
+typedef struct
+{
+	char *message;
+	ngx_uint_t status;
+	time_t retry_after;
+	ngx_str_t json;
+	ngx_str_t msgpack;
+}ngx_http_as_canned_error_t;
+
+/* This is a bin decoded from a request body, before it is set in the record.
+ * The record is created once the number of bins is known.
+ * A string or blob points into the request body, or to a copy in the request pool if it was split across buffers.
+ * val holds a list, a map or a tagged value, which is set in the record as is.
+ */
+typedef struct
+{
+	char name[AS_BIN_NAME_MAX_SIZE];
+	as_val_t type;
+	int64_t integer;
+	double dbl;
+	u_char *str;
+	size_t len;
+	as_val *val;
+}ngx_http_as_pending_bin_t;
+
+#define NGX_HTTP_AS_BUILDER_MAX_DEPTH 32
+
+/* This is a list or map being built as the value of a bin, or of another list or map.
+ * type is AS_BYTES or AS_GEOJSON for a tagged value, a map with the single key "$bytes" or "$geojson".
+ * key holds the key of the next value of a map, and is NULL if the next value is a key.
+ * capacity is the number of entries the list or map is created with.
+ */
+typedef struct
+{
+	as_val_t type;
+	as_val *val;
+	as_val *key;
+	uint32_t capacity;
+}ngx_http_as_builder_container_t;
+
+/* This is the record builder, which the body decoders call for each value they decode.
+ * depth is the nesting of the current value, the record itself being the object at depth 1.
+ * containers holds the lists and maps being built at depths 2 and more.
+ * error holds the message for the response if a value is rejected, and is NULL otherwise.
+ * If the set has a schema, decl is the declaration of the bin named by the last key.
+ */
+typedef struct
+{
+	ngx_http_as_conf_t *as_conf;
+	ngx_http_as_schema_t *schema;
+	ngx_pool_t *pool;
+	ngx_uint_t depth;
+	bool has_bin;
+	char bin[AS_BIN_NAME_MAX_SIZE];
+	ngx_http_as_schema_bin_t *decl;
+	ngx_array_t bins;
+	ngx_http_as_builder_container_t containers[NGX_HTTP_AS_BUILDER_MAX_DEPTH + 1];
+	char *error;
+}ngx_http_as_record_builder_t;
+
+/* These are the states of the streaming json parser. */
+typedef enum
+{
+	NGX_HTTP_AS_JSON_VALUE = 0,
+	NGX_HTTP_AS_JSON_FIRST_KEY,
+	NGX_HTTP_AS_JSON_KEY,
+	NGX_HTTP_AS_JSON_COLON,
+	NGX_HTTP_AS_JSON_FIRST_VALUE,
+	NGX_HTTP_AS_JSON_AFTER_VALUE,
+	NGX_HTTP_AS_JSON_STRING,
+	NGX_HTTP_AS_JSON_ESCAPE,
+	NGX_HTTP_AS_JSON_UNICODE,
+	NGX_HTTP_AS_JSON_NUMBER,
+	NGX_HTTP_AS_JSON_LITERAL,
+	NGX_HTTP_AS_JSON_DONE
+}ngx_http_as_json_state;
+
+#define NGX_HTTP_AS_JSON_MAX_DEPTH 32
+#define NGX_HTTP_AS_JSON_NUMBER_LEN 64
+
+// size of the chunks in which a request body in a temporary file is read.
+#define NGX_HTTP_AS_BODY_FILE_CHUNK 16384
+
+/* This is the streaming json parser. It is fed the body one buffer at a time.
+ * A string is unescaped in place, from start to dst, while it lies in one buffer.
+ * If a string is split across buffers, it is moved to the spill buffer, allocated from the request pool.
+ * containers holds the '{' or '[' of each open container.
+ */
+typedef struct
+{
+	ngx_http_as_json_state state;
+	ngx_uint_t depth;
+	u_char containers[NGX_HTTP_AS_JSON_MAX_DEPTH];
+	bool is_key;
+
+	u_char *start;
+	u_char *dst;
+	bool spilled;
+	u_char *spill;
+	size_t spill_len;
+	size_t spill_size;
+
+	uint32_t code;
+	ngx_uint_t code_digits;
+	uint32_t high_surrogate;
+
+	u_char number[NGX_HTTP_AS_JSON_NUMBER_LEN];
+	size_t number_len;
+	bool is_double;
+
+	const char *literal;
+	size_t literal_pos;
+
+	ngx_pool_t *pool;
+	ngx_http_as_record_builder_t *builder;
+}ngx_http_as_json_parser_t;
+
+/* These are the states of the streaming msgpack parser. */
+typedef enum
+{
+	NGX_HTTP_AS_MSGPACK_TYPE = 0,
+	NGX_HTTP_AS_MSGPACK_HEADER,
+	NGX_HTTP_AS_MSGPACK_PAYLOAD,
+	NGX_HTTP_AS_MSGPACK_DONE
+}ngx_http_as_msgpack_state;
+
+#define NGX_HTTP_AS_MSGPACK_MAX_DEPTH 32
+
+/* This is the streaming msgpack parser. It is fed the body one buffer at a time.
+ * header holds the bytes following the type byte, which may be split across buffers.
+ * A string or blob which lies in one buffer is passed to the builder in place.
+ * Else it is copied to the payload buffer, allocated from the request pool with the length of the value.
+ * remaining holds the number of values left in each open container, two for each entry of a map.
+ * limit is the length of the body, which no value can be longer than.
+ * If stream is set, the body holds a sequence of records, and end is where the last record parsed ends in its buffer.
+ */
+typedef struct
+{
+	ngx_http_as_msgpack_state state;
+	u_char type;
+	u_char header[9];
+	size_t header_len;
+	size_t header_need;
+	bool is_key;
+
+	u_char *payload;
+	size_t payload_len;
+	size_t payload_have;
+
+	ngx_uint_t depth;
+	uint64_t remaining[NGX_HTTP_AS_MSGPACK_MAX_DEPTH];
+	bool is_map[NGX_HTTP_AS_MSGPACK_MAX_DEPTH];
+
+	off_t limit;
+	bool stream;
+	u_char *end;
+	ngx_pool_t *pool;
+	ngx_http_as_record_builder_t *builder;
+}ngx_http_as_msgpack_parser_t;
+
+/* This is a record of an as_import batch. It is kept until the batch is written, as the write of its bins holds its values. */
+typedef struct
+{
+	as_record rec;
+	ngx_uint_t record;
+	ngx_uint_t cluster;
+	uint32_t slot;
+}ngx_http_as_import_entry_t;
+
+/* This is the error of a record of an as_import body, for the summary of the response. record is the position of the record in the body, from 1. */
+typedef struct
+{
+	ngx_uint_t record;
+	as_status code;
+	const char *message;
+}ngx_http_as_import_error_t;
+
+/* This is the state of an as_import request, which writes the records of its body in batches, as the body is read.
+ * Each buffer of the body is copied into pool, which the values of the records point into, and which is replaced once their batch is written.
+ * pooled is the size of the buffers copied into it, and rotated the number of records when it was last replaced.
+ * entries holds the records of the batch, and batches their writes to each cluster, as in ngx_http_as_write_behind_flush.
+ * skip is set while the rest of an invalid line of ndjson is skipped, and stopped once an invalid msgpack record ends the import.
+ */
+struct ngx_http_as_import_s
+{
+	ngx_http_request_t *r;
+	ngx_http_as_conf_t *as_conf;
+	char namespace[40];
+	char set[100];
+	char key[1000];
+	ngx_http_as_schema_t *schema;
+	bool msgpack;
+	ngx_uint_t batch;
+
+	ngx_pool_t *pool;
+	size_t pooled;
+	ngx_uint_t rotated;
+	ngx_http_as_record_builder_t builder;
+	ngx_http_as_json_parser_t json;
+	ngx_http_as_msgpack_parser_t mp;
+	bool skip;
+	bool stopped;
+
+	ngx_http_as_import_entry_t *entries;
+	ngx_uint_t count;
+	ngx_uint_t nclusters;
+	aerospike **clusters;
+	as_batch_records *batches;
+
+	ngx_uint_t records;
+	ngx_uint_t written;
+	ngx_uint_t failed;
+	ngx_array_t errors;
+};
+
+/* This is the state of an op=scan request, which sends the records of a namespace or set a page at a time, as the client takes them.
+ * bins holds the names of the bins projected, nbins of them, each ending with '\0'.
+ * The records of a page are written to page, whose pool is destroyed once the page is sent, before the next one is fetched.
+ * With as_shard_group, the shards are scanned one after the other, cluster being the one scanned.
+ * If rate is not 0, no more than rate records are sent a second, counted from start.
+ * started is set once the headers are sent, done once the last page is fetched, and full once the page reached NGX_HTTP_AS_SCAN_PAGE_SIZE.
+ */
+struct ngx_http_as_scan_s
+{
+	ngx_http_request_t *r;
+	ngx_http_as_conf_t *as_conf;
+	char namespace[40];
+	char set[100];
+	char bins[1000];
+	ngx_uint_t nbins;
+	ngx_http_as_schema_t *schema;
+	bool msgpack;
+
+	as_policy_scan policy;
+	as_scan scan;
+	bool initialized;
+	ngx_uint_t cluster;
+	ngx_uint_t nclusters;
+
+	ngx_uint_t rate;
+	ngx_msec_t start;
+	ngx_uint_t records;
+
+	ngx_http_as_response_t page;
+	bool started;
+	bool done;
+	bool full;
+};
+
+/* This is the function, called by ngx_http_as_utils_parse_body, which parses a buffer of the request body. */
+typedef ngx_int_t (*ngx_http_as_body_parse_pt)(void *parser, u_char *p, u_char *last);
+
+/* This is the function which returns the length of the run of bytes from p which need no escaping in a json string.
+ * It is chosen at startup for the instructions the cpu supports.
+ */
+typedef size_t (*ngx_http_as_json_scan_pt)(const u_char *p, const u_char *last);
+
+/* This is the function which returns the length of the run of bytes from p without a '%' or a '+', to be decoded in a url arguement.
+ * It is chosen at startup for the instructions the cpu supports.
+ */
+typedef size_t (*ngx_http_as_url_scan_pt)(const u_char *p, const u_char *last);
+
+/* This is a floating point number f * 2^e, with a 64 bit significand, used to format doubles. */
+typedef struct
+{
+	uint64_t f;
+	int e;
+}ngx_http_as_diyfp_t;
+
+// room for the longest double formatted in json, -0.0000012345678901234567 or -1.2345678901234567e-308.
+#define NGX_HTTP_AS_DOUBLE_LEN 32
+
+/* This is the state of a list or map being written in a json response, passed to the foreach callbacks.
+ * first is set until the first item is written, as the items are separated by commas.
+ */
+typedef struct
+{
+	ngx_http_as_response_t *response;
+	bool first;
+}ngx_http_as_json_iter_t;
+
+// writes a string literal in the msgpack response.
+#define ngx_http_as_msgpack_write_literal(response, s) ngx_http_as_msgpack_write_str(response, (u_char*)s, sizeof(s) - 1)
+
 
 //static u_char connected[] = "Connected to aerospike!";
 //static u_char not_connected[] = "Not connected to aerospike!";
@@ -75,28 +839,224 @@ static u_char not_entered[] = "Not entered the block";*/
 
 
 
+static ngx_int_t ngx_http_as_module_init(ngx_conf_t *cf);
+static ngx_int_t ngx_http_as_init_process(ngx_cycle_t *cycle);
+static void* ngx_http_as_module_create_main_conf(ngx_conf_t *cf);
 static void* ngx_http_as_module_create_srv_conf(ngx_conf_t *cf);
 static void* ngx_http_as_module_create_loc_conf(ngx_conf_t *cf);
 static char* ngx_http_as_connect(ngx_conf_t *cf, ngx_command_t *cmd, void* conf);
 static char* ngx_http_as_use_srv_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 static char* ngx_http_as_operate(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char* ngx_http_as_compress(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char* ngx_http_as_replica_retry(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char* ngx_http_as_limit(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char* ngx_http_as_retry(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char* ngx_http_as_breaker(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static ngx_int_t ngx_http_as_breaker_init_zone(ngx_shm_zone_t *shm_zone, void *data);
+static char* ngx_http_as_secondary(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char* ngx_http_as_shard_group(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char* ngx_http_as_write_behind(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static ngx_int_t ngx_http_as_write_behind_init_zone(ngx_shm_zone_t *shm_zone, void *data);
+static char* ngx_http_as_spool(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char* ngx_http_as_import(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static ngx_int_t ngx_http_as_limit_init_zone(ngx_shm_zone_t *shm_zone, void *data);
+static char* ngx_http_as_set_template(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char* ngx_http_as_set_handler(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char* ngx_http_as_operate_ops_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char* ngx_http_as_schema(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char* ngx_http_as_schema_bin(ngx_conf_t *cf, ngx_command_t *dummy, void *conf);
+static char* ngx_http_as_set_flag(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char* ngx_http_as_set_msec(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char* ngx_http_as_set_number(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
+static ngx_int_t ngx_http_as_operate_handler(ngx_http_request_t *r);
+static ngx_int_t ngx_http_as_get_handler(ngx_http_request_t *r);
+static ngx_int_t ngx_http_as_put_handler(ngx_http_request_t *r);
+static ngx_int_t ngx_http_as_delete_handler(ngx_http_request_t *r);
+static ngx_int_t ngx_http_as_operate_ops_handler(ngx_http_request_t *r);
+static ngx_int_t ngx_http_as_rest_handler(ngx_http_request_t *r);
+static void ngx_http_as_put_body_handler(ngx_http_request_t *r);
+static ngx_int_t ngx_http_as_import_handler(ngx_http_request_t *r);
+static void ngx_http_as_import_body_handler(ngx_http_request_t *r);
+static void ngx_http_as_import_read_handler(ngx_http_request_t *r);
+static void ngx_http_as_import_consume(ngx_http_request_t *r, bool done);
+static void ngx_http_as_import_cleanup(void *data);
+static ngx_int_t ngx_http_as_scan_start(ngx_http_request_t *r, ngx_http_as_conf_t *as_conf, ngx_http_as_response_t *response);
+static void ngx_http_as_scan_run(ngx_http_request_t *r);
+static void ngx_http_as_scan_write_handler(ngx_http_request_t *r);
+static void ngx_http_as_scan_cleanup(void *data);
+static ngx_int_t ngx_http_as_limit_handler(ngx_http_request_t *r);
+static void ngx_http_as_limit_wait_handler(ngx_http_request_t *r);
+static void ngx_http_as_limit_cleanup(void *data);
+static void ngx_http_as_limit_waiter_cleanup(void *data);
+static void ngx_http_as_limit_wake(ngx_http_as_main_conf_t *amcf, ngx_shm_zone_t *zone, ngx_uint_t n);
+static void ngx_http_as_limit_check_handler(ngx_event_t *ev);
+static void ngx_http_as_breaker_handler(ngx_event_t *ev);
+static void ngx_http_as_write_behind_handler(ngx_event_t *ev);
+static void ngx_http_as_spool_handler(ngx_event_t *ev);
 
 bool ngx_http_as_operate_connect(ngx_http_request_t *r, ngx_http_as_conf_t *as_conf);
-void ngx_http_as_utils_put(ngx_str_t url, aerospike *as, char response[]);
-void ngx_http_as_operate_get(ngx_str_t url, aerospike *as, char response[]);
-void ngx_http_as_operate_del(ngx_str_t url, aerospike *as, char response[]);
+void ngx_http_as_utils_put(ngx_http_request_t *r, ngx_http_as_conf_t *as_conf, ngx_http_as_response_t *response);
+void ngx_http_as_operate_get(ngx_http_request_t *r, ngx_http_as_conf_t *as_conf, ngx_http_as_response_t *response);
+void ngx_http_as_operate_del(ngx_http_request_t *r, ngx_http_as_conf_t *as_conf, ngx_http_as_response_t *response);
+void ngx_http_as_operate_mget(ngx_http_request_t *r, ngx_http_as_conf_t *as_conf, ngx_http_as_response_t *response);
+void ngx_http_as_operate_ops(ngx_http_request_t *r, ngx_http_as_conf_t *as_conf, ngx_array_t *ops, ngx_http_as_response_t *response);
 
 bool ngx_http_as_utils_connect(aerospike **as, ngx_http_as_hosts hosts);
+bool ngx_http_as_utils_connect_timeout(aerospike **as, ngx_http_as_hosts hosts, uint32_t timeout);
 void ngx_http_as_utils_create_config(as_config *cfg, ngx_http_as_hosts hosts);
-void ngx_http_as_utils_get_hosts(char *arg, ngx_http_as_hosts *hosts);
-bool ngx_http_as_utils_get_parsed_url_arguement(ngx_str_t url, char *arg, char value[]);
-void ngx_http_as_utils_replace(char * o_string, char * s_string, char * r_string);
+bool ngx_http_as_utils_parse_hosts(u_char *p, size_t len, ngx_http_as_hosts *hosts);
+bool ngx_http_as_utils_get_parsed_url_arguement(ngx_str_t url, char *arg, char value[], size_t size);
+u_char* ngx_http_as_utils_unescape(u_char *dst, u_char *dst_end, const u_char *src, const u_char *last);
+bool ngx_http_as_utils_get_key_args(ngx_http_request_t *r, ngx_http_as_conf_t *as_conf, char namespace[], char set[], char key[]);
+bool ngx_http_as_utils_get_template_value(ngx_http_request_t *r, ngx_http_complex_value_t *template, char *arg, char value[], size_t size);
+bool ngx_http_as_utils_copy_slice(ngx_str_t slice, char value[], size_t size);
+void ngx_http_as_utils_parse_rest_uri(ngx_str_t uri, ngx_http_as_ctx_t *ctx);
+bool ngx_http_as_utils_read_body(ngx_http_request_t *r, ngx_str_t *body);
+ngx_http_binvalue* ngx_http_as_utils_get_url_bin_value_pairs(ngx_http_request_t *r, int *n, ngx_http_as_response_t *response);
+ngx_http_binvalue* ngx_http_as_utils_get_body_bin_value_pairs(ngx_http_request_t *r, ngx_str_t body, int *n);
+char* ngx_http_as_utils_set_bin_value_pairs(as_record *rec, ngx_http_binvalue *binvalue, int n, ngx_http_as_conf_t *as_conf, ngx_http_as_schema_t *schema);
+void ngx_http_as_utils_set_unquoted_value(as_record *rec, char *bin, char *value);
+char* ngx_http_as_utils_set_declared_value(as_record *rec, ngx_http_binvalue *binvalue, ngx_http_as_schema_bin_t *decl, ngx_http_as_conf_t *as_conf);
+ngx_http_as_schema_t* ngx_http_as_utils_find_schema(ngx_http_request_t *r, char *set);
+ngx_http_as_schema_bin_t* ngx_http_as_utils_find_schema_bin(ngx_http_as_schema_t *schema, u_char *name, size_t len);
+ngx_http_as_ordered_bin_t* ngx_http_as_utils_order_bins(as_record *p_rec, ngx_http_as_schema_t *schema, ngx_pool_t *pool);
+bool ngx_http_as_utils_is_json(ngx_http_request_t *r);
+bool ngx_http_as_utils_is_msgpack(ngx_http_request_t *r);
+bool ngx_http_as_utils_accepts_msgpack(ngx_http_request_t *r);
+ngx_str_t ngx_http_as_utils_media_type(u_char *p, u_char *last);
+ngx_uint_t ngx_http_as_utils_accept_q(u_char *p, u_char *last);
+bool ngx_http_as_utils_is_msgpack_type(ngx_str_t type);
+bool ngx_http_as_utils_prefers_minimal(ngx_http_request_t *r);
+bool ngx_http_as_utils_set_policy(ngx_http_request_t *r, ngx_http_as_conf_t *as_conf, as_policy_base *base);
+bool ngx_http_as_utils_arm_replica_retry(ngx_http_as_conf_t *as_conf, as_policy_read *policy);
+ngx_msec_t ngx_http_as_utils_clock(void);
+void ngx_http_as_utils_retry_init(ngx_http_as_retry_t *retry, as_policy_base *base);
+bool ngx_http_as_utils_retry(ngx_http_as_conf_t *as_conf, ngx_http_as_retry_t *retry, as_policy_base *base, as_status code, bool idempotent);
+void ngx_http_as_breaker_record(ngx_http_as_conf_t *as_conf, as_status code);
+bool ngx_http_as_breaker_probe(ngx_http_as_conf_t *as_conf);
+bool ngx_http_as_breaker_admit(ngx_http_as_conf_t *as_conf);
+bool ngx_http_as_utils_unavailable(as_status code);
+bool ngx_http_as_cluster_connect(ngx_http_as_cluster_t *cluster);
+ngx_uint_t ngx_http_as_utils_read_clusters(ngx_http_as_conf_t *as_conf, as_key *key, aerospike *clusters[], ngx_uint_t *latencies[]);
+ngx_http_as_cluster_t* ngx_http_as_utils_shard(ngx_http_as_conf_t *as_conf, as_key *key);
+aerospike* ngx_http_as_utils_cluster(ngx_http_as_conf_t *as_conf, as_key *key);
+ngx_uint_t ngx_http_as_utils_jump_hash(uint64_t key, ngx_uint_t buckets);
+bool ngx_http_as_utils_connect_default(ngx_http_as_conf_t *as_conf);
+bool ngx_http_as_utils_connect_configured(ngx_http_as_conf_t *as_conf);
+void ngx_http_as_utils_put_name(u_char *data, char namespace[], char set[], char key[], ngx_str_t *name);
+as_map* ngx_http_as_utils_bins_map(as_record *rec);
+bool ngx_http_as_write_behind_add(ngx_http_as_conf_t *as_conf, char namespace[], char set[], char key[], as_record *rec);
+bool ngx_http_as_write_behind_store(ngx_http_as_conf_t *as_conf, ngx_str_t *key, as_map *bins, bool older);
+bool ngx_http_as_write_behind_flush(ngx_http_as_conf_t *as_conf, ngx_log_t *log);
+ngx_uint_t ngx_http_as_write_behind_take(ngx_http_as_conf_t *as_conf, ngx_pool_t *pool, ngx_http_as_write_behind_entry_t *entries);
+bool ngx_http_as_spool_open(ngx_http_as_spool_t *spool, ngx_log_t *log);
+bool ngx_http_as_spool_pending(ngx_http_as_spool_t *spool);
+bool ngx_http_as_spool_put(ngx_http_as_conf_t *as_conf, char namespace[], char set[], char key[], as_record *rec);
+bool ngx_http_as_spool_append(ngx_http_as_spool_t *spool, ngx_str_t *name, as_map *bins);
+void ngx_http_as_spool_replay(ngx_http_as_conf_t *as_conf, ngx_log_t *log);
+bool ngx_http_as_import_init(ngx_http_as_import_t *import);
+void ngx_http_as_import_reset(ngx_http_as_import_t *import);
+void ngx_http_as_import_parse(ngx_http_as_import_t *import, u_char *p, u_char *last);
+void ngx_http_as_import_line(ngx_http_as_import_t *import);
+void ngx_http_as_import_record(ngx_http_as_import_t *import);
+void ngx_http_as_import_key(ngx_http_as_import_t *import, as_val *value, char *str, as_key *key);
+void ngx_http_as_import_flush(ngx_http_as_import_t *import);
+bool ngx_http_as_import_rotate(ngx_http_as_import_t *import, u_char **p, u_char **last);
+void ngx_http_as_import_finish(ngx_http_as_import_t *import);
+void ngx_http_as_import_error(ngx_http_as_import_t *import, ngx_uint_t record, as_status code, const char *message);
+void ngx_http_as_import_summary(ngx_http_as_import_t *import, ngx_http_as_response_t *response);
+bool ngx_http_as_scan_init(ngx_http_as_scan_t *scan);
+aerospike* ngx_http_as_scan_cluster(ngx_http_as_scan_t *scan);
+bool ngx_http_as_scan_page(ngx_http_as_scan_t *scan, as_error *err);
+void ngx_http_as_scan_write_record(ngx_http_as_response_t *response, as_record *p_rec, ngx_http_as_schema_t *schema);
+void ngx_http_as_scan_write_error(ngx_http_as_response_t *response, as_error *err);
+bool ngx_http_as_limit_acquire(ngx_http_as_limit_sh_t *sh, ngx_http_as_conf_t *as_conf);
+void ngx_http_as_limit_release(ngx_http_as_limit_sh_t *sh, ngx_http_as_conf_t *as_conf, ngx_msec_t elapsed, bool overloaded);
+ngx_http_as_limit_worker_t* ngx_http_as_limit_worker(ngx_http_as_limit_sh_t *sh);
+void ngx_http_as_limit_reclaim(ngx_http_as_limit_sh_t *sh, ngx_log_t *log);
+void ngx_http_as_limit_begin(ngx_http_request_t *r);
+void ngx_http_as_limit_end(ngx_http_request_t *r, bool overloaded);
+ngx_int_t ngx_http_as_utils_get_deadline(ngx_http_request_t *r);
+ngx_int_t ngx_http_as_utils_parse_body(ngx_http_request_t *r, ngx_http_as_body_parse_pt parse, void *parser);
+
+void ngx_http_as_builder_init(ngx_http_as_record_builder_t *builder, ngx_pool_t *pool, ngx_http_as_conf_t *as_conf, ngx_http_as_schema_t *schema);
+void ngx_http_as_builder_destroy(ngx_http_as_record_builder_t *builder);
+bool ngx_http_as_builder_begin_map(ngx_http_as_record_builder_t *builder, uint32_t n);
+bool ngx_http_as_builder_end_map(ngx_http_as_record_builder_t *builder);
+bool ngx_http_as_builder_begin_list(ngx_http_as_record_builder_t *builder, uint32_t n);
+bool ngx_http_as_builder_end_list(ngx_http_as_record_builder_t *builder);
+bool ngx_http_as_builder_key(ngx_http_as_record_builder_t *builder, u_char *name, size_t len);
+bool ngx_http_as_builder_string(ngx_http_as_record_builder_t *builder, u_char *str, size_t len);
+bool ngx_http_as_builder_integer(ngx_http_as_record_builder_t *builder, int64_t value);
+bool ngx_http_as_builder_double(ngx_http_as_record_builder_t *builder, double value);
+bool ngx_http_as_builder_boolean(ngx_http_as_record_builder_t *builder, bool value);
+bool ngx_http_as_builder_nil(ngx_http_as_record_builder_t *builder);
+bool ngx_http_as_builder_bytes(ngx_http_as_record_builder_t *builder, u_char *data, size_t len);
+bool ngx_http_as_builder_geojson(ngx_http_as_record_builder_t *builder, u_char *str, size_t len);
+bool ngx_http_as_builder_finish(ngx_http_as_record_builder_t *builder, as_record *rec);
+ngx_http_as_pending_bin_t* ngx_http_as_builder_add_bin(ngx_http_as_record_builder_t *builder, as_val_t type);
+
+void ngx_http_as_json_init(ngx_http_as_json_parser_t *parser, ngx_pool_t *pool, ngx_http_as_record_builder_t *builder);
+ngx_int_t ngx_http_as_json_parse(ngx_http_as_json_parser_t *parser, u_char *p, u_char *last);
+ngx_int_t ngx_http_as_json_finish(ngx_http_as_json_parser_t *parser);
+bool ngx_http_as_json_parse_body(ngx_http_request_t *r, ngx_http_as_record_builder_t *builder);
+
+void ngx_http_as_msgpack_init(ngx_http_as_msgpack_parser_t *parser, ngx_http_request_t *r, ngx_http_as_record_builder_t *builder);
+ngx_int_t ngx_http_as_msgpack_parse(ngx_http_as_msgpack_parser_t *parser, u_char *p, u_char *last);
+bool ngx_http_as_msgpack_parse_body(ngx_http_request_t *r, ngx_http_as_record_builder_t *builder);
 bool ngx_http_as_utils_compare_prev_new_hosts(ngx_http_as_hosts current_hosts, ngx_http_as_hosts hosts);
 void ngx_http_as_utils_get_bin_value_pair(char b[], char v[],ngx_http_binvalue bv[], int size);
 
-void ngx_http_as_utils_dump_error(as_error err, char response[], char* last_char);
-void ngx_http_as_utils_dump_record(as_record *p_rec, as_error err, char response[]);
-void ngx_http_as_utils_dump_bin(const as_bin* p_bin, char response[]);
+void ngx_http_as_utils_dump_error(as_error err, ngx_http_as_response_t *response, char* last_char);
+void ngx_http_as_utils_dump_record(as_record *p_rec, as_error err, ngx_http_as_schema_t *schema, ngx_http_as_response_t *response);
+void ngx_http_as_utils_dump_bin(const as_bin* p_bin, ngx_http_as_schema_bin_t *decl, ngx_http_as_response_t *response);
+as_val* ngx_http_as_utils_get_bin_value(const as_bin *p_bin, as_string *str, as_bytes *bytes, u_char **decompressed);
+
+u_char* ngx_http_as_response_reserve(ngx_http_as_response_t *response, size_t len);
+void ngx_http_as_response_append(ngx_http_as_response_t *response, const void *data, size_t len);
+void ngx_http_as_response_begin(ngx_http_as_response_t *response);
+void ngx_http_as_response_canned(ngx_http_as_response_t *response, ngx_http_as_canned_error_e error);
+bool ngx_http_as_response_status(ngx_http_as_response_t *response, as_status code);
+ngx_int_t ngx_http_as_render_canned_errors(ngx_pool_t *pool);
+
+void ngx_http_as_json_write_string(ngx_http_as_response_t *response, const u_char *data, size_t len);
+void ngx_http_as_json_write_escaped(ngx_http_as_response_t *response, const u_char *data, size_t len);
+void ngx_http_as_json_write_integer(ngx_http_as_response_t *response, int64_t value);
+void ngx_http_as_json_write_double(ngx_http_as_response_t *response, double value);
+void ngx_http_as_json_write_val(ngx_http_as_response_t *response, const as_val *val);
+u_char* ngx_http_as_json_format_integer(u_char *p, int64_t value);
+u_char* ngx_http_as_json_format_double(u_char *p, double value);
+
+void ngx_http_as_msgpack_write_nil(ngx_http_as_response_t *response);
+void ngx_http_as_msgpack_write_boolean(ngx_http_as_response_t *response, bool value);
+void ngx_http_as_msgpack_write_integer(ngx_http_as_response_t *response, int64_t value);
+void ngx_http_as_msgpack_write_double(ngx_http_as_response_t *response, double value);
+void ngx_http_as_msgpack_write_str(ngx_http_as_response_t *response, const u_char *data, size_t len);
+void ngx_http_as_msgpack_write_bin(ngx_http_as_response_t *response, const u_char *data, size_t len);
+void ngx_http_as_msgpack_write_ext(ngx_http_as_response_t *response, u_char type, const u_char *data, size_t len);
+void ngx_http_as_msgpack_write_array(ngx_http_as_response_t *response, uint32_t n);
+void ngx_http_as_msgpack_write_map(ngx_http_as_response_t *response, uint32_t n);
+void ngx_http_as_msgpack_write_val(ngx_http_as_response_t *response, const as_val *val);
+void ngx_http_as_msgpack_dump_error(as_error err, ngx_http_as_response_t *response, char *last_char);
+void ngx_http_as_msgpack_dump_record(as_record *p_rec, ngx_http_as_schema_t *schema, ngx_http_as_response_t *response);
+
+bool ngx_http_as_utils_set_compressed(as_record *rec, const char *bin, const char *value, size_t len, as_val_t type, ngx_http_as_conf_t *as_conf);
+u_char* ngx_http_as_utils_decompress(as_bytes *bytes, size_t *len, as_val_t *type);
+
+// the message is the one formatted by ngx_http_as_utils_dump_error, the bodies are rendered by ngx_http_as_render_canned_errors.
+static ngx_http_as_canned_error_t ngx_http_as_canned_errors[NGX_HTTP_AS_CANNED_ERRORS] = {
+	{ "AEROSPIKE_NOT_CONNECTED", NGX_HTTP_SERVICE_UNAVAILABLE, NGX_HTTP_AS_RETRY_AFTER, ngx_null_string, ngx_null_string },
+	{ "AEROSPIKE_INSTANCE_NULL", NGX_HTTP_SERVICE_UNAVAILABLE, NGX_HTTP_AS_RETRY_AFTER, ngx_null_string, ngx_null_string },
+	{ "INVALID_KEY", NGX_HTTP_BAD_REQUEST, 0, ngx_null_string, ngx_null_string },
+	{ "NUM_OF_BINS_AND_VALUES_MISMATCH", NGX_HTTP_BAD_REQUEST, 0, ngx_null_string, ngx_null_string },
+	{ "AEROSPIKE_CONNECTED", NGX_HTTP_BAD_REQUEST, 0, ngx_null_string, ngx_null_string },
+	{ "DEADLINE_EXCEEDED", NGX_HTTP_GATEWAY_TIME_OUT, 0, ngx_null_string, ngx_null_string },
+	{ "CONCURRENCY_LIMIT_EXCEEDED", NGX_HTTP_SERVICE_UNAVAILABLE, NGX_HTTP_AS_RETRY_AFTER, ngx_null_string, ngx_null_string },
+	{ "CIRCUIT_OPEN", NGX_HTTP_SERVICE_UNAVAILABLE, NGX_HTTP_AS_RETRY_AFTER, ngx_null_string, ngx_null_string },
+	{ "INVALID_SCAN", NGX_HTTP_BAD_REQUEST, 0, ngx_null_string, ngx_null_string },
+	{ "INVALID_BATCH", NGX_HTTP_BAD_REQUEST, 0, ngx_null_string, ngx_null_string }
+};
 
 static ngx_command_t ngx_http_as_commands[] = {
 	{
@@ -126,825 +1086,9808 @@ static ngx_command_t ngx_http_as_commands[] = {
 		NULL
 	},
 
-	ngx_null_command
-};
+	{
+		ngx_string("as_get"),
+		NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+		ngx_http_as_set_handler,
+		0,
+		0,
+		ngx_http_as_get_handler
+	},
 
-ngx_http_module_t ngx_http_as_module_ctx = {
-	NULL,
-	NULL,
+	{
+		ngx_string("as_put"),
+		NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+		ngx_http_as_set_handler,
+		0,
+		0,
+		ngx_http_as_put_handler
+	},
 
-	NULL,
-	NULL,
+	{
+		ngx_string("as_delete"),
+		NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+		ngx_http_as_set_handler,
+		0,
+		0,
+		ngx_http_as_delete_handler
+	},
 
-	ngx_http_as_module_create_srv_conf,
-	NULL,
+	{
+		ngx_string("as_rest"),
+		NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+		ngx_http_as_set_handler,
+		0,
+		0,
+		ngx_http_as_rest_handler
+	},
 
-	ngx_http_as_module_create_loc_conf,
-	NULL
-};
+	{
+		ngx_string("as_import"),
+		NGX_HTTP_LOC_CONF|NGX_CONF_ANY,
+		ngx_http_as_import,
+		0,
+		0,
+		NULL
+	},
 
-ngx_module_t ngx_http_as_module = {
-	NGX_MODULE_V1,
-	&ngx_http_as_module_ctx,
-	ngx_http_as_commands,
-	NGX_HTTP_MODULE,
-	NULL,
-	NULL,
-	NULL,
-	NULL,
-	NULL,
-	NULL,
-	NULL,
-	NGX_MODULE_V1_PADDING
-};
+	{
+		ngx_string("as_operate_ops"),
+		NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
+		ngx_http_as_operate_ops_conf,
+		0,
+		0,
+		NULL
+	},
 
-/* This function creates the server configuration of the aersopike moodules.
- * It allocates memory for the ngx_http_as_conf_t structre.
- */
-static void* ngx_http_as_module_create_srv_conf(ngx_conf_t *cf)
-{
+	{
+		ngx_string("as_compress"),
+		NGX_HTTP_LOC_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_1MORE,
+		ngx_http_as_compress,
+		0,
+		0,
+		NULL
+	},
 
-	// The configuration pointer to the structure.
-	ngx_http_as_conf_t *conf;
+	{
+		ngx_string("as_namespace"),
+		NGX_HTTP_LOC_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_TAKE1,
+		ngx_http_as_set_template,
+		0,
+		offsetof(ngx_http_as_conf_t, namespace_template),
+		NULL
+	},
 
-	// Allocating memory using the default nginx function pcalloc.
-	// It takes care of deallocating memory later.
-	conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_as_conf_t));
+	{
+		ngx_string("as_set"),
+		NGX_HTTP_LOC_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_TAKE1,
+		ngx_http_as_set_template,
+		0,
+		offsetof(ngx_http_as_conf_t, set_template),
+		NULL
+	},
 
-	// Setting all the flag variables for the cluster objects to false.
-	// No cluster objects initialised.
-	conf->as = NULL;
-	conf->connected = false;
-	conf->use_server_conf = true;
-	conf->pool = cf->pool;
+	{
+		ngx_string("as_key"),
+		NGX_HTTP_LOC_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_TAKE1,
+		ngx_http_as_set_template,
+		0,
+		offsetof(ngx_http_as_conf_t, key_template),
+		NULL
+	},
 
-	return conf;
-}
+	{
+		ngx_string("as_replica_retry"),
+		NGX_HTTP_LOC_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_1MORE,
+		ngx_http_as_replica_retry,
+		0,
+		0,
+		NULL
+	},
 
-/* This function creates the location configuration for the module.
- * It allocates memory for the nngx_http_as_loc_conf_t object for the location.
+	{
+		ngx_string("as_retry"),
+		NGX_HTTP_LOC_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_1MORE,
+		ngx_http_as_retry,
+		0,
+		0,
+		NULL
+	},
+
+	{
+		ngx_string("as_write_behind"),
+		NGX_HTTP_LOC_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_1MORE,
+		ngx_http_as_write_behind,
+		0,
+		0,
+		NULL
+	},
+
+	{
+		ngx_string("as_spool"),
+		NGX_HTTP_LOC_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_1MORE,
+		ngx_http_as_spool,
+		0,
+		0,
+		NULL
+	},
+
+	{
+		ngx_string("as_shard_group"),
+		NGX_HTTP_LOC_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_2MORE,
+		ngx_http_as_shard_group,
+		0,
+		0,
+		NULL
+	},
+
+	{
+		ngx_string("as_secondary"),
+		NGX_HTTP_LOC_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_1MORE,
+		ngx_http_as_secondary,
+		0,
+		0,
+		NULL
+	},
+
+	{
+		ngx_string("as_breaker"),
+		NGX_HTTP_LOC_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_1MORE,
+		ngx_http_as_breaker,
+		0,
+		0,
+		NULL
+	},
+
+	{
+		ngx_string("as_limit"),
+		NGX_HTTP_LOC_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_1MORE,
+		ngx_http_as_limit,
+		0,
+		0,
+		NULL
+	},
+
+	{
+		ngx_string("as_minimal_errors"),
+		NGX_HTTP_LOC_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_FLAG,
+		ngx_http_as_set_flag,
+		0,
+		offsetof(ngx_http_as_conf_t, minimal_errors),
+		NULL
+	},
+
+	{
+		ngx_string("as_timeout"),
+		NGX_HTTP_LOC_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_TAKE1,
+		ngx_http_as_set_msec,
+		0,
+		offsetof(ngx_http_as_conf_t, timeout),
+		NULL
+	},
+
+	{
+		ngx_string("as_socket_timeout"),
+		NGX_HTTP_LOC_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_TAKE1,
+		ngx_http_as_set_msec,
+		0,
+		offsetof(ngx_http_as_conf_t, socket_timeout),
+		NULL
+	},
+
+	{
+		ngx_string("as_max_retries"),
+		NGX_HTTP_LOC_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_TAKE1,
+		ngx_http_as_set_number,
+		0,
+		offsetof(ngx_http_as_conf_t, max_retries),
+		NULL
+	},
+
+	{
+		ngx_string("as_schema"),
+		NGX_HTTP_MAIN_CONF|NGX_CONF_BLOCK|NGX_CONF_TAKE1,
+		ngx_http_as_schema,
+		NGX_HTTP_MAIN_CONF_OFFSET,
+		0,
+		NULL
+	},
+
+	ngx_null_command
+};
+
+ngx_http_module_t ngx_http_as_module_ctx = {
+	NULL,
+	ngx_http_as_module_init,
+
+	ngx_http_as_module_create_main_conf,
+	NULL,
+
+	ngx_http_as_module_create_srv_conf,
+	NULL,
+
+	ngx_http_as_module_create_loc_conf,
+	NULL
+};
+
+ngx_module_t ngx_http_as_module = {
+	NGX_MODULE_V1,
+	&ngx_http_as_module_ctx,
+	ngx_http_as_commands,
+	NGX_HTTP_MODULE,
+	NULL,
+	NULL,
+	ngx_http_as_init_process,
+	NULL,
+	NULL,
+	NULL,
+	NULL,
+	NGX_MODULE_V1_PADDING
+};
+
+/* This is the escape of each byte in a json string, 0 if it is written as is.
+ * Control characters without a short escape are written as \u00XX.
  */
-static void* ngx_http_as_module_create_loc_conf(ngx_conf_t *cf)
+static const u_char ngx_http_as_json_escape[256] = {
+	'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'b', 't', 'n', 'u', 'f', 'r', 'u', 'u',
+	'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+	0, 0, '"', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, '\\', 0, 0, 0
+};
+
+static size_t ngx_http_as_json_scan_scalar(const u_char *p, const u_char *last);
+static size_t ngx_http_as_url_scan_scalar(const u_char *p, const u_char *last);
+
+// the json string and url arguement scanners for the cpu, set by ngx_http_as_module_init.
+static ngx_http_as_json_scan_pt ngx_http_as_json_scan = ngx_http_as_json_scan_scalar;
+static ngx_http_as_url_scan_pt ngx_http_as_url_scan = ngx_http_as_url_scan_scalar;
+
+#if (NGX_HTTP_AS_HAVE_SSE2)
+
+/* This function scans 16 bytes at a time for a byte which needs escaping, a quote, a backslash or a control character.
+ * A byte is a control character if it is not above 0x1f, which is tested with an unsigned max.
+ */
+__attribute__((target("sse2")))
+static size_t ngx_http_as_json_scan_sse2(const u_char *p, const u_char *last)
 {
-	// creating a location object and allocating memory.
-	ngx_http_as_conf_t *conf;
-	conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_as_conf_t));
+	const u_char *start = p;
+	const __m128i quote = _mm_set1_epi8('"');
+	const __m128i backslash = _mm_set1_epi8('\\');
+	const __m128i control = _mm_set1_epi8(0x1f);
+	__m128i v, special;
+	int mask;
+
+	while(last - p>=16)
+	{
+		v = _mm_loadu_si128((const __m128i*)p);
 
-	// setting default values.
-	conf->as = NULL;
-	conf->connected = false;
-	conf->use_server_conf = false;
-	conf->pool = cf->pool;
+		special = _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash));
+		special = _mm_or_si128(special, _mm_cmpeq_epi8(_mm_max_epu8(v, control), control));
+
+		mask = _mm_movemask_epi8(special);
+		if(mask)
+			return (p - start) + __builtin_ctz(mask);
+
+		p += 16;
+	}
+
+	return (p - start) + ngx_http_as_json_scan_scalar(p, last);
+}
+
+/* This function is the 32 byte version of ngx_http_as_json_scan_sse2, for cpus with avx2. */
+__attribute__((target("avx2")))
+static size_t ngx_http_as_json_scan_avx2(const u_char *p, const u_char *last)
+{
+	const u_char *start = p;
+	const __m256i quote = _mm256_set1_epi8('"');
+	const __m256i backslash = _mm256_set1_epi8('\\');
+	const __m256i control = _mm256_set1_epi8(0x1f);
+	__m256i v, special;
+	uint32_t mask;
+
+	while(last - p>=32)
+	{
+		v = _mm256_loadu_si256((const __m256i*)p);
+
+		special = _mm256_or_si256(_mm256_cmpeq_epi8(v, quote), _mm256_cmpeq_epi8(v, backslash));
+		special = _mm256_or_si256(special, _mm256_cmpeq_epi8(_mm256_max_epu8(v, control), control));
+
+		mask = (uint32_t)_mm256_movemask_epi8(special);
+		if(mask)
+			return (p - start) + __builtin_ctz(mask);
+
+		p += 32;
+	}
+
+	return (p - start) + ngx_http_as_json_scan_sse2(p, last);
+}
+
+/* This function scans a url arguement 16 bytes at a time for a '%' or a '+'. */
+__attribute__((target("sse2")))
+static size_t ngx_http_as_url_scan_sse2(const u_char *p, const u_char *last)
+{
+	const u_char *start = p;
+	const __m128i percent = _mm_set1_epi8('%');
+	const __m128i plus = _mm_set1_epi8('+');
+	__m128i v;
+	int mask;
+
+	while(last - p>=16)
+	{
+		v = _mm_loadu_si128((const __m128i*)p);
+
+		mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, percent), _mm_cmpeq_epi8(v, plus)));
+		if(mask)
+			return (p - start) + __builtin_ctz(mask);
+
+		p += 16;
+	}
+
+	return (p - start) + ngx_http_as_url_scan_scalar(p, last);
+}
+
+/* This function is the 32 byte version of ngx_http_as_url_scan_sse2, for cpus with avx2. */
+__attribute__((target("avx2")))
+static size_t ngx_http_as_url_scan_avx2(const u_char *p, const u_char *last)
+{
+	const u_char *start = p;
+	const __m256i percent = _mm256_set1_epi8('%');
+	const __m256i plus = _mm256_set1_epi8('+');
+	__m256i v;
+	uint32_t mask;
+
+	while(last - p>=32)
+	{
+		v = _mm256_loadu_si256((const __m256i*)p);
+
+		mask = (uint32_t)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, percent), _mm256_cmpeq_epi8(v, plus)));
+		if(mask)
+			return (p - start) + __builtin_ctz(mask);
+
+		p += 32;
+	}
+
+	return (p - start) + ngx_http_as_url_scan_sse2(p, last);
+}
+
+#endif
+
+/* This function scans a json string one byte at a time, for short strings and the tail of the vector scans. */
+static size_t ngx_http_as_json_scan_scalar(const u_char *p, const u_char *last)
+{
+	const u_char *start = p;
+
+	while(p<last && ngx_http_as_json_escape[*p]==0)
+		p++;
+
+	return p - start;
+}
+
+/* This function scans a url arguement one byte at a time, for short values and the tail of the vector scans. */
+static size_t ngx_http_as_url_scan_scalar(const u_char *p, const u_char *last)
+{
+	const u_char *start = p;
+
+	while(p<last && *p!='%' && *p!='+')
+		p++;
+
+	return p - start;
+}
+
+/* This function returns the value of a hex digit, or -1 if it is not one. */
+static ngx_inline ngx_int_t ngx_http_as_hex_value(u_char c)
+{
+	if(c>='0' && c<='9')
+		return c - '0';
+
+	c |= 0x20;
+	if(c>='a' && c<='f')
+		return c - 'a' + 10;
+
+	return -1;
+}
+
+/* This function initialises the module once the configuration is read.
+ * It adds the as_limit handler to the preaccess phase, picks the json string and url arguement scanners for the cpu,
+ * and renders the canned error responses with them.
+ */
+static ngx_int_t ngx_http_as_module_init(ngx_conf_t *cf)
+{
+	ngx_http_core_main_conf_t *cmcf;
+	ngx_http_handler_pt *h;
+
+	cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
+
+	h = ngx_array_push(&cmcf->phases[NGX_HTTP_PREACCESS_PHASE].handlers);
+	if(h==NULL)
+		return NGX_ERROR;
+
+	*h = ngx_http_as_limit_handler;
+
+#if (NGX_HTTP_AS_HAVE_SSE2)
+	__builtin_cpu_init();
+
+	if(__builtin_cpu_supports("avx2"))
+	{
+		ngx_http_as_json_scan = ngx_http_as_json_scan_avx2;
+		ngx_http_as_url_scan = ngx_http_as_url_scan_avx2;
+	}
+	else if(__builtin_cpu_supports("sse2"))
+	{
+		ngx_http_as_json_scan = ngx_http_as_json_scan_sse2;
+		ngx_http_as_url_scan = ngx_http_as_url_scan_sse2;
+	}
+#endif
+
+	return ngx_http_as_render_canned_errors(cf->pool);
+}
+
+/* This function starts the probes of the as_breaker circuits, the flushers of as_write_behind and the replays of as_spool in each worker.
+ * Each is a timer of the worker, which runs every interval, with or without requests.
+ * It also gives back the slots of as_limit held by workers which are gone, as a worker replacing one which crashed starts.
+ */
+static ngx_int_t ngx_http_as_init_process(ngx_cycle_t *cycle)
+{
+	ngx_http_as_main_conf_t *amcf;
+	ngx_http_as_conf_t **confs;
+	ngx_http_as_spool_t *spool;
+	ngx_event_t *ev;
+	ngx_uint_t i;
+
+	amcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_as_module);
+	if(amcf==NULL)
+		return NGX_OK;
+
+	confs = amcf->breakers.elts;
+	for(i=0; i<amcf->breakers.nelts; i++)
+	{
+		// the probes made before the worker started are not taken.
+		confs[i]->breaker_generation = ((ngx_http_as_breaker_sh_t*)confs[i]->breaker_zone->data)[confs[i]->breaker_index].generation;
+
+		ev = &confs[i]->breaker_event;
+		ev->handler = ngx_http_as_breaker_handler;
+		ev->data = confs[i];
+		ev->log = cycle->log;
+		ev->cancelable = 1;
+
+		ngx_add_timer(ev, confs[i]->breaker_interval);
+	}
+
+	// the flusher is not cancelable, so a worker shutting down flushes the zone once more before it exits.
+	confs = amcf->write_behinds.elts;
+	for(i=0; i<amcf->write_behinds.nelts; i++)
+	{
+		ev = &confs[i]->write_behind_event;
+		ev->handler = ngx_http_as_write_behind_handler;
+		ev->data = confs[i];
+		ev->log = cycle->log;
+
+		ngx_add_timer(ev, confs[i]->write_behind_interval);
+	}
+
+	// a spool which cannot be opened yet, as the worker it replaces still holds it, is opened by its timer.
+	confs = amcf->spools.elts;
+	for(i=0; i<amcf->spools.nelts; i++)
+	{
+		spool = confs[i]->spool;
+		spool->fd = NGX_INVALID_FILE;
+		spool->addr = NULL;
+		spool->synced = ngx_current_msec;
+
+		ngx_http_as_spool_open(spool, cycle->log);
+
+		ev = &spool->event;
+		ev->handler = ngx_http_as_spool_handler;
+		ev->data = confs[i];
+		ev->log = cycle->log;
+		ev->cancelable = 1;
+
+		ngx_add_timer(ev, NGX_HTTP_AS_SPOOL_TICK);
+	}
+
+	confs = amcf->limits.elts;
+	for(i=0; i<amcf->limits.nelts; i++)
+		ngx_http_as_limit_reclaim(confs[i]->limit_zone->data, cycle->log);
+
+	ngx_queue_init(&amcf->limit_waiters);
+
+	ev = &amcf->limit_event;
+	ev->handler = ngx_http_as_limit_check_handler;
+	ev->data = amcf;
+	ev->log = cycle->log;
+	ev->cancelable = 1;
+
+	return NGX_OK;
+}
+
+/* This function checks the circuit of an as_breaker every interval.
+ * A closed circuit opens if enough requests of the interval failed. An open one probes the cluster, or takes the probe of another worker,
+ * and is half open if it answers, and a half open one closes, as it would have opened again on a failure of its trial requests.
+ */
+static void ngx_http_as_breaker_handler(ngx_event_t *ev)
+{
+	ngx_http_as_conf_t *as_conf = ev->data;
+
+	if(ngx_exiting)
+		return;
+
+	switch(as_conf->breaker_state)
+	{
+		case NGX_HTTP_AS_BREAKER_CLOSED:
+			if(as_conf->breaker_requests>=as_conf->breaker_min_requests
+				&& as_conf->breaker_failures * 100>=as_conf->breaker_threshold * as_conf->breaker_requests)
+			{
+				ngx_log_error(NGX_LOG_WARN, ev->log, 0, "aerospike circuit opened, %ui of %ui requests failed",
+					as_conf->breaker_failures, as_conf->breaker_requests);
+				as_conf->breaker_state = NGX_HTTP_AS_BREAKER_OPEN;
+			}
+			break;
+
+		case NGX_HTTP_AS_BREAKER_OPEN:
+			if(ngx_http_as_breaker_probe(as_conf))
+			{
+				ngx_log_error(NGX_LOG_NOTICE, ev->log, 0, "aerospike circuit half open");
+				as_conf->breaker_state = NGX_HTTP_AS_BREAKER_HALF_OPEN;
+				as_conf->breaker_trials = 0;
+				as_conf->breaker_successes = 0;
+			}
+			break;
+
+		case NGX_HTTP_AS_BREAKER_HALF_OPEN:
+			ngx_log_error(NGX_LOG_NOTICE, ev->log, 0, "aerospike circuit closed");
+			as_conf->breaker_state = NGX_HTTP_AS_BREAKER_CLOSED;
+			break;
+	}
+
+	as_conf->breaker_requests = 0;
+	as_conf->breaker_failures = 0;
+
+	ngx_add_timer(ev, as_conf->breaker_interval);
+}
+
+/* This function writes a batch of the puts buffered by as_write_behind every interval, and the next batch at once if the batch was full,
+ * after the events of the worker are handled. It is not armed again once the worker is shutting down, after this last flush of every batch.
+ */
+static void ngx_http_as_write_behind_handler(ngx_event_t *ev)
+{
+	ngx_http_as_conf_t *as_conf = ev->data;
+	bool more;
+
+	more = ngx_http_as_write_behind_flush(as_conf, ev->log);
+
+	if(ngx_exiting)
+	{
+		while(more)
+			more = ngx_http_as_write_behind_flush(as_conf, ev->log);
+		return;
+	}
+
+	ngx_add_timer(ev, more ? 1 : as_conf->write_behind_interval);
+}
+
+/* This function replays the puts of an as_spool, and syncs it to the disk every fsync interval. */
+static void ngx_http_as_spool_handler(ngx_event_t *ev)
+{
+	ngx_http_as_conf_t *as_conf = ev->data;
+	ngx_http_as_spool_t *spool = as_conf->spool;
+
+	if(spool->addr!=NULL || ngx_http_as_spool_open(spool, ev->log))
+	{
+		ngx_http_as_spool_replay(as_conf, ev->log);
+
+		if(spool->fsync_interval && ngx_current_msec - spool->synced>=spool->fsync_interval)
+		{
+			// the records wrap, so the whole file is synced, which only writes the pages changed.
+			if(msync(spool->addr, spool->size, MS_SYNC)==-1)
+				ngx_log_error(NGX_LOG_ALERT, ev->log, ngx_errno, "msync() of the aerospike spool failed");
+
+			spool->synced = ngx_current_msec;
+		}
+	}
+
+	ngx_add_timer(ev, NGX_HTTP_AS_SPOOL_TICK);
+}
+
+/* This function creates the main configuration of the module, which holds the schemas of the sets. */
+static void* ngx_http_as_module_create_main_conf(ngx_conf_t *cf)
+{
+	ngx_http_as_main_conf_t *conf;
+
+	conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_as_main_conf_t));
+	if(conf==NULL)
+		return NULL;
+
+	if(ngx_array_init(&conf->schemas, cf->pool, 4, sizeof(ngx_http_as_schema_t))!=NGX_OK)
+		return NULL;
+
+	if(ngx_array_init(&conf->breakers, cf->pool, 4, sizeof(ngx_http_as_conf_t*))!=NGX_OK)
+		return NULL;
+
+	if(ngx_array_init(&conf->write_behinds, cf->pool, 4, sizeof(ngx_http_as_conf_t*))!=NGX_OK)
+		return NULL;
+
+	if(ngx_array_init(&conf->spools, cf->pool, 4, sizeof(ngx_http_as_conf_t*))!=NGX_OK)
+		return NULL;
+
+	if(ngx_array_init(&conf->limits, cf->pool, 4, sizeof(ngx_http_as_conf_t*))!=NGX_OK)
+		return NULL;
 
 	return conf;
 }
 
-static ngx_int_t ngx_http_as_operate_handler(ngx_http_request_t *r)
+/* This function creates the server configuration of the aersopike moodules.
+ * It allocates memory for the ngx_http_as_conf_t structre.
+ */
+static void* ngx_http_as_module_create_srv_conf(ngx_conf_t *cf)
 {
 
-	ngx_int_t rc;
-	ngx_buf_t *b;
-	ngx_chain_t out;
+	// The configuration pointer to the structure.
+	ngx_http_as_conf_t *conf;
+
+	// Allocating memory using the default nginx function pcalloc.
+	// It takes care of deallocating memory later.
+	conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_as_conf_t));
+
+	// Setting all the flag variables for the cluster objects to false.
+	// No cluster objects initialised.
+	conf->as = NULL;
+	conf->connected = false;
+	conf->use_server_conf = true;
+	conf->replica_budget = 10;
+	conf->retry_budget = 10;
+	conf->limit_latency = 20;
+	conf->limit_min = 1;
+	conf->limit_max = 64;
+	conf->write_behind_interval = 50;
+	conf->write_behind_max = 10000;
+	conf->compress = false;
+	conf->compress_level = 3;
+	conf->compress_min_size = 1024;
+	conf->timeout = NGX_CONF_UNSET_MSEC;
+	conf->socket_timeout = NGX_CONF_UNSET_MSEC;
+	conf->max_retries = NGX_CONF_UNSET;
+	conf->pool = cf->pool;
+
+	return conf;
+}
+
+/* This function creates the location configuration for the module.
+ * It allocates memory for the nngx_http_as_loc_conf_t object for the location.
+ */
+static void* ngx_http_as_module_create_loc_conf(ngx_conf_t *cf)
+{
+	// creating a location object and allocating memory.
+	ngx_http_as_conf_t *conf;
+	conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_as_conf_t));
+
+	// setting default values.
+	conf->as = NULL;
+	conf->connected = false;
+	conf->use_server_conf = false;
+	conf->replica_budget = 10;
+	conf->retry_budget = 10;
+	conf->limit_latency = 20;
+	conf->limit_min = 1;
+	conf->limit_max = 64;
+	conf->write_behind_interval = 50;
+	conf->write_behind_max = 10000;
+	conf->compress = false;
+	conf->compress_level = 3;
+	conf->compress_min_size = 1024;
+	conf->timeout = NGX_CONF_UNSET_MSEC;
+	conf->socket_timeout = NGX_CONF_UNSET_MSEC;
+	conf->max_retries = NGX_CONF_UNSET;
+	conf->pool = cf->pool;
+
+	return conf;
+}
+
+/* This function returns the configuration to be used for the request.
+ * It is the location configuration, or the server configuration if as_use_srv_conf is set.
+ */
+static ngx_http_as_conf_t* ngx_http_as_get_conf(ngx_http_request_t *r)
+{
+	ngx_http_as_conf_t *as_conf;
+	as_conf = ngx_http_get_module_loc_conf(r, ngx_http_as_module);
+
+	if(as_conf->use_server_conf)
+		as_conf = ngx_http_get_module_srv_conf(r, ngx_http_as_module);
+
+	return as_conf;
+}
+
+/* This function creates the response for the request, in msgpack if the client accepts it, else in json.
+ * Errors are sent without a body if as_minimal_errors is on, or the client sent Prefer: return=minimal.
+ * The response is allocated from the request pool, as the output filter may send it after the handler returns.
+ */
+static ngx_http_as_response_t* ngx_http_as_create_response(ngx_http_request_t *r)
+{
+	ngx_http_as_response_t *response = ngx_pcalloc(r->pool, sizeof(ngx_http_as_response_t));
+	if(response==NULL)
+		return NULL;
+
+	response->pool = r->pool;
+	response->last = &response->out;
+	response->status = NGX_HTTP_OK;
+	response->msgpack = ngx_http_as_utils_accepts_msgpack(r);
+	response->minimal = ngx_http_as_get_conf(r)->minimal_errors || ngx_http_as_utils_prefers_minimal(r);
+	return response;
+}
+
+/* This function sets the not connected error as the response, or the circuit open one if as_breaker failed the request. */
+static void ngx_http_as_not_connected(ngx_http_as_response_t *response, ngx_http_as_conf_t *as_conf)
+{
+	if(as_conf->breaker_state!=NGX_HTTP_AS_BREAKER_CLOSED)
+		ngx_http_as_response_canned(response, NGX_HTTP_AS_CIRCUIT_OPEN);
+	else
+		ngx_http_as_response_canned(response, NGX_HTTP_AS_NOT_CONNECTED);
+}
+
+/* This function sets the response of a put which is to be written later, by as_write_behind or as_spool. */
+static void ngx_http_as_accepted(ngx_http_as_response_t *response)
+{
+	as_error err;
+
+	as_error_init(&err);
+	response->status = NGX_HTTP_ACCEPTED;
+
+	if(!response->minimal)
+	{
+		ngx_http_as_response_begin(response);
+		ngx_http_as_utils_dump_error(err,response,NULL);
+	}
+}
+
+/* This function sends the response to the client, with the content type of its format. */
+static ngx_int_t ngx_http_as_send_response(ngx_http_request_t *r, ngx_http_as_response_t *response)
+{
+	ngx_table_elt_t *h;
+	ngx_int_t rc;
+
+	// the transactions are done, the slot of as_limit is not held while the response is sent.
+	ngx_http_as_limit_end(r, response->status==NGX_HTTP_SERVICE_UNAVAILABLE || response->status==NGX_HTTP_GATEWAY_TIME_OUT);
+
+	// an empty response still needs a buffer, to be marked as the last one.
+	if(response->buf==NULL)
+		ngx_http_as_response_reserve(response, 0);
+
+	if(response->error)
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+	if(response->msgpack)
+	{
+		ngx_str_set(&r->headers_out.content_type, "application/msgpack");
+	}
+	else if(response->ndjson && response->status==NGX_HTTP_OK)
+	{
+		ngx_str_set(&r->headers_out.content_type, "application/x-ndjson");
+	}
+	else
+	{
+		ngx_str_set(&r->headers_out.content_type, "application/json");
+	}
+
+	r->headers_out.content_type_len = r->headers_out.content_type.len;
+
+	response->buf->last_buf = 1;
+
+	r->headers_out.status = response->status;
+	r->headers_out.content_length_n = response->size;
+
+	if(response->retry_after)
+	{
+		h = ngx_list_push(&r->headers_out.headers);
+		if(h==NULL)
+			return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+		h->value.data = ngx_pnalloc(r->pool, NGX_TIME_T_LEN);
+		if(h->value.data==NULL)
+			return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+		h->hash = 1;
+		ngx_str_set(&h->key, "Retry-After");
+		h->value.len = ngx_sprintf(h->value.data, "%T", response->retry_after) - h->value.data;
+#if (nginx_version >= 1023000)
+		h->next = NULL;
+#endif
+	}
+
+	rc = ngx_http_send_header(r);
+
+	if(rc==NGX_ERROR || rc>NGX_OK || r->header_only)
+		return rc;
+
+	return ngx_http_output_filter(r, response->out);
+}
+
+/* This is the handler for the as_operate directive.
+ * The operation to be done is read from the op arguement of the url.
+ */
+static ngx_int_t ngx_http_as_operate_handler(ngx_http_request_t *r)
+{
+	ngx_int_t rc;
 	
 	rc = ngx_http_discard_request_body(r);
 
-	if(rc!=NGX_OK)
-		return rc;
+	if(rc!=NGX_OK)
+		return rc;
+
+	ngx_http_as_response_t *response = ngx_http_as_create_response(r);
+	if(response==NULL)
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+	ngx_http_as_conf_t *as_conf = ngx_http_as_get_conf(r);
+
+	bool is_connected = ngx_http_as_operate_connect(r, as_conf);
+	char operation[20] = "";
+	ngx_http_as_utils_get_parsed_url_arguement(r->args, "op",operation, sizeof(operation));
+
+	if((is_connected || as_conf->spool!=NULL) && strcmp(operation,"put")==0)
+	{
+		ngx_http_as_utils_put(r,as_conf,response);
+	}
+	else if((is_connected || as_conf->secondary!=NULL) && strcmp(operation,"get")==0)
+	{
+		ngx_http_as_operate_get(r, as_conf, response);
+	}
+	else if(is_connected && strcmp("del", operation)==0)
+	{
+		ngx_http_as_operate_del(r, as_conf, response);
+	}
+	else if(is_connected && strcmp("mget", operation)==0)
+	{
+		ngx_http_as_operate_mget(r, as_conf, response);
+	}
+	else if(is_connected && strcmp("scan", operation)==0)
+	{
+		return ngx_http_as_scan_start(r, as_conf, response);
+	}
+	else if(!is_connected)
+	{
+		ngx_http_as_not_connected(response, as_conf);
+	}
+	else
+	{
+		ngx_http_as_response_canned(response, NGX_HTTP_AS_UNKNOWN_OPERATION);
+	}
+
+	return ngx_http_as_send_response(r, response);
+}
+
+/* This is the handler for the as_get directive. */
+static ngx_int_t ngx_http_as_get_handler(ngx_http_request_t *r)
+{
+	ngx_int_t rc;
+
+	rc = ngx_http_discard_request_body(r);
+
+	if(rc!=NGX_OK)
+		return rc;
+
+	ngx_http_as_response_t *response = ngx_http_as_create_response(r);
+	if(response==NULL)
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+	ngx_http_as_conf_t *as_conf = ngx_http_as_get_conf(r);
+
+	// a read is sent to the secondary cluster if the primary is down.
+	if(ngx_http_as_utils_connect_configured(as_conf) || as_conf->secondary!=NULL)
+		ngx_http_as_operate_get(r, as_conf, response);
+	else
+		ngx_http_as_not_connected(response, as_conf);
+
+	return ngx_http_as_send_response(r, response);
+}
+
+/* This is the handler for the as_put directive.
+ * For PUT and POST, the bins are read from the request body, else from the url arguements.
+ */
+static ngx_int_t ngx_http_as_put_handler(ngx_http_request_t *r)
+{
+	ngx_int_t rc;
+	ngx_http_as_ctx_t *ctx;
+
+	if(r->method & (NGX_HTTP_PUT|NGX_HTTP_POST))
+	{
+		ctx = ngx_http_get_module_ctx(r, ngx_http_as_module);
+		if(ctx==NULL)
+		{
+			ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_as_ctx_t));
+			if(ctx==NULL)
+				return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+			ngx_http_set_ctx(r, ctx, ngx_http_as_module);
+		}
+
+		// the put is done once the whole body is read.
+		rc = ngx_http_read_client_request_body(r, ngx_http_as_put_body_handler);
+
+		if(rc>=NGX_HTTP_SPECIAL_RESPONSE)
+			return rc;
+
+		return NGX_DONE;
+	}
+
+	rc = ngx_http_discard_request_body(r);
+
+	if(rc!=NGX_OK)
+		return rc;
+
+	ngx_http_as_response_t *response = ngx_http_as_create_response(r);
+	if(response==NULL)
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+	ngx_http_as_conf_t *as_conf = ngx_http_as_get_conf(r);
+
+	// with as_spool, a put is taken even if the worker is not connected.
+	if(ngx_http_as_utils_connect_configured(as_conf) || as_conf->spool!=NULL)
+		ngx_http_as_utils_put(r, as_conf, response);
+	else
+		ngx_http_as_not_connected(response, as_conf);
+
+	return ngx_http_as_send_response(r, response);
+}
+
+/* This is the handler for the as_delete directive. */
+static ngx_int_t ngx_http_as_delete_handler(ngx_http_request_t *r)
+{
+	ngx_int_t rc;
+
+	rc = ngx_http_discard_request_body(r);
+
+	if(rc!=NGX_OK)
+		return rc;
+
+	ngx_http_as_response_t *response = ngx_http_as_create_response(r);
+	if(response==NULL)
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+	ngx_http_as_conf_t *as_conf = ngx_http_as_get_conf(r);
+
+	if(ngx_http_as_utils_connect_configured(as_conf))
+		ngx_http_as_operate_del(r, as_conf, response);
+	else
+		ngx_http_as_not_connected(response, as_conf);
+
+	return ngx_http_as_send_response(r, response);
+}
+
+/* This is the handler for the as_operate_ops directive.
+ * The operations were compiled from the directive arguements at configuration time.
+ */
+static ngx_int_t ngx_http_as_operate_ops_handler(ngx_http_request_t *r)
+{
+	ngx_int_t rc;
+
+	rc = ngx_http_discard_request_body(r);
+
+	if(rc!=NGX_OK)
+		return rc;
+
+	ngx_http_as_response_t *response = ngx_http_as_create_response(r);
+	if(response==NULL)
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+	ngx_http_as_conf_t *as_conf = ngx_http_get_module_loc_conf(r, ngx_http_as_module);
+	ngx_array_t *ops = as_conf->ops;
+
+	as_conf = ngx_http_as_get_conf(r);
+
+	if(ngx_http_as_utils_connect_configured(as_conf))
+		ngx_http_as_operate_ops(r, as_conf, ops, response);
+	else
+		ngx_http_as_not_connected(response, as_conf);
+
+	return ngx_http_as_send_response(r, response);
+}
+
+/* This is the handler for the as_rest directive.
+ * The uri is of the form /namespace/set/key, and the method selects the operation,
+ * GET and HEAD read the record, PUT and POST write the bins in the request body, and DELETE removes it.
+ */
+static ngx_int_t ngx_http_as_rest_handler(ngx_http_request_t *r)
+{
+	ngx_http_as_ctx_t *ctx;
+
+	// the context may have been created by as_limit.
+	ctx = ngx_http_get_module_ctx(r, ngx_http_as_module);
+	if(ctx==NULL)
+	{
+		ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_as_ctx_t));
+		if(ctx==NULL)
+			return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+		ngx_http_set_ctx(r, ctx, ngx_http_as_module);
+	}
+
+	ctx->rest = true;
+	ngx_http_as_utils_parse_rest_uri(r->uri, ctx);
+
+	if(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))
+		return ngx_http_as_get_handler(r);
+
+	if(r->method & NGX_HTTP_DELETE)
+		return ngx_http_as_delete_handler(r);
+
+	if(r->method & (NGX_HTTP_PUT|NGX_HTTP_POST))
+		return ngx_http_as_put_handler(r);
+
+	return NGX_HTTP_NOT_ALLOWED;
+}
+
+/* This is the preaccess handler of as_limit. It gives the request a slot on the cluster before its content handler runs.
+ * If all the slots are taken, the request waits for one up to the queue time of as_limit, in the queue of the worker,
+ * and is then rejected with a 503. It is woken up as soon as the worker gives back a slot, or within a few milliseconds of another worker giving one back.
+ * The slot is given back once the transactions of the request are done, by ngx_http_as_limit_end, or else once the request is freed.
+ */
+static ngx_int_t ngx_http_as_limit_handler(ngx_http_request_t *r)
+{
+	ngx_http_as_conf_t *as_conf = ngx_http_as_get_conf(r);
+	ngx_http_as_main_conf_t *amcf;
+	ngx_http_as_response_t *response;
+	ngx_http_as_limit_waiter_t *waiter;
+	ngx_http_as_limit_sh_t *sh;
+	ngx_http_as_limit_slot_t *slot;
+	ngx_http_as_ctx_t *ctx;
+	ngx_pool_cleanup_t *cln;
+	ngx_msec_t now;
+	ngx_int_t rc;
+	bool waited;
+
+	if(as_conf->limit_zone==NULL || r!=r->main)
+		return NGX_DECLINED;
+
+	ctx = ngx_http_get_module_ctx(r, ngx_http_as_module);
+	if(ctx==NULL)
+	{
+		ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_as_ctx_t));
+		if(ctx==NULL)
+			return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+		ngx_http_set_ctx(r, ctx, ngx_http_as_module);
+	}
+
+	if(ctx->limited)
+		return NGX_DECLINED;
+
+	now = ngx_http_as_utils_clock();
+
+	if(ngx_http_as_limit_acquire(as_conf->limit_zone->data, as_conf))
+	{
+		cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_http_as_limit_slot_t));
+		if(cln==NULL)
+		{
+			ngx_http_as_limit_release(as_conf->limit_zone->data, as_conf, NGX_CONF_UNSET_MSEC, false);
+			return NGX_HTTP_INTERNAL_SERVER_ERROR;
+		}
+
+		slot = cln->data;
+		slot->r = r;
+		slot->as_conf = as_conf;
+		slot->released = false;
+
+		cln->handler = ngx_http_as_limit_cleanup;
+
+		ctx->limit_slot = slot;
+		ctx->limited = true;
+		return NGX_DECLINED;
+	}
+
+	waited = ctx->limit_waiter!=NULL;
+
+	if(!waited)
+	{
+		cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_http_as_limit_waiter_t));
+		if(cln==NULL)
+			return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+		waiter = cln->data;
+		waiter->r = r;
+		waiter->zone = as_conf->limit_zone;
+		waiter->queued = false;
+
+		cln->handler = ngx_http_as_limit_waiter_cleanup;
+
+		ctx->limit_waiter = waiter;
+		ctx->limit_deadline = now + as_conf->limit_queue;
+	}
+
+	// waiting for a slot, as limit_req delays a request. A request woken up which missed the slot keeps its place at the head.
+	if(now<ctx->limit_deadline)
+	{
+		amcf = ngx_http_get_module_main_conf(r, ngx_http_as_module);
+		sh = as_conf->limit_zone->data;
+		waiter = ctx->limit_waiter;
+
+		waiter->released = sh->released;
+		waiter->queued = true;
+
+		if(waited)
+		{
+			ngx_queue_insert_head(&amcf->limit_waiters, &waiter->queue);
+		}
+		else
+		{
+			ngx_queue_insert_tail(&amcf->limit_waiters, &waiter->queue);
+		}
+
+		r->read_event_handler = ngx_http_test_reading;
+		r->write_event_handler = ngx_http_as_limit_wait_handler;
+
+		r->connection->write->delayed = 1;
+		ngx_add_timer(r->connection->write, ctx->limit_deadline - now);
+
+		if(!amcf->limit_event.timer_set)
+			ngx_add_timer(&amcf->limit_event, NGX_HTTP_AS_LIMIT_POLL);
+
+		return NGX_AGAIN;
+	}
+
+	rc = ngx_http_discard_request_body(r);
+	if(rc!=NGX_OK)
+		return rc;
+
+	response = ngx_http_as_create_response(r);
+	if(response==NULL)
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+	ngx_http_as_response_canned(response, NGX_HTTP_AS_OVERLOADED);
+	ngx_http_finalize_request(r, ngx_http_as_send_response(r, response));
+	return NGX_DONE;
+}
+
+/* This function is called when a request waiting for a slot of as_limit is woken up, or its wait is over, to run the preaccess phase again.
+ * Any other write event of the request is ignored. The flags of the event are cleared here, as not every version of nginx clears them.
+ */
+static void ngx_http_as_limit_wait_handler(ngx_http_request_t *r)
+{
+	ngx_http_as_ctx_t *ctx = ngx_http_get_module_ctx(r, ngx_http_as_module);
+	ngx_http_as_limit_waiter_t *waiter = ctx->limit_waiter;
+	ngx_event_t *wev = r->connection->write;
+
+	if(waiter->queued && !wev->timedout)
+	{
+		if(ngx_handle_write_event(wev, 0)!=NGX_OK)
+			ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+
+		return;
+	}
+
+	if(waiter->queued)
+	{
+		ngx_queue_remove(&waiter->queue);
+		waiter->queued = false;
+	}
+
+	if(wev->timer_set)
+		ngx_del_timer(wev);
+
+	wev->timedout = 0;
+	wev->delayed = 0;
+
+	if(ngx_handle_read_event(r->connection->read, 0)!=NGX_OK)
+	{
+		ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+		return;
+	}
+
+	r->read_event_handler = ngx_http_block_reading;
+	r->write_event_handler = ngx_http_core_run_phases;
+
+	ngx_http_core_run_phases(r);
+}
+
+/* This function gives back the slot of a request once it is freed, if its transactions did not give it back.
+ * A request which failed as the cluster is overloaded or timed out, 503 or 504, shrinks the limit.
+ */
+static void ngx_http_as_limit_cleanup(void *data)
+{
+	ngx_http_as_limit_slot_t *slot = data;
+	ngx_uint_t status = slot->r->headers_out.status;
+
+	ngx_http_as_limit_end(slot->r, status==NGX_HTTP_SERVICE_UNAVAILABLE || status==NGX_HTTP_GATEWAY_TIME_OUT);
+}
+
+/* This function takes a request which is freed out of the queue of the requests waiting for a slot of as_limit. */
+static void ngx_http_as_limit_waiter_cleanup(void *data)
+{
+	ngx_http_as_limit_waiter_t *waiter = data;
+
+	if(waiter->queued)
+	{
+		ngx_queue_remove(&waiter->queue);
+		waiter->queued = false;
+	}
+}
+
+/* This function wakes up the n oldest requests of the worker waiting for a slot of a zone, or of any zone if zone is NULL.
+ * A request is woken up by posting its write event, which runs the preaccess phase again.
+ */
+static void ngx_http_as_limit_wake(ngx_http_as_main_conf_t *amcf, ngx_shm_zone_t *zone, ngx_uint_t n)
+{
+	ngx_http_as_limit_waiter_t *waiter;
+	ngx_queue_t *q, *next;
+	ngx_event_t *wev;
+
+	for(q=ngx_queue_head(&amcf->limit_waiters); q!=ngx_queue_sentinel(&amcf->limit_waiters) && n>0; q=next)
+	{
+		next = ngx_queue_next(q);
+		waiter = ngx_queue_data(q, ngx_http_as_limit_waiter_t, queue);
+
+		if(zone!=NULL && waiter->zone!=zone)
+			continue;
+
+		ngx_queue_remove(q);
+		waiter->queued = false;
+
+		wev = waiter->r->connection->write;
+		if(wev->timer_set)
+			ngx_del_timer(wev);
+
+		ngx_post_event(wev, &ngx_posted_events);
+		n--;
+	}
+}
+
+/* This function checks, every few milliseconds while requests of the worker wait for a slot of as_limit,
+ * whether the other workers gave back slots since they were queued, and wakes up as many of them as slots were given back.
+ * The slots given back by the worker itself wake up its requests at once, in ngx_http_as_limit_end.
+ */
+static void ngx_http_as_limit_check_handler(ngx_event_t *ev)
+{
+	ngx_http_as_main_conf_t *amcf = ev->data;
+	ngx_http_as_limit_waiter_t *waiter;
+	ngx_http_as_limit_sh_t *sh;
+	ngx_queue_t *q, *next;
+	ngx_uint_t woken = 0;
+
+	for(q=ngx_queue_head(&amcf->limit_waiters); q!=ngx_queue_sentinel(&amcf->limit_waiters); q=next)
+	{
+		next = ngx_queue_next(q);
+		waiter = ngx_queue_data(q, ngx_http_as_limit_waiter_t, queue);
+		sh = waiter->zone->data;
+
+		if(sh->released - waiter->released<=woken)
+			continue;
+
+		ngx_queue_remove(q);
+		waiter->queued = false;
+
+		if(waiter->r->connection->write->timer_set)
+			ngx_del_timer(waiter->r->connection->write);
+
+		ngx_post_event(waiter->r->connection->write, &ngx_posted_events);
+		woken++;
+	}
+
+	if(!ngx_queue_empty(&amcf->limit_waiters) && !ngx_exiting)
+		ngx_add_timer(ev, NGX_HTTP_AS_LIMIT_POLL);
+}
+
+/* This function is called once the request body of a put is read.
+ * A json or msgpack body is parsed by the put directly from the body buffers,
+ * any other body is read into a string of bin=value pairs.
+ */
+static void ngx_http_as_put_body_handler(ngx_http_request_t *r)
+{
+	ngx_http_as_ctx_t *ctx = ngx_http_get_module_ctx(r, ngx_http_as_module);
+
+	// an empty body leaves the bins to the url arguements, as for the other methods.
+	if(r->request_body!=NULL && r->request_body->bufs!=NULL)
+	{
+		ctx->json = ngx_http_as_utils_is_json(r);
+		ctx->msgpack = ngx_http_as_utils_is_msgpack(r);
+	}
+
+	if(!ctx->json && !ctx->msgpack && !ngx_http_as_utils_read_body(r, &ctx->body))
+	{
+		ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+		return;
+	}
+
+	ngx_http_as_response_t *response = ngx_http_as_create_response(r);
+	if(response==NULL)
+	{
+		ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+		return;
+	}
+
+	ngx_http_as_conf_t *as_conf = ngx_http_as_get_conf(r);
+
+	// with as_spool, a put is taken even if the worker is not connected.
+	if(ngx_http_as_utils_connect_configured(as_conf) || as_conf->spool!=NULL)
+		ngx_http_as_utils_put(r, as_conf, response);
+	else
+		ngx_http_as_not_connected(response, as_conf);
+
+	ngx_http_finalize_request(r, ngx_http_as_send_response(r, response));
+}
+
+/* This is the handler for the as_import directive, which writes the records of an ndjson or msgpack body.
+ * ns and set are the arguements of the url, and key names the bin holding the key of each record, which is stored as a bin too.
+ * The body is read without buffering. Each buffer is parsed as it is read, and nginx reads no more of the body while a batch is written.
+ */
+static ngx_int_t ngx_http_as_import_handler(ngx_http_request_t *r)
+{
+	ngx_http_as_import_t *import;
+	ngx_http_as_response_t *response;
+	ngx_http_as_ctx_t *ctx;
+	ngx_pool_cleanup_t *cln;
+	ngx_int_t rc;
+
+	if(!(r->method & (NGX_HTTP_PUT|NGX_HTTP_POST)))
+		return NGX_HTTP_NOT_ALLOWED;
+
+	ngx_http_as_conf_t *as_conf = ngx_http_as_get_conf(r);
+
+	import = ngx_pcalloc(r->pool, sizeof(ngx_http_as_import_t));
+	if(import==NULL)
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+	import->r = r;
+	import->as_conf = as_conf;
+	import->batch = ((ngx_http_as_conf_t*)ngx_http_get_module_loc_conf(r, ngx_http_as_module))->import_batch;
+
+	bool is_connected = ngx_http_as_utils_connect_configured(as_conf);
+	bool has_key = ngx_http_as_utils_get_key_args(r, as_conf, import->namespace, import->set, import->key);
+
+	if(!is_connected || !has_key)
+	{
+		rc = ngx_http_discard_request_body(r);
+
+		if(rc!=NGX_OK)
+			return rc;
+
+		response = ngx_http_as_create_response(r);
+		if(response==NULL)
+			return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+		if(!is_connected)
+			ngx_http_as_not_connected(response, as_conf);
+		else
+			ngx_http_as_response_canned(response, NGX_HTTP_AS_INVALID_KEY);
+
+		return ngx_http_as_send_response(r, response);
+	}
+
+	ctx = ngx_http_get_module_ctx(r, ngx_http_as_module);
+	if(ctx==NULL)
+	{
+		ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_as_ctx_t));
+		if(ctx==NULL)
+			return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+		ngx_http_set_ctx(r, ctx, ngx_http_as_module);
+	}
+
+	ctx->import = import;
+	import->msgpack = ngx_http_as_utils_is_msgpack(r);
+	import->schema = ngx_http_as_utils_find_schema(r, import->set);
+
+	// the batch still held by a request which is cut short is destroyed with it.
+	cln = ngx_pool_cleanup_add(r->pool, 0);
+	if(cln==NULL)
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+	cln->handler = ngx_http_as_import_cleanup;
+	cln->data = import;
+
+	if(!ngx_http_as_import_init(import))
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+	r->request_body_no_buffering = 1;
+
+	rc = ngx_http_read_client_request_body(r, ngx_http_as_import_body_handler);
+
+	if(rc>=NGX_HTTP_SPECIAL_RESPONSE)
+		return rc;
+
+	return NGX_DONE;
+}
+
+/* This function is called once the first buffers of an as_import body are read.
+ * The rest of the body is read by ngx_http_as_import_read_handler, as the client sends it.
+ */
+static void ngx_http_as_import_body_handler(ngx_http_request_t *r)
+{
+	r->read_event_handler = ngx_http_as_import_read_handler;
+
+	ngx_http_as_import_consume(r, !r->reading_body);
+}
+
+/* This function reads the buffers of an as_import body which the client sent since the last call. */
+static void ngx_http_as_import_read_handler(ngx_http_request_t *r)
+{
+	ngx_int_t rc;
+
+	rc = ngx_http_read_unbuffered_request_body(r);
+
+	if(rc!=NGX_OK && rc!=NGX_AGAIN)
+	{
+		ngx_http_finalize_request(r, rc);
+		return;
+	}
+
+	ngx_http_as_import_consume(r, rc==NGX_OK);
+}
+
+/* This function parses the buffers of an as_import body which were read, and gives them back to nginx to read more of the body into.
+ * Once the whole body is read, the last batch is written and the summary of the records is sent.
+ */
+static void ngx_http_as_import_consume(ngx_http_request_t *r, bool done)
+{
+	ngx_http_as_ctx_t *ctx = ngx_http_get_module_ctx(r, ngx_http_as_module);
+	ngx_http_as_import_t *import = ctx->import;
+	ngx_http_as_response_t *response;
+	ngx_chain_t *cl;
+
+	for(cl=r->request_body->bufs; cl; cl=cl->next)
+	{
+		ngx_http_as_import_parse(import, cl->buf->pos, cl->buf->last);
+		cl->buf->pos = cl->buf->last;
+	}
+
+	r->request_body->bufs = NULL;
+
+	if(!done)
+		return;
+
+	ngx_http_as_import_finish(import);
+
+	r->read_event_handler = ngx_http_block_reading;
+
+	response = ngx_http_as_create_response(r);
+	if(response==NULL)
+	{
+		ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+		return;
+	}
+
+	ngx_http_as_import_summary(import, response);
+
+	ngx_http_finalize_request(r, ngx_http_as_send_response(r, response));
+}
+
+/* This function destroys the records and batches of an as_import request, and its pool, with the request. */
+static void ngx_http_as_import_cleanup(void *data)
+{
+	ngx_http_as_import_t *import = data;
+	ngx_uint_t i;
+
+	if(import->pool==NULL)
+		return;
+
+	ngx_http_as_builder_destroy(&import->builder);
+
+	for(i=0; i<import->count; i++)
+		as_record_destroy(&import->entries[i].rec);
+
+	for(i=0; import->batches && i<import->nclusters; i++)
+		as_batch_records_destroy(&import->batches[i]);
+
+	ngx_destroy_pool(import->pool);
+	import->pool = NULL;
+}
+
+/* This function starts an op=scan request, which streams the records of the namespace, or of the set if one is given, as ndjson or msgpack.
+ * The bins arguement lists the bins sent, separated by commas, else every bin is sent. The rate arguement caps the records sent a second.
+ * The response is chunked, and is sent a page at a time by ngx_http_as_scan_run. A page is of up to NGX_HTTP_AS_SCAN_PAGE records
+ * and about NGX_HTTP_AS_SCAN_PAGE_SIZE bytes, and is fetched synchronously, so the worker handles no other request until the nodes sent it.
+ */
+static ngx_int_t ngx_http_as_scan_start(ngx_http_request_t *r, ngx_http_as_conf_t *as_conf, ngx_http_as_response_t *response)
+{
+	ngx_http_as_scan_t *scan;
+	ngx_http_as_ctx_t *ctx;
+	ngx_pool_cleanup_t *cln;
+	ngx_int_t rate;
+	char value[20];
+	char *p, *comma;
+	size_t len;
+
+	scan = ngx_pcalloc(r->pool, sizeof(ngx_http_as_scan_t));
+	if(scan==NULL)
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+	scan->r = r;
+	scan->as_conf = as_conf;
+	scan->msgpack = response->msgpack;
+	scan->nclusters = as_conf->shards ? as_conf->shards->nelts : 1;
+
+	// the namespace is needed, the set is not, as a scan without one is of the whole namespace.
+	if(!ngx_http_as_utils_get_template_value(r, as_conf->namespace_template, "ns", scan->namespace, sizeof(scan->namespace))
+		|| scan->namespace[0]=='\0'
+		|| !ngx_http_as_utils_get_template_value(r, as_conf->set_template, "set", scan->set, sizeof(scan->set))
+		|| !ngx_http_as_utils_get_parsed_url_arguement(r->args, "bins", scan->bins, sizeof(scan->bins))
+		|| !ngx_http_as_utils_get_parsed_url_arguement(r->args, "rate", value, sizeof(value)))
+	{
+		ngx_http_as_response_canned(response, NGX_HTTP_AS_INVALID_SCAN);
+		return ngx_http_as_send_response(r, response);
+	}
+
+	if(value[0]!='\0')
+	{
+		rate = ngx_atoi((u_char*)value, strlen(value));
+		if(rate==NGX_ERROR)
+		{
+			ngx_http_as_response_canned(response, NGX_HTTP_AS_INVALID_SCAN);
+			return ngx_http_as_send_response(r, response);
+		}
+
+		scan->rate = rate;
+	}
+
+	// splitting the bins at the commas, in place.
+	for(p=scan->bins; scan->bins[0]!='\0'; p=comma + 1)
+	{
+		comma = strchr(p, ',');
+		if(comma)
+			*comma = '\0';
+
+		len = strlen(p);
+		if(len==0 || len>=AS_BIN_NAME_MAX_SIZE)
+		{
+			ngx_http_as_response_canned(response, NGX_HTTP_AS_INVALID_SCAN);
+			return ngx_http_as_send_response(r, response);
+		}
+
+		scan->nbins++;
+
+		if(comma==NULL)
+			break;
+	}
+
+	as_policy_scan_init(&scan->policy);
+	if(!ngx_http_as_utils_set_policy(r, as_conf, &scan->policy.base))
+	{
+		ngx_http_as_response_canned(response, NGX_HTTP_AS_DEADLINE_EXCEEDED);
+		return ngx_http_as_send_response(r, response);
+	}
+
+	// a page is no more than a second of records at the rate.
+	scan->policy.max_records = NGX_HTTP_AS_SCAN_PAGE;
+	if(scan->rate && scan->rate<NGX_HTTP_AS_SCAN_PAGE)
+		scan->policy.max_records = scan->rate;
+
+	scan->schema = ngx_http_as_utils_find_schema(r, scan->set);
+
+	ctx = ngx_http_get_module_ctx(r, ngx_http_as_module);
+	if(ctx==NULL)
+	{
+		ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_as_ctx_t));
+		if(ctx==NULL)
+			return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+		ngx_http_set_ctx(r, ctx, ngx_http_as_module);
+	}
+
+	ctx->scan = scan;
+
+	// the scan and the page still held by a request which is cut short are destroyed with it.
+	cln = ngx_pool_cleanup_add(r->pool, 0);
+	if(cln==NULL)
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+	cln->handler = ngx_http_as_scan_cleanup;
+	cln->data = scan;
+
+	if(!ngx_http_as_scan_init(scan))
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+	scan->start = ngx_http_as_utils_clock();
+
+	// the request is finalized by ngx_http_as_scan_run, once the last page is sent.
+	r->main->count++;
+
+	ngx_http_as_scan_run(r);
+	return NGX_DONE;
+}
+
+/* This function sends the pages of an op=scan request. The next page is only fetched once the client took the last one,
+ * so a single page is held at a time, and a slow client slows the scan down instead of it being buffered.
+ * It waits for the socket to be writable, or for the records sent to be due at the rate, as the write event of the request.
+ */
+static void ngx_http_as_scan_run(ngx_http_request_t *r)
+{
+	ngx_http_as_ctx_t *ctx = ngx_http_get_module_ctx(r, ngx_http_as_module);
+	ngx_http_as_scan_t *scan = ctx->scan;
+	ngx_connection_t *c = r->connection;
+	ngx_event_t *wev = c->write;
+	ngx_http_core_loc_conf_t *clcf;
+	ngx_http_as_response_t *response;
+	ngx_msec_t now, due;
+	as_error err;
+	ngx_int_t rc;
+
+	clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+	for( ;; )
+	{
+		// the page being sent is kept until it is all written to the socket.
+		if(scan->page.pool!=NULL)
+		{
+			rc = ngx_http_output_filter(r, NULL);
+			if(rc==NGX_ERROR)
+			{
+				ngx_http_finalize_request(r, NGX_ERROR);
+				return;
+			}
+
+			if(r->buffered || c->buffered)
+			{
+				r->write_event_handler = ngx_http_as_scan_write_handler;
+
+				if(!wev->delayed)
+					ngx_add_timer(wev, clcf->send_timeout);
+
+				if(ngx_handle_write_event(wev, clcf->send_lowat)!=NGX_OK)
+					ngx_http_finalize_request(r, NGX_ERROR);
+
+				return;
+			}
+
+			if(wev->timer_set && !wev->delayed)
+				ngx_del_timer(wev);
+
+			ngx_destroy_pool(scan->page.pool);
+			scan->page.pool = NULL;
+		}
+
+		if(scan->done)
+		{
+			ngx_http_finalize_request(r, ngx_http_send_special(r, NGX_HTTP_LAST));
+			return;
+		}
+
+		// with a rate, the next page waits until the records sent so far are due.
+		if(scan->rate)
+		{
+			now = ngx_http_as_utils_clock();
+			due = scan->start + scan->records * 1000 / scan->rate;
+
+			if(due>now)
+			{
+				r->write_event_handler = ngx_http_as_scan_write_handler;
+				wev->delayed = 1;
+				ngx_add_timer(wev, due - now);
+				return;
+			}
+		}
+
+		if(!ngx_http_as_scan_page(scan, &err))
+		{
+			ngx_http_finalize_request(r, scan->started ? NGX_ERROR : NGX_HTTP_INTERNAL_SERVER_ERROR);
+			return;
+		}
+
+		// the slot of as_limit is held for the first page only, as the pages are then paced by the client.
+		if(err.code==AEROSPIKE_OK)
+			ngx_http_as_limit_end(r, false);
+
+		if(!scan->started)
+		{
+			// a scan failing on its first page is sent the error with its status, as any other request.
+			if(err.code!=AEROSPIKE_OK)
+			{
+				response = ngx_http_as_create_response(r);
+				if(response==NULL)
+				{
+					ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+					return;
+				}
+
+				if(ngx_http_as_response_status(response, err.code))
+				{
+					ngx_http_as_response_begin(response);
+					ngx_http_as_utils_dump_error(err, response, NULL);
+				}
+
+				ngx_http_finalize_request(r, ngx_http_as_send_response(r, response));
+				return;
+			}
+
+			if(scan->msgpack)
+			{
+				ngx_str_set(&r->headers_out.content_type, "application/msgpack");
+			}
+			else
+			{
+				ngx_str_set(&r->headers_out.content_type, "application/x-ndjson");
+			}
+
+			r->headers_out.content_type_len = r->headers_out.content_type.len;
+			r->headers_out.status = NGX_HTTP_OK;
+			r->headers_out.content_length_n = -1;
+
+			scan->started = true;
+
+			rc = ngx_http_send_header(r);
+			if(rc==NGX_ERROR || rc>NGX_OK || r->header_only)
+			{
+				ngx_http_finalize_request(r, rc);
+				return;
+			}
+		}
+
+		// an empty page is not sent, its pool is destroyed before the next one is fetched.
+		if(scan->page.out==NULL)
+			continue;
+
+		scan->page.buf->flush = 1;
+
+		rc = ngx_http_output_filter(r, scan->page.out);
+		if(rc==NGX_ERROR)
+		{
+			ngx_http_finalize_request(r, NGX_ERROR);
+			return;
+		}
+	}
+}
+
+/* This function is the write event of an op=scan request, called once the socket is writable, or the wait of the rate is over.
+ * The event is delayed while waiting for the rate, and timed out if the client did not take the page in send_timeout.
+ * The timer of the rate times the event out too, so the wait is over once a delayed event is timed out, and both are cleared here.
+ */
+static void ngx_http_as_scan_write_handler(ngx_http_request_t *r)
+{
+	ngx_event_t *wev = r->connection->write;
+
+	if(wev->delayed)
+	{
+		if(!wev->timedout)
+		{
+			if(ngx_handle_write_event(wev, 0)!=NGX_OK)
+				ngx_http_finalize_request(r, NGX_ERROR);
+
+			return;
+		}
+
+		wev->delayed = 0;
+		wev->timedout = 0;
+	}
+
+	if(wev->timedout)
+	{
+		r->connection->timedout = 1;
+		ngx_http_finalize_request(r, NGX_HTTP_REQUEST_TIME_OUT);
+		return;
+	}
+
+	ngx_http_as_scan_run(r);
+}
+
+/* This function destroys the scan of an op=scan request, and the pool of its page, with the request. */
+static void ngx_http_as_scan_cleanup(void *data)
+{
+	ngx_http_as_scan_t *scan = data;
+
+	if(scan->initialized)
+	{
+		as_scan_destroy(&scan->scan);
+		scan->initialized = false;
+	}
+
+	if(scan->page.pool!=NULL)
+	{
+		ngx_destroy_pool(scan->page.pool);
+		scan->page.pool = NULL;
+	}
+}
+
+bool ngx_http_as_operate_connect(ngx_http_request_t *r, ngx_http_as_conf_t *as_conf)
+{
+	//ngx_write_stderr("In ngx_http_as_operate_connect\n");
+	//ngx_write_stderr((char*)r->args.data);
+
+	// the shards are connected when a key first picks them.
+	if(as_conf->shards!=NULL)
+		return true;
+
+	// an open circuit fails the request at once, without connecting or touching the client, and a half open one lets a few through.
+	if(!ngx_http_as_breaker_admit(as_conf))
+		return false;
+
+
+	// hosts stores the hosts address and ports to iniitailise the cluster object with.
+	// hosts_arrived_in_url checks whether the request contains the ip and ports.
+	ngx_http_as_hosts hosts;
+	bool hosts_arrived_in_url = false;
+
+	// getting the hosts string from the url.
+	char hosts_string[1000] = "";
+	ngx_http_as_utils_get_parsed_url_arguement(r->args, "hosts", hosts_string, sizeof(hosts_string));
+
+
+	// if the url contains ip and ports, setting the hosts_string to true, and parsing the host string.
+	if(strlen(hosts_string)>0)
+	{
+		// hosts which do not parse are not connected to.
+		if(!ngx_http_as_utils_parse_hosts((u_char*)hosts_string, strlen(hosts_string), &hosts))
+			return false;
+
+		hosts_arrived_in_url = true;
+		//if first tme connect then copy the host
+		if(as_conf->current_hosts.n==0)
+		{
+			as_conf->current_hosts = hosts;
+		}
+		as_conf->is_hosts_present = ngx_http_as_utils_compare_prev_new_hosts(as_conf->current_hosts, hosts);
+	}
+
+
+	// if hosts arrived in url, we need to connect to that addresses.
+	if(hosts_arrived_in_url && !(as_conf->is_hosts_present))
+	{
+		// if the object is previously connected, closing the connection.
+		if(as_conf->connected)
+		{
+			as_error err;
+			aerospike_close(as_conf->as, &err);
+			aerospike_destroy(as_conf->as);
+			as_conf->connected = false;
+		}
+			
+		// connecting to new configurations.
+		if(ngx_http_as_utils_connect(&(as_conf->as), hosts))
+		{
+			as_conf->connected = true;
+			return true;
+		}
+	}
+	else
+	{
+		// if using the default server hosts.
+		// if the object is not yet connected, we need to initialize.
+		if(!as_conf->connected)
+		{
+			// the default hosts were parsed with as_connect.
+			if(as_conf->current_hosts.n==0)
+			{
+				as_conf->current_hosts = as_conf->hosts;
+			}
+			if(ngx_http_as_utils_connect(&(as_conf->as), as_conf->hosts))
+			{
+				as_conf->connected = true;
+				return true;
+			}
+		}
+		else
+		{
+			return true;
+		}
+	}
+
+	ngx_http_as_breaker_record(as_conf, AEROSPIKE_ERR_CONNECTION);
+	return false;
+}
+
+/* This function sets up the as_connect directive.
+ * It takes one arguements, which is the default hosts string, of the form, 127.0.0.1:3000,127.0.0.1:4000
+ */
+static char* ngx_http_as_connect(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+	// Storing the arguemnts of the directive.
+	ngx_str_t *arguments = cf->args->elts;
+
+	// Acessing the server/local configuration.
+	ngx_http_as_conf_t *as_conf;
+
+	// Checking for the context, i.e. server/local.
+	if(cf->cmd_type==NGX_HTTP_SRV_CONF)
+		as_conf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_as_module);
+	else
+		as_conf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_as_module);
+
+	// the keys of as_shard_group are spread over its clusters, a cluster of as_connect would take none.
+	if(as_conf->shards!=NULL)
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"as_connect\" cannot be used with \"as_shard_group\"");
+		return NGX_CONF_ERROR;
+	}
+
+	// Stroing the default hosts provided in the arguement for the configuration.
+	as_conf->default_hosts.data = arguments[1].data;
+	as_conf->default_hosts.len = ngx_strlen(as_conf->default_hosts.data);
+
+	// the hosts are parsed once, and connected to from the parsed copy.
+	if(!ngx_http_as_utils_parse_hosts(arguments[1].data, arguments[1].len, &as_conf->hosts))
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid hosts \"%V\"", &arguments[1]);
+		return NGX_CONF_ERROR;
+	}
+
+	return NGX_CONF_OK;
+}
+
+/* This funnction sets the flag for the local configuratation to use the server context object. */
+static char* ngx_http_as_use_srv_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+	ngx_http_as_conf_t *as_conf;
+	as_conf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_as_module);
+	as_conf->use_server_conf = true;
+	return NGX_CONF_OK;
+}
+
+/* This function sets up an on/off directive, stored as a bool at the offset of the command in the configuration. */
+static char* ngx_http_as_set_flag(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+	ngx_str_t *arguments = cf->args->elts;
+	bool *flag;
+
+	ngx_http_as_conf_t *as_conf;
+
+	// Checking for the context, i.e. server/local.
+	if(cf->cmd_type==NGX_HTTP_SRV_CONF)
+		as_conf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_as_module);
+	else
+		as_conf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_as_module);
+
+	flag = (bool *)((u_char *)as_conf + cmd->offset);
+
+	if(ngx_strcasecmp(arguments[1].data, (u_char *)"on")==0)
+		*flag = true;
+	else if(ngx_strcasecmp(arguments[1].data, (u_char *)"off")==0)
+		*flag = false;
+	else
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid value \"%V\" in \"%V\" directive, it must be \"on\" or \"off\"", &arguments[1], &cmd->name);
+		return NGX_CONF_ERROR;
+	}
+
+	return NGX_CONF_OK;
+}
+
+/* This function sets up the as_replica_retry directive, of the form as_replica_retry timeout=5ms budget=10%, or as_replica_retry off.
+ * timeout is the socket timeout of the first try of a read, which is then tried again on the next replica,
+ * and budget the percentage of reads which may be tried again. The budget is kept by each worker.
+ * This is not a hedge: the client is synchronous, so the first try is given up before the next one is sent.
+ */
+static char* ngx_http_as_replica_retry(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+	ngx_str_t *arguments = cf->args->elts;
+	ngx_str_t value;
+	ngx_uint_t i;
+	ngx_int_t n;
+
+	ngx_http_as_conf_t *as_conf;
+
+	// Checking for the context, i.e. server/local.
+	if(cf->cmd_type==NGX_HTTP_SRV_CONF)
+		as_conf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_as_module);
+	else
+		as_conf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_as_module);
+
+	if(ngx_strcmp(arguments[1].data, "off")==0)
+	{
+		as_conf->replica_timeout = 0;
+		return NGX_CONF_OK;
+	}
+
+	for(i=1; i<cf->args->nelts; i++)
+	{
+		if(ngx_strncmp(arguments[i].data, "timeout=", 8)==0)
+		{
+			value.data = arguments[i].data + 8;
+			value.len = arguments[i].len - 8;
+			n = ngx_parse_time(&value, 0);
+			if(n==NGX_ERROR || n==0)
+			{
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid replica retry timeout \"%V\"", &arguments[i]);
+				return NGX_CONF_ERROR;
+			}
+			as_conf->replica_timeout = (ngx_msec_t)n;
+		}
+		else if(ngx_strncmp(arguments[i].data, "budget=", 7)==0)
+		{
+			value.data = arguments[i].data + 7;
+			value.len = arguments[i].len - 7;
+			if(value.len && value.data[value.len - 1]=='%')
+				value.len--;
+			n = ngx_atoi(value.data, value.len);
+			if(n==NGX_ERROR || n>100)
+			{
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid replica retry budget \"%V\"", &arguments[i]);
+				return NGX_CONF_ERROR;
+			}
+			as_conf->replica_budget = (ngx_uint_t)n;
+		}
+		else
+		{
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &arguments[i]);
+			return NGX_CONF_ERROR;
+		}
+	}
+
+	if(as_conf->replica_timeout==0)
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"as_replica_retry\" needs the timeout parameter");
+		return NGX_CONF_ERROR;
+	}
+
+	// the budget starts full.
+	as_conf->replica_tokens = NGX_HTTP_AS_REPLICA_RETRY_BURST * 100;
+	return NGX_CONF_OK;
+}
+
+/* This function sets up the as_retry directive, of the form as_retry attempts=2 budget=10%, or as_retry off.
+ * attempts is the number of retries of a transaction, and budget the percentage of requests which may be retried,
+ * kept by each worker. The client does not retry by itself then.
+ * A retry is sent at once: the transaction blocks the worker, which would sleep through a backoff, so the budget is what sheds a retry storm.
+ */
+static char* ngx_http_as_retry(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+	ngx_str_t *arguments = cf->args->elts;
+	ngx_str_t value;
+	ngx_uint_t i;
+	ngx_int_t n;
+
+	ngx_http_as_conf_t *as_conf;
+
+	// Checking for the context, i.e. server/local.
+	if(cf->cmd_type==NGX_HTTP_SRV_CONF)
+		as_conf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_as_module);
+	else
+		as_conf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_as_module);
+
+	if(ngx_strcmp(arguments[1].data, "off")==0)
+	{
+		as_conf->retry_attempts = 0;
+		return NGX_CONF_OK;
+	}
+
+	as_conf->retry_attempts = 2;
+
+	for(i=1; i<cf->args->nelts; i++)
+	{
+		value.data = (u_char*)ngx_strchr(arguments[i].data, '=');
+		if(value.data==NULL)
+		{
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &arguments[i]);
+			return NGX_CONF_ERROR;
+		}
+
+		value.data++;
+		value.len = arguments[i].data + arguments[i].len - value.data;
+
+		if(ngx_strncmp(arguments[i].data, "attempts=", 9)==0)
+		{
+			n = ngx_atoi(value.data, value.len);
+			if(n==NGX_ERROR || n==0)
+			{
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid retry attempts \"%V\"", &arguments[i]);
+				return NGX_CONF_ERROR;
+			}
+			as_conf->retry_attempts = (ngx_uint_t)n;
+		}
+		else if(ngx_strncmp(arguments[i].data, "budget=", 7)==0)
+		{
+			if(value.len && value.data[value.len - 1]=='%')
+				value.len--;
+			n = ngx_atoi(value.data, value.len);
+			if(n==NGX_ERROR || n>100)
+			{
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid retry budget \"%V\"", &arguments[i]);
+				return NGX_CONF_ERROR;
+			}
+			as_conf->retry_budget = (ngx_uint_t)n;
+		}
+		else
+		{
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &arguments[i]);
+			return NGX_CONF_ERROR;
+		}
+	}
+
+	// the budget starts full.
+	as_conf->retry_tokens = NGX_HTTP_AS_RETRY_BURST * 100;
+	return NGX_CONF_OK;
+}
+
+/* This function sets up the as_write_behind directive, of the form as_write_behind zone=name:10m interval=50ms max=10000, or as_write_behind off.
+ * Puts are buffered in the zone, up to max keys, and written by one worker at a time every interval, a batch of
+ * NGX_HTTP_AS_WRITE_BEHIND_BATCH records per flush. A batch is written synchronously, and the worker writing it
+ * handles no other request until the cluster answers, within the timeout of its batch policy.
+ */
+static char* ngx_http_as_write_behind(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+	ngx_str_t *arguments = cf->args->elts;
+	ngx_str_t name, value;
+	ngx_uint_t i;
+	ngx_int_t n;
+	ssize_t size;
+	u_char *p;
+
+	ngx_http_as_conf_t *as_conf, **slot;
+	ngx_http_as_main_conf_t *amcf;
+
+	// Checking for the context, i.e. server/local.
+	if(cf->cmd_type==NGX_HTTP_SRV_CONF)
+		as_conf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_as_module);
+	else
+		as_conf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_as_module);
+
+	if(as_conf->write_behind_zone)
+		return "is duplicate";
+
+	if(ngx_strcmp(arguments[1].data, "off")==0)
+		return NGX_CONF_OK;
+
+	ngx_str_null(&name);
+	size = 0;
+
+	for(i=1; i<cf->args->nelts; i++)
+	{
+		if(ngx_strncmp(arguments[i].data, "zone=", 5)==0)
+		{
+			name.data = arguments[i].data + 5;
+
+			p = (u_char*)ngx_strchr(name.data, ':');
+			if(p==NULL)
+			{
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid zone size \"%V\"", &arguments[i]);
+				return NGX_CONF_ERROR;
+			}
+
+			name.len = p - name.data;
+
+			value.data = p + 1;
+			value.len = arguments[i].data + arguments[i].len - value.data;
+
+			size = ngx_parse_size(&value);
+			if(size==NGX_ERROR || size<(ssize_t)(8 * ngx_pagesize))
+			{
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid zone size \"%V\"", &arguments[i]);
+				return NGX_CONF_ERROR;
+			}
+			continue;
+		}
+
+		if(ngx_strncmp(arguments[i].data, "interval=", 9)==0)
+		{
+			value.data = arguments[i].data + 9;
+			value.len = arguments[i].len - 9;
+
+			n = ngx_parse_time(&value, 0);
+			if(n==NGX_ERROR || n==0)
+			{
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid time \"%V\"", &arguments[i]);
+				return NGX_CONF_ERROR;
+			}
+
+			as_conf->write_behind_interval = (ngx_msec_t)n;
+			continue;
+		}
+
+		if(ngx_strncmp(arguments[i].data, "max=", 4)==0)
+		{
+			n = ngx_atoi(arguments[i].data + 4, arguments[i].len - 4);
+			if(n==NGX_ERROR || n==0)
+			{
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid max \"%V\"", &arguments[i]);
+				return NGX_CONF_ERROR;
+			}
+
+			as_conf->write_behind_max = (ngx_uint_t)n;
+			continue;
+		}
+
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &arguments[i]);
+		return NGX_CONF_ERROR;
+	}
+
+	if(name.len==0)
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"as_write_behind\" needs the zone parameter");
+		return NGX_CONF_ERROR;
+	}
+
+	as_conf->write_behind_zone = ngx_shared_memory_add(cf, &name, size, &ngx_http_as_module);
+	if(as_conf->write_behind_zone==NULL)
+		return NGX_CONF_ERROR;
+
+	as_conf->write_behind_zone->init = ngx_http_as_write_behind_init_zone;
+
+	// the flusher of the zone is started by each worker, in ngx_http_as_init_process.
+	amcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_as_module);
+	slot = ngx_array_push(&amcf->write_behinds);
+	if(slot==NULL)
+		return NGX_CONF_ERROR;
+
+	*slot = as_conf;
+	return NGX_CONF_OK;
+}
+
+/* This function allocates the state of an as_write_behind zone in its shared memory.
+ * The state is kept across reloads, with the puts still buffered.
+ */
+static ngx_int_t ngx_http_as_write_behind_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+	ngx_slab_pool_t *shpool = (ngx_slab_pool_t *)shm_zone->shm.addr;
+	ngx_http_as_write_behind_sh_t *sh;
+
+	if(data)
+	{
+		shm_zone->data = data;
+		return NGX_OK;
+	}
+
+	if(shm_zone->shm.exists)
+	{
+		shm_zone->data = shpool->data;
+		return NGX_OK;
+	}
+
+	sh = ngx_slab_alloc(shpool, sizeof(ngx_http_as_write_behind_sh_t));
+	if(sh==NULL)
+		return NGX_ERROR;
+
+	ngx_rbtree_init(&sh->rbtree, &sh->sentinel, ngx_str_rbtree_insert_value);
+	ngx_queue_init(&sh->queue);
+	sh->count = 0;
+	sh->stamp = 0;
+	sh->flusher = 0;
+
+	shpool->data = sh;
+	shm_zone->data = sh;
+	return NGX_OK;
+}
+
+/* This function sets up the as_spool directive, of the form as_spool path=/var/spool/nginx size=64m fsync=off|always|1s rate=1000, or as_spool off.
+ * Each worker spools to a file of its own in the directory, of the size, which is replayed at up to rate puts a second.
+ * The puts of a key are replayed in order within a worker only. Puts of a key spooled by two workers are replayed
+ * by each of them on its own, so an older put of one may overwrite a later put of the other.
+ */
+static char* ngx_http_as_spool(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+	ngx_str_t *arguments = cf->args->elts;
+	ngx_str_t value;
+	ngx_uint_t i;
+	ngx_int_t n;
+	ssize_t size;
+
+	ngx_http_as_conf_t *as_conf, **slot, **confs;
+	ngx_http_as_main_conf_t *amcf;
+	ngx_http_as_spool_t *spool;
+
+	// Checking for the context, i.e. server/local.
+	if(cf->cmd_type==NGX_HTTP_SRV_CONF)
+		as_conf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_as_module);
+	else
+		as_conf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_as_module);
+
+	if(as_conf->spool)
+		return "is duplicate";
+
+	if(ngx_strcmp(arguments[1].data, "off")==0)
+		return NGX_CONF_OK;
+
+	spool = ngx_pcalloc(cf->pool, sizeof(ngx_http_as_spool_t));
+	if(spool==NULL)
+		return NGX_CONF_ERROR;
+
+	spool->size = 64 * 1024 * 1024;
+	spool->rate = 1000;
+
+	for(i=1; i<cf->args->nelts; i++)
+	{
+		if(ngx_strncmp(arguments[i].data, "path=", 5)==0)
+		{
+			spool->path.data = arguments[i].data + 5;
+			spool->path.len = arguments[i].len - 5;
+
+			if(spool->path.len==0 || ngx_conf_full_name(cf->cycle, &spool->path, 0)!=NGX_OK)
+			{
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid path \"%V\"", &arguments[i]);
+				return NGX_CONF_ERROR;
+			}
+			continue;
+		}
+
+		if(ngx_strncmp(arguments[i].data, "size=", 5)==0)
+		{
+			value.data = arguments[i].data + 5;
+			value.len = arguments[i].len - 5;
+
+			size = ngx_parse_size(&value);
+			if(size==NGX_ERROR || size<(ssize_t)(8 * ngx_pagesize))
+			{
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid size \"%V\"", &arguments[i]);
+				return NGX_CONF_ERROR;
+			}
+
+			spool->size = (size_t)size;
+			continue;
+		}
+
+		if(ngx_strncmp(arguments[i].data, "fsync=", 6)==0)
+		{
+			value.data = arguments[i].data + 6;
+			value.len = arguments[i].len - 6;
+
+			if(ngx_strcmp(value.data, "off")==0)
+			{
+				spool->fsync_always = false;
+				spool->fsync_interval = 0;
+				continue;
+			}
+
+			if(ngx_strcmp(value.data, "always")==0)
+			{
+				spool->fsync_always = true;
+				continue;
+			}
+
+			n = ngx_parse_time(&value, 0);
+			if(n==NGX_ERROR || n==0)
+			{
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid fsync \"%V\"", &arguments[i]);
+				return NGX_CONF_ERROR;
+			}
+
+			spool->fsync_interval = (ngx_msec_t)n;
+			continue;
+		}
+
+		if(ngx_strncmp(arguments[i].data, "rate=", 5)==0)
+		{
+			n = ngx_atoi(arguments[i].data + 5, arguments[i].len - 5);
+			if(n==NGX_ERROR || n==0)
+			{
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid rate \"%V\"", &arguments[i]);
+				return NGX_CONF_ERROR;
+			}
+
+			spool->rate = (ngx_uint_t)n;
+			continue;
+		}
+
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &arguments[i]);
+		return NGX_CONF_ERROR;
+	}
+
+	if(spool->path.len==0)
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"as_spool\" needs the path parameter");
+		return NGX_CONF_ERROR;
+	}
+
+	// the files of a worker are named by the worker alone, so two spools cannot share a directory.
+	amcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_as_module);
+	confs = amcf->spools.elts;
+	for(i=0; i<amcf->spools.nelts; i++)
+	{
+		if(confs[i]->spool->path.len==spool->path.len && ngx_strncmp(confs[i]->spool->path.data, spool->path.data, spool->path.len)==0)
+		{
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "duplicate spool path \"%V\"", &spool->path);
+			return NGX_CONF_ERROR;
+		}
+	}
+
+	// the spool is opened and replayed by each worker, in ngx_http_as_init_process.
+	slot = ngx_array_push(&amcf->spools);
+	if(slot==NULL)
+		return NGX_CONF_ERROR;
+
+	as_conf->spool = spool;
+	*slot = as_conf;
+	return NGX_CONF_OK;
+}
+
+/* This function sets up the as_shard_group directive, of the form as_shard_group 127.0.0.1:3000 127.0.0.2:3000,127.0.0.3:3000,
+ * each arguement being the hosts of a cluster. Keys are spread over the clusters by their digest, so a cluster
+ * must only be added at the end, which moves the fewest keys, and never be removed or moved in the list.
+ */
+static char* ngx_http_as_shard_group(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+	ngx_str_t *arguments = cf->args->elts;
+	ngx_uint_t i;
+
+	ngx_http_as_conf_t *as_conf;
+	ngx_http_as_cluster_t *shard;
+
+	// Checking for the context, i.e. server/local.
+	if(cf->cmd_type==NGX_HTTP_SRV_CONF)
+		as_conf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_as_module);
+	else
+		as_conf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_as_module);
+
+	if(as_conf->shards!=NULL)
+		return "is duplicate";
+
+	if(as_conf->breaker_interval)
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"as_shard_group\" cannot be used with \"as_breaker\"");
+		return NGX_CONF_ERROR;
+	}
+
+	if(as_conf->hosts.n || as_conf->secondary!=NULL)
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"as_shard_group\" cannot be used with \"as_connect\" or \"as_secondary\"");
+		return NGX_CONF_ERROR;
+	}
+
+	as_conf->shards = ngx_array_create(cf->pool, cf->args->nelts - 1, sizeof(ngx_http_as_cluster_t));
+	if(as_conf->shards==NULL)
+		return NGX_CONF_ERROR;
+
+	for(i=1; i<cf->args->nelts; i++)
+	{
+		shard = ngx_array_push(as_conf->shards);
+		if(shard==NULL)
+			return NGX_CONF_ERROR;
+
+		ngx_memzero(shard, sizeof(ngx_http_as_cluster_t));
+
+		if(!ngx_http_as_utils_parse_hosts(arguments[i].data, arguments[i].len, &shard->hosts))
+		{
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid hosts \"%V\"", &arguments[i]);
+			return NGX_CONF_ERROR;
+		}
+	}
+
+	return NGX_CONF_OK;
+}
+
+/* This function sets up the as_secondary directive, of the form as_secondary 127.0.0.1:3000,127.0.0.1:4000 reads=failover|fastest.
+ * Reads which the primary cluster does not answer are sent to the secondary one, or reads go to the cluster with the lower latency.
+ * Writes only go to the primary cluster.
+ */
+static char* ngx_http_as_secondary(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+	ngx_str_t *arguments = cf->args->elts;
+	ngx_uint_t i;
+
+	ngx_http_as_conf_t *as_conf;
+	ngx_http_as_cluster_t *secondary;
+
+	// Checking for the context, i.e. server/local.
+	if(cf->cmd_type==NGX_HTTP_SRV_CONF)
+		as_conf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_as_module);
+	else
+		as_conf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_as_module);
+
+	if(as_conf->secondary!=NULL)
+		return "is duplicate";
+
+	// with as_shard_group, a read only goes to the shard of its key.
+	if(as_conf->shards!=NULL)
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"as_secondary\" cannot be used with \"as_shard_group\"");
+		return NGX_CONF_ERROR;
+	}
+
+	secondary = ngx_pcalloc(cf->pool, sizeof(ngx_http_as_cluster_t));
+	if(secondary==NULL)
+		return NGX_CONF_ERROR;
+
+	if(!ngx_http_as_utils_parse_hosts(arguments[1].data, arguments[1].len, &secondary->hosts))
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid hosts \"%V\"", &arguments[1]);
+		return NGX_CONF_ERROR;
+	}
+
+	secondary->reads = NGX_HTTP_AS_READS_FAILOVER;
+
+	for(i=2; i<cf->args->nelts; i++)
+	{
+		if(ngx_strcmp(arguments[i].data, "reads=failover")==0)
+			secondary->reads = NGX_HTTP_AS_READS_FAILOVER;
+		else if(ngx_strcmp(arguments[i].data, "reads=fastest")==0)
+			secondary->reads = NGX_HTTP_AS_READS_FASTEST;
+		else
+		{
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &arguments[i]);
+			return NGX_CONF_ERROR;
+		}
+	}
+
+	as_conf->secondary = secondary;
+	return NGX_CONF_OK;
+}
+
+/* This function sets up the as_breaker directive, of the form as_breaker failures=50% min_requests=20 interval=1s, or as_breaker off.
+ * The circuit opens when failures percent of the requests of an interval failed, if there were at least min_requests of them,
+ * and its cluster is probed every interval while it is open.
+ */
+static char* ngx_http_as_breaker(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+	ngx_str_t *arguments = cf->args->elts;
+	ngx_str_t value;
+	ngx_uint_t i;
+	ngx_int_t n;
+
+	ngx_http_as_conf_t *as_conf, **slot;
+	ngx_http_as_main_conf_t *amcf;
+
+	// Checking for the context, i.e. server/local.
+	if(cf->cmd_type==NGX_HTTP_SRV_CONF)
+		as_conf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_as_module);
+	else
+		as_conf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_as_module);
+
+	if(as_conf->breaker_interval)
+		return "is duplicate";
+
+	if(ngx_strcmp(arguments[1].data, "off")==0)
+		return NGX_CONF_OK;
+
+	// the circuit is of the cluster of as_connect, the shards have none.
+	if(as_conf->shards!=NULL)
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"as_breaker\" cannot be used with \"as_shard_group\"");
+		return NGX_CONF_ERROR;
+	}
+
+	as_conf->breaker_threshold = 50;
+	as_conf->breaker_min_requests = 20;
+	as_conf->breaker_interval = 1000;
+
+	for(i=1; i<cf->args->nelts; i++)
+	{
+		value.data = (u_char*)ngx_strchr(arguments[i].data, '=');
+		if(value.data==NULL)
+		{
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &arguments[i]);
+			return NGX_CONF_ERROR;
+		}
+
+		value.data++;
+		value.len = arguments[i].data + arguments[i].len - value.data;
+
+		if(ngx_strncmp(arguments[i].data, "failures=", 9)==0)
+		{
+			if(value.len && value.data[value.len - 1]=='%')
+				value.len--;
+			n = ngx_atoi(value.data, value.len);
+			if(n==NGX_ERROR || n==0 || n>100)
+			{
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid breaker failures \"%V\"", &arguments[i]);
+				return NGX_CONF_ERROR;
+			}
+			as_conf->breaker_threshold = (ngx_uint_t)n;
+		}
+		else if(ngx_strncmp(arguments[i].data, "min_requests=", 13)==0)
+		{
+			n = ngx_atoi(value.data, value.len);
+			if(n==NGX_ERROR)
+			{
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid breaker min_requests \"%V\"", &arguments[i]);
+				return NGX_CONF_ERROR;
+			}
+			as_conf->breaker_min_requests = (ngx_uint_t)n;
+		}
+		else if(ngx_strncmp(arguments[i].data, "interval=", 9)==0)
+		{
+			n = ngx_parse_time(&value, 0);
+			if(n==NGX_ERROR || n==0)
+			{
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid breaker interval \"%V\"", &arguments[i]);
+				return NGX_CONF_ERROR;
+			}
+			as_conf->breaker_interval = (ngx_msec_t)n;
+		}
+		else
+		{
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &arguments[i]);
+			return NGX_CONF_ERROR;
+		}
+	}
+
+	// the probe of the circuit is started by each worker, in ngx_http_as_init_process, and shared by them in the as_breaker zone.
+	amcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_as_module);
+	if(amcf->breakers.nelts>=NGX_HTTP_AS_BREAKER_MAX)
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "too many \"as_breaker\" circuits");
+		return NGX_CONF_ERROR;
+	}
+
+	ngx_str_set(&value, "as_breaker");
+	as_conf->breaker_zone = ngx_shared_memory_add(cf, &value, 8 * ngx_pagesize, &ngx_http_as_module);
+	if(as_conf->breaker_zone==NULL)
+		return NGX_CONF_ERROR;
+
+	as_conf->breaker_zone->init = ngx_http_as_breaker_init_zone;
+	as_conf->breaker_index = amcf->breakers.nelts;
+
+	slot = ngx_array_push(&amcf->breakers);
+	if(slot==NULL)
+		return NGX_CONF_ERROR;
+
+	*slot = as_conf;
+	return NGX_CONF_OK;
+}
+
+/* This function allocates the probes of the as_breaker circuits in the shared memory of the as_breaker zone.
+ * They are kept across reloads, which only carries a probe over to the circuit taking the same index.
+ */
+static ngx_int_t ngx_http_as_breaker_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+	ngx_slab_pool_t *shpool = (ngx_slab_pool_t *)shm_zone->shm.addr;
+	ngx_http_as_breaker_sh_t *sh;
+
+	if(data)
+	{
+		shm_zone->data = data;
+		return NGX_OK;
+	}
+
+	if(shm_zone->shm.exists)
+	{
+		shm_zone->data = shpool->data;
+		return NGX_OK;
+	}
+
+	sh = ngx_slab_calloc(shpool, NGX_HTTP_AS_BREAKER_MAX * sizeof(ngx_http_as_breaker_sh_t));
+	if(sh==NULL)
+		return NGX_ERROR;
+
+	shpool->data = sh;
+	shm_zone->data = sh;
+	return NGX_OK;
+}
+
+/* This function sets up the as_limit directive, of the form as_limit zone=name latency=20ms min=1 max=64 queue=10ms.
+ * The locations sharing a zone share its limit, so a zone is used for the locations of a cluster, or of a namespace.
+ * latency is the time above which a transaction shrinks the limit, which stays between min and max,
+ * and queue the time a request waits for a slot before it is rejected, none by default.
+ */
+static char* ngx_http_as_limit(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+	ngx_str_t *arguments = cf->args->elts;
+	ngx_str_t name, value;
+	ngx_uint_t i;
+	ngx_int_t n;
+
+	ngx_http_as_conf_t *as_conf, **slot;
+	ngx_http_as_main_conf_t *amcf;
+
+	// Checking for the context, i.e. server/local.
+	if(cf->cmd_type==NGX_HTTP_SRV_CONF)
+		as_conf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_as_module);
+	else
+		as_conf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_as_module);
+
+	if(as_conf->limit_zone)
+		return "is duplicate";
+
+	ngx_str_null(&name);
+
+	for(i=1; i<cf->args->nelts; i++)
+	{
+		if(ngx_strncmp(arguments[i].data, "zone=", 5)==0)
+		{
+			name.data = arguments[i].data + 5;
+			name.len = arguments[i].len - 5;
+			continue;
+		}
+
+		if(ngx_strncmp(arguments[i].data, "latency=", 8)==0 || ngx_strncmp(arguments[i].data, "queue=", 6)==0)
+		{
+			value.data = (u_char*)ngx_strchr(arguments[i].data, '=') + 1;
+			value.len = arguments[i].data + arguments[i].len - value.data;
+
+			n = ngx_parse_time(&value, 0);
+			if(n==NGX_ERROR)
+			{
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid time \"%V\"", &arguments[i]);
+				return NGX_CONF_ERROR;
+			}
+
+			if(arguments[i].data[0]=='l')
+				as_conf->limit_latency = (ngx_msec_t)n;
+			else
+				as_conf->limit_queue = (ngx_msec_t)n;
+			continue;
+		}
+
+		if(ngx_strncmp(arguments[i].data, "min=", 4)==0 || ngx_strncmp(arguments[i].data, "max=", 4)==0)
+		{
+			n = ngx_atoi(arguments[i].data + 4, arguments[i].len - 4);
+			if(n==NGX_ERROR || n==0)
+			{
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid limit \"%V\"", &arguments[i]);
+				return NGX_CONF_ERROR;
+			}
+
+			if(arguments[i].data[1]=='i')
+				as_conf->limit_min = (ngx_uint_t)n;
+			else
+				as_conf->limit_max = (ngx_uint_t)n;
+			continue;
+		}
+
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &arguments[i]);
+		return NGX_CONF_ERROR;
+	}
+
+	if(name.len==0)
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"as_limit\" needs the zone parameter");
+		return NGX_CONF_ERROR;
+	}
+
+	if(as_conf->limit_min>as_conf->limit_max)
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "the min of \"as_limit\" is above its max");
+		return NGX_CONF_ERROR;
+	}
+
+	as_conf->limit_zone = ngx_shared_memory_add(cf, &name, 8 * ngx_pagesize, &ngx_http_as_module);
+	if(as_conf->limit_zone==NULL)
+		return NGX_CONF_ERROR;
+
+	as_conf->limit_zone->init = ngx_http_as_limit_init_zone;
+
+	// the slots of the workers which are gone are given back by each worker, in ngx_http_as_init_process.
+	amcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_as_module);
+	slot = ngx_array_push(&amcf->limits);
+	if(slot==NULL)
+		return NGX_CONF_ERROR;
+
+	*slot = as_conf;
+	return NGX_CONF_OK;
+}
+
+/* This function allocates the state of an as_limit zone in its shared memory. The state is kept across reloads. */
+static ngx_int_t ngx_http_as_limit_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+	ngx_slab_pool_t *shpool = (ngx_slab_pool_t *)shm_zone->shm.addr;
+	ngx_http_as_limit_sh_t *sh;
+
+	if(data)
+	{
+		shm_zone->data = data;
+		return NGX_OK;
+	}
+
+	if(shm_zone->shm.exists)
+	{
+		shm_zone->data = shpool->data;
+		return NGX_OK;
+	}
+
+	// a limit of 0 is set to the max of the first location using the zone.
+	sh = ngx_slab_calloc(shpool, sizeof(ngx_http_as_limit_sh_t));
+	if(sh==NULL)
+		return NGX_ERROR;
+
+	shpool->data = sh;
+	shm_zone->data = sh;
+	return NGX_OK;
+}
+
+/* This function sets up a time directive, such as 50ms or 1s, stored in milliseconds at the offset of the command. */
+static char* ngx_http_as_set_msec(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+	ngx_str_t *arguments = cf->args->elts;
+	ngx_msec_t *msec;
+	ngx_int_t value;
+
+	ngx_http_as_conf_t *as_conf;
+
+	// Checking for the context, i.e. server/local.
+	if(cf->cmd_type==NGX_HTTP_SRV_CONF)
+		as_conf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_as_module);
+	else
+		as_conf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_as_module);
+
+	msec = (ngx_msec_t *)((u_char *)as_conf + cmd->offset);
+	if(*msec!=NGX_CONF_UNSET_MSEC)
+		return "is duplicate";
+
+	value = ngx_parse_time(&arguments[1], 0);
+	if(value==NGX_ERROR)
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid time \"%V\" in \"%V\" directive", &arguments[1], &cmd->name);
+		return NGX_CONF_ERROR;
+	}
+
+	*msec = (ngx_msec_t)value;
+	return NGX_CONF_OK;
+}
+
+/* This function sets up a directive taking a number, stored at the offset of the command in the configuration. */
+static char* ngx_http_as_set_number(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+	ngx_str_t *arguments = cf->args->elts;
+	ngx_int_t *number;
+
+	ngx_http_as_conf_t *as_conf;
+
+	// Checking for the context, i.e. server/local.
+	if(cf->cmd_type==NGX_HTTP_SRV_CONF)
+		as_conf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_as_module);
+	else
+		as_conf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_as_module);
+
+	number = (ngx_int_t *)((u_char *)as_conf + cmd->offset);
+	if(*number!=NGX_CONF_UNSET)
+		return "is duplicate";
+
+	*number = ngx_atoi(arguments[1].data, arguments[1].len);
+	if(*number==NGX_ERROR)
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid number \"%V\" in \"%V\" directive", &arguments[1], &cmd->name);
+		return NGX_CONF_ERROR;
+	}
+
+	return NGX_CONF_OK;
+}
+
+/* This function sets the handler for the as_operate_directive. */
+static char* ngx_http_as_operate(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+	ngx_http_core_loc_conf_t *clcf;
+	clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+	clcf->handler = ngx_http_as_operate_handler;
+	return NGX_CONF_OK;
+}
+
+/* This function sets the handler for the as_get, as_put, as_delete and as_rest directives.
+ * The handler for each directive is stored in its post field.
+ */
+static char* ngx_http_as_set_handler(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+	ngx_http_core_loc_conf_t *clcf;
+	clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+	clcf->handler = (ngx_http_handler_pt)cmd->post;
+	return NGX_CONF_OK;
+}
+
+/* This function sets up the as_import directive, of the form as_import batch=1000, and sets its handler.
+ * The records of the body are written in batches of this many. A request has one batch in flight, written synchronously
+ * as the body is read, and the worker handles no other request until the cluster answers it, within the timeout of the batch policy.
+ */
+static char* ngx_http_as_import(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+	ngx_str_t *arguments = cf->args->elts;
+	ngx_http_core_loc_conf_t *clcf;
+	ngx_http_as_conf_t *as_conf;
+	ngx_uint_t i;
+	ngx_int_t n;
+
+	as_conf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_as_module);
+
+	if(as_conf->import_batch)
+		return "is duplicate";
+
+	as_conf->import_batch = NGX_HTTP_AS_IMPORT_BATCH;
+
+	for(i=1; i<cf->args->nelts; i++)
+	{
+		if(ngx_strncmp(arguments[i].data, "batch=", 6)==0)
+		{
+			n = ngx_atoi(arguments[i].data + 6, arguments[i].len - 6);
+			if(n==NGX_ERROR || n==0)
+			{
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid batch \"%V\"", &arguments[i]);
+				return NGX_CONF_ERROR;
+			}
+
+			as_conf->import_batch = (ngx_uint_t)n;
+			continue;
+		}
+
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &arguments[i]);
+		return NGX_CONF_ERROR;
+	}
+
+	clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+	clcf->handler = ngx_http_as_import_handler;
+	return NGX_CONF_OK;
+}
+
+/* This function sets up the as_operate_ops directive, and sets its handler.
+ * Each arguement is an operation of the form op:bin[:value], where op is one of
+ * read, write, incr, append, prepend, touch and delete. For eg,
+ * as_operate_ops incr:hits:1 write:status:"active" read:hits;
+ * A value enclosed in double quotes is a string, else it is an integer.
+ */
+static char* ngx_http_as_operate_ops_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+	ngx_str_t *arguments = cf->args->elts;
+	ngx_http_as_conf_t *as_conf;
+	ngx_http_core_loc_conf_t *clcf;
+	ngx_http_as_op_t *op;
+	ngx_uint_t i;
+	u_char *p, *last, *bin, *value;
+	size_t len;
+
+	as_conf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_as_module);
+	if(as_conf->ops!=NULL)
+		return "is duplicate";
+
+	as_conf->ops = ngx_array_create(cf->pool, cf->args->nelts - 1, sizeof(ngx_http_as_op_t));
+	if(as_conf->ops==NULL)
+		return NGX_CONF_ERROR;
+
+	for(i=1; i<cf->args->nelts; i++)
+	{
+		op = ngx_array_push(as_conf->ops);
+		if(op==NULL)
+			return NGX_CONF_ERROR;
+		ngx_memzero(op, sizeof(ngx_http_as_op_t));
+
+		// splitting the operation into op, bin and value.
+		p = arguments[i].data;
+		last = p + arguments[i].len;
+
+		bin = (u_char*)ngx_strchr(p, ':');
+		if(bin==NULL)
+			bin = last;
+		len = bin - p;
+
+		if(len==4 && ngx_strncmp(p, "read", 4)==0)
+			op->type = NGX_HTTP_AS_OP_READ;
+		else if(len==5 && ngx_strncmp(p, "write", 5)==0)
+			op->type = NGX_HTTP_AS_OP_WRITE;
+		else if(len==4 && ngx_strncmp(p, "incr", 4)==0)
+			op->type = NGX_HTTP_AS_OP_INCR;
+		else if(len==6 && ngx_strncmp(p, "append", 6)==0)
+			op->type = NGX_HTTP_AS_OP_APPEND;
+		else if(len==7 && ngx_strncmp(p, "prepend", 7)==0)
+			op->type = NGX_HTTP_AS_OP_PREPEND;
+		else if(len==5 && ngx_strncmp(p, "touch", 5)==0)
+			op->type = NGX_HTTP_AS_OP_TOUCH;
+		else if(len==6 && ngx_strncmp(p, "delete", 6)==0)
+			op->type = NGX_HTTP_AS_OP_DELETE;
+		else
+		{
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid operation \"%V\"", &arguments[i]);
+			return NGX_CONF_ERROR;
+		}
+
+		// touch and delete apply to the whole record.
+		if(op->type==NGX_HTTP_AS_OP_TOUCH || op->type==NGX_HTTP_AS_OP_DELETE)
+		{
+			if(bin!=last)
+			{
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "operation \"%V\" takes no bin", &arguments[i]);
+				return NGX_CONF_ERROR;
+			}
+			continue;
+		}
+
+		if(bin==last)
+		{
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "operation \"%V\" has no bin", &arguments[i]);
+			return NGX_CONF_ERROR;
+		}
+		bin++;
+
+		value = (u_char*)ngx_strchr(bin, ':');
+		if(value==NULL)
+			value = last;
+		len = value - bin;
+
+		if(len==0 || len>AS_BIN_NAME_MAX_LEN)
+		{
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid bin name in \"%V\"", &arguments[i]);
+			return NGX_CONF_ERROR;
+		}
+		ngx_memcpy(op->bin, bin, len);
+		op->bin[len] = '\0';
+
+		// read takes no value, all the other operations need one.
+		if(op->type==NGX_HTTP_AS_OP_READ)
+		{
+			if(value!=last)
+			{
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "operation \"%V\" takes no value", &arguments[i]);
+				return NGX_CONF_ERROR;
+			}
+			continue;
+		}
+
+		if(value==last)
+		{
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "operation \"%V\" has no value", &arguments[i]);
+			return NGX_CONF_ERROR;
+		}
+		value++;
+		len = last - value;
+
+		if(len>=2 && value[0]=='"' && value[len-1]=='"')
+		{
+			op->is_str = true;
+			op->str_value = ngx_pnalloc(cf->pool, len - 1);
+			if(op->str_value==NULL)
+				return NGX_CONF_ERROR;
+			ngx_memcpy(op->str_value, value + 1, len - 2);
+			op->str_value[len - 2] = '\0';
+		}
+		else
+		{
+			// parsing the integer, with an optional sign.
+			bool negative = (len>0 && value[0]=='-');
+			ngx_int_t n = ngx_atoi(value + negative, len - negative);
+			if(n==NGX_ERROR)
+			{
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid integer value in \"%V\"", &arguments[i]);
+				return NGX_CONF_ERROR;
+			}
+			op->int_value = negative ? -n : n;
+		}
+
+		if((op->type==NGX_HTTP_AS_OP_INCR && op->is_str)
+			|| ((op->type==NGX_HTTP_AS_OP_APPEND || op->type==NGX_HTTP_AS_OP_PREPEND) && !op->is_str))
+		{
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid value type in \"%V\"", &arguments[i]);
+			return NGX_CONF_ERROR;
+		}
+	}
+
+	clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+	clcf->handler = ngx_http_as_operate_ops_handler;
+	return NGX_CONF_OK;
+}
+
+/* This function sets up the as_compress directive.
+ * It takes the algorithm (zstd or off), followed by the optional level=N and min_size=size arguements.
+ * For eg, as_compress zstd level=3 min_size=1k
+ */
+static char* ngx_http_as_compress(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+	ngx_str_t *arguments = cf->args->elts;
+	ngx_str_t size;
+	ngx_uint_t i;
+	ngx_int_t level;
+	ssize_t min_size;
+
+	ngx_http_as_conf_t *as_conf;
+
+	// Checking for the context, i.e. server/local.
+	if(cf->cmd_type==NGX_HTTP_SRV_CONF)
+		as_conf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_as_module);
+	else
+		as_conf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_as_module);
+
+	if(ngx_strcmp(arguments[1].data, "off")==0)
+	{
+		as_conf->compress = false;
+		return NGX_CONF_OK;
+	}
+
+	if(ngx_strcmp(arguments[1].data, "zstd")!=0)
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "unsupported compression \"%V\"", &arguments[1]);
+		return NGX_CONF_ERROR;
+	}
+
+	as_conf->compress = true;
+
+	for(i=2; i<cf->args->nelts; i++)
+	{
+		if(ngx_strncmp(arguments[i].data, "level=", 6)==0)
+		{
+			level = ngx_atoi(arguments[i].data + 6, arguments[i].len - 6);
+			if(level==NGX_ERROR || level<1 || level>ZSTD_maxCLevel())
+			{
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid compression level \"%V\"", &arguments[i]);
+				return NGX_CONF_ERROR;
+			}
+			as_conf->compress_level = (int)level;
+		}
+		else if(ngx_strncmp(arguments[i].data, "min_size=", 9)==0)
+		{
+			size.data = arguments[i].data + 9;
+			size.len = arguments[i].len - 9;
+			min_size = ngx_parse_size(&size);
+			if(min_size==NGX_ERROR)
+			{
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid minimum size \"%V\"", &arguments[i]);
+				return NGX_CONF_ERROR;
+			}
+			as_conf->compress_min_size = (size_t)min_size;
+		}
+		else
+		{
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &arguments[i]);
+			return NGX_CONF_ERROR;
+		}
+	}
+
+	return NGX_CONF_OK;
+}
+
+/* This function sets up the as_namespace, as_set and as_key directives.
+ * The arguement is compiled once here, and may contain variables, for eg, as_key $arg_id or as_key $1.
+ * The offset of the directive gives the template field of the configuration.
+ */
+static char* ngx_http_as_set_template(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+	ngx_str_t *arguments = cf->args->elts;
+	ngx_http_complex_value_t **template;
+	ngx_http_compile_complex_value_t ccv;
+
+	ngx_http_as_conf_t *as_conf;
+
+	// Checking for the context, i.e. server/local.
+	if(cf->cmd_type==NGX_HTTP_SRV_CONF)
+		as_conf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_as_module);
+	else
+		as_conf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_as_module);
+
+	template = (ngx_http_complex_value_t **)((u_char *)as_conf + cmd->offset);
+	if(*template!=NULL)
+		return "is duplicate";
+
+	*template = ngx_palloc(cf->pool, sizeof(ngx_http_complex_value_t));
+	if(*template==NULL)
+		return NGX_CONF_ERROR;
+
+	ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+	ccv.cf = cf;
+	ccv.value = &arguments[1];
+	ccv.complex_value = *template;
+
+	if(ngx_http_compile_complex_value(&ccv)!=NGX_OK)
+		return NGX_CONF_ERROR;
+
+	return NGX_CONF_OK;
+}
+
+/* This function sets up the as_schema block, which declares the bins of a set and their types. For eg,
+ * as_schema set=users { bin id int; bin name string; bin tags list; }
+ * Puts to the set are checked against the schema, and gets write the declared bins first, in their order.
+ * The bin names are hashed here, so the bins of a request are looked up without comparing them one by one.
+ */
+static char* ngx_http_as_schema(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+	ngx_http_as_main_conf_t *amcf = conf;
+	ngx_str_t *arguments = cf->args->elts;
+	ngx_http_as_schema_t *schema;
+	ngx_http_as_schema_bin_t *bin;
+	ngx_hash_key_t *names;
+	ngx_hash_init_t hash;
+	ngx_conf_t save;
+	ngx_str_t set;
+	ngx_uint_t i;
+	char *rv;
+
+	if(arguments[1].len<=4 || ngx_strncmp(arguments[1].data, "set=", 4)!=0)
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &arguments[1]);
+		return NGX_CONF_ERROR;
+	}
+
+	set.data = arguments[1].data + 4;
+	set.len = arguments[1].len - 4;
+
+	if(set.len>=AS_SET_MAX_SIZE)
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid set name \"%V\"", &set);
+		return NGX_CONF_ERROR;
+	}
+
+	schema = amcf->schemas.elts;
+	for(i=0; i<amcf->schemas.nelts; i++)
+	{
+		if(ngx_strlen(schema[i].set)==set.len && ngx_strncmp(schema[i].set, set.data, set.len)==0)
+		{
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "duplicate schema for set \"%V\"", &set);
+			return NGX_CONF_ERROR;
+		}
+	}
+
+	schema = ngx_array_push(&amcf->schemas);
+	if(schema==NULL)
+		return NGX_CONF_ERROR;
+
+	ngx_memzero(schema, sizeof(ngx_http_as_schema_t));
+	ngx_memcpy(schema->set, set.data, set.len);
+
+	if(ngx_array_init(&schema->bins, cf->pool, 8, sizeof(ngx_http_as_schema_bin_t))!=NGX_OK)
+		return NGX_CONF_ERROR;
+
+	// the bin directives of the block are parsed by ngx_http_as_schema_bin.
+	save = *cf;
+	cf->handler = ngx_http_as_schema_bin;
+	cf->handler_conf = schema;
+
+	rv = ngx_conf_parse(cf, NULL);
+
+	*cf = save;
+
+	if(rv!=NGX_CONF_OK)
+		return rv;
+
+	if(schema->bins.nelts==0)
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "schema of set \"%V\" declares no bins", &set);
+		return NGX_CONF_ERROR;
+	}
+
+	names = ngx_palloc(cf->temp_pool, schema->bins.nelts * sizeof(ngx_hash_key_t));
+	if(names==NULL)
+		return NGX_CONF_ERROR;
+
+	bin = schema->bins.elts;
+	for(i=0; i<schema->bins.nelts; i++)
+	{
+		names[i].key.data = (u_char*)bin[i].name;
+		names[i].key.len = bin[i].len;
+		names[i].key_hash = ngx_hash_key(names[i].key.data, names[i].key.len);
+		names[i].value = &bin[i];
+	}
+
+	hash.hash = &schema->hash;
+	hash.key = ngx_hash_key;
+	hash.max_size = 512;
+	hash.bucket_size = ngx_align(64, ngx_cacheline_size);
+	hash.name = "as_schema_hash";
+	hash.pool = cf->pool;
+	hash.temp_pool = NULL;
+
+	if(ngx_hash_init(&hash, names, schema->bins.nelts)!=NGX_OK)
+		return NGX_CONF_ERROR;
+
+	return NGX_CONF_OK;
+}
+
+/* This function parses a directive of an as_schema block, which is of the form, bin name type;
+ * The type is one of int, double, string, bytes, list, map and geojson.
+ */
+static char* ngx_http_as_schema_bin(ngx_conf_t *cf, ngx_command_t *dummy, void *conf)
+{
+	static struct
+	{
+		ngx_str_t name;
+		as_val_t type;
+	} types[] = {
+		{ ngx_string("int"), AS_INTEGER },
+		{ ngx_string("integer"), AS_INTEGER },
+		{ ngx_string("double"), AS_DOUBLE },
+		{ ngx_string("float"), AS_DOUBLE },
+		{ ngx_string("string"), AS_STRING },
+		{ ngx_string("bytes"), AS_BYTES },
+		{ ngx_string("blob"), AS_BYTES },
+		{ ngx_string("list"), AS_LIST },
+		{ ngx_string("map"), AS_MAP },
+		{ ngx_string("geojson"), AS_GEOJSON }
+	};
+
+	ngx_http_as_schema_t *schema = conf;
+	ngx_str_t *arguments = cf->args->elts;
+	ngx_http_as_schema_bin_t *bin;
+	as_val_t type = AS_UNDEF;
+	ngx_uint_t i;
+	u_char *p;
+
+	if(cf->args->nelts!=3 || arguments[0].len!=3 || ngx_strncmp(arguments[0].data, "bin", 3)!=0)
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid directive \"%V\" in as_schema, expected \"bin name type\"", &arguments[0]);
+		return NGX_CONF_ERROR;
+	}
+
+	if(arguments[1].len==0 || arguments[1].len>AS_BIN_NAME_MAX_LEN)
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid bin name \"%V\"", &arguments[1]);
+		return NGX_CONF_ERROR;
+	}
+
+	for(i=0; i<sizeof(types)/sizeof(types[0]); i++)
+	{
+		if(arguments[2].len==types[i].name.len && ngx_strncmp(arguments[2].data, types[i].name.data, types[i].name.len)==0)
+		{
+			type = types[i].type;
+			break;
+		}
+	}
+
+	if(type==AS_UNDEF)
+	{
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid bin type \"%V\"", &arguments[2]);
+		return NGX_CONF_ERROR;
+	}
+
+	// the name is written in json responses as is.
+	for(i=0; i<arguments[1].len; i++)
+	{
+		if(ngx_http_as_json_escape[arguments[1].data[i]])
+		{
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid bin name \"%V\"", &arguments[1]);
+			return NGX_CONF_ERROR;
+		}
+	}
+
+	bin = schema->bins.elts;
+	for(i=0; i<schema->bins.nelts; i++)
+	{
+		if(bin[i].len==arguments[1].len && ngx_strncmp(bin[i].name, arguments[1].data, bin[i].len)==0)
+		{
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "duplicate bin \"%V\"", &arguments[1]);
+			return NGX_CONF_ERROR;
+		}
+	}
+
+	bin = ngx_array_push(&schema->bins);
+	if(bin==NULL)
+		return NGX_CONF_ERROR;
+
+	ngx_memzero(bin, sizeof(ngx_http_as_schema_bin_t));
+	ngx_memcpy(bin->name, arguments[1].data, arguments[1].len);
+	bin->len = arguments[1].len;
+	bin->type = type;
+	bin->index = schema->bins.nelts - 1;
+
+	// the key of the bin in a json response, "\t\t\"name\":".
+	p = ngx_pnalloc(cf->pool, bin->len + sizeof("\t\t\"\":") - 1);
+	if(p==NULL)
+		return NGX_CONF_ERROR;
+
+	bin->json_name.data = p;
+	bin->json_name.len = ngx_sprintf(p, "\t\t\"%V\":", &arguments[1]) - p;
+
+	return NGX_CONF_OK;
+}
+
+/* This function accepts an aerospike object, and the hosts to be connected.
+ * It then created the connected to the cluster.
+ * If the connection is succesful, it returns true, else false.
+ */
+bool ngx_http_as_utils_connect(aerospike **as, ngx_http_as_hosts hosts)
+{
+	return ngx_http_as_utils_connect_timeout(as, hosts, 0);
+}
+
+/* This function connects to the cluster as ngx_http_as_utils_connect does, waiting no longer than timeout milliseconds for a node.
+ * A timeout of 0 is the default of the client.
+ */
+bool ngx_http_as_utils_connect_timeout(aerospike **as, ngx_http_as_hosts hosts, uint32_t timeout)
+{
+	// creating and initialising the as_config object.
+	as_config cfg;
+	as_config_init(&cfg);
+
+	if(timeout)
+		cfg.conn_timeout_ms = timeout;
+
+	// adding the multiple ip and ports to the as_config object.
+	ngx_http_as_utils_create_config(&cfg, hosts);
+
+	// connecting to aerospike.
+	*as = aerospike_new(&cfg);
+	as_error err;
+	if(aerospike_connect(*as, &err)!=AEROSPIKE_OK)
+	{
+		// the object is not kept, as the next try creates a new one.
+		aerospike_destroy(*as);
+		*as = NULL;
+		return false;
+	}
+
+	return true;
+}
+
+/* This function adds the different ip and ports, to the as_config object.*/
+void ngx_http_as_utils_create_config(as_config *cfg, ngx_http_as_hosts hosts)
+{
+	int i;
+	for(i=0; i<hosts.n; i++)
+	{
+		cfg->hosts[i].addr = hosts.address[i];
+		cfg->hosts[i].port = hosts.port[i];
+	}
+}
+
+/* This function parses a hosts string, of the form 127.0.0.1:3000,127.0.0.1:4000, into hosts, without changing the string.
+ * A host without a port gets the default port of aerospike, 3000.
+ * It returns false if there is no host, too many of them, or a host is too long or has an invalid port.
+ */
+bool ngx_http_as_utils_parse_hosts(u_char *p, size_t len, ngx_http_as_hosts *hosts)
+{
+	u_char *last = p + len, *end, *colon;
+	ngx_int_t port;
+	size_t n;
+
+	hosts->n = 0;
+
+	for( ; p<last; p=end + 1)
+	{
+		end = ngx_strlchr(p, last, ',');
+		if(end==NULL)
+			end = last;
+
+		colon = ngx_strlchr(p, end, ':');
+		n = (colon ? colon : end) - p;
+
+		if(n==0 || n>=sizeof(hosts->address[0]) || hosts->n==(int)(sizeof(hosts->port) / sizeof(hosts->port[0])))
+			return false;
+
+		port = 3000;
+		if(colon)
+		{
+			port = ngx_atoi(colon + 1, end - colon - 1);
+			if(port<=0 || port>65535)
+				return false;
+		}
+
+		ngx_memcpy(hosts->address[hosts->n], p, n);
+		hosts->address[hosts->n][n] = '\0';
+		hosts->port[hosts->n] = (int)port;
+		hosts->n++;
+	}
+
+	return hosts->n>0;
+}
+
+/* This function finds the arguement arg in the url arguements, and copies its value into the value array of the given size.
+ * The values of bin and value are copied as is, as their comma separated items are decoded once split.
+ * Any other value is decoded, and its enclosing double quotes, %22 in the url, are removed.
+ * The arguements are scanned once, without copying them. If arg is not found, the value is empty.
+ * It returns false if the value does not fit in the array.
+ */
+bool ngx_http_as_utils_get_parsed_url_arguement(ngx_str_t url, char* arg, char value[], size_t size)
+{
+	u_char *name, *end, *eq, *dst;
+	u_char *last = url.data + url.len;
+	size_t len = strlen(arg);
+	bool raw = (strcmp(arg, "bin")==0 || strcmp(arg, "value")==0);
+
+	value[0] = '\0';
+
+	for(name=url.data; name<last; name=end+1)
+	{
+		end = ngx_strlchr(name, last, '&');
+		if(end==NULL)
+			end = last;
+
+		eq = ngx_strlchr(name, end, '=');
+		if(eq==NULL || (size_t)(eq - name)!=len || ngx_strncmp(name, arg, len)!=0)
+			continue;
+
+		if(raw)
+		{
+			if((size_t)(end - eq - 1)>=size)
+				return false;
+
+			dst = ngx_cpymem(value, eq + 1, end - eq - 1);
+		}
+		else
+		{
+			dst = ngx_http_as_utils_unescape((u_char*)value, (u_char*)value + size - 1, eq + 1, end);
+			if(dst==NULL)
+			{
+				value[0] = '\0';
+				return false;
+			}
+
+			// stripping the double quotes of a string.
+			if(dst - (u_char*)value>=2 && value[0]=='"' && dst[-1]=='"')
+			{
+				dst -= 2;
+				ngx_memmove(value, value + 1, dst - (u_char*)value);
+			}
+		}
+
+		*dst = '\0';
+		return true;
+	}
+
+	return true;
+}
+
+/* This function decodes the percent escapes and plus signs of a url arguement, from src to last, into dst.
+ * dst may be src, as the decoded value is never longer. A '%' which is not followed by two hex digits is kept.
+ * The runs without a '%' or a '+' are found by the vector scanner and copied as is, so the value is decoded in one pass.
+ * It returns the end of the decoded value, or NULL if it does not fit before dst_end.
+ */
+u_char* ngx_http_as_utils_unescape(u_char *dst, u_char *dst_end, const u_char *src, const u_char *last)
+{
+	size_t n;
+	ngx_int_t high, low;
+
+	while(src<last)
+	{
+		n = ngx_http_as_url_scan(src, last);
+		if(n>(size_t)(dst_end - dst))
+			return NULL;
+
+		// in place, the run is moved only once a value was decoded before it.
+		if(dst!=src)
+			ngx_memmove(dst, src, n);
+
+		dst += n;
+		src += n;
+
+		if(src==last)
+			break;
+
+		if(dst==dst_end)
+			return NULL;
+
+		if(*src=='+')
+		{
+			*dst++ = ' ';
+			src++;
+			continue;
+		}
+
+		high = (last - src>=3) ? ngx_http_as_hex_value(src[1]) : -1;
+		low = (last - src>=3) ? ngx_http_as_hex_value(src[2]) : -1;
+
+		if(high<0 || low<0)
+		{
+			*dst++ = *src++;
+			continue;
+		}
+
+		*dst++ = (u_char)((high << 4) | low);
+		src += 3;
+	}
+
+	return dst;
+}
+
+/* This function obtains the namespace, set and key of the record for the request.
+ * Each of them is evaluated from its template, if configured, else parsed from the url arguements.
+ * It returns false if a value could not be evaluated, or is too long.
+ */
+bool ngx_http_as_utils_get_key_args(ngx_http_request_t *r, ngx_http_as_conf_t *as_conf, char namespace[], char set[], char key[])
+{
+	// for as_rest, the namespace, set and key are the slices of the uri.
+	ngx_http_as_ctx_t *ctx = ngx_http_get_module_ctx(r, ngx_http_as_module);
+	if(ctx && ctx->rest)
+	{
+		if(ctx->namespace.len==0 || ctx->key.len==0)
+			return false;
+
+		return ngx_http_as_utils_copy_slice(ctx->namespace, namespace, 40)
+			&& ngx_http_as_utils_copy_slice(ctx->set, set, 100)
+			&& ngx_http_as_utils_copy_slice(ctx->key, key, 1000);
+	}
+
+	return ngx_http_as_utils_get_template_value(r, as_conf->namespace_template, "ns", namespace, 40)
+		&& ngx_http_as_utils_get_template_value(r, as_conf->set_template, "set", set, 100)
+		&& ngx_http_as_utils_get_template_value(r, as_conf->key_template, "key", key, 1000);
+}
+
+/* This function evaluates a template into the value array, of the given size.
+ * If the template is NULL, the arguement arg is parsed from the url instead.
+ */
+bool ngx_http_as_utils_get_template_value(ngx_http_request_t *r, ngx_http_complex_value_t *template, char *arg, char value[], size_t size)
+{
+	ngx_str_t v;
+
+	value[0] = '\0';
+
+	if(template==NULL)
+		return ngx_http_as_utils_get_parsed_url_arguement(r->args, arg, value, size);
+
+	if(ngx_http_complex_value(r, template, &v)!=NGX_OK)
+		return false;
+
+	return ngx_http_as_utils_copy_slice(v, value, size);
+}
+
+/* This function copies a slice into the value array of the given size, and null terminates it.
+ * It returns false if the slice does not fit.
+ */
+bool ngx_http_as_utils_copy_slice(ngx_str_t slice, char value[], size_t size)
+{
+	if(slice.len>=size)
+		return false;
+
+	ngx_memcpy(value, slice.data, slice.len);
+	value[slice.len] = '\0';
+	return true;
+}
+
+/* This function splits the uri of an as_rest request into the namespace, set and key.
+ * The uri is scanned once, and its last three segments are kept, so the location may have a prefix,
+ * for eg, /kv/test/users/1 gives the namespace test, the set users and the key 1.
+ * If the uri has less than three segments, the namespace and key are left empty.
+ */
+void ngx_http_as_utils_parse_rest_uri(ngx_str_t uri, ngx_http_as_ctx_t *ctx)
+{
+	ngx_str_t segments[3];
+	ngx_uint_t n = 0;
+	u_char *p, *last, *start;
+
+	p = uri.data;
+	last = uri.data + uri.len;
+
+	// skipping the leading slash.
+	if(p<last && *p=='/')
+		p++;
+
+	for(start=p; p<=last; p++)
+	{
+		if(p<last && *p!='/')
+			continue;
+
+		// the segments are kept in a ring of three.
+		segments[n%3].data = start;
+		segments[n%3].len = p - start;
+		n++;
+
+		start = p + 1;
+	}
+
+	if(n<3)
+		return;
+
+	ctx->namespace = segments[(n-3)%3];
+	ctx->set = segments[(n-2)%3];
+	ctx->key = segments[(n-1)%3];
+}
+
+/* This function copies the request body into a null terminated string allocated from the request pool.
+ * The body may be in memory, or in a temporary file if it is larger than client_body_buffer_size.
+ */
+bool ngx_http_as_utils_read_body(ngx_http_request_t *r, ngx_str_t *body)
+{
+	ngx_chain_t *cl;
+	ngx_buf_t *b;
+	size_t len = 0;
+	ssize_t n;
+	u_char *p;
+
+	body->len = 0;
+	body->data = (u_char*)"";
+
+	if(r->request_body==NULL || r->request_body->bufs==NULL)
+		return true;
+
+	for(cl=r->request_body->bufs; cl; cl=cl->next)
+		len += ngx_buf_size(cl->buf);
+
+	p = ngx_pnalloc(r->pool, len + 1);
+	if(p==NULL)
+		return false;
+
+	body->data = p;
+
+	for(cl=r->request_body->bufs; cl; cl=cl->next)
+	{
+		b = cl->buf;
+
+		if(b->in_file)
+		{
+			n = ngx_read_file(b->file, p, b->file_last - b->file_pos, b->file_pos);
+			if(n!=b->file_last - b->file_pos)
+				return false;
+			p += n;
+		}
+		else
+		{
+			p = ngx_cpymem(p, b->pos, b->last - b->pos);
+		}
+	}
+
+	*p = '\0';
+	body->len = len;
+	return true;
+}
+
+/* This function parses the bins and values of a put from the bin and value arguements of the url.
+ * Both are comma separated lists, and strings are enclosed in %22.
+ * If the number of bins and values differ, the error is formatted in the response and NULL is returned.
+ */
+ngx_http_binvalue* ngx_http_as_utils_get_url_bin_value_pairs(ngx_http_request_t *r, int *n, ngx_http_as_response_t *response)
+{
+	ngx_http_binvalue *binvalue;
+	int i,countbin=0,countval=0;
+
+	// the bin and value lists are kept in the request pool, as the pairs point into them.
+	char *bin = ngx_pnalloc(r->pool, r->args.len + 1);
+	char *value = ngx_pnalloc(r->pool, r->args.len + 1);
+	if(bin==NULL || value==NULL)
+		return NULL;
+
+	ngx_http_as_utils_get_parsed_url_arguement(r->args, "bin", bin, r->args.len + 1);
+	ngx_http_as_utils_get_parsed_url_arguement(r->args, "value", value, r->args.len + 1);
+	int len = strlen(bin);
+	for(i=0;i<len;i++)
+	{
+    	if((int)bin[i]==',')
+        	countbin++;
+	}
+	len = strlen(value);
+	for(i=0;i<len;i++)
+	{
+		if((int)value[i]==',')
+			countval++;
+	}
+	if(countbin!=countval)
+	{
+		ngx_http_as_response_canned(response, NGX_HTTP_AS_BINS_AND_VALUES_MISMATCH);
+		return NULL;
+	}
+
+	countbin++;
+	binvalue = ngx_palloc(r->pool, countbin * sizeof(ngx_http_binvalue));
+	if(binvalue==NULL)
+		return NULL;
+	ngx_http_as_utils_get_bin_value_pair(bin,value,binvalue,countbin);
+
+	*n = countbin;
+	return binvalue;
+}
+
+/* This function parses the bins and values of a put from the request body.
+ * The body is of the form bin1=value1&bin2=value2, with url encoded values.
+ * A value in double quotes is a string, else it is an integer.
+ * The body is parsed in place, and the number of pairs is set in n.
+ */
+ngx_http_binvalue* ngx_http_as_utils_get_body_bin_value_pairs(ngx_http_request_t *r, ngx_str_t body, int *n)
+{
+	ngx_http_binvalue *bv;
+	u_char *p, *last, *pair, *end, *eq, *dst;
+	int count = 1, i = 0;
+
+	p = body.data;
+	last = body.data + body.len;
+
+	for(; p<last; p++)
+	{
+		if(*p=='&')
+			count++;
+	}
+
+	bv = ngx_palloc(r->pool, count * sizeof(ngx_http_binvalue));
+	if(bv==NULL)
+		return NULL;
+
+	for(pair=body.data; pair<last; pair=end+1)
+	{
+		end = (u_char*)ngx_strchr(pair, '&');
+		if(end==NULL)
+			end = last;
+		*end = '\0';
+
+		eq = (u_char*)ngx_strchr(pair, '=');
+		if(eq==NULL)
+			continue;
+
+		// decoding the bin name and the value in place.
+		*ngx_http_as_utils_unescape(pair, eq, pair, eq) = '\0';
+
+		dst = ngx_http_as_utils_unescape(eq + 1, end, eq + 1, end);
+		*dst = '\0';
+
+		bv[i].bin = (char*)pair;
+		bv[i].value = (char*)eq + 1;
+		bv[i].is_str = false;
+
+		// stripping the double quotes of a string.
+		if(dst - eq - 1>=2 && eq[1]=='"' && dst[-1]=='"')
+		{
+			dst[-1] = '\0';
+			bv[i].value++;
+			bv[i].is_str = true;
+		}
+		i++;
+	}
+
+	*n = i;
+	return bv;
+}
+
+void ngx_http_as_utils_put(ngx_http_request_t *r, ngx_http_as_conf_t *as_conf, ngx_http_as_response_t *response)
+{
+	aerospike *as;
+	int countbin=0;
+	ngx_http_binvalue *binvalue;
+	
+	char key[1000], namespace[40], set[100];
+	if(!ngx_http_as_utils_get_key_args(r, as_conf, namespace, set, key))
+	{
+		ngx_http_as_response_canned(response, NGX_HTTP_AS_INVALID_KEY);
+		return;
+	}
+
+	as_key put_key;
+	as_key_init_str(&put_key, namespace, set, key);
+
+	// with as_shard_group, the key picks the cluster of its shard.
+	// with as_spool, a put is spooled if there is no cluster to take it.
+	as = ngx_http_as_utils_cluster(as_conf, &put_key);
+	if(as==NULL && as_conf->spool==NULL)
+	{
+		ngx_http_as_response_canned(response, NGX_HTTP_AS_INSTANCE_NULL);
+		return;
+	}
+
+	as_policy_write policy;
+	if(as)
+		policy = as->config.policies.write;
+	else
+		as_policy_write_init(&policy);
+
+	if(!ngx_http_as_utils_set_policy(r, as_conf, &policy.base))
+	{
+		ngx_http_as_response_canned(response, NGX_HTTP_AS_DEADLINE_EXCEEDED);
+		return;
+	}
+
+	as_record rec;
+	as_error err_res;
+	ngx_http_as_ctx_t *ctx = ngx_http_get_module_ctx(r, ngx_http_as_module);
+
+	if(ctx && (ctx->json || ctx->msgpack))
+	{
+		// the record is built while the body is parsed.
+		ngx_http_as_record_builder_t builder;
+		ngx_http_as_builder_init(&builder, r->pool, as_conf, ngx_http_as_utils_find_schema(r, set));
+
+		bool parsed = ctx->json ? ngx_http_as_json_parse_body(r, &builder) : ngx_http_as_msgpack_parse_body(r, &builder);
+
+		if(!parsed || !ngx_http_as_builder_finish(&builder, &rec))
+		{
+			ngx_http_as_builder_destroy(&builder);
+
+			err_res.code = -1;
+			err_res.func = NULL;
+			ngx_cpystrn((u_char*)err_res.message, (u_char*)(builder.error ? builder.error : "INVALID_RECORD"), sizeof(err_res.message));
+			response->status = NGX_HTTP_BAD_REQUEST;
+
+			if(!response->minimal)
+			{
+				ngx_http_as_response_begin(response);
+				ngx_http_as_utils_dump_error(err_res,response,NULL);
+			}
+			return;
+		}
+	}
+	else
+	{
+		// the bins and values are in the request body, else in the url.
+		if(ctx && ctx->body.len>0)
+			binvalue = ngx_http_as_utils_get_body_bin_value_pairs(r, ctx->body, &countbin);
+		else
+			binvalue = ngx_http_as_utils_get_url_bin_value_pairs(r, &countbin, response);
+
+		if(binvalue==NULL)
+			return;
+
+		as_record_inita(&rec, countbin);
+
+		char *error = ngx_http_as_utils_set_bin_value_pairs(&rec, binvalue, countbin, as_conf, ngx_http_as_utils_find_schema(r, set));
+		if(error)
+		{
+			as_record_destroy(&rec);
+
+			err_res.code = -1;
+			err_res.func = NULL;
+			strcpy(err_res.message, error);
+			response->status = NGX_HTTP_BAD_REQUEST;
+
+			if(!response->minimal)
+			{
+				ngx_http_as_response_begin(response);
+				ngx_http_as_utils_dump_error(err_res,response,NULL);
+			}
+			return;
+		}
+	}
+
+	as_error err;
+	ngx_http_as_retry_t retry;
+
+	// with as_write_behind, the put is acknowledged once it is buffered, and written by the flusher.
+	if(as_conf->write_behind_zone && as!=NULL && ngx_http_as_write_behind_add(as_conf, namespace, set, key, &rec))
+	{
+		ngx_http_as_accepted(response);
+		as_record_destroy(&rec);
+		return;
+	}
+
+	// puts are spooled while the spool of the worker is replayed, so a key is not overwritten by an older put of it
+	// spooled by the worker. once the spool is full, they are written at once.
+	if(as_conf->spool && (as==NULL || ngx_http_as_spool_pending(as_conf->spool))
+		&& ngx_http_as_spool_put(as_conf, namespace, set, key, &rec))
+	{
+		ngx_http_as_accepted(response);
+		as_record_destroy(&rec);
+		return;
+	}
+
+	if(as==NULL)
+	{
+		ngx_http_as_not_connected(response, as_conf);
+		as_record_destroy(&rec);
+		return;
+	}
+
+	// a put sets the same bins to the same values, so it is retried.
+	ngx_http_as_utils_retry_init(&retry, &policy.base);
+
+	do
+	{
+		aerospike_key_put(as, &err, &policy, &put_key, &rec);
+	}
+	while(ngx_http_as_utils_retry(as_conf, &retry, &policy.base, err.code, true));
+
+	ngx_http_as_breaker_record(as_conf, err.code);
+
+	if(as_conf->spool && ngx_http_as_utils_unavailable(err.code) && ngx_http_as_spool_put(as_conf, namespace, set, key, &rec))
+	{
+		ngx_http_as_accepted(response);
+		as_record_destroy(&rec);
+		return;
+	}
+
+	if(ngx_http_as_response_status(response, err.code))
+	{
+		ngx_http_as_response_begin(response);
+		ngx_http_as_utils_dump_error(err,response,NULL);
+	}
+
+	as_record_destroy(&rec);
+}
+
+/* This function sets the bins and values parsed from the url, or a bin=value body, in the record.
+ * If the set has a schema, each value is parsed as the type of its bin.
+ * It returns the error message if a bin is rejected, and NULL otherwise.
+ */
+char* ngx_http_as_utils_set_bin_value_pairs(as_record *rec, ngx_http_binvalue *binvalue, int n, ngx_http_as_conf_t *as_conf, ngx_http_as_schema_t *schema)
+{
+	ngx_http_as_schema_bin_t *decl;
+	char *error;
+	int i;
+	for(i=0;i<n;i++)
+	{
+		if(schema)
+		{
+			decl = ngx_http_as_utils_find_schema_bin(schema, (u_char*)binvalue[i].bin, strlen(binvalue[i].bin));
+			if(decl==NULL)
+				return "UNKNOWN_BIN";
+
+			error = ngx_http_as_utils_set_declared_value(rec, &binvalue[i], decl, as_conf);
+			if(error)
+				return error;
+
+			continue;
+		}
+
+		if(binvalue[i].is_str)
+		{
+			// large strings are stored compressed, if compression is enabled.
+			if(as_conf->compress && ngx_http_as_utils_set_compressed(rec, binvalue[i].bin, binvalue[i].value, strlen(binvalue[i].value), AS_STRING, as_conf))
+				continue;
+
+			as_record_set_str(rec, binvalue[i].bin, binvalue[i].value);
+		}
+		else
+			ngx_http_as_utils_set_unquoted_value(rec, binvalue[i].bin, binvalue[i].value);
+	}
+
+	return NULL;
+}
+
+/* This function sets a value which is not quoted, as an integer or a double if it is a number.
+ * Any other value is set as a string.
+ */
+void ngx_http_as_utils_set_unquoted_value(as_record *rec, char *bin, char *value)
+{
+	char *end;
+	int64_t integer;
+	double dbl;
+
+	// only decimal numbers are accepted, not the hex, inf and nan of strtod.
+	if(*value=='\0' || strspn(value, "0123456789+-.eE")!=strlen(value))
+	{
+		as_record_set_str(rec, bin, value);
+		return;
+	}
+
+	errno = 0;
+	integer = strtoll(value, &end, 10);
+	if(*end=='\0' && errno==0)
+	{
+		as_record_set_int64(rec, bin, integer);
+		return;
+	}
+
+	errno = 0;
+	dbl = strtod(value, &end);
+	if(*end=='\0' && errno==0)
+	{
+		as_record_set_double(rec, bin, dbl);
+		return;
+	}
+
+	as_record_set_str(rec, bin, value);
+}
+
+/* This function sets a value parsed from the url, or a bin=value body, as the type declared for its bin.
+ * Strings and geojson may be quoted or not, numbers must not be. Other types cannot be written as a pair.
+ */
+char* ngx_http_as_utils_set_declared_value(as_record *rec, ngx_http_binvalue *binvalue, ngx_http_as_schema_bin_t *decl, ngx_http_as_conf_t *as_conf)
+{
+	char *value = binvalue->value;
+	char *end;
+	int64_t integer;
+	double dbl;
+
+	switch(decl->type)
+	{
+		case AS_STRING:
+			if(as_conf->compress && ngx_http_as_utils_set_compressed(rec, decl->name, value, strlen(value), AS_STRING, as_conf))
+				return NULL;
+
+			as_record_set_str(rec, decl->name, value);
+			return NULL;
+
+		case AS_GEOJSON:
+			as_record_set_geojson_str(rec, decl->name, value);
+			return NULL;
+
+		case AS_INTEGER:
+			if(binvalue->is_str || *value=='\0')
+				break;
+
+			errno = 0;
+			integer = strtoll(value, &end, 10);
+			if(*end!='\0' || errno!=0)
+				break;
+
+			as_record_set_int64(rec, decl->name, integer);
+			return NULL;
+
+		case AS_DOUBLE:
+			if(binvalue->is_str || *value=='\0' || strspn(value, "0123456789+-.eE")!=strlen(value))
+				break;
+
+			errno = 0;
+			dbl = strtod(value, &end);
+			if(*end!='\0' || errno!=0)
+				break;
+
+			as_record_set_double(rec, decl->name, dbl);
+			return NULL;
+
+		default:
+			break;
+	}
+
+	return "BIN_TYPE_MISMATCH";
+}
+
+/* This function returns the schema declared for a set, or NULL if the set has none. */
+ngx_http_as_schema_t* ngx_http_as_utils_find_schema(ngx_http_request_t *r, char *set)
+{
+	ngx_http_as_main_conf_t *amcf = ngx_http_get_module_main_conf(r, ngx_http_as_module);
+	ngx_http_as_schema_t *schema = amcf->schemas.elts;
+	ngx_uint_t i;
+
+	for(i=0; i<amcf->schemas.nelts; i++)
+	{
+		if(strcmp(schema[i].set, set)==0)
+			return &schema[i];
+	}
+
+	return NULL;
+}
+
+/* This function returns the declaration of a bin in a schema, or NULL if the schema does not declare it. */
+ngx_http_as_schema_bin_t* ngx_http_as_utils_find_schema_bin(ngx_http_as_schema_t *schema, u_char *name, size_t len)
+{
+	return ngx_hash_find(&schema->hash, ngx_hash_key(name, len), name, len);
+}
+
+/* This function returns the bins of a record in the order they are written in the response.
+ * If the set has a schema, the declared bins come first, in the order of the schema, followed by the other bins.
+ * The bins are placed by the index of their declaration, so the record is walked twice and never sorted.
+ * The array has as many entries as the record has bins, and NULL is returned if it could not be allocated.
+ */
+ngx_http_as_ordered_bin_t* ngx_http_as_utils_order_bins(as_record *p_rec, ngx_http_as_schema_t *schema, ngx_pool_t *pool)
+{
+	ngx_http_as_ordered_bin_t *ordered, *declared;
+	ngx_http_as_schema_bin_t *decl;
+	as_bin *bins = p_rec->bins.entries;
+	uint16_t n = p_rec->bins.size;
+	ngx_uint_t i, j;
+
+	ordered = ngx_palloc(pool, (n + 1) * sizeof(ngx_http_as_ordered_bin_t));
+	if(ordered==NULL)
+		return NULL;
+
+	if(schema==NULL)
+	{
+		for(i=0; i<n; i++)
+		{
+			ordered[i].bin = &bins[i];
+			ordered[i].decl = NULL;
+		}
+		return ordered;
+	}
+
+	declared = ngx_pcalloc(pool, schema->bins.nelts * sizeof(ngx_http_as_ordered_bin_t));
+	if(declared==NULL)
+		return NULL;
+
+	j = 0;
+	for(i=0; i<n; i++)
+	{
+		decl = ngx_http_as_utils_find_schema_bin(schema, (u_char*)bins[i].name, strlen(bins[i].name));
+		if(decl)
+		{
+			declared[decl->index].bin = &bins[i];
+			declared[decl->index].decl = decl;
+		}
+	}
+
+	for(i=0; i<schema->bins.nelts; i++)
+	{
+		if(declared[i].bin)
+			ordered[j++] = declared[i];
+	}
+
+	for(i=0; i<n; i++)
+	{
+		if(ngx_http_as_utils_find_schema_bin(schema, (u_char*)bins[i].name, strlen(bins[i].name))==NULL)
+		{
+			ordered[j].bin = &bins[i];
+			ordered[j++].decl = NULL;
+		}
+	}
+
+	return ordered;
+}
+
+/* This function checks whether the request body is json, from the Content-Type header. */
+bool ngx_http_as_utils_is_json(ngx_http_request_t *r)
+{
+	ngx_table_elt_t *content_type = r->headers_in.content_type;
+	ngx_str_t type;
+
+	if(content_type==NULL)
+		return false;
+
+	type = ngx_http_as_utils_media_type(content_type->value.data, content_type->value.data + content_type->value.len);
+
+	return type.len==sizeof("application/json")-1
+		&& ngx_strncasecmp(type.data, (u_char*)"application/json", sizeof("application/json")-1)==0;
+}
+
+/* This function checks whether the request body is msgpack, from the Content-Type header. */
+bool ngx_http_as_utils_is_msgpack(ngx_http_request_t *r)
+{
+	ngx_table_elt_t *content_type = r->headers_in.content_type;
+
+	if(content_type==NULL)
+		return false;
+
+	return ngx_http_as_utils_is_msgpack_type(ngx_http_as_utils_media_type(content_type->value.data, content_type->value.data + content_type->value.len));
+}
+
+/* This function checks if the client asked for minimal responses, with a Prefer header holding return=minimal. */
+bool ngx_http_as_utils_prefers_minimal(ngx_http_request_t *r)
+{
+	ngx_list_part_t *part = &r->headers_in.headers.part;
+	ngx_table_elt_t *header = part->elts;
+	ngx_uint_t i;
+
+	for(i=0; ; i++)
+	{
+		if(i>=part->nelts)
+		{
+			if(part->next==NULL)
+				break;
+
+			part = part->next;
+			header = part->elts;
+			i = 0;
+		}
+
+		if(header[i].key.len==sizeof("Prefer")-1
+			&& ngx_strncasecmp(header[i].key.data, (u_char*)"Prefer", sizeof("Prefer")-1)==0
+			&& ngx_strlcasestrn(header[i].value.data, header[i].value.data + header[i].value.len,
+				(u_char*)"return=minimal", sizeof("return=minimal")-2)!=NULL)
+			return true;
+	}
+
+	return false;
+}
+
+/* This function returns the milliseconds the client has left to wait for the response, or NGX_CONF_UNSET if it did not say.
+ * The X-Request-Timeout header holds the milliseconds the client waits from sending the request,
+ * from which the time the request already spent in nginx, reading its body for instance, is taken.
+ */
+ngx_int_t ngx_http_as_utils_get_deadline(ngx_http_request_t *r)
+{
+	ngx_list_part_t *part = &r->headers_in.headers.part;
+	ngx_table_elt_t *header = part->elts;
+	ngx_time_t *tp;
+	ngx_int_t timeout, elapsed;
+	ngx_uint_t i;
+
+	for(i=0; ; i++)
+	{
+		if(i>=part->nelts)
+		{
+			if(part->next==NULL)
+				return NGX_CONF_UNSET;
+
+			part = part->next;
+			header = part->elts;
+			i = 0;
+		}
+
+		if(header[i].key.len==sizeof(NGX_HTTP_AS_DEADLINE_HEADER)-1
+			&& ngx_strncasecmp(header[i].key.data, (u_char*)NGX_HTTP_AS_DEADLINE_HEADER, sizeof(NGX_HTTP_AS_DEADLINE_HEADER)-1)==0)
+			break;
+	}
+
+	timeout = ngx_atoi(header[i].value.data, header[i].value.len);
+	if(timeout==NGX_ERROR)
+		return NGX_CONF_UNSET;
+
+	tp = ngx_timeofday();
+	elapsed = (ngx_int_t)((tp->sec - r->start_sec) * 1000 + (ngx_int_t)(tp->msec - r->start_msec));
+
+	return ngx_max(timeout - elapsed, 0);
+}
+
+/* This function sets the timeouts and retries of a transaction in the base of its policy, a copy of the default policy of the client.
+ * The total timeout is cut to the time the client has left, so the cluster does not work for a client which gave up.
+ * It returns false if there is no time left, in which case the transaction is not sent.
+ */
+bool ngx_http_as_utils_set_policy(ngx_http_request_t *r, ngx_http_as_conf_t *as_conf, as_policy_base *base)
+{
+	ngx_int_t left;
+
+	ngx_http_as_limit_begin(r);
+
+	if(as_conf->timeout!=NGX_CONF_UNSET_MSEC)
+		base->total_timeout = as_conf->timeout;
+
+	if(as_conf->socket_timeout!=NGX_CONF_UNSET_MSEC)
+		base->socket_timeout = as_conf->socket_timeout;
+
+	if(as_conf->max_retries!=NGX_CONF_UNSET)
+		base->max_retries = as_conf->max_retries;
+
+	// with as_retry, the transaction is retried here, within the budget, and each request adds to it.
+	if(as_conf->retry_attempts)
+	{
+		base->max_retries = 0;
+		as_conf->retry_tokens = ngx_min(as_conf->retry_tokens + as_conf->retry_budget, NGX_HTTP_AS_RETRY_BURST * 100);
+	}
+
+	left = ngx_http_as_utils_get_deadline(r);
+	if(left==NGX_CONF_UNSET)
+		return true;
+
+	if(left==0)
+		return false;
+
+	// a total timeout of 0 is no timeout.
+	if(base->total_timeout==0 || base->total_timeout>(uint32_t)left)
+		base->total_timeout = (uint32_t)left;
+
+	return true;
+}
+
+/* This function returns a monotonic clock in milliseconds. The cached time of nginx is not updated while a transaction blocks. */
+ngx_msec_t ngx_http_as_utils_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ngx_msec_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* This function sets up a read to be tried again on the next replica, if as_replica_retry is on and the budget has a retry left.
+ * The first try waits replica_timeout for the socket, then the client sends the read to the next replica, as the replica policy is sequence.
+ * It returns true if the read is set up, in which case the caller takes the retry from the budget if it was sent.
+ */
+bool ngx_http_as_utils_arm_replica_retry(ngx_http_as_conf_t *as_conf, as_policy_read *policy)
+{
+	if(as_conf->replica_timeout==0)
+		return false;
+
+	as_conf->replica_tokens = ngx_min(as_conf->replica_tokens + as_conf->replica_budget, NGX_HTTP_AS_REPLICA_RETRY_BURST * 100);
+	if(as_conf->replica_tokens<100)
+		return false;
+
+	// a shorter total timeout leaves no time for the retry.
+	if(policy->base.total_timeout!=0 && policy->base.total_timeout<=as_conf->replica_timeout)
+		return false;
+
+	if(policy->base.socket_timeout==0 || policy->base.socket_timeout>as_conf->replica_timeout)
+		policy->base.socket_timeout = as_conf->replica_timeout;
+
+	if(policy->base.max_retries<1)
+		policy->base.max_retries = 1;
+
+	policy->base.sleep_between_retries = 0;
+	policy->replica = AS_POLICY_REPLICA_SEQUENCE;
+	return true;
+}
+
+/* This function starts the retries of a transaction, before its first try. */
+void ngx_http_as_utils_retry_init(ngx_http_as_retry_t *retry, as_policy_base *base)
+{
+	retry->attempt = 0;
+	retry->start = ngx_http_as_utils_clock();
+	retry->total_timeout = base->total_timeout;
+}
+
+/* This function decides if a failed transaction is tried again, for as_retry.
+ * Only an idempotent transaction which failed with a transient error, a timeout, an overloaded or busy node or
+ * a lost connection, is retried, while it has attempts, the budget has a retry and the total timeout has time left.
+ * It then sets the time left as the total timeout. The retry is sent at once, as the worker must not sleep.
+ * A request which is not retried as the budget is spent is failed with its error, which sheds the load of retry storms.
+ */
+bool ngx_http_as_utils_retry(ngx_http_as_conf_t *as_conf, ngx_http_as_retry_t *retry, as_policy_base *base, as_status code, bool idempotent)
+{
+	ngx_msec_t elapsed;
+
+	if(!as_conf->retry_attempts || !idempotent || retry->attempt>=as_conf->retry_attempts)
+		return false;
+
+	switch(code)
+	{
+		case AEROSPIKE_ERR_TIMEOUT:
+		case AEROSPIKE_ERR_DEVICE_OVERLOAD:
+		case AEROSPIKE_ERR_RECORD_BUSY:
+		case AEROSPIKE_ERR_CLUSTER_CHANGE:
+		case AEROSPIKE_ERR_CONNECTION:
+		case AEROSPIKE_ERR_NO_MORE_CONNECTIONS:
+		case AEROSPIKE_ERR_INVALID_NODE:
+			break;
+
+		default:
+			return false;
+	}
+
+	if(as_conf->retry_tokens<100)
+		return false;
+
+	elapsed = ngx_http_as_utils_clock() - retry->start;
+
+	if(retry->total_timeout!=0)
+	{
+		if(retry->total_timeout<=elapsed)
+			return false;
+
+		base->total_timeout = retry->total_timeout - (uint32_t)elapsed;
+	}
+
+	as_conf->retry_tokens -= 100;
+	retry->attempt++;
+
+	return true;
+}
+
+/* This function counts a transaction in the interval of the as_breaker circuit, as a failure if the cluster did not answer it.
+ * A failure in a half open circuit opens it again, and it closes once its trial requests all succeeded.
+ */
+void ngx_http_as_breaker_record(ngx_http_as_conf_t *as_conf, as_status code)
+{
+	if(!as_conf->breaker_interval)
+		return;
+
+	as_conf->breaker_requests++;
+
+	if(!ngx_http_as_utils_unavailable(code))
+	{
+		if(as_conf->breaker_state==NGX_HTTP_AS_BREAKER_HALF_OPEN && ++as_conf->breaker_successes>=NGX_HTTP_AS_BREAKER_TRIALS)
+			as_conf->breaker_state = NGX_HTTP_AS_BREAKER_CLOSED;
+
+		return;
+	}
+
+	as_conf->breaker_failures++;
+
+	if(as_conf->breaker_state==NGX_HTTP_AS_BREAKER_HALF_OPEN)
+		as_conf->breaker_state = NGX_HTTP_AS_BREAKER_OPEN;
+}
+
+/* This function checks if the as_breaker circuit lets a request through. A closed circuit lets every request through, and an open one none.
+ * A half open one lets the first NGX_HTTP_AS_BREAKER_TRIALS requests of the worker through, whose results close or open it again.
+ */
+bool ngx_http_as_breaker_admit(ngx_http_as_conf_t *as_conf)
+{
+	switch(as_conf->breaker_state)
+	{
+		case NGX_HTTP_AS_BREAKER_CLOSED:
+			return true;
+
+		case NGX_HTTP_AS_BREAKER_OPEN:
+			return false;
+	}
+
+	if(as_conf->breaker_trials>=NGX_HTTP_AS_BREAKER_TRIALS)
+		return false;
+
+	as_conf->breaker_trials++;
+	return true;
+}
+
+/* This function checks if a transaction failed as the cluster did not answer it,
+ * as it timed out, was overloaded or lost its connection.
+ */
+bool ngx_http_as_utils_unavailable(as_status code)
+{
+	switch(code)
+	{
+		case AEROSPIKE_ERR_TIMEOUT:
+		case AEROSPIKE_ERR_CLUSTER:
+		case AEROSPIKE_ERR_CLUSTER_CHANGE:
+		case AEROSPIKE_ERR_DEVICE_OVERLOAD:
+		case AEROSPIKE_ERR_CONNECTION:
+		case AEROSPIKE_ERR_INVALID_NODE:
+		case AEROSPIKE_ERR_NO_MORE_CONNECTIONS:
+		case AEROSPIKE_ERR_ASYNC_CONNECTION:
+		case AEROSPIKE_ERR_MAX_ERROR_RATE:
+			return true;
+
+		default:
+			return false;
+	}
+}
+
+/* This function connects the worker to a secondary cluster or a shard, if it is not connected, from the hosts parsed by its directive.
+ * A failed connection is tried again after NGX_HTTP_AS_SECONDARY_RECONNECT, so requests do not block on a cluster which is down.
+ */
+bool ngx_http_as_cluster_connect(ngx_http_as_cluster_t *cluster)
+{
+	ngx_msec_t now;
+
+	if(cluster->connected)
+		return true;
+
+	now = ngx_http_as_utils_clock();
+	if(now<cluster->next_connect)
+		return false;
+
+	if(!ngx_http_as_utils_connect(&(cluster->as), cluster->hosts))
+	{
+		cluster->next_connect = now + NGX_HTTP_AS_SECONDARY_RECONNECT;
+		return false;
+	}
+
+	cluster->connected = true;
+	return true;
+}
+
+/* This function maps a key to one of the buckets, with the jump consistent hash of Lamping and Veach.
+ * Adding a bucket at the end only moves 1/buckets of the keys, all of them to the new bucket.
+ */
+ngx_uint_t ngx_http_as_utils_jump_hash(uint64_t key, ngx_uint_t buckets)
+{
+	int64_t b = -1, j = 0;
+
+	while(j<(int64_t)buckets)
+	{
+		b = j;
+		key = key * 2862933555777941757ULL + 1;
+		j = (int64_t)((b + 1) * ((double)(1LL << 31) / (double)((key >> 33) + 1)));
+	}
+
+	return (ngx_uint_t)b;
+}
+
+/* This function picks the shard of a key in the as_shard_group, by the jump hash of its digest, and connects the worker to it.
+ * The digest is the one aerospike partitions records by, so it is spread evenly whatever the keys are.
+ * It returns NULL if the shard is not connected.
+ */
+ngx_http_as_cluster_t* ngx_http_as_utils_shard(ngx_http_as_conf_t *as_conf, as_key *key)
+{
+	ngx_http_as_cluster_t *shards = as_conf->shards->elts;
+	as_digest *digest;
+	uint64_t hash;
+	ngx_uint_t i;
+
+	digest = as_key_digest(key);
+	if(digest==NULL)
+		return NULL;
+
+	ngx_memcpy(&hash, digest->value, sizeof(hash));
+	i = ngx_http_as_utils_jump_hash(hash, as_conf->shards->nelts);
+
+	if(!ngx_http_as_cluster_connect(&shards[i]))
+		return NULL;
+
+	return &shards[i];
+}
+
+/* This function returns the cluster a write of the key is sent to, its shard with as_shard_group, else the cluster of as_connect.
+ * It returns NULL if the worker is not connected to it, or its circuit is open.
+ */
+aerospike* ngx_http_as_utils_cluster(ngx_http_as_conf_t *as_conf, as_key *key)
+{
+	ngx_http_as_cluster_t *shard;
+
+	if(as_conf->shards==NULL)
+		return as_conf->connected && as_conf->breaker_state!=NGX_HTTP_AS_BREAKER_OPEN ? as_conf->as : NULL;
+
+	shard = ngx_http_as_utils_shard(as_conf, key);
+	return shard ? shard->as : NULL;
+}
+
+/* This function lists the clusters a read of the key is sent to, in the order they are tried, with the averages of their latencies.
+ * With as_shard_group, it is the shard of the key alone. Else the primary is first while it is up, and the secondary of as_secondary is only connected when the primary is down, unless reads=fastest.
+ * Then the cluster with the lower latency is first, except for one read in NGX_HTTP_AS_SECONDARY_PROBE.
+ * A read failing over later connects the secondary itself.
+ */
+ngx_uint_t ngx_http_as_utils_read_clusters(ngx_http_as_conf_t *as_conf, as_key *key, aerospike *clusters[], ngx_uint_t *latencies[])
+{
+	ngx_http_as_cluster_t *secondary = as_conf->secondary, *shard;
+	ngx_uint_t n = 0;
+	bool swap;
+
+	if(as_conf->shards!=NULL)
+	{
+		shard = ngx_http_as_utils_shard(as_conf, key);
+		if(shard==NULL)
+			return 0;
+
+		clusters[0] = shard->as;
+		latencies[0] = &shard->latency;
+		return 1;
+	}
+
+	if(as_conf->as!=NULL && as_conf->connected && as_conf->breaker_state!=NGX_HTTP_AS_BREAKER_OPEN)
+	{
+		clusters[n] = as_conf->as;
+		latencies[n++] = &as_conf->latency;
+	}
+
+	if(secondary==NULL || (n && secondary->reads!=NGX_HTTP_AS_READS_FASTEST) || !ngx_http_as_cluster_connect(secondary))
+		return n;
+
+	clusters[n] = secondary->as;
+	latencies[n++] = &secondary->latency;
+
+	if(n==2)
+	{
+		swap = secondary->latency<as_conf->latency;
+		if(++secondary->probes % NGX_HTTP_AS_SECONDARY_PROBE==0)
+			swap = !swap;
+
+		if(swap)
+		{
+			clusters[1] = as_conf->as;
+			latencies[1] = &as_conf->latency;
+			clusters[0] = secondary->as;
+			latencies[0] = &secondary->latency;
+		}
+	}
+
+	return n;
+}
+
+/* This function probes the cluster of an open as_breaker circuit, with an info request to any node.
+ * A single worker probes the cluster each interval, the first whose timer is due, and the others take the result of its probe once.
+ * The probe waits no longer than NGX_HTTP_AS_BREAKER_PROBE_TIMEOUT, or the interval if shorter, as the worker blocks on it.
+ * A worker which is not connected probes with a client of its own, connected to the default hosts, so recovery is seen without requests.
+ */
+bool ngx_http_as_breaker_probe(ngx_http_as_conf_t *as_conf)
+{
+	ngx_http_as_breaker_sh_t *sh = &((ngx_http_as_breaker_sh_t*)as_conf->breaker_zone->data)[as_conf->breaker_index];
+	ngx_atomic_uint_t next, generation;
+	as_policy_info policy;
+	aerospike *as = NULL;
+	ngx_msec_t now;
+	as_error err;
+	char *res = NULL;
+	bool up;
+
+	now = ngx_http_as_utils_clock();
+	next = sh->next;
+
+	if(now<next || !ngx_atomic_cmp_set(&sh->next, next, now + as_conf->breaker_interval))
+	{
+		generation = sh->generation;
+		if(generation==as_conf->breaker_generation)
+			return false;
+
+		as_conf->breaker_generation = generation;
+		return sh->up;
+	}
+
+	as_policy_info_init(&policy);
+	policy.timeout = (uint32_t)ngx_min(as_conf->breaker_interval, NGX_HTTP_AS_BREAKER_PROBE_TIMEOUT);
+
+	if(as_conf->connected)
+		as = as_conf->as;
+	else if(as_conf->hosts.n==0 || !ngx_http_as_utils_connect_timeout(&as, as_conf->hosts, policy.timeout))
+		as = NULL;
+
+	up = as!=NULL && aerospike_info_any(as, &err, &policy, "status", &res)==AEROSPIKE_OK;
+
+	if(res)
+		free(res);
+
+	if(as!=NULL && as!=as_conf->as)
+	{
+		aerospike_close(as, &err);
+		aerospike_destroy(as);
+	}
+
+	sh->up = up;
+	as_conf->breaker_generation = ngx_atomic_fetch_add(&sh->generation, 1) + 1;
+	return up;
+}
+
+/* This function connects the worker to the default hosts of as_connect, if it is not connected, outside of a request.
+ * A failed connection is tried again after NGX_HTTP_AS_SECONDARY_RECONNECT, so the timers and requests do not block on a cluster which is down.
+ */
+bool ngx_http_as_utils_connect_default(ngx_http_as_conf_t *as_conf)
+{
+	ngx_msec_t now;
+
+	if(as_conf->connected)
+		return true;
+
+	if(as_conf->hosts.n==0)
+		return false;
+
+	now = ngx_http_as_utils_clock();
+	if(now<as_conf->next_connect)
+		return false;
+
+	if(!ngx_http_as_utils_connect(&(as_conf->as), as_conf->hosts))
+	{
+		as_conf->next_connect = now + NGX_HTTP_AS_SECONDARY_RECONNECT;
+		return false;
+	}
+
+	if(as_conf->current_hosts.n==0)
+		as_conf->current_hosts = as_conf->hosts;
+	as_conf->connected = true;
+	return true;
+}
+
+/* This function connects the worker for the handlers of as_get, as_put, as_delete and as_operate_ops,
+ * which take the hosts of as_connect only, so unlike ngx_http_as_operate_connect, no url arguement is parsed.
+ */
+bool ngx_http_as_utils_connect_configured(ngx_http_as_conf_t *as_conf)
+{
+	// the shards are connected when a key first picks them.
+	if(as_conf->shards!=NULL)
+		return true;
+
+	// an open circuit fails the request at once, without connecting or touching the client, and a half open one lets a few through.
+	if(!ngx_http_as_breaker_admit(as_conf))
+		return false;
+
+	if(ngx_http_as_utils_connect_default(as_conf))
+		return true;
+
+	ngx_http_as_breaker_record(as_conf, AEROSPIKE_ERR_CONNECTION);
+	return false;
+}
+
+/* This function sets a bin of a map to the value of another map, for ngx_http_as_write_behind_store. */
+static bool ngx_http_as_write_behind_overlay(const as_val *key, const as_val *value, void *udata)
+{
+	as_map_set((as_map*)udata, as_val_reserve(key), as_val_reserve(value));
+	return true;
+}
+
+/* This function sets the name of a put kept by as_write_behind or as_spool, the namespace, set and key, each ending with '\0'.
+ * data holds 40 + 100 + 1000 bytes, as ngx_http_as_utils_get_key_args sizes them.
+ */
+void ngx_http_as_utils_put_name(u_char *data, char namespace[], char set[], char key[], ngx_str_t *name)
+{
+	name->data = data;
+	name->len = ngx_cpymem(ngx_cpymem(ngx_cpymem(data, namespace, strlen(namespace) + 1), set, strlen(set) + 1), key, strlen(key) + 1) - data;
+}
+
+/* This function returns a map of the bin names of a record to their values, for as_write_behind and as_spool. */
+as_map* ngx_http_as_utils_bins_map(as_record *rec)
+{
+	as_hashmap *bins;
+	as_bin *bin;
+	uint16_t i;
+
+	bins = as_hashmap_new(rec->bins.size);
+	if(bins==NULL)
+		return NULL;
+
+	for(i=0; i<rec->bins.size; i++)
+	{
+		bin = &rec->bins.entries[i];
+		as_map_set((as_map*)bins, (as_val*)as_string_new_strdup(bin->name), as_val_reserve((as_val*)bin->valuep));
+	}
+
+	return (as_map*)bins;
+}
+
+/* This function buffers a put in the as_write_behind zone, as a map of its bins.
+ * It returns false if the zone is full, in which case the put is written at once.
+ */
+bool ngx_http_as_write_behind_add(ngx_http_as_conf_t *as_conf, char namespace[], char set[], char key[], as_record *rec)
+{
+	u_char data[40 + 100 + 1000];
+	ngx_str_t name;
+	as_map *bins;
+	bool stored;
+
+	ngx_http_as_utils_put_name(data, namespace, set, key, &name);
+
+	bins = ngx_http_as_utils_bins_map(rec);
+	if(bins==NULL)
+		return false;
+
+	stored = ngx_http_as_write_behind_store(as_conf, &name, bins, false);
+
+	as_val_destroy(bins);
+	return stored;
+}
+
+/* This function merges the bins of a key with those buffered in the as_write_behind zone, serialized in data,
+ * those of the later put winning, and returns the merged bins serialized in memory of its own, or NULL.
+ * It runs outside of the lock of the zone, on a copy of the buffered bins.
+ */
+static u_char* ngx_http_as_write_behind_merge(as_serializer *ser, u_char *data, size_t size, as_map *bins, bool older, size_t *merged_size)
+{
+	as_buffer buffer;
+	as_val *val = NULL;
+	as_map *buffered, *merged;
+	u_char *p = NULL;
+
+	buffer.data = data;
+	buffer.size = (uint32_t)size;
+	buffer.capacity = buffer.size;
+
+	if(as_serializer_deserialize(ser, &buffer, &val)!=0 || (buffered = as_map_fromval(val))==NULL)
+		goto done;
+
+	// the bins of the put are left as they are, as the merge is done again if the key is written meanwhile.
+	if(older)
+	{
+		merged = (as_map*)as_hashmap_new(as_map_size(bins) + as_map_size(buffered));
+		if(merged==NULL)
+			goto done;
+
+		as_map_foreach(bins, ngx_http_as_write_behind_overlay, merged);
+		as_map_foreach(buffered, ngx_http_as_write_behind_overlay, merged);
+	}
+	else
+	{
+		as_map_foreach(bins, ngx_http_as_write_behind_overlay, buffered);
+		merged = (as_map*)as_val_reserve(buffered);
+	}
+
+	*merged_size = as_serializer_serialize_getsize(ser, (as_val*)merged);
+
+	p = ngx_alloc(*merged_size, ngx_cycle->log);
+	if(p)
+		as_serializer_serialize_presized(ser, (as_val*)merged, p);
+
+	as_val_destroy(merged);
+
+done:
+
+	if(val)
+		as_val_destroy(val);
+
+	return p;
+}
+
+/* This function stores the bins of a key in the as_write_behind zone. If the key is buffered, the bins are merged with it,
+ * those of the later put winning. older is set when the bins are put back by the flusher after a failed write,
+ * in which case they are written first, unless a later put of the key is buffered, and are stored even above the max.
+ * The zone is only locked to look the key up and copy the bins in and out, the bins are serialized and merged outside of it.
+ * If the key is written meanwhile, its bins are merged again.
+ */
+bool ngx_http_as_write_behind_store(ngx_http_as_conf_t *as_conf, ngx_str_t *key, as_map *bins, bool older)
+{
+	ngx_slab_pool_t *shpool = (ngx_slab_pool_t *)as_conf->write_behind_zone->shm.addr;
+	ngx_http_as_write_behind_sh_t *sh = as_conf->write_behind_zone->data;
+	ngx_http_as_write_behind_node_t *node;
+	as_serializer ser;
+	u_char *own, *merged = NULL, *copy, *data, *p;
+	size_t own_size, merged_size = 0, copy_size, size;
+	ngx_uint_t stamp = 0;
+	uint32_t hash;
+	bool stored = false;
+
+	hash = ngx_crc32_short(key->data, key->len);
+	as_msgpack_init(&ser);
+
+	own_size = as_serializer_serialize_getsize(&ser, (as_val*)bins);
+	own = ngx_alloc(own_size, ngx_cycle->log);
+	if(own==NULL)
+	{
+		as_serializer_destroy(&ser);
+		return false;
+	}
+
+	as_serializer_serialize_presized(&ser, (as_val*)bins, own);
+
+	for( ;; )
+	{
+		ngx_shmtx_lock(&shpool->mutex);
+
+		node = (ngx_http_as_write_behind_node_t *)ngx_str_rbtree_lookup(&sh->rbtree, key, hash);
+
+		// the buffered bins are copied out, and merged once the zone is unlocked.
+		if(node && (merged==NULL || node->stamp!=stamp))
+		{
+			copy_size = node->size;
+			copy = ngx_alloc(copy_size, ngx_cycle->log);
+			if(copy)
+				ngx_memcpy(copy, node->bins, copy_size);
+			stamp = node->stamp;
+
+			ngx_shmtx_unlock(&shpool->mutex);
+
+			if(copy==NULL)
+				goto done;
+
+			if(merged)
+				ngx_free(merged);
+
+			merged = ngx_http_as_write_behind_merge(&ser, copy, copy_size, bins, older, &merged_size);
+			ngx_free(copy);
+
+			if(merged==NULL)
+				goto done;
+			continue;
+		}
+
+		if(node)
+		{
+			data = merged;
+			size = merged_size;
+		}
+		else
+		{
+			data = own;
+			size = own_size;
+		}
+
+		if(node==NULL && !older && sh->count>=as_conf->write_behind_max)
+			break;
+
+		p = ngx_slab_alloc_locked(shpool, size);
+		if(p==NULL)
+			break;
+
+		ngx_memcpy(p, data, size);
+
+		if(node)
+		{
+			ngx_slab_free_locked(shpool, node->bins);
+		}
+		else
+		{
+			node = ngx_slab_alloc_locked(shpool, offsetof(ngx_http_as_write_behind_node_t, data) + key->len);
+			if(node==NULL)
+			{
+				ngx_slab_free_locked(shpool, p);
+				break;
+			}
+
+			node->sn.node.key = hash;
+			node->sn.str.data = node->data;
+			node->sn.str.len = key->len;
+			ngx_memcpy(node->data, key->data, key->len);
+
+			ngx_rbtree_insert(&sh->rbtree, &node->sn.node);
+
+			// the queue macros are several statements.
+			if(older)
+			{
+				ngx_queue_insert_head(&sh->queue, &node->queue);
+			}
+			else
+			{
+				ngx_queue_insert_tail(&sh->queue, &node->queue);
+			}
+
+			sh->count++;
+		}
+
+		node->bins = p;
+		node->size = size;
+		node->stamp = ++sh->stamp;
+		stored = true;
+		break;
+	}
+
+	ngx_shmtx_unlock(&shpool->mutex);
+
+done:
+
+	if(merged)
+		ngx_free(merged);
+	ngx_free(own);
+	as_serializer_destroy(&ser);
+
+	return stored;
+}
+
+/* This function puts a put the flusher failed to write back in the as_write_behind zone, to be written by the next flush.
+ * It is only lost if the zone has no memory left for it.
+ */
+static void ngx_http_as_write_behind_put_back(ngx_http_as_conf_t *as_conf, ngx_http_as_write_behind_entry_t *entry, ngx_log_t *log)
+{
+	if(!ngx_http_as_write_behind_store(as_conf, &entry->key, entry->map, true))
+		ngx_log_error(NGX_LOG_ALERT, log, 0, "aerospike write behind lost a put of \"%s\", the zone is full", entry->key.data);
+}
+
+/* This function takes up to NGX_HTTP_AS_WRITE_BEHIND_BATCH of the oldest puts out of the as_write_behind zone,
+ * copying them into the pool, so the zone is locked for no more than the copies.
+ */
+ngx_uint_t ngx_http_as_write_behind_take(ngx_http_as_conf_t *as_conf, ngx_pool_t *pool, ngx_http_as_write_behind_entry_t *entries)
+{
+	ngx_slab_pool_t *shpool = (ngx_slab_pool_t *)as_conf->write_behind_zone->shm.addr;
+	ngx_http_as_write_behind_sh_t *sh = as_conf->write_behind_zone->data;
+	ngx_http_as_write_behind_node_t *node;
+	ngx_http_as_write_behind_entry_t *entry;
+	ngx_queue_t *q;
+	ngx_uint_t n = 0;
+
+	ngx_shmtx_lock(&shpool->mutex);
+
+	while(!ngx_queue_empty(&sh->queue) && n<NGX_HTTP_AS_WRITE_BEHIND_BATCH)
+	{
+		q = ngx_queue_head(&sh->queue);
+		node = ngx_queue_data(q, ngx_http_as_write_behind_node_t, queue);
+
+		entry = &entries[n];
+		entry->key.len = node->sn.str.len;
+		entry->key.data = ngx_pnalloc(pool, node->sn.str.len + node->size);
+		if(entry->key.data==NULL)
+			break;
+
+		as_buffer_init(&entry->bins);
+		entry->bins.data = ngx_cpymem(entry->key.data, node->data, node->sn.str.len);
+		ngx_memcpy(entry->bins.data, node->bins, node->size);
+		entry->bins.size = (uint32_t)node->size;
+		entry->bins.capacity = entry->bins.size;
+		entry->map = NULL;
+		n++;
+
+		ngx_queue_remove(q);
+		ngx_rbtree_delete(&sh->rbtree, &node->sn.node);
+		ngx_slab_free_locked(shpool, node->bins);
+		ngx_slab_free_locked(shpool, node);
+		sh->count--;
+	}
+
+	ngx_shmtx_unlock(&shpool->mutex);
+
+	return n;
+}
+
+/* This function adds the write of a bin of a buffered put to its operations, for ngx_http_as_write_behind_flush. */
+static bool ngx_http_as_write_behind_add_op(const as_val *key, const as_val *value, void *udata)
+{
+	as_string *name = as_string_fromval(key);
+
+	if(name)
+		as_operations_add_write((as_operations*)udata, as_string_get(name), (as_bin_value*)as_val_reserve(value));
+	return true;
+}
+
+/* This function writes a batch of up to NGX_HTTP_AS_WRITE_BEHIND_BATCH of the puts buffered in the as_write_behind zone,
+ * split over the clusters, the cluster of as_connect or the shards of as_shard_group. Each bin of a put is written as is.
+ * A put the cluster did not answer is put back in the zone, to be written by the next flush.
+ * One worker flushes the zone at a time, the others skip their flush, and a flusher which is gone is taken over.
+ * The batches are written synchronously, blocking the worker. It returns true if the batch was full and written,
+ * so more puts may be buffered.
+ */
+bool ngx_http_as_write_behind_flush(ngx_http_as_conf_t *as_conf, ngx_log_t *log)
+{
+	ngx_http_as_write_behind_sh_t *sh = as_conf->write_behind_zone->data;
+	ngx_http_as_write_behind_entry_t *entries, *entry;
+	ngx_uint_t i, j, n, nclusters, failed;
+	ngx_pool_t *pool;
+	aerospike **clusters, *as;
+	as_batch_records *batches;
+	as_batch_write_record *wr;
+	as_batch_record *br;
+	as_serializer ser;
+	as_error err;
+	as_val *val;
+	ngx_atomic_uint_t flusher;
+	as_key key;
+	char *namespace, *set, *value;
+
+	// an open circuit keeps the puts buffered, until the cluster is back, and a half open one lets its trial requests through alone.
+	if(as_conf->shards==NULL && (as_conf->breaker_state!=NGX_HTTP_AS_BREAKER_CLOSED || !ngx_http_as_utils_connect_default(as_conf)))
+		return false;
+
+	// the flush is synchronous, so a flusher with the pid of the worker is one which is gone.
+	flusher = sh->flusher;
+	if(flusher && flusher!=(ngx_atomic_uint_t)ngx_pid && (kill((ngx_pid_t)flusher, 0)==0 || ngx_errno!=NGX_ESRCH))
+		return false;
+
+	if(!ngx_atomic_cmp_set(&sh->flusher, flusher, ngx_pid))
+		return false;
+
+	nclusters = as_conf->shards ? as_conf->shards->nelts : 1;
+	n = 0;
+	failed = 0;
+
+	entries = ngx_alloc(NGX_HTTP_AS_WRITE_BEHIND_BATCH * sizeof(ngx_http_as_write_behind_entry_t)
+		+ nclusters * (sizeof(aerospike*) + sizeof(as_batch_records)), log);
+	if(entries==NULL)
+		goto done;
+
+	batches = (as_batch_records *)(entries + NGX_HTTP_AS_WRITE_BEHIND_BATCH);
+	clusters = (aerospike **)(batches + nclusters);
+
+	as_msgpack_init(&ser);
+
+	pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, log);
+	if(pool==NULL)
+		goto done;
+
+	n = ngx_http_as_write_behind_take(as_conf, pool, entries);
+	if(n==0)
+	{
+		ngx_destroy_pool(pool);
+		goto done;
+	}
+
+	for(j=0; j<nclusters; j++)
+	{
+		clusters[j] = NULL;
+		as_batch_records_init(&batches[j], (uint32_t)n);
+	}
+
+	for(i=0; i<n; i++)
+	{
+		entry = &entries[i];
+		namespace = (char*)entry->key.data;
+		set = namespace + strlen(namespace) + 1;
+		value = set + strlen(set) + 1;
+
+		entry->cluster = nclusters;
+		val = NULL;
+		if(as_serializer_deserialize(&ser, &entry->bins, &val)!=0 || (entry->map = as_map_fromval(val))==NULL)
+		{
+			ngx_log_error(NGX_LOG_ERR, log, 0, "aerospike write behind dropped an invalid put of \"%s\"", value);
+			if(val)
+				as_val_destroy(val);
+			continue;
+		}
+
+		// the put is added to the batch of its cluster.
+		as_key_init_str(&key, namespace, set, value);
+		as = ngx_http_as_utils_cluster(as_conf, &key);
+
+		for(j=0; j<nclusters && clusters[j]!=NULL && clusters[j]!=as; j++);
+
+		if(as==NULL || j==nclusters)
+		{
+			ngx_http_as_write_behind_put_back(as_conf, entry, log);
+			failed++;
+			continue;
+		}
+
+		clusters[j] = as;
+		entry->cluster = j;
+		entry->slot = batches[j].list.size;
+
+		wr = as_batch_write_reserve(&batches[j]);
+		as_key_init_str(&wr->key, namespace, set, value);
+		wr->ops = as_operations_new((uint16_t)as_map_size(entry->map));
+		as_map_foreach(entry->map, ngx_http_as_write_behind_add_op, wr->ops);
+	}
+
+	for(j=0; j<nclusters && clusters[j]!=NULL; j++)
+	{
+		aerospike_batch_write(clusters[j], &err, NULL, &batches[j]);
+
+		for(i=0; i<n; i++)
+		{
+			entry = &entries[i];
+			if(entry->map==NULL || entry->cluster!=j)
+				continue;
+
+			br = as_vector_get(&batches[j].list, entry->slot);
+			if(br->write.result==AEROSPIKE_OK)
+				continue;
+
+			// a put the cluster did not answer is written again, any other error is final.
+			if(ngx_http_as_utils_unavailable(br->write.result) || ngx_http_as_utils_unavailable(err.code))
+			{
+				ngx_http_as_write_behind_put_back(as_conf, entry, log);
+				failed++;
+			}
+			else
+			{
+				ngx_log_error(NGX_LOG_ERR, log, 0, "aerospike write behind failed to write \"%s\", error %d",
+					entry->key.data, br->write.result);
+			}
+		}
+	}
+
+	for(j=0; j<nclusters; j++)
+		as_batch_records_destroy(&batches[j]);
+
+	for(i=0; i<n; i++)
+	{
+		if(entries[i].map)
+			as_val_destroy(entries[i].map);
+	}
+
+	ngx_destroy_pool(pool);
+
+done:
+
+	ngx_atomic_cmp_set(&sh->flusher, ngx_pid, 0);
+
+	if(entries)
+	{
+		as_serializer_destroy(&ser);
+		ngx_free(entries);
+	}
+
+	return n==NGX_HTTP_AS_WRITE_BEHIND_BATCH && failed==0;
+}
+
+/* This function opens the as_spool file of the worker, path/<worker>.spool, and maps it.
+ * The file is locked, as a worker of the previous cycle may still replay it during a reload, and it is opened by the timer once that worker is gone.
+ * Records after the last whole one, as cut by a crash, are dropped.
+ */
+bool ngx_http_as_spool_open(ngx_http_as_spool_t *spool, ngx_log_t *log)
+{
+	u_char name[NGX_MAX_PATH];
+	ngx_http_as_spool_header_t *header;
+	ngx_http_as_spool_record_t *record;
+	ngx_file_info_t fi;
+	uint64_t off, start, end;
+	ngx_fd_t fd;
+	size_t size;
+	u_char *addr;
+
+	ngx_snprintf(name, NGX_MAX_PATH, "%V/%ui.spool%Z", &spool->path, ngx_worker);
+
+	fd = ngx_open_file(name, NGX_FILE_RDWR, NGX_FILE_CREATE_OR_OPEN, NGX_FILE_DEFAULT_ACCESS);
+	if(fd==NGX_INVALID_FILE)
+	{
+		ngx_log_error(NGX_LOG_ALERT, log, ngx_errno, ngx_open_file_n " \"%s\" failed", name);
+		return false;
+	}
+
+	if(ngx_trylock_fd(fd)!=0)
+	{
+		ngx_close_file(fd);
+		return false;
+	}
+
+	// a file larger than the size, of a larger earlier size, is kept whole.
+	if(ngx_fd_info(fd, &fi)==NGX_FILE_ERROR)
+	{
+		ngx_log_error(NGX_LOG_ALERT, log, ngx_errno, ngx_fd_info_n " \"%s\" failed", name);
+		ngx_close_file(fd);
+		return false;
+	}
+
+	size = ngx_max(spool->size, (size_t)ngx_file_size(&fi));
+
+	if((size_t)ngx_file_size(&fi)<size && ftruncate(fd, size)==-1)
+	{
+		ngx_log_error(NGX_LOG_ALERT, log, ngx_errno, "ftruncate() \"%s\" failed", name);
+		ngx_close_file(fd);
+		return false;
+	}
+
+	addr = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if(addr==MAP_FAILED)
+	{
+		ngx_log_error(NGX_LOG_ALERT, log, ngx_errno, "mmap() \"%s\" failed", name);
+		ngx_close_file(fd);
+		return false;
+	}
+
+	header = (ngx_http_as_spool_header_t*)addr;
+	start = sizeof(ngx_http_as_spool_header_t);
+
+	if(header->magic!=NGX_HTTP_AS_SPOOL_MAGIC || header->head<start || header->tail<start
+		|| header->head>size || header->tail>size || header->head % 8 || header->tail % 8)
+	{
+		if(header->magic!=0)
+			ngx_log_error(NGX_LOG_WARN, log, 0, "aerospike spool \"%s\" is invalid, and is emptied", name);
+
+		header->magic = NGX_HTTP_AS_SPOOL_MAGIC;
+		header->head = start;
+		header->tail = start;
+	}
+
+	// the records are checked from the head, wrapping to the start once, up to the tail.
+	off = header->head;
+	while(off!=header->tail)
+	{
+		record = (ngx_http_as_spool_record_t*)(addr + off);
+
+		if(off + sizeof(ngx_http_as_spool_record_t)>size || record->len==NGX_HTTP_AS_SPOOL_WRAP)
+		{
+			if(header->tail>off)
+			{
+				ngx_log_error(NGX_LOG_WARN, log, 0, "aerospike spool \"%s\" is cut at offset %uL", name, off);
+				header->tail = off;
+				break;
+			}
+
+			off = start;
+			continue;
+		}
+
+		end = header->tail>off ? header->tail : size;
+
+		if(end - off<sizeof(ngx_http_as_spool_record_t)
+			|| record->len>end - off - sizeof(ngx_http_as_spool_record_t)
+			|| ngx_crc32_long((u_char*)(record + 1), record->len)!=record->crc)
+		{
+			ngx_log_error(NGX_LOG_WARN, log, 0, "aerospike spool \"%s\" is cut at offset %uL", name, off);
+			header->tail = off;
+			break;
+		}
+
+		off += ngx_align(sizeof(ngx_http_as_spool_record_t) + record->len, 8);
+	}
+
+	if(header->head!=header->tail)
+		ngx_log_error(NGX_LOG_NOTICE, log, 0, "aerospike spool \"%s\" has records to replay from offset %uL", name, header->head);
+
+	spool->fd = fd;
+	spool->addr = addr;
+	spool->size = size;
+	return true;
+}
+
+/* This function checks if an as_spool has puts to replay. */
+bool ngx_http_as_spool_pending(ngx_http_as_spool_t *spool)
+{
+	ngx_http_as_spool_header_t *header = (ngx_http_as_spool_header_t*)spool->addr;
+
+	return header!=NULL && header->head!=header->tail;
+}
+
+/* This function appends a put to the as_spool of the worker, as a map of its bins.
+ * It returns false if the spool is not open or is full, in which case the put fails.
+ */
+bool ngx_http_as_spool_put(ngx_http_as_conf_t *as_conf, char namespace[], char set[], char key[], as_record *rec)
+{
+	u_char data[40 + 100 + 1000];
+	ngx_str_t name;
+	as_map *bins;
+	bool stored;
+
+	if(as_conf->spool->addr==NULL)
+		return false;
+
+	ngx_http_as_utils_put_name(data, namespace, set, key, &name);
+
+	bins = ngx_http_as_utils_bins_map(rec);
+	if(bins==NULL)
+		return false;
+
+	stored = ngx_http_as_spool_append(as_conf->spool, &name, bins);
+
+	as_val_destroy(bins);
+	return stored;
+}
+
+/* This function appends a record of the name and bins of a put at the tail of an as_spool.
+ * The record is written before the tail is moved past it, so a crash leaves no half record in the spool.
+ * A record which does not fit before the end of the file wraps to its start, after a record marking the wrap,
+ * if the records replayed left room for it there. Nothing is moved, so a crash at any point leaves the spool whole.
+ * An empty spool starts again at the front of the file, so it takes any record which fits in the file.
+ * With fsync=always, it returns false if the record or the header could not be synced, and the put is then not taken.
+ */
+bool ngx_http_as_spool_append(ngx_http_as_spool_t *spool, ngx_str_t *name, as_map *bins)
+{
+	ngx_http_as_spool_header_t *header = (ngx_http_as_spool_header_t*)spool->addr;
+	ngx_http_as_spool_record_t *record, *wrap = NULL;
+	as_serializer ser;
+	uint64_t start, off, total, tail;
+	uint32_t size;
+	u_char *p;
+
+	as_msgpack_init(&ser);
+	size = as_serializer_serialize_getsize(&ser, (as_val*)bins);
+
+	total = ngx_align(sizeof(ngx_http_as_spool_record_t) + name->len + size, 8);
+	start = sizeof(ngx_http_as_spool_header_t);
+
+	// the tail is moved first, after a record marking the wrap at the old one, so a crash in between leaves the spool empty.
+	if(header->head==header->tail && header->head!=start)
+	{
+		if(header->tail + sizeof(ngx_http_as_spool_record_t)<=spool->size)
+		{
+			record = (ngx_http_as_spool_record_t*)(spool->addr + header->tail);
+			record->len = NGX_HTTP_AS_SPOOL_WRAP;
+			record->crc = 0;
+		}
+
+		header->tail = start;
+		header->head = start;
+	}
+
+	tail = header->tail;
+
+	// the tail is kept from reaching the head, which would make the spool look empty.
+	if(tail<header->head)
+	{
+		off = tail;
+		if(off + total>=header->head)
+			goto full;
+	}
+	else if(tail + total<=spool->size)
+	{
+		off = tail;
+	}
+	else
+	{
+		off = start;
+		if(off + total>=header->head)
+			goto full;
+
+		if(tail + sizeof(ngx_http_as_spool_record_t)<=spool->size)
+		{
+			wrap = (ngx_http_as_spool_record_t*)(spool->addr + tail);
+			wrap->len = NGX_HTTP_AS_SPOOL_WRAP;
+			wrap->crc = 0;
+		}
+	}
+
+	record = (ngx_http_as_spool_record_t*)(spool->addr + off);
+	record->len = (uint32_t)(name->len + size);
+
+	p = ngx_cpymem((u_char*)(record + 1), name->data, name->len);
+	as_serializer_serialize_presized(&ser, (as_val*)bins, p);
+	as_serializer_destroy(&ser);
+
+	record->crc = ngx_crc32_long((u_char*)(record + 1), record->len);
+
+	// msync takes the range from the start of the page.
+	if(spool->fsync_always)
+	{
+		p = spool->addr + (off & ~((uint64_t)ngx_pagesize - 1));
+		if(msync(p, (u_char*)record + total - p, MS_SYNC)==-1)
+			return false;
+
+		p = spool->addr + (tail & ~((uint64_t)ngx_pagesize - 1));
+		if(wrap && msync(p, (u_char*)(wrap + 1) - p, MS_SYNC)==-1)
+			return false;
+	}
+
+	header->tail = off + total;
+
+	if(spool->fsync_always && msync(spool->addr, ngx_pagesize, MS_SYNC)==-1)
+	{
+		header->tail = tail;
+		return false;
+	}
+
+	return true;
+
+full:
+
+	as_serializer_destroy(&ser);
+	return false;
+}
+
+/* This function replays the puts of an as_spool in order, up to its rate, once the circuit of the cluster is closed.
+ * A put the cluster does not answer stops the replay, to be tried again by the next one, and any other error drops it.
+ */
+void ngx_http_as_spool_replay(ngx_http_as_conf_t *as_conf, ngx_log_t *log)
+{
+	ngx_http_as_spool_t *spool = as_conf->spool;
+	ngx_http_as_spool_header_t *header = (ngx_http_as_spool_header_t*)spool->addr;
+	ngx_http_as_spool_record_t *record;
+	as_operations ops;
+	as_serializer ser;
+	as_buffer buffer;
+	as_error err;
+	as_map *map;
+	as_val *val;
+	as_key key;
+	aerospike *as;
+	char *namespace, *set, *value;
+	ngx_uint_t n, budget;
+
+	if(header->head==header->tail)
+		return;
+
+	// a cluster which is down is connected to again every NGX_HTTP_AS_SECONDARY_RECONNECT, not on every tick.
+	if(as_conf->shards==NULL && (as_conf->breaker_state!=NGX_HTTP_AS_BREAKER_CLOSED || !ngx_http_as_utils_connect_default(as_conf)))
+		return;
+
+	budget = ngx_max(spool->rate * NGX_HTTP_AS_SPOOL_TICK / 1000, 1);
+
+	as_msgpack_init(&ser);
+
+	for(n=0; n<budget && header->head!=header->tail; n++)
+	{
+		record = (ngx_http_as_spool_record_t*)(spool->addr + header->head);
+
+		// the records past the end of the file wrap to its start.
+		if(header->head + sizeof(ngx_http_as_spool_record_t)>spool->size || record->len==NGX_HTTP_AS_SPOOL_WRAP)
+		{
+			header->head = sizeof(ngx_http_as_spool_header_t);
+			continue;
+		}
+
+		namespace = (char*)(record + 1);
+		set = namespace + strlen(namespace) + 1;
+		value = set + strlen(set) + 1;
+
+		as_buffer_init(&buffer);
+		buffer.data = (u_char*)value + strlen(value) + 1;
+		buffer.size = record->len - (uint32_t)(buffer.data - (u_char*)(record + 1));
+		buffer.capacity = buffer.size;
+
+		val = NULL;
+		if(as_serializer_deserialize(&ser, &buffer, &val)!=0 || (map = as_map_fromval(val))==NULL)
+		{
+			ngx_log_error(NGX_LOG_ERR, log, 0, "aerospike spool dropped an invalid put of \"%s\"", value);
+			if(val)
+				as_val_destroy(val);
+
+			header->head += ngx_align(sizeof(ngx_http_as_spool_record_t) + record->len, 8);
+			continue;
+		}
+
+		as_key_init_str(&key, namespace, set, value);
+		as = ngx_http_as_utils_cluster(as_conf, &key);
+		if(as==NULL)
+		{
+			as_val_destroy(val);
+			break;
+		}
+
+		as_operations_inita(&ops, (uint16_t)as_map_size(map));
+		as_map_foreach(map, ngx_http_as_write_behind_add_op, &ops);
+
+		aerospike_key_operate(as, &err, NULL, &key, &ops, NULL);
+
+		as_operations_destroy(&ops);
+		as_val_destroy(val);
+
+		if(err.code!=AEROSPIKE_OK)
+		{
+			if(ngx_http_as_utils_unavailable(err.code))
+				break;
+
+			ngx_log_error(NGX_LOG_ERR, log, 0, "aerospike spool failed to write \"%s\", error %d", value, err.code);
+		}
+
+		header->head += ngx_align(sizeof(ngx_http_as_spool_record_t) + record->len, 8);
+	}
+
+	as_serializer_destroy(&ser);
+}
+
+/* This function allocates the batch of an as_import request, with a batch of writes for each cluster, and its first pool. */
+bool ngx_http_as_import_init(ngx_http_as_import_t *import)
+{
+	ngx_http_request_t *r = import->r;
+	ngx_http_as_conf_t *as_conf = import->as_conf;
+	as_batch_records *batches;
+	ngx_uint_t j;
+
+	import->nclusters = as_conf->shards ? as_conf->shards->nelts : 1;
+
+	import->entries = ngx_palloc(r->pool, import->batch * sizeof(ngx_http_as_import_entry_t));
+	import->clusters = ngx_pcalloc(r->pool, import->nclusters * sizeof(aerospike*));
+	batches = ngx_palloc(r->pool, import->nclusters * sizeof(as_batch_records));
+
+	if(import->entries==NULL || import->clusters==NULL || batches==NULL)
+		return false;
+
+	if(ngx_array_init(&import->errors, r->pool, 8, sizeof(ngx_http_as_import_error_t))!=NGX_OK)
+		return false;
+
+	import->pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, r->connection->log);
+	if(import->pool==NULL)
+		return false;
+
+	for(j=0; j<import->nclusters; j++)
+		as_batch_records_init(&batches[j], (uint32_t)import->batch);
+
+	import->batches = batches;
+
+	ngx_http_as_import_reset(import);
+	return true;
+}
+
+/* This function starts the next record of an as_import body, with the parser of its format. */
+void ngx_http_as_import_reset(ngx_http_as_import_t *import)
+{
+	ngx_http_as_builder_init(&import->builder, import->pool, import->as_conf, import->schema);
+
+	if(import->msgpack)
+	{
+		ngx_http_as_msgpack_init(&import->mp, import->r, &import->builder);
+		import->mp.pool = import->pool;
+		import->mp.stream = true;
+	}
+	else
+	{
+		ngx_http_as_json_init(&import->json, import->pool, &import->builder);
+	}
+}
+
+/* This function parses a buffer of an as_import body. It is copied into the pool first, as nginx reads the next buffer over it.
+ * A record of ndjson ends with its line, and an invalid one is skipped to the next line.
+ * An invalid msgpack record stops the import, as the records following it cannot be found.
+ * Once the batch is full it is written, which holds up reading the body. It is also written once the records parsed,
+ * including those which failed, fill a batch, or the pool holds NGX_HTTP_AS_IMPORT_POOL_SIZE bytes, so the pool
+ * is replaced before it grows with the body.
+ */
+void ngx_http_as_import_parse(ngx_http_as_import_t *import, u_char *p, u_char *last)
+{
+	u_char *chunk, *nl;
+
+	if(import->stopped || p==last)
+		return;
+
+	chunk = ngx_pnalloc(import->pool, last - p);
+	if(chunk==NULL)
+	{
+		ngx_http_as_import_error(import, import->records + 1, AEROSPIKE_ERR_CLIENT, "OUT_OF_MEMORY");
+		import->stopped = true;
+		return;
+	}
+
+	import->pooled += last - p;
+	last = ngx_cpymem(chunk, p, last - p);
+	p = chunk;
+
+	while(p<last && !import->stopped)
+	{
+		if(import->msgpack)
+		{
+			switch(ngx_http_as_msgpack_parse(&import->mp, p, last))
+			{
+				case NGX_AGAIN:
+					return;
+
+				case NGX_ERROR:
+					import->records++;
+					ngx_http_as_import_error(import, import->records, AEROSPIKE_ERR_CLIENT,
+						import->builder.error ? import->builder.error : "INVALID_MSGPACK");
+					ngx_http_as_builder_destroy(&import->builder);
+					import->stopped = true;
+					return;
+			}
+
+			p = import->mp.end;
+			import->records++;
+			ngx_http_as_import_record(import);
+			ngx_http_as_import_reset(import);
+		}
+		else
+		{
+			nl = ngx_strlchr(p, last, '\n');
+
+			if(!import->skip && ngx_http_as_json_parse(&import->json, p, nl ? nl : last)==NGX_ERROR)
+			{
+				import->records++;
+				ngx_http_as_import_error(import, import->records, AEROSPIKE_ERR_CLIENT,
+					import->builder.error ? import->builder.error : "INVALID_JSON");
+				ngx_http_as_builder_destroy(&import->builder);
+				import->skip = true;
+			}
+
+			if(nl==NULL)
+				return;
+
+			p = nl + 1;
+			ngx_http_as_import_line(import);
+		}
+
+		if(import->count==import->batch || import->records - import->rotated>=import->batch
+			|| import->pooled>=NGX_HTTP_AS_IMPORT_POOL_SIZE)
+		{
+			if(import->count)
+				ngx_http_as_import_flush(import);
+
+			if(!ngx_http_as_import_rotate(import, &p, &last))
+			{
+				ngx_http_as_import_error(import, import->records + 1, AEROSPIKE_ERR_CLIENT, "OUT_OF_MEMORY");
+				import->stopped = true;
+			}
+		}
+	}
+}
+
+/* This function ends a line of an ndjson body. The record of the line is added to the batch, and a blank line is skipped. */
+void ngx_http_as_import_line(ngx_http_as_import_t *import)
+{
+	// the error of a skipped line is counted already.
+	if(import->skip)
+	{
+		import->skip = false;
+		ngx_http_as_import_reset(import);
+		return;
+	}
+
+	if(import->json.state==NGX_HTTP_AS_JSON_VALUE && import->builder.depth==0)
+		return;
+
+	import->records++;
+
+	if(ngx_http_as_json_finish(&import->json)==NGX_OK)
+	{
+		ngx_http_as_import_record(import);
+	}
+	else
+	{
+		ngx_http_as_import_error(import, import->records, AEROSPIKE_ERR_CLIENT,
+			import->builder.error ? import->builder.error : "INVALID_JSON");
+		ngx_http_as_builder_destroy(&import->builder);
+	}
+
+	ngx_http_as_import_reset(import);
+}
+
+/* This function adds the record just parsed to the batch of its cluster.
+ * The key is the value of the key bin, a string or an integer, and each bin is written as is.
+ */
+void ngx_http_as_import_record(ngx_http_as_import_t *import)
+{
+	ngx_http_as_import_entry_t *entry = &import->entries[import->count];
+	as_batch_write_record *wr;
+	as_string *s;
+	as_val *value;
+	as_key key;
+	as_bin *bin;
+	aerospike *as;
+	char *str = NULL;
+	ngx_uint_t j;
+	uint16_t i;
+
+	if(!ngx_http_as_builder_finish(&import->builder, &entry->rec))
+	{
+		ngx_http_as_import_error(import, import->records, AEROSPIKE_ERR_CLIENT, import->builder.error);
+		ngx_http_as_builder_destroy(&import->builder);
+		return;
+	}
+
+	value = (as_val*)as_record_get(&entry->rec, import->key);
+
+	// a string of the body is not null terminated, so the key is a copy of it.
+	if(value && as_val_type(value)==AS_STRING)
+	{
+		s = (as_string*)value;
+		str = ngx_pnalloc(import->pool, as_string_len(s) + 1);
+		if(str)
+			*ngx_cpymem(str, as_string_get(s), as_string_len(s)) = '\0';
+	}
+
+	if(value==NULL || (as_val_type(value)==AS_STRING && str==NULL) || (as_val_type(value)!=AS_STRING && as_val_type(value)!=AS_INTEGER))
+	{
+		ngx_http_as_import_error(import, import->records, AEROSPIKE_ERR_CLIENT, "INVALID_KEY");
+		as_record_destroy(&entry->rec);
+		return;
+	}
+
+	ngx_http_as_import_key(import, value, str, &key);
+
+	as = ngx_http_as_utils_cluster(import->as_conf, &key);
+	if(as==NULL)
+	{
+		ngx_http_as_import_error(import, import->records, AEROSPIKE_ERR_CLUSTER, "NOT_CONNECTED");
+		as_record_destroy(&entry->rec);
+		return;
+	}
+
+	for(j=0; j<import->nclusters && import->clusters[j]!=NULL && import->clusters[j]!=as; j++);
+
+	import->clusters[j] = as;
+	entry->record = import->records;
+	entry->cluster = j;
+	entry->slot = import->batches[j].list.size;
+
+	wr = as_batch_write_reserve(&import->batches[j]);
+	ngx_http_as_import_key(import, value, str, &wr->key);
+	wr->ops = as_operations_new(entry->rec.bins.size);
+
+	for(i=0; i<entry->rec.bins.size; i++)
+	{
+		bin = &entry->rec.bins.entries[i];
+		as_operations_add_write(wr->ops, bin->name, (as_bin_value*)as_val_reserve((as_val*)bin->valuep));
+	}
+
+	import->count++;
+}
+
+/* This function sets the key of a record of an as_import body, from the value of its key bin, or str, its null terminated copy. */
+void ngx_http_as_import_key(ngx_http_as_import_t *import, as_val *value, char *str, as_key *key)
+{
+	if(str)
+		as_key_init_strp(key, import->namespace, import->set, str, false);
+	else
+		as_key_init_int64(key, import->namespace, import->set, as_integer_get((as_integer*)value));
+}
+
+/* This function writes the batch of an as_import request, with a batch write to each cluster, and counts the records written and failed. */
+void ngx_http_as_import_flush(ngx_http_as_import_t *import)
+{
+	ngx_http_as_import_entry_t *entry;
+	as_batch_record *br;
+	as_status code;
+	as_error err;
+	ngx_uint_t i, j;
+	bool overloaded = false;
+
+	ngx_http_as_limit_begin(import->r);
+
+	for(j=0; j<import->nclusters && import->clusters[j]!=NULL; j++)
+	{
+		aerospike_batch_write(import->clusters[j], &err, NULL, &import->batches[j]);
+
+		ngx_http_as_breaker_record(import->as_conf, err.code);
+
+		if(err.code==AEROSPIKE_ERR_TIMEOUT || err.code==AEROSPIKE_ERR_DEVICE_OVERLOAD)
+			overloaded = true;
+
+		for(i=0; i<import->count; i++)
+		{
+			entry = &import->entries[i];
+			if(entry->cluster!=j)
+				continue;
+
+			// each record has its result, unless the whole batch failed.
+			br = as_vector_get(&import->batches[j].list, entry->slot);
+			code = (err.code==AEROSPIKE_OK || err.code==AEROSPIKE_BATCH_FAILED) ? br->write.result : err.code;
+
+			if(code==AEROSPIKE_OK)
+				import->written++;
+			else
+				ngx_http_as_import_error(import, entry->record, code, as_error_string(code));
+		}
+	}
+
+	for(j=0; j<import->nclusters; j++)
+	{
+		as_batch_records_destroy(&import->batches[j]);
+		as_batch_records_init(&import->batches[j], (uint32_t)import->batch);
+		import->clusters[j] = NULL;
+	}
+
+	for(i=0; i<import->count; i++)
+		as_record_destroy(&import->entries[i].rec);
+
+	import->count = 0;
+
+	// the slot of as_limit is held for the first batch only, as the batches are then paced by the client.
+	ngx_http_as_limit_end(import->r, overloaded);
+}
+
+/* This function replaces the pool of an as_import request once its batch is written,
+ * moving the rest of the buffer being parsed, from p to last, into the new pool.
+ * It is only called between two records, so no value of the record being parsed is in the pool.
+ */
+bool ngx_http_as_import_rotate(ngx_http_as_import_t *import, u_char **p, u_char **last)
+{
+	ngx_pool_t *pool;
+	u_char *rest = NULL;
+
+	pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, import->r->connection->log);
+	if(pool==NULL)
+		return false;
+
+	if(*p<*last)
+	{
+		rest = ngx_pnalloc(pool, *last - *p);
+		if(rest==NULL)
+		{
+			ngx_destroy_pool(pool);
+			return false;
+		}
+
+		*last = ngx_cpymem(rest, *p, *last - *p);
+		*p = rest;
+	}
+
+	ngx_destroy_pool(import->pool);
+	import->pool = pool;
+	import->pooled = *last - *p;
+	import->rotated = import->records;
+
+	ngx_http_as_import_reset(import);
+	return true;
+}
+
+/* This function is called at the end of an as_import body. It ends its last line, which may have no newline, and writes the last batch. */
+void ngx_http_as_import_finish(ngx_http_as_import_t *import)
+{
+	if(!import->msgpack)
+	{
+		ngx_http_as_import_line(import);
+	}
+	else if(!import->stopped && (import->mp.state!=NGX_HTTP_AS_MSGPACK_TYPE || import->mp.depth>0))
+	{
+		// the body ends within a record.
+		import->records++;
+		ngx_http_as_import_error(import, import->records, AEROSPIKE_ERR_CLIENT, "INVALID_MSGPACK");
+		ngx_http_as_builder_destroy(&import->builder);
+	}
+
+	if(import->count)
+		ngx_http_as_import_flush(import);
+}
+
+/* This function counts a record of an as_import body which failed, and keeps its error for the summary, up to NGX_HTTP_AS_IMPORT_MAX_ERRORS of them. */
+void ngx_http_as_import_error(ngx_http_as_import_t *import, ngx_uint_t record, as_status code, const char *message)
+{
+	ngx_http_as_import_error_t *error;
+
+	import->failed++;
+
+	if(import->errors.nelts>=NGX_HTTP_AS_IMPORT_MAX_ERRORS)
+		return;
+
+	error = ngx_array_push(&import->errors);
+	if(error==NULL)
+		return;
+
+	error->record = record;
+	error->code = code;
+	error->message = message ? message : "";
+}
+
+/* This function writes the summary of an as_import request, the number of records in the body, written and failed,
+ * and the errors of the first records which failed.
+ */
+void ngx_http_as_import_summary(ngx_http_as_import_t *import, ngx_http_as_response_t *response)
+{
+	ngx_http_as_import_error_t *error = import->errors.elts;
+	ngx_uint_t i;
+
+	if(response->msgpack)
+	{
+		ngx_http_as_msgpack_write_map(response, 4);
+		ngx_http_as_msgpack_write_str(response, (u_char*)"Records", strlen("Records"));
+		ngx_http_as_msgpack_write_integer(response, import->records);
+		ngx_http_as_msgpack_write_str(response, (u_char*)"Written", strlen("Written"));
+		ngx_http_as_msgpack_write_integer(response, import->written);
+		ngx_http_as_msgpack_write_str(response, (u_char*)"Failed", strlen("Failed"));
+		ngx_http_as_msgpack_write_integer(response, import->failed);
+		ngx_http_as_msgpack_write_str(response, (u_char*)"Errors", strlen("Errors"));
+		ngx_http_as_msgpack_write_array(response, (uint32_t)import->errors.nelts);
+
+		for(i=0; i<import->errors.nelts; i++)
+		{
+			ngx_http_as_msgpack_write_map(response, 3);
+			ngx_http_as_msgpack_write_str(response, (u_char*)"Record", strlen("Record"));
+			ngx_http_as_msgpack_write_integer(response, error[i].record);
+			ngx_http_as_msgpack_write_str(response, (u_char*)"Code", strlen("Code"));
+			ngx_http_as_msgpack_write_integer(response, error[i].code);
+			ngx_http_as_msgpack_write_str(response, (u_char*)"Message", strlen("Message"));
+			ngx_http_as_msgpack_write_str(response, (u_char*)error[i].message, strlen(error[i].message));
+		}
+		return;
+	}
+
+	ngx_http_as_response_begin(response);
+
+	ngx_http_as_response_append(response, "\t\"Records\":", strlen("\t\"Records\":"));
+	ngx_http_as_json_write_integer(response, import->records);
+	ngx_http_as_response_append(response, ",\n\t\"Written\":", strlen(",\n\t\"Written\":"));
+	ngx_http_as_json_write_integer(response, import->written);
+	ngx_http_as_response_append(response, ",\n\t\"Failed\":", strlen(",\n\t\"Failed\":"));
+	ngx_http_as_json_write_integer(response, import->failed);
+	ngx_http_as_response_append(response, ",\n\t\"Errors\":\n\t[\n", strlen(",\n\t\"Errors\":\n\t[\n"));
+
+	for(i=0; i<import->errors.nelts; i++)
+	{
+		ngx_http_as_response_append(response, "\t\t{\"Record\":", strlen("\t\t{\"Record\":"));
+		ngx_http_as_json_write_integer(response, error[i].record);
+		ngx_http_as_response_append(response, ",\"Code\":", strlen(",\"Code\":"));
+		ngx_http_as_json_write_integer(response, error[i].code);
+		ngx_http_as_response_append(response, ",\"Message\":\"", strlen(",\"Message\":\""));
+		ngx_http_as_json_write_escaped(response, (u_char*)error[i].message, strlen(error[i].message));
+
+		if(i + 1<import->errors.nelts)
+			ngx_http_as_response_append(response, "\"},\n", strlen("\"},\n"));
+		else
+			ngx_http_as_response_append(response, "\"}\n", strlen("\"}\n"));
+	}
+
+	ngx_http_as_response_append(response, "\t]\n}", strlen("\t]\n}"));
+}
+
+/* This function starts the scan of the cluster of an op=scan request, or of its next shard, selecting the bins projected.
+ * The scan is paginated: each call of aerospike_scan_partitions returns the next max_records records, and as_scan_is_done tells when none are left.
+ */
+bool ngx_http_as_scan_init(ngx_http_as_scan_t *scan)
+{
+	ngx_uint_t i;
+	char *bin;
+
+	if(scan->initialized)
+		as_scan_destroy(&scan->scan);
+
+	as_scan_init(&scan->scan, scan->namespace, scan->set);
+	scan->initialized = true;
+
+	as_scan_set_paginate(&scan->scan, true);
+
+	if(scan->nbins==0)
+		return true;
+
+	if(!as_scan_select_init(&scan->scan, (uint16_t)scan->nbins))
+		return false;
+
+	for(i=0, bin=scan->bins; i<scan->nbins; i++, bin+=strlen(bin) + 1)
+	{
+		if(!as_scan_select(&scan->scan, bin))
+			return false;
+	}
+
+	return true;
+}
+
+/* This function returns the cluster being scanned by an op=scan request, the shard of as_shard_group, else the cluster of as_connect.
+ * It returns NULL if the worker is not connected to it, or its circuit is open.
+ */
+aerospike* ngx_http_as_scan_cluster(ngx_http_as_scan_t *scan)
+{
+	ngx_http_as_conf_t *as_conf = scan->as_conf;
+	ngx_http_as_cluster_t *shards;
+
+	if(as_conf->shards==NULL)
+		return ngx_http_as_utils_cluster(as_conf, NULL);
+
+	shards = as_conf->shards->elts;
+	return ngx_http_as_cluster_connect(&shards[scan->cluster]) ? shards[scan->cluster].as : NULL;
+}
+
+/* This function writes a record of an op=scan page, called by the client for each record of the page, and with NULL once it is done.
+ * The scan is not concurrent, so the nodes are scanned one after the other, in the thread of the worker.
+ * Once the page reaches NGX_HTTP_AS_SCAN_PAGE_SIZE bytes it is cut short, after the record, which the client counts as sent,
+ * so the next page starts after it.
+ */
+static bool ngx_http_as_scan_callback(const as_val *val, void *udata)
+{
+	ngx_http_as_scan_t *scan = udata;
+	as_record *rec;
+
+	if(val==NULL)
+		return true;
+
+	rec = as_record_fromval(val);
+	if(rec==NULL)
+		return true;
+
+	ngx_http_as_scan_write_record(&scan->page, rec, scan->schema);
+	scan->records++;
+
+	if(scan->page.size>=NGX_HTTP_AS_SCAN_PAGE_SIZE)
+	{
+		scan->full = true;
+		return false;
+	}
+
+	// a page which could not be allocated stops the scan.
+	return !scan->page.error;
+}
+
+/* This function fetches the next page of an op=scan request into its response, with a pool of its own.
+ * Once a cluster has no records left, the scan moves to the next shard, and is done after the last one.
+ * A page failing ends the scan. Once the headers are sent, the error is written as the last record, else it is left in err for the response.
+ * It returns false if the page could not be allocated.
+ */
+bool ngx_http_as_scan_page(ngx_http_as_scan_t *scan, as_error *err)
+{
+	as_partition_filter pf;
+	aerospike *as;
+
+	ngx_memzero(&scan->page, sizeof(ngx_http_as_response_t));
+
+	scan->page.pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, scan->r->connection->log);
+	if(scan->page.pool==NULL)
+		return false;
+
+	scan->page.last = &scan->page.out;
+	scan->page.status = NGX_HTTP_OK;
+	scan->page.msgpack = scan->msgpack;
+
+	as_error_init(err);
+
+	as = ngx_http_as_scan_cluster(scan);
+	if(as==NULL)
+	{
+		err->code = AEROSPIKE_ERR_CLUSTER;
+		ngx_cpystrn((u_char*)err->message, (u_char*)"AEROSPIKE_NOT_CONNECTED", sizeof(err->message));
+	}
+	else
+	{
+		// the scan keeps the status of the partitions of the pages before, so the filter only applies to the first page.
+		as_partition_filter_set_all(&pf);
+		scan->full = false;
+		aerospike_scan_partitions(as, err, &scan->policy, &scan->scan, &pf, ngx_http_as_scan_callback, scan);
+
+		// a page cut short at its size is not an error, the scan goes on with the next page.
+		if(scan->full && !scan->page.error && err->code==AEROSPIKE_ERR_CLIENT_ABORT)
+			as_error_init(err);
+
+		if(as==scan->as_conf->as)
+			ngx_http_as_breaker_record(scan->as_conf, err->code);
+	}
+
+	if(scan->page.error)
+		return false;
+
+	if(err->code!=AEROSPIKE_OK)
+	{
+		scan->done = true;
+
+		if(scan->started)
+			ngx_http_as_scan_write_error(&scan->page, err);
+
+		return !scan->page.error;
+	}
+
+	if(as_scan_is_done(&scan->scan))
+	{
+		if(++scan->cluster==scan->nclusters)
+			scan->done = true;
+		else if(!ngx_http_as_scan_init(scan))
+			return false;
+	}
+
+	return true;
+}
+
+/* This function writes a record of an op=scan request, on a line of its own in json, or as a map in msgpack.
+ * The key is written if it was stored with the record, and the bins in the order of the schema of the set, if it has one.
+ */
+void ngx_http_as_scan_write_record(ngx_http_as_response_t *response, as_record *p_rec, ngx_http_as_schema_t *schema)
+{
+	ngx_http_as_ordered_bin_t *ordered;
+	as_bytes decompressed_bytes;
+	as_string decompressed_str;
+	u_char *decompressed;
+	const as_bin *p_bin;
+	const char *name;
+	as_val *val;
+	size_t len;
+	uint16_t i;
+
+	uint16_t num_bins = as_record_numbins(p_rec);
+	bool has_key = p_rec->key.valuep!=NULL;
+
+	ordered = ngx_http_as_utils_order_bins(p_rec, schema, response->pool);
+	if(ordered==NULL)
+	{
+		response->error = true;
+		return;
+	}
+
+	if(response->msgpack)
+	{
+		ngx_http_as_msgpack_write_map(response, has_key ? 4 : 3);
+
+		if(has_key)
+		{
+			ngx_http_as_msgpack_write_literal(response, "Key");
+			ngx_http_as_msgpack_write_val(response, (as_val*)p_rec->key.valuep);
+		}
+
+		ngx_http_as_msgpack_write_literal(response, "Generation");
+		ngx_http_as_msgpack_write_integer(response, p_rec->gen);
+		ngx_http_as_msgpack_write_literal(response, "Ttl");
+		ngx_http_as_msgpack_write_integer(response, p_rec->ttl);
+		ngx_http_as_msgpack_write_literal(response, "Bins");
+		ngx_http_as_msgpack_write_map(response, num_bins);
+	}
+	else
+	{
+		ngx_http_as_response_append(response, "{", strlen("{"));
+
+		if(has_key)
+		{
+			ngx_http_as_response_append(response, "\"Key\":", strlen("\"Key\":"));
+			ngx_http_as_json_write_val(response, (as_val*)p_rec->key.valuep);
+			ngx_http_as_response_append(response, ",", strlen(","));
+		}
+
+		ngx_http_as_response_append(response, "\"Generation\":", strlen("\"Generation\":"));
+		ngx_http_as_json_write_integer(response, p_rec->gen);
+		ngx_http_as_response_append(response, ",\"Ttl\":", strlen(",\"Ttl\":"));
+		ngx_http_as_json_write_integer(response, (int32_t)p_rec->ttl);
+		ngx_http_as_response_append(response, ",\"Bins\":{", strlen(",\"Bins\":{"));
+	}
+
+	for(i=0; i<num_bins; i++)
+	{
+		p_bin = ordered[i].bin;
+		val = ngx_http_as_utils_get_bin_value(p_bin, &decompressed_str, &decompressed_bytes, &decompressed);
+
+		if(ordered[i].decl)
+		{
+			name = ordered[i].decl->name;
+			len = ordered[i].decl->len;
+		}
+		else
+		{
+			name = as_bin_get_name(p_bin);
+			len = strlen(name);
+		}
+
+		if(response->msgpack)
+		{
+			ngx_http_as_msgpack_write_str(response, (u_char*)name, len);
+			ngx_http_as_msgpack_write_val(response, val);
+		}
+		else
+		{
+			if(i)
+				ngx_http_as_response_append(response, ",", strlen(","));
+
+			ngx_http_as_json_write_string(response, (u_char*)name, len);
+			ngx_http_as_response_append(response, ":", strlen(":"));
+			ngx_http_as_json_write_val(response, val);
+		}
+
+		free(decompressed);
+	}
+
+	if(!response->msgpack)
+		ngx_http_as_response_append(response, "}}\n", strlen("}}\n"));
+}
+
+/* This function writes the error which ended an op=scan request after its headers were sent, as its last record. */
+void ngx_http_as_scan_write_error(ngx_http_as_response_t *response, as_error *err)
+{
+	if(response->msgpack)
+	{
+		ngx_http_as_msgpack_write_map(response, 1);
+		ngx_http_as_msgpack_write_literal(response, "Error");
+		ngx_http_as_msgpack_write_map(response, 2);
+		ngx_http_as_msgpack_write_literal(response, "Code");
+		ngx_http_as_msgpack_write_integer(response, err->code);
+		ngx_http_as_msgpack_write_literal(response, "Message");
+		ngx_http_as_msgpack_write_str(response, (u_char*)err->message, strlen(err->message));
+		return;
+	}
+
+	ngx_http_as_response_append(response, "{\"Error\":{\"Code\":", strlen("{\"Error\":{\"Code\":"));
+	ngx_http_as_json_write_integer(response, err->code);
+	ngx_http_as_response_append(response, ",\"Message\":\"", strlen(",\"Message\":\""));
+	ngx_http_as_json_write_escaped(response, (u_char*)err->message, strlen(err->message));
+	ngx_http_as_response_append(response, "\"}}\n", strlen("\"}}\n"));
+}
+
+/* This function takes a slot of an as_limit zone, if the transactions in flight are below its limit, and adds it to the share of the worker. */
+bool ngx_http_as_limit_acquire(ngx_http_as_limit_sh_t *sh, ngx_http_as_conf_t *as_conf)
+{
+	ngx_http_as_limit_worker_t *worker;
+	ngx_atomic_uint_t inflight, limit;
+
+	if(sh->limit==0)
+		ngx_atomic_cmp_set(&sh->limit, 0, as_conf->limit_max * 1000);
+
+	for( ;; )
+	{
+		inflight = sh->inflight;
+		limit = ngx_max(ngx_min(sh->limit, as_conf->limit_max * 1000), as_conf->limit_min * 1000);
+
+		if(inflight * 1000>=limit)
+			return false;
+
+		if(ngx_atomic_cmp_set(&sh->inflight, inflight, inflight + 1))
+			break;
+	}
+
+	worker = ngx_http_as_limit_worker(sh);
+	if(worker)
+		ngx_atomic_fetch_add(&worker->inflight, 1);
+
+	return true;
+}
+
+/* This function gives back a slot of an as_limit zone, and adapts the limit to the transaction, additive increase and multiplicative decrease.
+ * A transaction within the latency grows the limit by 1/limit, so by one once as many transactions as the limit are done,
+ * and a slower or overloaded one shrinks it by a tenth. A request which sent no transaction, whose elapsed is unset, leaves the limit as is.
+ */
+void ngx_http_as_limit_release(ngx_http_as_limit_sh_t *sh, ngx_http_as_conf_t *as_conf, ngx_msec_t elapsed, bool overloaded)
+{
+	ngx_http_as_limit_worker_t *worker;
+	ngx_atomic_uint_t limit, next;
+
+	worker = ngx_http_as_limit_worker(sh);
+	if(worker && worker->inflight>0)
+		ngx_atomic_fetch_add(&worker->inflight, -1);
+
+	ngx_atomic_fetch_add(&sh->inflight, -1);
+	ngx_atomic_fetch_add(&sh->released, 1);
+
+	if(elapsed==NGX_CONF_UNSET_MSEC && !overloaded)
+		return;
+
+	do
+	{
+		limit = sh->limit;
+
+		if(overloaded || elapsed>as_conf->limit_latency)
+			next = ngx_max(limit - limit / 10, as_conf->limit_min * 1000);
+		else
+			next = ngx_min(limit + 1000 * 1000 / ngx_max(limit, 1000), as_conf->limit_max * 1000);
+	}
+	while(next!=limit && !ngx_atomic_cmp_set(&sh->limit, limit, next));
+}
+
+/* This function returns the share of the slots of an as_limit zone of the worker, which it takes on its first slot.
+ * It returns NULL if every share is taken, in which case the slots of the worker are only counted in the sum.
+ */
+ngx_http_as_limit_worker_t* ngx_http_as_limit_worker(ngx_http_as_limit_sh_t *sh)
+{
+	ngx_uint_t i;
+
+	for(i=0; i<NGX_HTTP_AS_LIMIT_WORKERS; i++)
+	{
+		if(sh->workers[i].pid==(ngx_atomic_uint_t)ngx_pid)
+			return &sh->workers[i];
+	}
+
+	for(i=0; i<NGX_HTTP_AS_LIMIT_WORKERS; i++)
+	{
+		if(sh->workers[i].pid==0 && ngx_atomic_cmp_set(&sh->workers[i].pid, 0, ngx_pid))
+			return &sh->workers[i];
+	}
+
+	return NULL;
+}
+
+/* This function gives back the slots of an as_limit zone held by the workers which are gone, so a worker which crashed does not keep them.
+ * The zone is kept across reloads, so they would be lost for good otherwise. It is called as a worker starts,
+ * so a share with its own pid is of a worker which is gone too. A share is taken back by one worker, which marks it with the pid 1.
+ */
+void ngx_http_as_limit_reclaim(ngx_http_as_limit_sh_t *sh, ngx_log_t *log)
+{
+	ngx_atomic_uint_t pid, inflight;
+	ngx_uint_t i;
+
+	for(i=0; i<NGX_HTTP_AS_LIMIT_WORKERS; i++)
+	{
+		pid = sh->workers[i].pid;
+		if(pid==0 || pid==1)
+			continue;
+
+		if(pid!=(ngx_atomic_uint_t)ngx_pid && (kill((ngx_pid_t)pid, 0)==0 || ngx_errno!=NGX_ESRCH))
+			continue;
+
+		if(!ngx_atomic_cmp_set(&sh->workers[i].pid, pid, 1))
+			continue;
+
+		inflight = sh->workers[i].inflight;
+		sh->workers[i].inflight = 0;
+
+		if(inflight)
+		{
+			ngx_log_error(NGX_LOG_NOTICE, log, 0, "as_limit: %uA slots of the gone worker %uA given back", inflight, pid);
+			ngx_atomic_fetch_add(&sh->inflight, -(ngx_atomic_int_t)inflight);
+			ngx_atomic_fetch_add(&sh->released, inflight);
+		}
+
+		sh->workers[i].pid = 0;
+	}
+}
+
+/* This function marks the start of the first transaction of a request holding a slot of as_limit. */
+void ngx_http_as_limit_begin(ngx_http_request_t *r)
+{
+	ngx_http_as_ctx_t *ctx = ngx_http_get_module_ctx(r->main, ngx_http_as_module);
+
+	if(ctx && ctx->limit_slot && !ctx->limit_slot->released && ctx->limit_start==0)
+		ctx->limit_start = ngx_http_as_utils_clock();
+}
+
+/* This function gives back the slot of as_limit of a request once its transactions are done, before its response is sent to the client,
+ * and wakes up a request of the worker waiting for a slot of the zone. The limit is adapted to the time since the first transaction,
+ * so the time the request spends reading its body or sending its response is not counted.
+ * A scan or an import gives it back after its first page or batch, as the rest of it is paced by the client.
+ */
+void ngx_http_as_limit_end(ngx_http_request_t *r, bool overloaded)
+{
+	ngx_http_as_ctx_t *ctx = ngx_http_get_module_ctx(r->main, ngx_http_as_module);
+	ngx_http_as_limit_slot_t *slot;
+	ngx_msec_t elapsed;
+
+	if(ctx==NULL || ctx->limit_slot==NULL || ctx->limit_slot->released)
+		return;
+
+	slot = ctx->limit_slot;
+	slot->released = true;
+
+	elapsed = ctx->limit_start ? ngx_http_as_utils_clock() - ctx->limit_start : NGX_CONF_UNSET_MSEC;
+
+	ngx_http_as_limit_release(slot->as_conf->limit_zone->data, slot->as_conf, elapsed, overloaded);
+	ngx_http_as_limit_wake(ngx_http_get_module_main_conf(r, ngx_http_as_module), slot->as_conf->limit_zone, 1);
+}
+
+/* This function checks whether the client accepts a msgpack response, from the media ranges of its Accept headers.
+ * json is matched by the most specific of application/json, any application type and any type, and msgpack by its own types.
+ * msgpack is sent if it is accepted, with a q above 0, and with a q not lower than the one of json.
+ */
+bool ngx_http_as_utils_accepts_msgpack(ngx_http_request_t *r)
+{
+	ngx_list_part_t *part = &r->headers_in.headers.part;
+	ngx_table_elt_t *header = part->elts;
+	ngx_uint_t i, q, level, msgpack_q = 0, json_q = 0, json_level = 0;
+	u_char *p, *last, *end, *semi;
+	ngx_str_t type;
+
+	for(i=0; ; i++)
+	{
+		if(i>=part->nelts)
+		{
+			if(part->next==NULL)
+				break;
+
+			part = part->next;
+			header = part->elts;
+			i = 0;
+		}
+
+		if(header[i].key.len!=sizeof("Accept")-1
+			|| ngx_strncasecmp(header[i].key.data, (u_char*)"Accept", sizeof("Accept")-1)!=0)
+			continue;
+
+		last = header[i].value.data + header[i].value.len;
+
+		// each media range is separated by a comma, and its parameters by semicolons.
+		for(p=header[i].value.data; p<last; p=end + 1)
+		{
+			end = ngx_strlchr(p, last, ',');
+			if(end==NULL)
+				end = last;
+
+			semi = ngx_strlchr(p, end, ';');
+			type = ngx_http_as_utils_media_type(p, semi ? semi : end);
+			q = ngx_http_as_utils_accept_q(semi, end);
+
+			if(ngx_http_as_utils_is_msgpack_type(type))
+			{
+				msgpack_q = ngx_max(msgpack_q, q);
+				continue;
+			}
+
+			if(type.len==sizeof("application/json")-1 && ngx_strncasecmp(type.data, (u_char*)"application/json", type.len)==0)
+				level = 3;
+			else if(type.len==sizeof("application/*")-1 && ngx_strncasecmp(type.data, (u_char*)"application/*", type.len)==0)
+				level = 2;
+			else if(type.len==sizeof("*/*")-1 && ngx_strncmp(type.data, "*/*", type.len)==0)
+				level = 1;
+			else
+				continue;
+
+			if(level>json_level)
+			{
+				json_level = level;
+				json_q = q;
+			}
+			else if(level==json_level)
+				json_q = ngx_max(json_q, q);
+		}
+	}
+
+	return msgpack_q>0 && msgpack_q>=json_q;
+}
+
+/* This function returns the media type of a Content-Type value or of an Accept range, from p to last, without the blanks around it.
+ * last is the end of the value, or the semicolon starting its parameters.
+ */
+ngx_str_t ngx_http_as_utils_media_type(u_char *p, u_char *last)
+{
+	ngx_str_t type;
+
+	while(p<last && (*p==' ' || *p=='\t'))
+		p++;
+
+	while(last>p && (last[-1]==' ' || last[-1]=='\t'))
+		last--;
+
+	type.data = p;
+	type.len = last - p;
+
+	// the parameters of a Content-Type are cut, if the caller did not.
+	for(p=type.data; p<last; p++)
+	{
+		if(*p==';' || *p==' ' || *p=='\t')
+		{
+			type.len = p - type.data;
+			break;
+		}
+	}
+
+	return type;
+}
+
+/* This function returns the q value of an Accept range in thousandths, from its parameters, from p, the first semicolon, to last.
+ * A range without a q value, or with an invalid one, has a q of 1.
+ */
+ngx_uint_t ngx_http_as_utils_accept_q(u_char *p, u_char *last)
+{
+	ngx_uint_t q, scale;
+
+	for( ; p!=NULL && p<last; p=ngx_strlchr(p + 1, last, ';'))
+	{
+		p++;
+
+		while(p<last && (*p==' ' || *p=='\t'))
+			p++;
+
+		if(last - p<3 || (*p!='q' && *p!='Q') || p[1]!='=')
+			continue;
+
+		p += 2;
+
+		if(*p=='1')
+			return 1000;
+
+		if(*p!='0')
+			return 1000;
+
+		q = 0;
+		scale = 100;
+
+		if(++p<last && *p=='.')
+		{
+			for(p++; p<last && *p>='0' && *p<='9' && scale; p++, scale/=10)
+				q += (*p - '0') * scale;
+		}
+
+		return q;
+	}
+
+	return 1000;
+}
+
+/* This function checks whether a media type is the one of msgpack. */
+bool ngx_http_as_utils_is_msgpack_type(ngx_str_t type)
+{
+	static ngx_str_t types[] = { ngx_string("application/msgpack"), ngx_string("application/x-msgpack") };
+	ngx_uint_t i;
+
+	for(i=0; i<sizeof(types)/sizeof(types[0]); i++)
+	{
+		if(type.len==types[i].len && ngx_strncasecmp(type.data, types[i].data, types[i].len)==0)
+			return true;
+	}
+
+	return false;
+}
+
+void ngx_http_as_operate_get(ngx_http_request_t *r, ngx_http_as_conf_t *as_conf, ngx_http_as_response_t *response)
+{
+	aerospike *clusters[2];
+	ngx_uint_t *latencies[2];
+	ngx_uint_t i, n;
+
+	char key[1000], namespace[40], set[100];
+
+	if(!ngx_http_as_utils_get_key_args(r, as_conf, namespace, set, key))
+	{
+		ngx_http_as_response_canned(response, NGX_HTTP_AS_INVALID_KEY);
+		return;
+	}
+
+	as_key get_key;
+	as_key_init_str(&get_key, namespace, set, key);
+
+	n = ngx_http_as_utils_read_clusters(as_conf, &get_key, clusters, latencies);
+	if(n==0)
+	{
+		ngx_http_as_not_connected(response, as_conf);
+		return;
+	}
+
+	aerospike *as = clusters[0];
+
+	as_policy_read policy = as->config.policies.read;
+	if(!ngx_http_as_utils_set_policy(r, as_conf, &policy.base))
+	{
+		ngx_http_as_response_canned(response, NGX_HTTP_AS_DEADLINE_EXCEEDED);
+		return;
+	}
+
+	as_error err;
+	as_record* p_rec = NULL;
+
+	as_policy_read shortened;
+	ngx_http_as_retry_t retry;
+	ngx_msec_t start = 0, elapsed, sent, took;
+	bool replica;
+
+	for(i=0; i<n; i++)
+	{
+		as = clusters[i];
+		sent = ngx_http_as_utils_clock();
+
+		ngx_http_as_utils_retry_init(&retry, &policy.base);
+
+		do
+		{
+			shortened = policy;
+			replica = ngx_http_as_utils_arm_replica_retry(as_conf, &shortened);
+
+			if(replica)
+				start = ngx_http_as_utils_clock();
+
+			// Read the (whole) test record from the database.
+			aerospike_key_get(as, &err, replica ? &shortened : &policy, &get_key, &p_rec);
+
+			if(replica)
+			{
+				elapsed = ngx_http_as_utils_clock() - start;
+
+				// a read which took longer than the timeout was tried again, which is taken from the budget.
+				if(elapsed>=as_conf->replica_timeout)
+					as_conf->replica_tokens -= ngx_min(as_conf->replica_tokens, 100);
+
+				// every replica was slower than the timeout, the read is done again with the full socket timeout, in the time left.
+				if(err.code==AEROSPIKE_ERR_TIMEOUT && (policy.base.total_timeout==0 || policy.base.total_timeout>elapsed))
+				{
+					as_policy_read rest = policy;
+
+					if(rest.base.total_timeout!=0)
+						rest.base.total_timeout -= elapsed;
+
+					aerospike_key_get(as, &err, &rest, &get_key, &p_rec);
+				}
+			}
+		}
+		while(ngx_http_as_utils_retry(as_conf, &retry, &policy.base, err.code, true));
+
+		took = ngx_http_as_utils_clock() - sent;
+		*latencies[i] = *latencies[i] - (*latencies[i] >> 3) + took;
+
+		if(as==as_conf->as)
+			ngx_http_as_breaker_record(as_conf, err.code);
+
+		// a read the cluster did not answer is sent to the other one, in the time left.
+		if(!ngx_http_as_utils_unavailable(err.code))
+			break;
+
+		if(policy.base.total_timeout!=0)
+		{
+			if(policy.base.total_timeout<=took)
+				break;
+			policy.base.total_timeout -= took;
+		}
+
+		if(n==1 && as==as_conf->as && as_conf->secondary!=NULL && ngx_http_as_cluster_connect(as_conf->secondary))
+		{
+			clusters[n] = as_conf->secondary->as;
+			latencies[n++] = &as_conf->secondary->latency;
+		}
+	}
+
+	if(ngx_http_as_response_status(response, err.code))
+	{
+		// Starting the json formatted string.
+		ngx_http_as_response_begin(response);
+
+		if(err.code!=AEROSPIKE_OK)
+		{
+			ngx_http_as_utils_dump_error(err, response, "");
+		}
+		else
+		{
+			ngx_http_as_utils_dump_error(err, response, ",");
+			ngx_http_as_utils_dump_record(p_rec, err, ngx_http_as_utils_find_schema(r, set), response);
+		}
+	}
+
+	if(p_rec)
+		as_record_destroy(p_rec);
+}
+
+/* This function reads the records of the keys arguement, separated by commas, with a batch read per cluster,
+ * which with as_shard_group is a batch per shard. A key can therefore not hold a comma.
+ * The records are sent in the order of the keys, as op=scan sends them, a line each in json or a map each in msgpack.
+ * A key which was not read is sent as the error of its record, so the status is 200 unless the request itself is invalid.
+ */
+void ngx_http_as_operate_mget(ngx_http_request_t *r, ngx_http_as_conf_t *as_conf, ngx_http_as_response_t *response)
+{
+	as_batch_records batches[NGX_HTTP_AS_BATCH_MAX];
+	aerospike *clusters[NGX_HTTP_AS_BATCH_MAX];
+	as_status codes[NGX_HTTP_AS_BATCH_MAX];
+	char *keys[NGX_HTTP_AS_BATCH_MAX];
+	ngx_uint_t cluster[NGX_HTTP_AS_BATCH_MAX];
+	uint32_t slot[NGX_HTTP_AS_BATCH_MAX];
+	ngx_uint_t i, j, n = 0, nclusters = 0;
+	char arg[NGX_HTTP_AS_BATCH_KEYS], namespace[40], set[100];
+	ngx_http_as_schema_t *schema;
+	as_batch_read_record *br;
+	as_policy_batch policy;
+	as_status code;
+	as_error err;
+	aerospike *as;
+	as_key key;
+	char *p, *comma;
+
+	if(!ngx_http_as_utils_get_template_value(r, as_conf->namespace_template, "ns", namespace, sizeof(namespace))
+		|| namespace[0]=='\0'
+		|| !ngx_http_as_utils_get_template_value(r, as_conf->set_template, "set", set, sizeof(set))
+		|| !ngx_http_as_utils_get_parsed_url_arguement(r->args, "keys", arg, sizeof(arg))
+		|| arg[0]=='\0')
+	{
+		ngx_http_as_response_canned(response, NGX_HTTP_AS_INVALID_BATCH);
+		return;
+	}
+
+	// the keys are split in place, and are read from the arguement until the batches are destroyed.
+	for(p=arg; ; p=comma + 1)
+	{
+		comma = strchr(p, ',');
+		if(comma)
+			*comma = '\0';
+
+		if(*p=='\0' || n==NGX_HTTP_AS_BATCH_MAX)
+		{
+			ngx_http_as_response_canned(response, NGX_HTTP_AS_INVALID_BATCH);
+			return;
+		}
+
+		keys[n++] = p;
+		if(comma==NULL)
+			break;
+	}
+
+	// each key is added to the batch of its cluster, NGX_HTTP_AS_BATCH_MAX being the cluster of a key with none to read it.
+	for(i=0; i<n; i++)
+	{
+		as_key_init_str(&key, namespace, set, keys[i]);
+		as = ngx_http_as_utils_cluster(as_conf, &key);
+		as_key_destroy(&key);
+
+		if(as==NULL)
+		{
+			cluster[i] = NGX_HTTP_AS_BATCH_MAX;
+			continue;
+		}
+
+		for(j=0; j<nclusters && clusters[j]!=as; j++);
+		if(j==nclusters)
+		{
+			clusters[nclusters++] = as;
+			as_batch_records_init(&batches[j], n);
+		}
+
+		br = as_batch_read_reserve(&batches[j]);
+		as_key_init_str(&br->key, namespace, set, keys[i]);
+		br->read_all_bins = true;
+
+		cluster[i] = j;
+		slot[i] = batches[j].list.size - 1;
+	}
+
+	if(nclusters==0)
+	{
+		ngx_http_as_not_connected(response, as_conf);
+		return;
+	}
+
+	policy = clusters[0]->config.policies.batch;
+	if(!ngx_http_as_utils_set_policy(r, as_conf, &policy.base))
+	{
+		for(j=0; j<nclusters; j++)
+			as_batch_records_destroy(&batches[j]);
+
+		ngx_http_as_response_canned(response, NGX_HTTP_AS_DEADLINE_EXCEEDED);
+		return;
+	}
+
+	for(j=0; j<nclusters; j++)
+	{
+		aerospike_batch_read(clusters[j], &err, &policy, &batches[j]);
+		codes[j] = err.code;
+
+		// the shards have no circuit, only the cluster of as_connect has.
+		if(clusters[j]==as_conf->as)
+			ngx_http_as_breaker_record(as_conf, err.code);
+	}
+
+	schema = ngx_http_as_utils_find_schema(r, set);
+	response->ndjson = true;
+
+	for(i=0; i<n; i++)
+	{
+		if(cluster[i]==NGX_HTTP_AS_BATCH_MAX)
+		{
+			code = AEROSPIKE_ERR_CLUSTER;
+			br = NULL;
+		}
+		else
+		{
+			// a batch which failed as a whole left the results of its records unset.
+			br = as_vector_get(&batches[cluster[i]].list, slot[i]);
+			code = codes[cluster[i]]==AEROSPIKE_OK || codes[cluster[i]]==AEROSPIKE_BATCH_FAILED ? br->result : codes[cluster[i]];
+		}
+
+		if(code==AEROSPIKE_OK)
+		{
+			ngx_http_as_scan_write_record(response, &br->record, schema);
+			continue;
+		}
+
+		as_error_init(&err);
+		err.code = code;
+		ngx_cpystrn((u_char*)err.message, (u_char*)as_error_string(code), sizeof(err.message));
+		ngx_http_as_scan_write_error(response, &err);
+	}
+
+	for(j=0; j<nclusters; j++)
+		as_batch_records_destroy(&batches[j]);
+}
+
+void ngx_http_as_operate_del(ngx_http_request_t *r, ngx_http_as_conf_t *as_conf, ngx_http_as_response_t *response)
+{
+	aerospike *as;
+
+	char key[1000], namespace[40], set[100];
+
+	if(!ngx_http_as_utils_get_key_args(r, as_conf, namespace, set, key))
+	{
+		ngx_http_as_response_canned(response, NGX_HTTP_AS_INVALID_KEY);
+		return;
+	}
+
+	as_key del_key;
+	as_key_init_str(&del_key, namespace, set, key);
+
+	// with as_shard_group, the key picks the cluster of its shard.
+	as = ngx_http_as_utils_cluster(as_conf, &del_key);
+	if(as==NULL)
+	{
+		ngx_http_as_response_canned(response, NGX_HTTP_AS_INSTANCE_NULL);
+		return;
+	}
+
+	as_policy_remove policy = as->config.policies.remove;
+	if(!ngx_http_as_utils_set_policy(r, as_conf, &policy.base))
+	{
+		ngx_http_as_response_canned(response, NGX_HTTP_AS_DEADLINE_EXCEEDED);
+		return;
+	}
+
+	as_error err;
+	ngx_http_as_retry_t retry;
+
+	ngx_http_as_utils_retry_init(&retry, &policy.base);
+
+	// Delete the (whole) test record from the database.
+	do
+	{
+		aerospike_key_remove(as, &err, &policy, &del_key);
+	}
+	while(ngx_http_as_utils_retry(as_conf, &retry, &policy.base, err.code, true));
+
+	ngx_http_as_breaker_record(as_conf, err.code);
+
+	if(ngx_http_as_response_status(response, err.code))
+	{
+		// Starting the json formatted string.
+		ngx_http_as_response_begin(response);
+		ngx_http_as_utils_dump_error(err, response, "");
+	}
+}
+
+/* This function applies the operations of as_operate_ops on the record in a single request.
+ * The bins returned by the read operations are formatted into the response.
+ */
+void ngx_http_as_operate_ops(ngx_http_request_t *r, ngx_http_as_conf_t *as_conf, ngx_array_t *ops, ngx_http_as_response_t *response)
+{
+	aerospike *as;
+
+	char key[1000], namespace[40], set[100];
+
+	if(!ngx_http_as_utils_get_key_args(r, as_conf, namespace, set, key))
+	{
+		ngx_http_as_response_canned(response, NGX_HTTP_AS_INVALID_KEY);
+		return;
+	}
+
+	as_key op_key;
+	as_key_init_str(&op_key, namespace, set, key);
+
+	// with as_shard_group, the key picks the cluster of its shard.
+	as = ngx_http_as_utils_cluster(as_conf, &op_key);
+	if(as==NULL)
+	{
+		ngx_http_as_response_canned(response, NGX_HTTP_AS_INSTANCE_NULL);
+		return;
+	}
+
+	as_policy_operate policy = as->config.policies.operate;
+	if(!ngx_http_as_utils_set_policy(r, as_conf, &policy.base))
+	{
+		ngx_http_as_response_canned(response, NGX_HTTP_AS_DEADLINE_EXCEEDED);
+		return;
+	}
+
+
+	// adding the compiled operations.
+	ngx_http_as_op_t *op = ops->elts;
+	ngx_uint_t i;
+
+	as_operations operations;
+	as_operations_inita(&operations, ops->nelts);
+
+	// increments, appends and prepends are not idempotent, so operations with them are not retried.
+	bool idempotent = true;
+
+	for(i=0; i<ops->nelts; i++)
+	{
+		switch(op[i].type)
+		{
+			case NGX_HTTP_AS_OP_READ:
+				as_operations_add_read(&operations, op[i].bin);
+				break;
+
+			case NGX_HTTP_AS_OP_WRITE:
+				if(op[i].is_str)
+					as_operations_add_write_str(&operations, op[i].bin, op[i].str_value);
+				else
+					as_operations_add_write_int64(&operations, op[i].bin, op[i].int_value);
+				break;
+
+			case NGX_HTTP_AS_OP_INCR:
+				as_operations_add_incr(&operations, op[i].bin, op[i].int_value);
+				idempotent = false;
+				break;
+
+			case NGX_HTTP_AS_OP_APPEND:
+				as_operations_add_append_str(&operations, op[i].bin, op[i].str_value);
+				idempotent = false;
+				break;
+
+			case NGX_HTTP_AS_OP_PREPEND:
+				as_operations_add_prepend_str(&operations, op[i].bin, op[i].str_value);
+				idempotent = false;
+				break;
+
+			case NGX_HTTP_AS_OP_TOUCH:
+				as_operations_add_touch(&operations);
+				break;
+
+			case NGX_HTTP_AS_OP_DELETE:
+				as_operations_add_delete(&operations);
+				break;
+		}
+	}
+
+	as_error err;
+	as_record* p_rec = NULL;
+	ngx_http_as_retry_t retry;
+
+	ngx_http_as_utils_retry_init(&retry, &policy.base);
+
+	do
+	{
+		aerospike_key_operate(as, &err, &policy, &op_key, &operations, &p_rec);
+	}
+	while(ngx_http_as_utils_retry(as_conf, &retry, &policy.base, err.code, idempotent));
+
+	ngx_http_as_breaker_record(as_conf, err.code);
+
+	if(ngx_http_as_response_status(response, err.code))
+	{
+		// Starting the json formatted string.
+		ngx_http_as_response_begin(response);
+
+		if(err.code!=AEROSPIKE_OK || p_rec==NULL)
+		{
+			ngx_http_as_utils_dump_error(err, response, "");
+		}
+		else
+		{
+			ngx_http_as_utils_dump_error(err, response, ",");
+			ngx_http_as_utils_dump_record(p_rec, err, ngx_http_as_utils_find_schema(r, set), response);
+		}
+	}
+
+	if(p_rec)
+		as_record_destroy(p_rec);
+	as_operations_destroy(&operations);
+}
+
+ bool ngx_http_as_utils_compare_prev_new_hosts(ngx_http_as_hosts current_hosts, ngx_http_as_hosts hosts)
+{
+	if(current_hosts.n < hosts.n || current_hosts.n > hosts.n)
+		return false;
+	int i,j;
+	bool flag = false;
+	for(i=0;i<hosts.n;i++)
+	{
+		for(j=0;j<current_hosts.n;j++)
+		{
+			if((strcmp(current_hosts.address[j], hosts.address[i])==0))
+			{
+				if(current_hosts.port[j]==hosts.port[i])
+					flag = true;
+			}
+		}
+		if(!flag)
+			break;
+	}
+	if(flag)
+		return true;
+	else
+		return false;
+
+}
+
+/* This function splits the comma separated bins and values of the url into size pairs, and decodes each item in place.
+ * Items are decoded once split, so a comma in a value is sent as %2C.
+ * A value in double quotes, %22 in the url, is a string.
+ */
+void ngx_http_as_utils_get_bin_value_pair(char b[], char v[],ngx_http_binvalue bv[], int size)
+{
+	int i;
+	char *next;
+	u_char *end;
+
+	for(i=0;i<size;i++)
+	{
+		next = strchr(v, ',');
+		if(next)
+			*next++ = '\0';
+		else
+			next = v + strlen(v);
+
+		end = ngx_http_as_utils_unescape((u_char*)v, (u_char*)v + strlen(v), (u_char*)v, (u_char*)v + strlen(v));
+		*end = '\0';
+
+		bv[i].value = v;
+		bv[i].is_str = false;
+
+		// stripping the double quotes of a string.
+		if(end - (u_char*)v>=2 && v[0]=='"' && end[-1]=='"')
+		{
+			end[-1] = '\0';
+			bv[i].value++;
+			bv[i].is_str = true;
+		}
+
+		v = next;
+	}
+
+	for(i=0;i<size;i++)
+	{
+		next = strchr(b, ',');
+		if(next)
+			*next++ = '\0';
+		else
+			next = b + strlen(b);
+
+		end = ngx_http_as_utils_unescape((u_char*)b, (u_char*)b + strlen(b), (u_char*)b, (u_char*)b + strlen(b));
+		*end = '\0';
+
+		// a bin name in double quotes is the same as one without.
+		if(end - (u_char*)b>=2 && b[0]=='"' && end[-1]=='"')
+		{
+			end[-1] = '\0';
+			b++;
+		}
+
+		bv[i].bin = b;
+		b = next;
+	}
+}
+
+/*This function generates the error or the reponse json 
+which is then send to the client*/
+
+void ngx_http_as_utils_dump_error(as_error err, ngx_http_as_response_t *response, char* last_char)
+ {
+ 	if(response->msgpack)
+ 	{
+ 		ngx_http_as_msgpack_dump_error(err, response, last_char);
+ 		return;
+ 	}
+
+ 	//Starting the error block.
+ 	ngx_http_as_response_append(response, "\t\"Error\":\n\t{\n", strlen("\t\"Error\":\n\t{\n"));
+
+ 	// Adding the status code to the json string.
+ 	ngx_http_as_response_append(response, "\t\t\"Code\":", strlen("\t\t\"Code\":"));
+ 	ngx_http_as_json_write_integer(response, err.code);
+ 	ngx_http_as_response_append(response, ",\n", strlen(",\n"));
+
+ 	// Adding the message to the json string.
+ 	ngx_http_as_response_append(response, "\t\t\"Message\":\"", strlen("\t\t\"Message\":\""));
+ 	ngx_http_as_json_write_escaped(response, (u_char*)err.message, strlen(err.message));
+ 	ngx_http_as_response_append(response, "\",\n", strlen("\",\n"));
+
+ 	// Adding the funtion where the error occured.
+ 	ngx_http_as_response_append(response, "\t\t\"Function\":\"", strlen("\t\t\"Function\":\""));
+ 	if(err.func==NULL)
+ 		ngx_http_as_response_append(response, "Null", strlen("Null"));
+ 	else
+ 		ngx_http_as_response_append(response, err.func, strlen(err.func));
+ 	ngx_http_as_response_append(response, "\",\n", strlen("\",\n"));
+
+ 	// Adding the file where the error occured.
+ 	ngx_http_as_response_append(response, "\t\t\"File\":\"", strlen("\t\t\"File\":\""));
+ 	if(err.func==NULL)
+ 		ngx_http_as_response_append(response, "Null", strlen("Null"));
+ 	else
+ 		ngx_http_as_response_append(response, err.file, strlen(err.file));
+ 	ngx_http_as_response_append(response, "\",\n", strlen("\",\n"));
+
+ 	// Adding the line where the error occured.
+ 	ngx_http_as_response_append(response, "\t\t\"Line\":", strlen("\t\t\"Line\":"));
+ 	if(err.func==NULL)
+ 		ngx_http_as_response_append(response, "\"Null\"", strlen("\"Null\""));
+ 	else
+ 		ngx_http_as_json_write_integer(response, err.line);
+ 	ngx_http_as_response_append(response, "\n", strlen("\n"));
+
+ 	// Ending the error block
+ 	if(last_char && strcmp(last_char, ",")==0)
+ 		ngx_http_as_response_append(response, "\t},\n", strlen("\t},\n"));
+ 	else
+ 		ngx_http_as_response_append(response, "\t}\n}", strlen("\t}\n}"));
+ }
+
+ /* This function formats a bin as a json in the response string.
+ * The first parameter is the bin to be formatted.
+ * The second parameter is the declaration of the bin in the schema of the set, or NULL.
+ * The third parameter is the response string.
+ */
+void ngx_http_as_utils_dump_bin(const as_bin* p_bin, ngx_http_as_schema_bin_t *decl, ngx_http_as_response_t *response)
+{
+	// if the bin is null, writing to the log file.
+ 	if (! p_bin)
+ 	{
+		ngx_write_stderr("Bin passed to dump_bin is null.\n");
+		return;
+	}
+
+	as_bytes decompressed_bytes;
+	as_string decompressed_str;
+	u_char *decompressed;
+
+	as_val *val = ngx_http_as_utils_get_bin_value(p_bin, &decompressed_str, &decompressed_bytes, &decompressed);
+
+	// writing the bin name, which was formatted at configuration time for a declared bin.
+	if(decl)
+	{
+		ngx_http_as_response_append(response, decl->json_name.data, decl->json_name.len);
+	}
+	else
+	{
+		ngx_http_as_response_append(response, "\t\t", strlen("\t\t"));
+		ngx_http_as_json_write_string(response, (u_char*)as_bin_get_name(p_bin), strlen(as_bin_get_name(p_bin)));
+		ngx_http_as_response_append(response, ":", strlen(":"));
+	}
+
+	// writing the value, straight into the response.
+	ngx_http_as_json_write_val(response, val);
+
+	free(decompressed);
+ }
+
+/* This function returns the value of a bin to be formatted in the response.
+ * Compressed values are decompressed into a malloc'd buffer, which must be freed by the caller,
+ * and wrapped in the string or bytes passed, as the type of the original value.
+ * Values without the compression header are passed through.
+ */
+as_val* ngx_http_as_utils_get_bin_value(const as_bin *p_bin, as_string *str, as_bytes *bytes, u_char **decompressed)
+{
+	as_val *val = (as_val*)as_bin_get_value(p_bin);
+	as_val_t type;
+	size_t len;
+
+	*decompressed = NULL;
+	if(as_val_type(val)!=AS_BYTES)
+		return val;
+
+	*decompressed = ngx_http_as_utils_decompress((as_bytes*)val, &len, &type);
+	if(*decompressed==NULL)
+		return val;
+
+	if(type==AS_STRING)
+		return (as_val*)as_string_init_wlen(str, (char*)*decompressed, len, false);
+
+	return (as_val*)as_bytes_init_wrap(bytes, *decompressed, len, false);
+}
+
+ /* This function creates the json formatted string for a record.
+ * The first parameter is the record, whose json formatting is to be done.
+ * The second parameter is a character array, which stores the json of the record.
+ */
+void ngx_http_as_utils_dump_record(as_record *p_rec, as_error err, ngx_http_as_schema_t *schema, ngx_http_as_response_t *response)
+{
+	// If the record is null, write to the log file.
+	if (! p_rec) {
+		ngx_write_stderr("The record object passed to dump_record is null.");
+		return;
+	}
+
+	if(response->msgpack)
+	{
+		ngx_http_as_msgpack_dump_record(p_rec, schema, response);
+		return;
+	}
+
+	// Obtaining the number of bins in the record.
+	uint16_t num_bins = as_record_numbins(p_rec);
+
+	// the bins are written in the order of the schema of the set, if it has one.
+	ngx_http_as_ordered_bin_t *ordered = ngx_http_as_utils_order_bins(p_rec, schema, response->pool);
+	if(ordered==NULL)
+	{
+		response->error = true;
+		return;
+	}
+
+	// Starting metadata block.
+	ngx_http_as_response_append(response, "\t\"Metadata\":\n\t{\n", strlen("\t\"Metadata\":\n\t{\n"));
+
+	// Appending the number of bins.
+	ngx_http_as_response_append(response, "\t\t\"Num_bins\": ", strlen("\t\t\"Num_bins\": "));
+	ngx_http_as_json_write_integer(response, num_bins);
+	ngx_http_as_response_append(response, ",\n", strlen(",\n"));
+
+	// Appending the generation of the record
+	ngx_http_as_response_append(response, "\t\t\"Generation\": ", strlen("\t\t\"Generation\": "));
+	ngx_http_as_json_write_integer(response, p_rec->gen);
+	ngx_http_as_response_append(response, ",\n", strlen(",\n"));
+
+	// appending the ttl.
+	ngx_http_as_response_append(response, "\t\t\"Ttl\": ", strlen("\t\t\"Ttl\": "));
+	ngx_http_as_json_write_integer(response, (int32_t)p_rec->ttl);
+	ngx_http_as_response_append(response, "\n", strlen("\n"));
+
+	// Ending metadata.
+	ngx_http_as_response_append(response, "\t},\n", strlen("\t},\n"));
+
+	// Starting the bins block
+	ngx_http_as_response_append(response, "\t\"Bins\":\n\t{\n", strlen("\t\"Bins\":\n\t{\n"));
+
+	// for each bin in the record.
+	uint16_t i;
+	for(i=0; i<num_bins; i++)
+	{
+
+		// print "," after each record except the last one.
+		if(i)
+			ngx_http_as_response_append(response, ",\n", strlen(",\n"));
+
+		// format the bin as json.
+		ngx_http_as_utils_dump_bin(ordered[i].bin, ordered[i].decl, response);
+	}
+
+	// not appending "," at the end of last bin.
+	ngx_http_as_response_append(response, "\n", strlen("\n"));
+
+	// Ending bin block
+	ngx_http_as_response_append(response, "\t}\n", strlen("\t}\n"));
+
+	// Ending string
+	ngx_http_as_response_append(response, "}", strlen("}"));
+ }
+
+/* This function starts the response. A json response is an object, which the error block is written in.
+ * A msgpack response is a map, whose size is written with the error.
+ */
+void ngx_http_as_response_begin(ngx_http_as_response_t *response)
+{
+	if(!response->msgpack)
+		ngx_http_as_response_append(response, "{\n", strlen("{\n"));
+}
+
+/* This function sets a canned error as the whole response, with its http status.
+ * The buffer points to the body rendered at configuration time, so nothing is formatted or copied.
+ */
+void ngx_http_as_response_canned(ngx_http_as_response_t *response, ngx_http_as_canned_error_e error)
+{
+	ngx_http_as_canned_error_t *canned = &ngx_http_as_canned_errors[error];
+	ngx_str_t *body = response->msgpack ? &canned->msgpack : &canned->json;
+	ngx_chain_t *cl;
+	ngx_buf_t *b;
+
+	response->status = canned->status;
+	response->retry_after = canned->retry_after;
+
+	// a minimal error is sent with the status alone.
+	if(response->minimal)
+		return;
+
+	b = ngx_calloc_buf(response->pool);
+	cl = ngx_alloc_chain_link(response->pool);
+	if(b==NULL || cl==NULL)
+	{
+		response->error = true;
+		return;
+	}
+
+	// the buffer is full, anything appended after it goes to a new one.
+	b->memory = 1;
+	b->pos = body->data;
+	b->last = body->data + body->len;
+	b->start = b->pos;
+	b->end = b->last;
+
+	cl->buf = b;
+	cl->next = NULL;
+
+	response->out = cl;
+	response->last = &cl->next;
+	response->buf = b;
+	response->size = body->len;
+}
+
+/* This function sets the http status of the response from the status of an aerospike operation.
+ * A missing record is 404 and a failed generation or existence check 409. A timeout is 504, and an unavailable
+ * or overloaded cluster 503 with a Retry-After, for proxies to fail over or retry after a while.
+ * Bad requests are 400, and any other error 500.
+ * It returns false if the error is to be sent without a body, as the client asked for minimal errors.
+ */
+bool ngx_http_as_response_status(ngx_http_as_response_t *response, as_status code)
+{
+	response->retry_after = 0;
+
+	switch(code)
+	{
+		case AEROSPIKE_OK:
+			response->status = NGX_HTTP_OK;
+			return true;
+
+		case AEROSPIKE_ERR_RECORD_NOT_FOUND:
+			response->status = NGX_HTTP_NOT_FOUND;
+			break;
+
+		case AEROSPIKE_ERR_RECORD_GENERATION:
+		case AEROSPIKE_ERR_RECORD_EXISTS:
+		case AEROSPIKE_ERR_BIN_EXISTS:
+			response->status = NGX_HTTP_CONFLICT;
+			break;
+
+		case AEROSPIKE_ERR_TIMEOUT:
+			response->status = NGX_HTTP_GATEWAY_TIME_OUT;
+			break;
+
+		case AEROSPIKE_ERR_CLUSTER:
+		case AEROSPIKE_ERR_CLUSTER_CHANGE:
+		case AEROSPIKE_ERR_DEVICE_OVERLOAD:
+		case AEROSPIKE_ERR_RECORD_BUSY:
+		case AEROSPIKE_ERR_SERVER_FULL:
+		case AEROSPIKE_ERR_CONNECTION:
+		case AEROSPIKE_ERR_INVALID_NODE:
+		case AEROSPIKE_ERR_NO_MORE_CONNECTIONS:
+		case AEROSPIKE_ERR_ASYNC_CONNECTION:
+		case AEROSPIKE_ERR_MAX_ERROR_RATE:
+			response->status = NGX_HTTP_SERVICE_UNAVAILABLE;
+			response->retry_after = NGX_HTTP_AS_RETRY_AFTER;
+			break;
+
+		case AEROSPIKE_ERR_PARAM:
+		case AEROSPIKE_ERR_REQUEST_INVALID:
+		case AEROSPIKE_ERR_BIN_INCOMPATIBLE_TYPE:
+		case AEROSPIKE_ERR_BIN_NAME:
+		case AEROSPIKE_ERR_NAMESPACE_NOT_FOUND:
+			response->status = NGX_HTTP_BAD_REQUEST;
+			break;
+
+		case AEROSPIKE_ERR_RECORD_TOO_BIG:
+			response->status = NGX_HTTP_REQUEST_ENTITY_TOO_LARGE;
+			break;
+
+		default:
+			response->status = NGX_HTTP_INTERNAL_SERVER_ERROR;
+			break;
+	}
+
+	return !response->minimal;
+}
+
+/* This function renders the json and msgpack bodies of the canned errors, as ngx_http_as_utils_dump_error formats them.
+ * Each body is flattened into a single buffer of the pool.
+ */
+ngx_int_t ngx_http_as_render_canned_errors(ngx_pool_t *pool)
+{
+	ngx_http_as_canned_error_t *canned;
+	ngx_http_as_response_t response;
+	ngx_str_t *body;
+	ngx_chain_t *cl;
+	as_error err;
+	ngx_uint_t i, format;
+	u_char *p;
+
+	for(i=0; i<NGX_HTTP_AS_CANNED_ERRORS; i++)
+	{
+		canned = &ngx_http_as_canned_errors[i];
+
+		err.code = -1;
+		err.func = NULL;
+		ngx_cpystrn((u_char*)err.message, (u_char*)canned->message, sizeof(err.message));
+
+		for(format=0; format<2; format++)
+		{
+			ngx_memzero(&response, sizeof(ngx_http_as_response_t));
+			response.pool = pool;
+			response.last = &response.out;
+			response.msgpack = format==1;
+
+			ngx_http_as_response_begin(&response);
+			ngx_http_as_utils_dump_error(err, &response, NULL);
+			if(response.error)
+				return NGX_ERROR;
+
+			body = response.msgpack ? &canned->msgpack : &canned->json;
+			body->len = response.size;
+			body->data = ngx_pnalloc(pool, body->len);
+			if(body->data==NULL)
+				return NGX_ERROR;
+
+			for(p=body->data, cl=response.out; cl; cl=cl->next)
+				p = ngx_cpymem(p, cl->buf->pos, cl->buf->last - cl->buf->pos);
+		}
+	}
+
+	return NGX_OK;
+}
+
+/* This function returns a pointer to len bytes at the end of the response, to be written by the caller.
+ * A new buffer is linked to the response if the last one does not have room.
+ * If the buffer could not be allocated, NULL is returned.
+ */
+u_char* ngx_http_as_response_reserve(ngx_http_as_response_t *response, size_t len)
+{
+	ngx_chain_t *cl;
+	u_char *p;
+
+	if(response->error)
+		return NULL;
+
+	if(response->buf==NULL || (size_t)(response->buf->end - response->buf->last)<len)
+	{
+		cl = ngx_alloc_chain_link(response->pool);
+		if(cl==NULL)
+		{
+			response->error = true;
+			return NULL;
+		}
+
+		cl->buf = ngx_create_temp_buf(response->pool, ngx_max(len, NGX_HTTP_AS_RESPONSE_BUF_SIZE));
+		if(cl->buf==NULL)
+		{
+			response->error = true;
+			return NULL;
+		}
+
+		cl->next = NULL;
+		*response->last = cl;
+		response->last = &cl->next;
+		response->buf = cl->buf;
+	}
+
+	p = response->buf->last;
+	response->buf->last += len;
+	response->size += len;
+	return p;
+}
+
+/* This function appends len bytes to the response. The room left in the last buffer is filled first. */
+void ngx_http_as_response_append(ngx_http_as_response_t *response, const void *data, size_t len)
+{
+	ngx_buf_t *b = response->buf;
+	size_t n;
+	u_char *p;
+
+	if(b && !response->error)
+	{
+		n = ngx_min(len, (size_t)(b->end - b->last));
+		b->last = ngx_cpymem(b->last, data, n);
+		response->size += n;
+		data = (u_char*)data + n;
+		len -= n;
+	}
+
+	if(len==0)
+		return;
+
+	p = ngx_http_as_response_reserve(response, len);
+	if(p)
+		ngx_memcpy(p, data, len);
+}
+
+/* This function writes a string in the json response, quoted and escaped. */
+void ngx_http_as_json_write_string(ngx_http_as_response_t *response, const u_char *data, size_t len)
+{
+	ngx_http_as_response_append(response, "\"", 1);
+	ngx_http_as_json_write_escaped(response, data, len);
+	ngx_http_as_response_append(response, "\"", 1);
+}
+
+/* This function writes the escaped bytes of a json string in the response.
+ * The runs of bytes which need no escaping are found by the vector scanner and copied as is.
+ */
+void ngx_http_as_json_write_escaped(ngx_http_as_response_t *response, const u_char *data, size_t len)
+{
+	static const u_char hex[] = "0123456789abcdef";
+	const u_char *p = data, *last = data + len;
+	u_char escape[6];
+	size_t n;
+
+	while(p<last)
+	{
+		n = ngx_http_as_json_scan(p, last);
+		if(n)
+		{
+			ngx_http_as_response_append(response, p, n);
+			p += n;
+
+			if(p==last)
+				break;
+		}
+
+		escape[0] = '\\';
+		escape[1] = ngx_http_as_json_escape[*p];
+
+		if(escape[1]=='u')
+		{
+			escape[2] = '0';
+			escape[3] = '0';
+			escape[4] = hex[*p >> 4];
+			escape[5] = hex[*p & 0xf];
+			ngx_http_as_response_append(response, escape, 6);
+		}
+		else
+		{
+			ngx_http_as_response_append(response, escape, 2);
+		}
+
+		p++;
+	}
+}
+
+/* These are the pairs of digits from 00 to 99, with which integers are formatted two digits at a time. */
+static const char ngx_http_as_digit_pairs[] =
+	"00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+	"40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
+
+/* These are the powers of ten from 10^-348 to 10^340, in steps of 8, as normalised 64 bit significands and binary exponents. */
+static const ngx_http_as_diyfp_t ngx_http_as_cached_powers[] = {
+	{ 0xfa8fd5a0081c0288ULL, -1220 }, { 0xbaaee17fa23ebf76ULL, -1193 }, { 0x8b16fb203055ac76ULL, -1166 },
+	{ 0xcf42894a5dce35eaULL, -1140 }, { 0x9a6bb0aa55653b2dULL, -1113 }, { 0xe61acf033d1a45dfULL, -1087 },
+	{ 0xab70fe17c79ac6caULL, -1060 }, { 0xff77b1fcbebcdc4fULL, -1034 }, { 0xbe5691ef416bd60cULL, -1007 },
+	{ 0x8dd01fad907ffc3cULL, -980 }, { 0xd3515c2831559a83ULL, -954 }, { 0x9d71ac8fada6c9b5ULL, -927 },
+	{ 0xea9c227723ee8bcbULL, -901 }, { 0xaecc49914078536dULL, -874 }, { 0x823c12795db6ce57ULL, -847 },
+	{ 0xc21094364dfb5637ULL, -821 }, { 0x9096ea6f3848984fULL, -794 }, { 0xd77485cb25823ac7ULL, -768 },
+	{ 0xa086cfcd97bf97f4ULL, -741 }, { 0xef340a98172aace5ULL, -715 }, { 0xb23867fb2a35b28eULL, -688 },
+	{ 0x84c8d4dfd2c63f3bULL, -661 }, { 0xc5dd44271ad3cdbaULL, -635 }, { 0x936b9fcebb25c996ULL, -608 },
+	{ 0xdbac6c247d62a584ULL, -582 }, { 0xa3ab66580d5fdaf6ULL, -555 }, { 0xf3e2f893dec3f126ULL, -529 },
+	{ 0xb5b5ada8aaff80b8ULL, -502 }, { 0x87625f056c7c4a8bULL, -475 }, { 0xc9bcff6034c13053ULL, -449 },
+	{ 0x964e858c91ba2655ULL, -422 }, { 0xdff9772470297ebdULL, -396 }, { 0xa6dfbd9fb8e5b88fULL, -369 },
+	{ 0xf8a95fcf88747d94ULL, -343 }, { 0xb94470938fa89bcfULL, -316 }, { 0x8a08f0f8bf0f156bULL, -289 },
+	{ 0xcdb02555653131b6ULL, -263 }, { 0x993fe2c6d07b7facULL, -236 }, { 0xe45c10c42a2b3b06ULL, -210 },
+	{ 0xaa242499697392d3ULL, -183 }, { 0xfd87b5f28300ca0eULL, -157 }, { 0xbce5086492111aebULL, -130 },
+	{ 0x8cbccc096f5088ccULL, -103 }, { 0xd1b71758e219652cULL, -77 }, { 0x9c40000000000000ULL, -50 },
+	{ 0xe8d4a51000000000ULL, -24 }, { 0xad78ebc5ac620000ULL, 3 }, { 0x813f3978f8940984ULL, 30 },
+	{ 0xc097ce7bc90715b3ULL, 56 }, { 0x8f7e32ce7bea5c70ULL, 83 }, { 0xd5d238a4abe98068ULL, 109 },
+	{ 0x9f4f2726179a2245ULL, 136 }, { 0xed63a231d4c4fb27ULL, 162 }, { 0xb0de65388cc8ada8ULL, 189 },
+	{ 0x83c7088e1aab65dbULL, 216 }, { 0xc45d1df942711d9aULL, 242 }, { 0x924d692ca61be758ULL, 269 },
+	{ 0xda01ee641a708deaULL, 295 }, { 0xa26da3999aef774aULL, 322 }, { 0xf209787bb47d6b85ULL, 348 },
+	{ 0xb454e4a179dd1877ULL, 375 }, { 0x865b86925b9bc5c2ULL, 402 }, { 0xc83553c5c8965d3dULL, 428 },
+	{ 0x952ab45cfa97a0b3ULL, 455 }, { 0xde469fbd99a05fe3ULL, 481 }, { 0xa59bc234db398c25ULL, 508 },
+	{ 0xf6c69a72a3989f5cULL, 534 }, { 0xb7dcbf5354e9beceULL, 561 }, { 0x88fcf317f22241e2ULL, 588 },
+	{ 0xcc20ce9bd35c78a5ULL, 614 }, { 0x98165af37b2153dfULL, 641 }, { 0xe2a0b5dc971f303aULL, 667 },
+	{ 0xa8d9d1535ce3b396ULL, 694 }, { 0xfb9b7cd9a4a7443cULL, 720 }, { 0xbb764c4ca7a44410ULL, 747 },
+	{ 0x8bab8eefb6409c1aULL, 774 }, { 0xd01fef10a657842cULL, 800 }, { 0x9b10a4e5e9913129ULL, 827 },
+	{ 0xe7109bfba19c0c9dULL, 853 }, { 0xac2820d9623bf429ULL, 880 }, { 0x80444b5e7aa7cf85ULL, 907 },
+	{ 0xbf21e44003acdd2dULL, 933 }, { 0x8e679c2f5e44ff8fULL, 960 }, { 0xd433179d9c8cb841ULL, 986 },
+	{ 0x9e19db92b4e31ba9ULL, 1013 }, { 0xeb96bf6ebadf77d9ULL, 1039 }, { 0xaf87023b9bf0ee6bULL, 1066 }
+};
+
+static const uint64_t ngx_http_as_pow10[] = {
+	1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL, 100000000ULL, 1000000000ULL,
+	10000000000ULL, 100000000000ULL, 1000000000000ULL, 10000000000000ULL, 100000000000000ULL,
+	1000000000000000ULL, 10000000000000000ULL, 100000000000000000ULL, 1000000000000000000ULL,
+	10000000000000000000ULL
+};
+
+/* This function returns the number of decimal digits of n. */
+static ngx_inline ngx_uint_t ngx_http_as_count_digits(uint64_t n)
+{
+	ngx_uint_t len = 1;
+
+	for( ;; )
+	{
+		if(n<10)
+			return len;
+		if(n<100)
+			return len + 1;
+		if(n<1000)
+			return len + 2;
+		if(n<10000)
+			return len + 3;
+
+		n /= 10000;
+		len += 4;
+	}
+}
+
+/* This function formats an integer at p, two digits at a time from its end, and returns the end of it.
+ * p must have room for NGX_INT64_LEN bytes.
+ */
+u_char* ngx_http_as_json_format_integer(u_char *p, int64_t value)
+{
+	uint64_t n = (value<0) ? 0 - (uint64_t)value : (uint64_t)value;
+	const char *pair;
+	u_char *end;
+
+	if(value<0)
+		*p++ = '-';
+
+	end = p + ngx_http_as_count_digits(n);
+	p = end;
+
+	while(n>=100)
+	{
+		pair = &ngx_http_as_digit_pairs[(n % 100) * 2];
+		n /= 100;
+		*--p = pair[1];
+		*--p = pair[0];
+	}
+
+	if(n>=10)
+	{
+		pair = &ngx_http_as_digit_pairs[n * 2];
+		*--p = pair[1];
+		*--p = pair[0];
+	}
+	else
+	{
+		*--p = (u_char)('0' + n);
+	}
+
+	return end;
+}
+
+/* This function multiplies two floating point numbers, keeping the high 64 bits of the product, rounded. */
+static ngx_http_as_diyfp_t ngx_http_as_diyfp_mul(ngx_http_as_diyfp_t x, ngx_http_as_diyfp_t y)
+{
+	ngx_http_as_diyfp_t r;
+	uint64_t a = x.f >> 32, b = x.f & 0xffffffff, c = y.f >> 32, d = y.f & 0xffffffff;
+	uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+	uint64_t mid = (bd >> 32) + (ad & 0xffffffff) + (bc & 0xffffffff) + (1ULL << 31);
+
+	r.f = ac + (ad >> 32) + (bc >> 32) + (mid >> 32);
+	r.e = x.e + y.e + 64;
+	return r;
+}
+
+/* This function shifts a floating point number left until its highest bit is set. */
+static ngx_http_as_diyfp_t ngx_http_as_diyfp_normalize(ngx_http_as_diyfp_t x)
+{
+	int shift = __builtin_clzll(x.f);
+
+	x.f <<= shift;
+	x.e -= shift;
+	return x;
+}
+
+/* This function moves the last digit down while the number stays within the interval and gets closer to the value. */
+static void ngx_http_as_grisu_round(u_char *buf, size_t len, uint64_t delta, uint64_t rest, uint64_t ten_kappa, uint64_t wp_w)
+{
+	while(rest<wp_w && delta - rest>=ten_kappa
+		&& (rest + ten_kappa<wp_w || wp_w - rest>rest + ten_kappa - wp_w))
+	{
+		buf[len - 1]--;
+		rest += ten_kappa;
+	}
+}
+
+/* This function generates the shortest digits of a number within delta below the upper boundary mp.
+ * It returns the number of digits, and adds the decimal exponent of the last digit to k.
+ */
+static size_t ngx_http_as_grisu_digits(ngx_http_as_diyfp_t w, ngx_http_as_diyfp_t mp, uint64_t delta, u_char *buf, int *k)
+{
+	ngx_http_as_diyfp_t one;
+	uint64_t wp_w, p2, rest;
+	uint32_t p1, d;
+	int kappa;
+	size_t len = 0;
+
+	one.f = 1ULL << -mp.e;
+	one.e = mp.e;
+	wp_w = mp.f - w.f;
+
+	p1 = (uint32_t)(mp.f >> -one.e);
+	p2 = mp.f & (one.f - 1);
+	kappa = (int)ngx_http_as_count_digits(p1);
+
+	// the digits of the integral part.
+	while(kappa>0)
+	{
+		d = p1 / (uint32_t)ngx_http_as_pow10[kappa - 1];
+		p1 %= (uint32_t)ngx_http_as_pow10[kappa - 1];
+
+		if(d || len)
+			buf[len++] = (u_char)('0' + d);
+
+		kappa--;
+		rest = ((uint64_t)p1 << -one.e) + p2;
+
+		if(rest<=delta)
+		{
+			*k += kappa;
+			ngx_http_as_grisu_round(buf, len, delta, rest, ngx_http_as_pow10[kappa] << -one.e, wp_w);
+			return len;
+		}
+	}
+
+	// the digits of the fractional part.
+	for( ;; )
+	{
+		p2 *= 10;
+		delta *= 10;
+		d = (uint32_t)(p2 >> -one.e);
+
+		if(d || len)
+			buf[len++] = (u_char)('0' + d);
+
+		p2 &= one.f - 1;
+		kappa--;
+
+		if(p2<delta)
+		{
+			*k += kappa;
+			ngx_http_as_grisu_round(buf, len, delta, p2, one.f, (-kappa<20) ? wp_w * ngx_http_as_pow10[-kappa] : 0);
+			return len;
+		}
+	}
+}
+
+/* This function generates the shortest digits of a positive double which read back as it, with Grisu2.
+ * It returns the number of digits, and sets k to the decimal exponent of the last digit.
+ */
+static size_t ngx_http_as_grisu2(double value, u_char *buf, int *k)
+{
+	ngx_http_as_diyfp_t v, w, mp, mm, c;
+	uint64_t bits;
+	int biased_e, index;
+	double dk;
+
+	ngx_memcpy(&bits, &value, sizeof(bits));
+
+	biased_e = (int)((bits >> 52) & 0x7ff);
+	v.f = bits & 0xfffffffffffffULL;
+
+	if(biased_e)
+	{
+		v.f += 1ULL << 52;
+		v.e = biased_e - 1075;
+	}
+	else
+	{
+		v.e = -1074;
+	}
+
+	// the boundaries halfway to the neighbouring doubles, with the exponent of the upper one.
+	mp.f = (v.f << 1) + 1;
+	mp.e = v.e - 1;
+	mp = ngx_http_as_diyfp_normalize(mp);
+
+	if(v.f==(1ULL << 52))
+	{
+		mm.f = (v.f << 2) - 1;
+		mm.e = v.e - 2;
+	}
+	else
+	{
+		mm.f = (v.f << 1) - 1;
+		mm.e = v.e - 1;
+	}
+
+	mm.f <<= mm.e - mp.e;
+	mm.e = mp.e;
+
+	// the cached power of ten which brings the exponent into the range of the digit generation.
+	dk = (-61 - mp.e) * 0.30102999566398114 + 347;
+	index = (int)dk;
+	if(dk - index>0)
+		index++;
+
+	index = (index >> 3) + 1;
+	*k = -(-348 + index * 8);
+	c = ngx_http_as_cached_powers[index];
+
+	w = ngx_http_as_diyfp_mul(ngx_http_as_diyfp_normalize(v), c);
+	mp = ngx_http_as_diyfp_mul(mp, c);
+	mm = ngx_http_as_diyfp_mul(mm, c);
+
+	mm.f++;
+	mp.f--;
+
+	return ngx_http_as_grisu_digits(w, mp, mp.f - mm.f, buf, k);
+}
+
+/* This function formats a double at p with the shortest digits which read back as it, and returns the end of it.
+ * The number always has a '.' or an exponent, so it is read back as a double. Infinities and nan are written as null.
+ * p must have room for NGX_HTTP_AS_DOUBLE_LEN bytes.
+ */
+u_char* ngx_http_as_json_format_double(u_char *p, double value)
+{
+	u_char *buf;
+	size_t len;
+	int k, kk, i;
+
+	if(isnan(value) || isinf(value))
+		return ngx_cpymem(p, "null", 4);
+
+	if(signbit(value))
+	{
+		*p++ = '-';
+		value = -value;
+	}
+
+	if(value==0)
+		return ngx_cpymem(p, "0.0", 3);
+
+	buf = p;
+	len = ngx_http_as_grisu2(value, buf, &k);
+
+	// the value is digits * 10^k, and 10^(kk-1) <= value < 10^kk.
+	kk = (int)len + k;
+
+	if(k>=0 && kk<=21)
+	{
+		// 1234e7 is 12340000000.0
+		for(i=(int)len; i<kk; i++)
+			buf[i] = '0';
+
+		buf[kk] = '.';
+		buf[kk + 1] = '0';
+		return buf + kk + 2;
+	}
+
+	if(kk>0 && kk<=21)
+	{
+		// 1234e-2 is 12.34
+		ngx_memmove(buf + kk + 1, buf + kk, len - kk);
+		buf[kk] = '.';
+		return buf + len + 1;
+	}
+
+	if(kk>-6 && kk<=0)
+	{
+		// 1234e-6 is 0.001234
+		ngx_memmove(buf + 2 - kk, buf, len);
+		buf[0] = '0';
+		buf[1] = '.';
+
+		for(i=2; i<2 - kk; i++)
+			buf[i] = '0';
+
+		return buf + len + 2 - kk;
+	}
+
+	// 1e30 and 1234e30 is 1.234e33
+	if(len>1)
+	{
+		ngx_memmove(buf + 2, buf + 1, len - 1);
+		buf[1] = '.';
+		p = buf + len + 1;
+	}
+	else
+	{
+		p = buf + 1;
+	}
+
+	*p++ = 'e';
+	return ngx_http_as_json_format_integer(p, kk - 1);
+}
+
+/* This function writes an integer in the json response. */
+void ngx_http_as_json_write_integer(ngx_http_as_response_t *response, int64_t value)
+{
+	u_char buf[NGX_INT64_LEN + 1];
+
+	ngx_http_as_response_append(response, buf, ngx_http_as_json_format_integer(buf, value) - buf);
+}
+
+/* This function writes a double in the json response. */
+void ngx_http_as_json_write_double(ngx_http_as_response_t *response, double value)
+{
+	u_char buf[NGX_HTTP_AS_DOUBLE_LEN];
+
+	ngx_http_as_response_append(response, buf, ngx_http_as_json_format_double(buf, value) - buf);
+}
+
+static bool ngx_http_as_json_write_list_item(as_val *val, void *udata)
+{
+	ngx_http_as_json_iter_t *iter = udata;
+
+	if(!iter->first)
+		ngx_http_as_response_append(iter->response, ",", 1);
+
+	iter->first = false;
+	ngx_http_as_json_write_val(iter->response, val);
+	return !iter->response->error;
+}
+
+/* This function writes the key of a map entry. A json key is a string, so a key of another type
+ * is written as a string holding its json, which is formatted in a response of its own first.
+ */
+static void ngx_http_as_json_write_key(ngx_http_as_response_t *response, const as_val *key)
+{
+	ngx_http_as_response_t formatted;
+	ngx_chain_t *cl;
+
+	if(key && as_val_type(key)==AS_STRING)
+	{
+		ngx_http_as_json_write_string(response, (u_char*)as_string_get((as_string*)key), as_string_len((as_string*)key));
+		return;
+	}
+
+	ngx_memzero(&formatted, sizeof(ngx_http_as_response_t));
+	formatted.pool = response->pool;
+	formatted.last = &formatted.out;
+
+	ngx_http_as_json_write_val(&formatted, key);
+	if(formatted.error)
+	{
+		response->error = true;
+		return;
+	}
+
+	ngx_http_as_response_append(response, "\"", 1);
+	for(cl=formatted.out; cl; cl=cl->next)
+		ngx_http_as_json_write_escaped(response, cl->buf->pos, cl->buf->last - cl->buf->pos);
+	ngx_http_as_response_append(response, "\"", 1);
+}
+
+static bool ngx_http_as_json_write_map_entry(const as_val *key, const as_val *val, void *udata)
+{
+	ngx_http_as_json_iter_t *iter = udata;
+
+	if(!iter->first)
+		ngx_http_as_response_append(iter->response, ",", 1);
+
+	iter->first = false;
+	ngx_http_as_json_write_key(iter->response, key);
+	ngx_http_as_response_append(iter->response, ":", 1);
+	ngx_http_as_json_write_val(iter->response, val);
+	return !iter->response->error;
+}
+
+/* This function writes a value in json, recursing into lists and maps, without formatting it in a string first.
+ * Blobs and geojson values are written as the tagged maps {"$bytes":"<base64>"} and {"$geojson":"<text>"},
+ * which a put reads back as the same type. Values of other types are written as null.
+ */
+void ngx_http_as_json_write_val(ngx_http_as_response_t *response, const as_val *val)
+{
+	ngx_http_as_json_iter_t iter;
+	ngx_str_t src, dst;
+
+	switch(val ? as_val_type(val) : AS_NIL)
+	{
+		case AS_BOOLEAN:
+			if(as_boolean_get((as_boolean*)val))
+				ngx_http_as_response_append(response, "true", 4);
+			else
+				ngx_http_as_response_append(response, "false", 5);
+			break;
+
+		case AS_INTEGER:
+			ngx_http_as_json_write_integer(response, as_integer_get((as_integer*)val));
+			break;
+
+		case AS_DOUBLE:
+			ngx_http_as_json_write_double(response, as_double_get((as_double*)val));
+			break;
+
+		case AS_STRING:
+			ngx_http_as_json_write_string(response, (u_char*)as_string_get((as_string*)val), as_string_len((as_string*)val));
+			break;
+
+		case AS_GEOJSON:
+			ngx_http_as_response_append(response, "{\"$geojson\":", sizeof("{\"$geojson\":") - 1);
+			ngx_http_as_json_write_string(response, (u_char*)as_geojson_get((as_geojson*)val), as_geojson_len((as_geojson*)val));
+			ngx_http_as_response_append(response, "}", 1);
+			break;
+
+		case AS_BYTES:
+			// the base64 is encoded straight into the response.
+			src.data = as_bytes_get((as_bytes*)val);
+			src.len = as_bytes_size((as_bytes*)val);
+
+			ngx_http_as_response_append(response, "{\"$bytes\":\"", sizeof("{\"$bytes\":\"") - 1);
+
+			dst.data = ngx_http_as_response_reserve(response, ngx_base64_encoded_length(src.len));
+			if(dst.data)
+				ngx_encode_base64(&dst, &src);
+
+			ngx_http_as_response_append(response, "\"}", 2);
+			break;
+
+		case AS_LIST:
+			iter.response = response;
+			iter.first = true;
+
+			ngx_http_as_response_append(response, "[", 1);
+			as_list_foreach((as_list*)val, ngx_http_as_json_write_list_item, &iter);
+			ngx_http_as_response_append(response, "]", 1);
+			break;
+
+		case AS_MAP:
+			iter.response = response;
+			iter.first = true;
+
+			ngx_http_as_response_append(response, "{", 1);
+			as_map_foreach((as_map*)val, ngx_http_as_json_write_map_entry, &iter);
+			ngx_http_as_response_append(response, "}", 1);
+			break;
+
+		default:
+			ngx_http_as_response_append(response, "null", 4);
+			break;
+	}
+}
+
+/* This function stores the n low bytes of a value, big endian as in msgpack. */
+static u_char* ngx_http_as_msgpack_store(u_char *p, uint64_t value, size_t n)
+{
+	while(n--)
+		*p++ = (u_char)(value >> (8 * n));
+
+	return p;
+}
+
+/* This function writes the type byte and the size of a string, blob, array or map.
+ * fix is the type byte of the format holding the size in the type byte, for sizes below fix_limit, and is 0 for blobs.
+ * type8, type16 and type32 are the type bytes with a 1, 2 and 4 byte size. type8 is 0 for arrays and maps.
+ */
+static void ngx_http_as_msgpack_write_size(ngx_http_as_response_t *response, size_t size, u_char fix, size_t fix_limit, u_char type8, u_char type16, u_char type32)
+{
+	u_char *p;
+
+	if(fix && size<fix_limit)
+	{
+		p = ngx_http_as_response_reserve(response, 1);
+		if(p)
+			*p = (u_char)(fix | size);
+		return;
+	}
+
+	if(type8 && size<=0xff)
+	{
+		p = ngx_http_as_response_reserve(response, 2);
+		if(p)
+		{
+			*p = type8;
+			ngx_http_as_msgpack_store(p + 1, size, 1);
+		}
+		return;
+	}
+
+	if(size<=0xffff)
+	{
+		p = ngx_http_as_response_reserve(response, 3);
+		if(p)
+		{
+			*p = type16;
+			ngx_http_as_msgpack_store(p + 1, size, 2);
+		}
+		return;
+	}
+
+	p = ngx_http_as_response_reserve(response, 5);
+	if(p)
+	{
+		*p = type32;
+		ngx_http_as_msgpack_store(p + 1, size, 4);
+	}
+}
+
+void ngx_http_as_msgpack_write_nil(ngx_http_as_response_t *response)
+{
+	ngx_http_as_response_append(response, "\xc0", 1);
+}
+
+void ngx_http_as_msgpack_write_boolean(ngx_http_as_response_t *response, bool value)
+{
+	ngx_http_as_response_append(response, value ? "\xc3" : "\xc2", 1);
+}
+
+/* This function writes an integer in the smallest msgpack format which holds it. */
+void ngx_http_as_msgpack_write_integer(ngx_http_as_response_t *response, int64_t value)
+{
+	u_char *p, type;
+	size_t n;
+
+	// positive and negative fixints are the type byte itself.
+	if(value>=-32 && value<128)
+	{
+		p = ngx_http_as_response_reserve(response, 1);
+		if(p)
+			*p = (u_char)value;
+		return;
+	}
+
+	if(value>=0)
+	{
+		n = (value<=0xff) ? 1 : (value<=0xffff) ? 2 : (value<=0xffffffffLL) ? 4 : 8;
+		type = (n==1) ? 0xcc : (n==2) ? 0xcd : (n==4) ? 0xce : 0xcf;
+	}
+	else
+	{
+		n = (value>=-128) ? 1 : (value>=-32768) ? 2 : (value>=INT32_MIN) ? 4 : 8;
+		type = (n==1) ? 0xd0 : (n==2) ? 0xd1 : (n==4) ? 0xd2 : 0xd3;
+	}
+
+	p = ngx_http_as_response_reserve(response, 1 + n);
+	if(p==NULL)
+		return;
+
+	*p = type;
+	ngx_http_as_msgpack_store(p + 1, (uint64_t)value, n);
+}
+
+void ngx_http_as_msgpack_write_double(ngx_http_as_response_t *response, double value)
+{
+	uint64_t bits;
+	u_char *p;
+
+	p = ngx_http_as_response_reserve(response, 9);
+	if(p==NULL)
+		return;
+
+	ngx_memcpy(&bits, &value, sizeof(bits));
+	*p = 0xcb;
+	ngx_http_as_msgpack_store(p + 1, bits, 8);
+}
+
+void ngx_http_as_msgpack_write_str(ngx_http_as_response_t *response, const u_char *data, size_t len)
+{
+	ngx_http_as_msgpack_write_size(response, len, 0xa0, 32, 0xd9, 0xda, 0xdb);
+	ngx_http_as_response_append(response, data, len);
+}
+
+void ngx_http_as_msgpack_write_bin(ngx_http_as_response_t *response, const u_char *data, size_t len)
+{
+	ngx_http_as_msgpack_write_size(response, len, 0, 0, 0xc4, 0xc5, 0xc6);
+	ngx_http_as_response_append(response, data, len);
+}
+
+/* This function writes an extension value, of the given extension type. */
+void ngx_http_as_msgpack_write_ext(ngx_http_as_response_t *response, u_char type, const u_char *data, size_t len)
+{
+	ngx_http_as_msgpack_write_size(response, len, 0, 0, 0xc7, 0xc8, 0xc9);
+	ngx_http_as_response_append(response, &type, 1);
+	ngx_http_as_response_append(response, data, len);
+}
+
+void ngx_http_as_msgpack_write_array(ngx_http_as_response_t *response, uint32_t n)
+{
+	ngx_http_as_msgpack_write_size(response, n, 0x90, 16, 0, 0xdc, 0xdd);
+}
+
+void ngx_http_as_msgpack_write_map(ngx_http_as_response_t *response, uint32_t n)
+{
+	ngx_http_as_msgpack_write_size(response, n, 0x80, 16, 0, 0xde, 0xdf);
+}
+
+static bool ngx_http_as_msgpack_write_list_item(as_val *val, void *udata)
+{
+	ngx_http_as_response_t *response = udata;
+
+	ngx_http_as_msgpack_write_val(response, val);
+	return !response->error;
+}
+
+static bool ngx_http_as_msgpack_write_map_entry(const as_val *key, const as_val *val, void *udata)
+{
+	ngx_http_as_response_t *response = udata;
+
+	ngx_http_as_msgpack_write_val(response, key);
+	ngx_http_as_msgpack_write_val(response, val);
+	return !response->error;
+}
+
+/* This function writes a value in its msgpack type, recursing into lists and maps.
+ * Geojson values are written as an extension holding their text, as in the aerospike wire format.
+ * Values of other types are written as nil.
+ */
+void ngx_http_as_msgpack_write_val(ngx_http_as_response_t *response, const as_val *val)
+{
+	switch(val ? as_val_type(val) : AS_NIL)
+	{
+		case AS_BOOLEAN:
+			ngx_http_as_msgpack_write_boolean(response, as_boolean_get((as_boolean*)val));
+			break;
+
+		case AS_INTEGER:
+			ngx_http_as_msgpack_write_integer(response, as_integer_get((as_integer*)val));
+			break;
+
+		case AS_DOUBLE:
+			ngx_http_as_msgpack_write_double(response, as_double_get((as_double*)val));
+			break;
+
+		case AS_STRING:
+			ngx_http_as_msgpack_write_str(response, (u_char*)as_string_get((as_string*)val), as_string_len((as_string*)val));
+			break;
+
+		case AS_GEOJSON:
+			ngx_http_as_msgpack_write_ext(response, AS_BYTES_GEOJSON, (u_char*)as_geojson_get((as_geojson*)val), as_geojson_len((as_geojson*)val));
+			break;
+
+		case AS_BYTES:
+			ngx_http_as_msgpack_write_bin(response, as_bytes_get((as_bytes*)val), as_bytes_size((as_bytes*)val));
+			break;
+
+		case AS_LIST:
+			ngx_http_as_msgpack_write_array(response, as_list_size((as_list*)val));
+			as_list_foreach((as_list*)val, ngx_http_as_msgpack_write_list_item, response);
+			break;
+
+		case AS_MAP:
+			ngx_http_as_msgpack_write_map(response, as_map_size((as_map*)val));
+			as_map_foreach((as_map*)val, ngx_http_as_msgpack_write_map_entry, response);
+			break;
+
+		default:
+			ngx_http_as_msgpack_write_nil(response);
+			break;
+	}
+}
+
+/* This function writes the error of a msgpack response.
+ * The response is a map with the same keys as the json response. If last_char is ",", the record follows the error.
+ */
+void ngx_http_as_msgpack_dump_error(as_error err, ngx_http_as_response_t *response, char *last_char)
+{
+	ngx_http_as_msgpack_write_map(response, (last_char && strcmp(last_char, ",")==0) ? 3 : 1);
+
+	ngx_http_as_msgpack_write_literal(response, "Error");
+	ngx_http_as_msgpack_write_map(response, 5);
+
+	ngx_http_as_msgpack_write_literal(response, "Code");
+	ngx_http_as_msgpack_write_integer(response, err.code);
+
+	ngx_http_as_msgpack_write_literal(response, "Message");
+	ngx_http_as_msgpack_write_str(response, (u_char*)err.message, strlen(err.message));
+
+	// the function, file and line are nil if the error has no function.
+	ngx_http_as_msgpack_write_literal(response, "Function");
+	if(err.func==NULL)
+		ngx_http_as_msgpack_write_nil(response);
+	else
+		ngx_http_as_msgpack_write_str(response, (u_char*)err.func, strlen(err.func));
+
+	ngx_http_as_msgpack_write_literal(response, "File");
+	if(err.func==NULL)
+		ngx_http_as_msgpack_write_nil(response);
+	else
+		ngx_http_as_msgpack_write_str(response, (u_char*)err.file, strlen(err.file));
+
+	ngx_http_as_msgpack_write_literal(response, "Line");
+	if(err.func==NULL)
+		ngx_http_as_msgpack_write_nil(response);
+	else
+		ngx_http_as_msgpack_write_integer(response, err.line);
+}
+
+/* This function writes the metadata and the bins of a record in a msgpack response. */
+void ngx_http_as_msgpack_dump_record(as_record *p_rec, ngx_http_as_schema_t *schema, ngx_http_as_response_t *response)
+{
+	ngx_http_as_ordered_bin_t *ordered;
+	as_bytes decompressed_bytes;
+	as_string decompressed_str;
+	u_char *decompressed;
+	const as_bin *p_bin;
+	as_val *val;
+	uint16_t i;
+
+	uint16_t num_bins = as_record_numbins(p_rec);
+
+	ordered = ngx_http_as_utils_order_bins(p_rec, schema, response->pool);
+	if(ordered==NULL)
+	{
+		response->error = true;
+		return;
+	}
+
+	ngx_http_as_msgpack_write_literal(response, "Metadata");
+	ngx_http_as_msgpack_write_map(response, 3);
+	ngx_http_as_msgpack_write_literal(response, "Num_bins");
+	ngx_http_as_msgpack_write_integer(response, num_bins);
+	ngx_http_as_msgpack_write_literal(response, "Generation");
+	ngx_http_as_msgpack_write_integer(response, p_rec->gen);
+	ngx_http_as_msgpack_write_literal(response, "Ttl");
+	ngx_http_as_msgpack_write_integer(response, p_rec->ttl);
+
+	ngx_http_as_msgpack_write_literal(response, "Bins");
+	ngx_http_as_msgpack_write_map(response, num_bins);
+
+	for(i=0; i<num_bins; i++)
+	{
+		p_bin = ordered[i].bin;
+		val = ngx_http_as_utils_get_bin_value(p_bin, &decompressed_str, &decompressed_bytes, &decompressed);
+
+		if(ordered[i].decl)
+			ngx_http_as_msgpack_write_str(response, (u_char*)ordered[i].decl->name, ordered[i].decl->len);
+		else
+			ngx_http_as_msgpack_write_str(response, (u_char*)as_bin_get_name(p_bin), strlen(as_bin_get_name(p_bin)));
+
+		ngx_http_as_msgpack_write_val(response, val);
+
+		free(decompressed);
+	}
+}
+
+/* This function compresses a string or blob value with zstd, and sets it in the record as a blob.
+ * The blob starts with the compression header, which stores the type of the original value.
+ * Values smaller than min_size, or which do not shrink, are not compressed and false is returned.
+ */
+bool ngx_http_as_utils_set_compressed(as_record *rec, const char *bin, const char *value, size_t len, as_val_t type, ngx_http_as_conf_t *as_conf)
+{
+	// the compression context is created once per worker and reused.
+	static ZSTD_CCtx *cctx = NULL;
+
+	if(len<as_conf->compress_min_size)
+		return false;
+
+	if(cctx==NULL)
+	{
+		cctx = ZSTD_createCCtx();
+		if(cctx==NULL)
+			return false;
+	}
+
+	size_t bound = NGX_HTTP_AS_COMPRESS_HEADER_LEN + ZSTD_compressBound(len);
+	u_char *compressed = malloc(bound);
+	if(compressed==NULL)
+		return false;
+
+	// writing the header.
+	ngx_memcpy(compressed, NGX_HTTP_AS_COMPRESS_MAGIC, NGX_HTTP_AS_COMPRESS_MAGIC_LEN);
+	compressed[NGX_HTTP_AS_COMPRESS_MAGIC_LEN] = (u_char)type;
+
+	size_t size = ZSTD_compressCCtx(cctx, compressed + NGX_HTTP_AS_COMPRESS_HEADER_LEN, bound - NGX_HTTP_AS_COMPRESS_HEADER_LEN, value, len, as_conf->compress_level);
+	if(ZSTD_isError(size) || NGX_HTTP_AS_COMPRESS_HEADER_LEN + size >= len)
+	{
+		free(compressed);
+		return false;
+	}
+
+	// the record frees the compressed buffer when it is destroyed.
+	as_record_set_rawp(rec, bin, compressed, NGX_HTTP_AS_COMPRESS_HEADER_LEN + size, true);
+	return true;
+}
+
+/* This function decompresses a blob written by ngx_http_as_utils_set_compressed.
+ * It returns a malloc'd buffer with the original value, and sets its length and type.
+ * If the blob does not start with the compression header, or is corrupt, NULL is returned.
+ */
+u_char* ngx_http_as_utils_decompress(as_bytes *bytes, size_t *len, as_val_t *type)
+{
+	static ZSTD_DCtx *dctx = NULL;
+
+	uint8_t *data = as_bytes_get(bytes);
+	uint32_t size = as_bytes_size(bytes);
+
+	if(size<=NGX_HTTP_AS_COMPRESS_HEADER_LEN || ngx_memcmp(data, NGX_HTTP_AS_COMPRESS_MAGIC, NGX_HTTP_AS_COMPRESS_MAGIC_LEN)!=0)
+		return NULL;
+
+	as_val_t original_type = (as_val_t)data[NGX_HTTP_AS_COMPRESS_MAGIC_LEN];
+	data += NGX_HTTP_AS_COMPRESS_HEADER_LEN;
+	size -= NGX_HTTP_AS_COMPRESS_HEADER_LEN;
+
+	// the original size is stored in the zstd frame. it is not trusted beyond the size of a record,
+	// as any blob starting with the header could claim a size to be allocated.
+	unsigned long long original = ZSTD_getFrameContentSize(data, size);
+	if(original==ZSTD_CONTENTSIZE_UNKNOWN || original==ZSTD_CONTENTSIZE_ERROR || original>NGX_HTTP_AS_COMPRESS_MAX_SIZE)
+		return NULL;
+
+	if(dctx==NULL)
+	{
+		dctx = ZSTD_createDCtx();
+		if(dctx==NULL)
+			return NULL;
+	}
+
+	u_char *decompressed = malloc(original + 1);
+	if(decompressed==NULL)
+		return NULL;
+
+	size_t n = ZSTD_decompressDCtx(dctx, decompressed, original, data, size);
+	if(ZSTD_isError(n))
+	{
+		ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "as_compress: value could not be decompressed: %s", ZSTD_getErrorName(n));
+		free(decompressed);
+		return NULL;
+	}
+
+	decompressed[n] = '\0';
+	*len = n;
+	*type = original_type;
+	return decompressed;
+}
+
+/* This function initialises the record builder for a put. schema is the schema of the set, or NULL. */
+void ngx_http_as_builder_init(ngx_http_as_record_builder_t *builder, ngx_pool_t *pool, ngx_http_as_conf_t *as_conf, ngx_http_as_schema_t *schema)
+{
+	ngx_memzero(builder, sizeof(ngx_http_as_record_builder_t));
+	builder->as_conf = as_conf;
+	builder->schema = schema;
+	builder->pool = pool;
+
+	if(ngx_array_init(&builder->bins, pool, 8, sizeof(ngx_http_as_pending_bin_t))!=NGX_OK)
+		builder->bins.elts = NULL;
+}
+
+/* This function destroys the lists, maps and values still held by the builder.
+ * It is called if the record could not be built, as the values are owned by the record once it is.
+ */
+void ngx_http_as_builder_destroy(ngx_http_as_record_builder_t *builder)
+{
+	ngx_http_as_pending_bin_t *bin = builder->bins.elts;
+	ngx_http_as_builder_container_t *c;
+	ngx_uint_t i;
+
+	for(i=2; i<=builder->depth; i++)
+	{
+		c = &builder->containers[i];
+
+		if(c->val)
+			as_val_destroy(c->val);
+		if(c->key)
+			as_val_destroy(c->key);
+
+		c->val = NULL;
+		c->key = NULL;
+	}
+
+	for(i=0; bin && i<builder->bins.nelts; i++)
+	{
+		if(bin[i].val)
+			as_val_destroy(bin[i].val);
+
+		bin[i].val = NULL;
+	}
+}
+
+/* This function adds a bin of the given type, named by the last key, to the pending bins.
+ * Values are accepted only as the bins of the record object.
+ * A bin declared in the schema of the set only takes values of its type, or null.
+ */
+ngx_http_as_pending_bin_t* ngx_http_as_builder_add_bin(ngx_http_as_record_builder_t *builder, as_val_t type)
+{
+	ngx_http_as_pending_bin_t *bin;
+
+	if(builder->depth!=1 || !builder->has_bin || builder->bins.elts==NULL)
+	{
+		builder->error = "INVALID_RECORD";
+		return NULL;
+	}
+
+	if(builder->decl && type!=AS_NIL && type!=builder->decl->type)
+	{
+		builder->error = "BIN_TYPE_MISMATCH";
+		return NULL;
+	}
+
+	// a record holds at most 32767 bins.
+	if(builder->bins.nelts>=32767)
+	{
+		builder->error = "TOO_MANY_BINS";
+		return NULL;
+	}
+
+	bin = ngx_array_push(&builder->bins);
+	if(bin==NULL)
+	{
+		builder->error = "INVALID_RECORD";
+		return NULL;
+	}
+
+	ngx_memcpy(bin->name, builder->bin, AS_BIN_NAME_MAX_SIZE);
+	bin->type = type;
+	bin->val = NULL;
+	builder->has_bin = false;
+	builder->decl = NULL;
+	return bin;
+}
+
+/* This function returns a null terminated copy of a string of the body, from the pool of the builder.
+ * The strings of a list or map are hashed and compared as C strings, and a string of the body is not null terminated.
+ */
+static char *ngx_http_as_builder_copy(ngx_http_as_record_builder_t *builder, u_char *str, size_t len)
+{
+	char *p;
+
+	p = ngx_pnalloc(builder->pool, len + 1);
+	if(p==NULL)
+	{
+		builder->error = "INVALID_RECORD";
+		return NULL;
+	}
+
+	*ngx_cpymem(p, str, len) = '\0';
+	return p;
+}
+
+/* This function adds a value to the list or map being built.
+ * In a map, a value with no key pending is the key of the next value. The map is created at its first key.
+ * The value is destroyed if it cannot be added.
+ */
+static bool ngx_http_as_builder_add_val(ngx_http_as_record_builder_t *builder, as_val *val)
+{
+	ngx_http_as_builder_container_t *c = &builder->containers[builder->depth];
+
+	if(val==NULL)
+	{
+		builder->error = "INVALID_RECORD";
+		return false;
+	}
+
+	if(c->type==AS_LIST)
+	{
+		if(as_arraylist_append((as_arraylist*)c->val, val)==AS_ARRAYLIST_OK)
+			return true;
+	}
+	else if(c->type==AS_MAP && c->key==NULL)
+	{
+		if(c->val==NULL)
+			c->val = (as_val*)as_hashmap_new(c->capacity);
+
+		if(c->val)
+		{
+			c->key = val;
+			return true;
+		}
+	}
+	else if(c->type==AS_MAP)
+	{
+		if(as_hashmap_set((as_hashmap*)c->val, c->key, val)==0)
+		{
+			c->key = NULL;
+			return true;
+		}
+
+		as_val_destroy(c->key);
+		c->key = NULL;
+	}
+
+	// a tagged value holds a single string.
+	as_val_destroy(val);
+	builder->error = "INVALID_RECORD";
+	return false;
+}
+
+/* This function begins a list or a map. The outermost map is the record itself.
+ * n is the number of entries if the format tells it, and 0 otherwise.
+ */
+static bool ngx_http_as_builder_begin(ngx_http_as_record_builder_t *builder, as_val_t type, uint32_t n)
+{
+	ngx_http_as_builder_container_t *c = &builder->containers[builder->depth];
+
+	if(builder->depth==0 && type==AS_MAP)
+	{
+		builder->depth++;
+		return true;
+	}
+
+	// lists and maps are values of bins, of lists, or of maps, but not keys.
+	if(builder->depth==0 || (builder->depth==1 && !builder->has_bin)
+		|| (builder->depth>1 && (c->type!=AS_LIST && (c->type!=AS_MAP || c->key==NULL))))
+	{
+		builder->error = "INVALID_RECORD";
+		return false;
+	}
+
+	if(builder->depth==NGX_HTTP_AS_BUILDER_MAX_DEPTH)
+	{
+		builder->error = "INVALID_RECORD";
+		return false;
+	}
+
+	// the value of a declared bin is rejected before it is parsed, if it cannot be of the declared type.
+	// a map may be a tagged blob or geojson value.
+	if(builder->depth==1 && builder->decl
+		&& ((type==AS_LIST && builder->decl->type!=AS_LIST)
+			|| (type==AS_MAP && builder->decl->type!=AS_MAP && builder->decl->type!=AS_BYTES && builder->decl->type!=AS_GEOJSON)))
+	{
+		builder->error = "BIN_TYPE_MISMATCH";
+		return false;
+	}
+
+	c = &builder->containers[++builder->depth];
+	c->type = type;
+	c->key = NULL;
+	c->val = NULL;
+
+	// the size of the container is a hint, as it may be larger than the body.
+	c->capacity = (n>0) ? ngx_min(n, 1024) : 8;
+
+	if(type==AS_LIST)
+	{
+		c->val = (as_val*)as_arraylist_new(c->capacity, 8);
+		if(c->val==NULL)
+		{
+			builder->error = "INVALID_RECORD";
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/* This function ends a list, a map or a tagged value, and adds it to the bin or container it is the value of. */
+static bool ngx_http_as_builder_end(ngx_http_as_record_builder_t *builder)
+{
+	ngx_http_as_builder_container_t *c = &builder->containers[builder->depth];
+	ngx_http_as_pending_bin_t *bin;
+	as_val *val;
+
+	// the end of the record.
+	if(builder->depth==1)
+	{
+		builder->depth--;
+		return true;
+	}
+
+	// an empty map is created at its end.
+	if(c->type==AS_MAP && c->val==NULL)
+		c->val = (as_val*)as_hashmap_new(1);
+
+	if(c->val==NULL || c->key!=NULL)
+	{
+		builder->error = "INVALID_RECORD";
+		return false;
+	}
+
+	val = c->val;
+	c->val = NULL;
+	builder->depth--;
+
+	if(builder->depth>1)
+		return ngx_http_as_builder_add_val(builder, val);
+
+	bin = ngx_http_as_builder_add_bin(builder, as_val_type(val));
+	if(bin==NULL)
+	{
+		as_val_destroy(val);
+		return false;
+	}
+
+	bin->val = val;
+	return true;
+}
+
+bool ngx_http_as_builder_begin_map(ngx_http_as_record_builder_t *builder, uint32_t n)
+{
+	return ngx_http_as_builder_begin(builder, AS_MAP, n);
+}
+
+bool ngx_http_as_builder_end_map(ngx_http_as_record_builder_t *builder)
+{
+	return ngx_http_as_builder_end(builder);
+}
+
+bool ngx_http_as_builder_begin_list(ngx_http_as_record_builder_t *builder, uint32_t n)
+{
+	return ngx_http_as_builder_begin(builder, AS_LIST, n);
+}
+
+bool ngx_http_as_builder_end_list(ngx_http_as_record_builder_t *builder)
+{
+	return ngx_http_as_builder_end(builder);
+}
+
+/* This function sets the name of the bin for the next value, or the key of the next value of a map.
+ * A map whose first key is "$bytes" or "$geojson" is a tagged value,
+ * whose string is the base64 of a blob, or the text of a geojson value.
+ */
+bool ngx_http_as_builder_key(ngx_http_as_record_builder_t *builder, u_char *name, size_t len)
+{
+	ngx_http_as_builder_container_t *c = &builder->containers[builder->depth];
+	char *copy;
 
-	r->headers_out.content_type_len = sizeof("text/html")-1;
-	r->headers_out.content_type.len = sizeof("text/html")-1;
-	r->headers_out.content_type.data = (u_char *)"text/html";
+	if(builder->depth>1)
+	{
+		if(c->type==AS_MAP && c->val==NULL && len==sizeof("$bytes")-1 && ngx_strncmp(name, "$bytes", len)==0)
+		{
+			c->type = AS_BYTES;
+			return true;
+		}
 
-	b = ngx_pcalloc(r->pool, sizeof(ngx_buf_t));
-	if(b==NULL)
-		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+		if(c->type==AS_MAP && c->val==NULL && len==sizeof("$geojson")-1 && ngx_strncmp(name, "$geojson", len)==0)
+		{
+			c->type = AS_GEOJSON;
+			return true;
+		}
 
-	out.buf = b;
-	out.next = NULL;
+		if(c->type!=AS_MAP || c->key!=NULL)
+		{
+			builder->error = "INVALID_RECORD";
+			return false;
+		}
 
-	ngx_http_as_conf_t *as_conf;
-	as_conf = ngx_http_get_module_loc_conf(r, ngx_http_as_module);
+		copy = ngx_http_as_builder_copy(builder, name, len);
+		if(copy==NULL)
+			return false;
 
-	if(as_conf->use_server_conf)
-		as_conf = ngx_http_get_module_srv_conf(r, ngx_http_as_module);
+		return ngx_http_as_builder_add_val(builder, (as_val*)as_string_new_wlen(copy, len, false));
+	}
 
-	bool is_connected = ngx_http_as_operate_connect(r, as_conf);
-	char operation[20];
-	ngx_http_as_utils_get_parsed_url_arguement(r->args, "op",operation);
+	if(len==0 || len>AS_BIN_NAME_MAX_LEN)
+	{
+		builder->error = "INVALID_BIN_NAME";
+		return false;
+	}
 
-	//ngx_write_stderr((char*)is_connected);
-	if(is_connected && strcmp(operation,"put")==0)
+	if(builder->schema)
 	{
-			char response[129000] = "\0";
-			ngx_http_as_utils_put(r->args,as_conf->as,response);
-			ngx_write_stderr(response);
-			b->pos = (u_char *)response;
-			b->last = (u_char *)response + sizeof(response) - 1;
+		builder->decl = ngx_http_as_utils_find_schema_bin(builder->schema, name, len);
+		if(builder->decl==NULL)
+		{
+			builder->error = "UNKNOWN_BIN";
+			return false;
+		}
+	}
 
-			r->headers_out.status = NGX_HTTP_OK;
-			r->headers_out.content_length_n = sizeof(response)-1;
-		
+	ngx_memcpy(builder->bin, name, len);
+	builder->bin[len] = '\0';
+	builder->has_bin = true;
+	return true;
+}
+
+/* This function sets the value of a tagged value, from its string. */
+static bool ngx_http_as_builder_tagged(ngx_http_as_record_builder_t *builder, u_char *str, size_t len)
+{
+	ngx_http_as_builder_container_t *c = &builder->containers[builder->depth];
+	ngx_str_t src, dst;
+	char *copy;
+
+	if(c->val)
+	{
+		builder->error = "INVALID_RECORD";
+		return false;
 	}
-	else if(is_connected && strcmp(operation,"get")==0)
+
+	if(c->type==AS_GEOJSON)
 	{
-		char response[129000] = "\0";
-		ngx_http_as_operate_get(r->args, as_conf->as, response);
-		ngx_write_stderr(response);
-		b->pos = (u_char*)response;
-		b->last = (u_char*)response + sizeof(response) - 1;
+		copy = ngx_http_as_builder_copy(builder, str, len);
+		if(copy==NULL)
+			return false;
 
-		r->headers_out.status = NGX_HTTP_OK;
-		r->headers_out.content_length_n = sizeof(response)-1;
+		c->val = (as_val*)as_geojson_new_wlen(copy, len, false);
 	}
-	else if(is_connected && strcmp("del", operation)==0)
+	else
 	{
-		char response[129000] = "\0";
-		ngx_http_as_operate_del(r->args, as_conf->as, response);
-		
-		b->pos = (u_char*)response;
-		b->last = (u_char*)response + sizeof(response) - 1;
+		src.data = str;
+		src.len = len;
+
+		dst.data = ngx_pnalloc(builder->pool, ngx_base64_decoded_length(len));
+		if(dst.data==NULL)
+		{
+			builder->error = "INVALID_RECORD";
+			return false;
+		}
 
-		r->headers_out.status = NGX_HTTP_OK;
-		r->headers_out.content_length_n = sizeof(response)-1;
+		if(ngx_decode_base64(&dst, &src)!=NGX_OK)
+		{
+			builder->error = "INVALID_BASE64";
+			return false;
+		}
 
+		c->val = (as_val*)as_bytes_new_wrap(dst.data, (uint32_t)dst.len, false);
 	}
-	else if(!is_connected)
-	{
-		char response[129000] = "\0";
-		as_error err_res;
-		err_res.code = -1;
-		strcpy(err_res.message,"AEROSPIKE_NOT_CONNECTED");
-		strncat(response, "{\n", strlen("{\n"));
-		ngx_http_as_utils_dump_error(err_res,response,NULL);
-		b->pos = (u_char*)response;
-		b->last = (u_char*)response + sizeof(response) - 1;
 
-		r->headers_out.status = NGX_HTTP_OK;
-		r->headers_out.content_length_n = sizeof(response)-1;
+	if(c->val==NULL)
+	{
+		builder->error = "INVALID_RECORD";
+		return false;
 	}
-	else
+
+	return true;
+}
+
+/* This function adds a string value. The string need not be null terminated.
+ * The string of a bin is not copied, as it is set with its length. The string of a list or map is copied.
+ */
+bool ngx_http_as_builder_string(ngx_http_as_record_builder_t *builder, u_char *str, size_t len)
+{
+	ngx_http_as_builder_container_t *c = &builder->containers[builder->depth];
+	ngx_http_as_pending_bin_t *bin;
+	char *copy;
+
+	if(builder->depth>1 && (c->type==AS_BYTES || c->type==AS_GEOJSON))
+		return ngx_http_as_builder_tagged(builder, str, len);
+
+	if(builder->depth>1)
 	{
-		char response[129000] = "\0";
-		as_error err_res;
-		err_res.code = -1;
-		strcpy(err_res.message,"AEROSPIKE_CONNECTED");
-		strncat(response, "{\n", strlen("{\n"));
-		ngx_http_as_utils_dump_error(err_res,response,NULL);
-		b->pos = (u_char*)response;
-		b->last = (u_char*)response + sizeof(response) - 1;
+		copy = ngx_http_as_builder_copy(builder, str, len);
+		if(copy==NULL)
+			return false;
 
-		r->headers_out.status = NGX_HTTP_OK;
-		r->headers_out.content_length_n = sizeof(response)-1;
+		return ngx_http_as_builder_add_val(builder, (as_val*)as_string_new_wlen(copy, len, false));
 	}
 
-	b->memory = 1;
-	b->last_buf = 1;
+	// a string is the text of a bin declared as geojson.
+	if(builder->decl && builder->decl->type==AS_GEOJSON)
+		return ngx_http_as_builder_geojson(builder, str, len);
 
-	rc = ngx_http_send_header(r);
+	bin = ngx_http_as_builder_add_bin(builder, AS_STRING);
+	if(bin==NULL)
+		return false;
 
-	if(rc==NGX_ERROR || rc>NGX_OK || r->header_only)
-		return rc;
+	bin->str = str;
+	bin->len = len;
+	return true;
+}
+
+bool ngx_http_as_builder_integer(ngx_http_as_record_builder_t *builder, int64_t value)
+{
+	ngx_http_as_pending_bin_t *bin;
+
+	if(builder->depth>1)
+		return ngx_http_as_builder_add_val(builder, (as_val*)as_integer_new(value));
 
-	return ngx_http_output_filter(r, &out);
+	// an integer is stored as a double in a bin declared as double, as json writes 2.0 as 2.
+	if(builder->decl && builder->decl->type==AS_DOUBLE)
+		return ngx_http_as_builder_double(builder, (double)value);
 
+	bin = ngx_http_as_builder_add_bin(builder, AS_INTEGER);
+	if(bin==NULL)
+		return false;
 
+	bin->integer = value;
+	return true;
 }
 
-bool ngx_http_as_operate_connect(ngx_http_request_t *r, ngx_http_as_conf_t *as_conf)
+bool ngx_http_as_builder_double(ngx_http_as_record_builder_t *builder, double value)
 {
-	//ngx_write_stderr("In ngx_http_as_operate_connect\n");
-	//ngx_write_stderr((char*)r->args.data);
+	ngx_http_as_pending_bin_t *bin;
 
+	if(builder->depth>1)
+		return ngx_http_as_builder_add_val(builder, (as_val*)as_double_new(value));
 
+	bin = ngx_http_as_builder_add_bin(builder, AS_DOUBLE);
+	if(bin==NULL)
+		return false;
 
-	// hosts stores the hosts address and ports to iniitailise the cluster object with.
-	// hosts_arrived_in_url checks whether the request contains the ip and ports.
-	ngx_http_as_hosts hosts;
-	bool hosts_arrived_in_url = false;
+	bin->dbl = value;
+	return true;
+}
 
-	// getting the hosts string from the url.
-	char hosts_string[1000] = "";
-	ngx_http_as_utils_get_parsed_url_arguement(r->args, "hosts", hosts_string);
+/* This function adds a blob value. The blob is not copied. */
+bool ngx_http_as_builder_bytes(ngx_http_as_record_builder_t *builder, u_char *data, size_t len)
+{
+	ngx_http_as_pending_bin_t *bin;
+
+	if(len>UINT32_MAX)
+	{
+		builder->error = "INVALID_RECORD";
+		return false;
+	}
 
+	if(builder->depth>1)
+		return ngx_http_as_builder_add_val(builder, (as_val*)as_bytes_new_wrap(data, (uint32_t)len, false));
 
-	// if the url contains ip and ports, setting the hosts_string to true, and parsing the host string.
-	if(strlen(hosts_string)>0)
+	bin = ngx_http_as_builder_add_bin(builder, AS_BYTES);
+	if(bin==NULL)
+		return false;
+
+	bin->str = data;
+	bin->len = len;
+	return true;
+}
+
+/* This function adds a geojson value, from its text. The text of a bin is not copied, the text of a list or map is. */
+bool ngx_http_as_builder_geojson(ngx_http_as_record_builder_t *builder, u_char *str, size_t len)
+{
+	ngx_http_as_pending_bin_t *bin;
+	char *copy;
+
+	if(builder->depth>1)
 	{
-		hosts_arrived_in_url = true;
-		ngx_http_as_utils_get_hosts(hosts_string, &hosts);
-		//if first tme connect then copy the host
-		if(as_conf->current_hosts.n==0)
-		{
-			as_conf->current_hosts = hosts;
-		}
-		as_conf->is_hosts_present = ngx_http_as_utils_compare_prev_new_hosts(as_conf->current_hosts, hosts);
+		copy = ngx_http_as_builder_copy(builder, str, len);
+		if(copy==NULL)
+			return false;
+
+		return ngx_http_as_builder_add_val(builder, (as_val*)as_geojson_new_wlen(copy, len, false));
 	}
 
+	bin = ngx_http_as_builder_add_bin(builder, AS_GEOJSON);
+	if(bin==NULL)
+		return false;
 
-	// if hosts arrived in url, we need to connect to that addresses.
-	if(hosts_arrived_in_url && !(as_conf->is_hosts_present))
+	bin->str = str;
+	bin->len = len;
+	return true;
+}
+
+/* Booleans are stored as the integers 1 and 0. */
+bool ngx_http_as_builder_boolean(ngx_http_as_record_builder_t *builder, bool value)
+{
+	return ngx_http_as_builder_integer(builder, value ? 1 : 0);
+}
+
+/* A null bin value removes the bin from the record. In a list or map, it is a nil value. */
+bool ngx_http_as_builder_nil(ngx_http_as_record_builder_t *builder)
+{
+	if(builder->depth>1)
+		return ngx_http_as_builder_add_val(builder, (as_val*)&as_nil);
+
+	return ngx_http_as_builder_add_bin(builder, AS_NIL)!=NULL;
+}
+
+/* This function creates the record, with the exact number of pending bins, and sets them.
+ * The lists, maps and tagged values are owned by the record once they are set.
+ * The record must be destroyed by the caller.
+ */
+bool ngx_http_as_builder_finish(ngx_http_as_record_builder_t *builder, as_record *rec)
+{
+	ngx_http_as_pending_bin_t *bin = builder->bins.elts;
+	ngx_uint_t i;
+	as_string *str;
+	as_geojson *geo;
+
+	if(builder->bins.elts==NULL || builder->depth!=0)
 	{
-		// if the object is previously connected, closing the connection.
-		if(as_conf->connected)
-		{
-			as_error err;
-			aerospike_close(as_conf->as, &err);
-			aerospike_destroy(as_conf->as);
-			as_conf->connected = false;
-		}
-			
-		// connecting to new configurations.
-		if(ngx_http_as_utils_connect(&(as_conf->as), hosts))
-		{
-			as_conf->connected = true;
-			return true;
-		}
+		builder->error = "INVALID_RECORD";
+		return false;
 	}
-	else
+
+	as_record_init(rec, builder->bins.nelts);
+
+	for(i=0; i<builder->bins.nelts; i++)
 	{
-		// if using the default server hosts.
-		// if the object is not yet connected, we need to initialize.
-		if(!as_conf->connected)
-		{
-			ngx_http_as_utils_get_hosts((char*)as_conf->default_hosts.data, &hosts);
-			if(as_conf->current_hosts.n==0)
-			{
-				as_conf->current_hosts = hosts;
-			}
-			if(ngx_http_as_utils_connect(&(as_conf->as), hosts))
-			{
-				as_conf->connected = true;
-				return true;
-			}
-		}
-		else
+		switch(bin[i].type)
 		{
-			return true;
+			case AS_STRING:
+				// large strings are stored compressed, if compression is enabled.
+				if(builder->as_conf->compress && ngx_http_as_utils_set_compressed(rec, bin[i].name, (char*)bin[i].str, bin[i].len, AS_STRING, builder->as_conf))
+					break;
+
+				// the string is set with its length, as a msgpack string is not null terminated.
+				// the as_string is from the request pool, so the record does not free it.
+				str = ngx_palloc(builder->pool, sizeof(as_string));
+				if(str==NULL)
+				{
+					as_record_destroy(rec);
+					builder->error = "INVALID_RECORD";
+					return false;
+				}
+
+				as_string_init_wlen(str, (char*)bin[i].str, bin[i].len, false);
+				as_record_set_string(rec, bin[i].name, str);
+				break;
+
+			case AS_INTEGER:
+				as_record_set_int64(rec, bin[i].name, bin[i].integer);
+				break;
+
+			case AS_DOUBLE:
+				as_record_set_double(rec, bin[i].name, bin[i].dbl);
+				break;
+
+			case AS_BYTES:
+				// large blobs are stored compressed, as strings are.
+				if(bin[i].val)
+				{
+					if(builder->as_conf->compress && ngx_http_as_utils_set_compressed(rec, bin[i].name, (char*)as_bytes_get((as_bytes*)bin[i].val), as_bytes_size((as_bytes*)bin[i].val), AS_BYTES, builder->as_conf))
+						as_val_destroy(bin[i].val);
+					else
+						as_record_set_bytes(rec, bin[i].name, (as_bytes*)bin[i].val);
+				}
+				else if(!builder->as_conf->compress || !ngx_http_as_utils_set_compressed(rec, bin[i].name, (char*)bin[i].str, bin[i].len, AS_BYTES, builder->as_conf))
+					as_record_set_rawp(rec, bin[i].name, bin[i].str, (uint32_t)bin[i].len, false);
+				break;
+
+			case AS_GEOJSON:
+				if(bin[i].val)
+				{
+					as_record_set_geojson(rec, bin[i].name, (as_geojson*)bin[i].val);
+					break;
+				}
+
+				geo = ngx_palloc(builder->pool, sizeof(as_geojson));
+				if(geo==NULL)
+				{
+					as_record_destroy(rec);
+					builder->error = "INVALID_RECORD";
+					return false;
+				}
+
+				as_geojson_init_wlen(geo, (char*)bin[i].str, bin[i].len, false);
+				as_record_set_geojson(rec, bin[i].name, geo);
+				break;
+
+			case AS_LIST:
+				as_record_set_list(rec, bin[i].name, (as_list*)bin[i].val);
+				break;
+
+			case AS_MAP:
+				as_record_set_map(rec, bin[i].name, (as_map*)bin[i].val);
+				break;
+
+			default:
+				as_record_set_nil(rec, bin[i].name);
+				break;
 		}
+
+		bin[i].val = NULL;
 	}
-	return false;
+
+	return true;
 }
 
-/* This function sets up the as_connect directive.
- * It takes one arguements, which is the default hosts string, of the form, 127.0.0.1:3000,127.0.0.1:4000
+/* This function initialises the json parser, which passes the values it parses to the builder. */
+void ngx_http_as_json_init(ngx_http_as_json_parser_t *parser, ngx_pool_t *pool, ngx_http_as_record_builder_t *builder)
+{
+	ngx_memzero(parser, sizeof(ngx_http_as_json_parser_t));
+	parser->state = NGX_HTTP_AS_JSON_VALUE;
+	parser->pool = pool;
+	parser->builder = builder;
+}
+
+/* This function appends a decoded byte of the current string.
+ * In place, the byte is written behind the read position, as the escapes are never shorter than their decoding.
+ * Else it is appended to the spill buffer, which is grown as needed.
  */
-static char* ngx_http_as_connect(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+static bool ngx_http_as_json_put_char(ngx_http_as_json_parser_t *parser, u_char c)
 {
-	// Storing the arguemnts of the directive.
-	ngx_str_t *arguments = cf->args->elts;
+	u_char *spill;
 
-	// Acessing the server/local configuration.
-	ngx_http_as_conf_t *as_conf;
+	if(!parser->spilled)
+	{
+		*parser->dst++ = c;
+		return true;
+	}
 
-	// Checking for the context, i.e. server/local.
-	if(cf->cmd_type==NGX_HTTP_SRV_CONF)
-		as_conf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_as_module);
-	else
-		as_conf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_as_module);
+	if(parser->spill_len==parser->spill_size)
+	{
+		spill = ngx_pnalloc(parser->pool, parser->spill_size * 2);
+		if(spill==NULL)
+			return false;
 
-	// Stroing the default hosts provided in the arguement for the configuration.
-	as_conf->default_hosts.data = arguments[1].data;
-	as_conf->default_hosts.len = ngx_strlen(as_conf->default_hosts.data);
+		ngx_memcpy(spill, parser->spill, parser->spill_len);
+		parser->spill = spill;
+		parser->spill_size *= 2;
+	}
 
-	return NGX_CONF_OK;
+	parser->spill[parser->spill_len++] = c;
+	return true;
 }
 
-/* This funnction sets the flag for the local configuratation to use the server context object. */
-static char* ngx_http_as_use_srv_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+/* This function appends a unicode code point of the current string, encoded as utf-8. */
+static bool ngx_http_as_json_put_code(ngx_http_as_json_parser_t *parser, uint32_t code)
 {
-	ngx_http_as_conf_t *as_conf;
-	as_conf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_as_module);
-	as_conf->use_server_conf = true;
-	return NGX_CONF_OK;
+	if(code<0x80)
+		return ngx_http_as_json_put_char(parser, (u_char)code);
+
+	if(code<0x800)
+		return ngx_http_as_json_put_char(parser, (u_char)(0xc0 | (code >> 6)))
+			&& ngx_http_as_json_put_char(parser, (u_char)(0x80 | (code & 0x3f)));
+
+	if(code<0x10000)
+		return ngx_http_as_json_put_char(parser, (u_char)(0xe0 | (code >> 12)))
+			&& ngx_http_as_json_put_char(parser, (u_char)(0x80 | ((code >> 6) & 0x3f)))
+			&& ngx_http_as_json_put_char(parser, (u_char)(0x80 | (code & 0x3f)));
+
+	return ngx_http_as_json_put_char(parser, (u_char)(0xf0 | (code >> 18)))
+		&& ngx_http_as_json_put_char(parser, (u_char)(0x80 | ((code >> 12) & 0x3f)))
+		&& ngx_http_as_json_put_char(parser, (u_char)(0x80 | ((code >> 6) & 0x3f)))
+		&& ngx_http_as_json_put_char(parser, (u_char)(0x80 | (code & 0x3f)));
 }
 
-/* This function sets the handler for the as_operate_directive. */
-static char* ngx_http_as_operate(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+/* This function moves the part of the current string in the buffer to the spill buffer,
+ * as the string continues in the next buffer.
+ */
+static bool ngx_http_as_json_spill(ngx_http_as_json_parser_t *parser)
 {
-	ngx_http_core_loc_conf_t *clcf;
-	clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
-	clcf->handler = ngx_http_as_operate_handler;
-	return NGX_CONF_OK;
+	size_t len = parser->dst - parser->start;
+
+	parser->spill_size = ngx_max(2 * len, 256);
+	parser->spill = ngx_pnalloc(parser->pool, parser->spill_size);
+	if(parser->spill==NULL)
+		return false;
+
+	ngx_memcpy(parser->spill, parser->start, len);
+	parser->spill_len = len;
+	parser->spilled = true;
+	return true;
 }
 
-/* This function accepts an aerospike object, and the hosts to be connected.
- * It then created the connected to the cluster.
- * If the connection is succesful, it returns true, else false.
- */
-bool ngx_http_as_utils_connect(aerospike **as, ngx_http_as_hosts hosts)
+/* This function is called after a value is complete. */
+static void ngx_http_as_json_value_done(ngx_http_as_json_parser_t *parser)
 {
-	// creating and initialising the as_config object.
-	as_config cfg;
-	as_config_init(&cfg);
+	parser->state = (parser->depth==0) ? NGX_HTTP_AS_JSON_DONE : NGX_HTTP_AS_JSON_AFTER_VALUE;
+}
 
-	// adding the multiple ip and ports to the as_config object.
-	ngx_http_as_utils_create_config(&cfg, hosts);
+/* This function passes the complete string to the builder, as a key or a value.
+ * The string is null terminated where it ends, in place of the closing quote or further behind it.
+ */
+static bool ngx_http_as_json_string_done(ngx_http_as_json_parser_t *parser)
+{
+	u_char *str;
+	size_t len;
+	bool rc;
 
-	// connecting to aerospike.
-	*as = aerospike_new(&cfg);
-	as_error err;
-	if(aerospike_connect(*as, &err)!=AEROSPIKE_OK)
+	if(parser->high_surrogate && !ngx_http_as_json_put_code(parser, 0xfffd))
 		return false;
+	parser->high_surrogate = 0;
 
-	return true;
+	if(!parser->spilled)
+	{
+		*parser->dst = '\0';
+		str = parser->start;
+		len = parser->dst - parser->start;
+	}
+	else
+	{
+		if(!ngx_http_as_json_put_char(parser, '\0'))
+			return false;
+
+		// the spill buffer now belongs to the value.
+		str = parser->spill;
+		len = parser->spill_len - 1;
+		parser->spill = NULL;
+		parser->spilled = false;
+	}
+
+	if(parser->is_key)
+	{
+		parser->state = NGX_HTTP_AS_JSON_COLON;
+		return ngx_http_as_builder_key(parser->builder, str, len);
+	}
+
+	rc = ngx_http_as_builder_string(parser->builder, str, len);
+	ngx_http_as_json_value_done(parser);
+	return rc;
 }
 
-/* This function adds the different ip and ports, to the as_config object.*/
-void ngx_http_as_utils_create_config(as_config *cfg, ngx_http_as_hosts hosts)
+/* This function passes the complete number to the builder. */
+static bool ngx_http_as_json_number_done(ngx_http_as_json_parser_t *parser)
 {
-	int i;
-	for(i=0; i<hosts.n; i++)
+	char *end;
+	bool rc;
+
+	parser->number[parser->number_len] = '\0';
+	errno = 0;
+
+	if(parser->is_double)
 	{
-		cfg->hosts[i].addr = hosts.address[i];
-		cfg->hosts[i].port = hosts.port[i];
+		double d = strtod((char*)parser->number, &end);
+		rc = (*end=='\0') && ngx_http_as_builder_double(parser->builder, d);
+	}
+	else
+	{
+		long long n = strtoll((char*)parser->number, &end, 10);
+		rc = (*end=='\0') && errno==0 && ngx_http_as_builder_integer(parser->builder, n);
 	}
+
+	ngx_http_as_json_value_done(parser);
+	return rc;
 }
 
-/*This function takes as argument a character array of ip ports separeated by ";" which in turn are separated by ",".
- * It parses them into individual host ips and ports.
- */
-void ngx_http_as_utils_get_hosts(char *arg, ngx_http_as_hosts *hosts)
+/* This function begins a container, with c being '{' or '['. */
+static bool ngx_http_as_json_push(ngx_http_as_json_parser_t *parser, u_char c)
 {
-	// temp_hosts stores the string combinations of host ip and port, merged using a semicolon.
-	// for eg, 127.0.0.1:3000
-	char temp_hosts[256][30];
+	if(parser->depth==NGX_HTTP_AS_JSON_MAX_DEPTH)
+		return false;
+
+	parser->containers[parser->depth++] = c;
 
-	// pos stores the number of host ip and ports obtained. Set to 0.
-	int pos = 0, i;
+	if(c=='{')
+	{
+		parser->state = NGX_HTTP_AS_JSON_FIRST_KEY;
+		return ngx_http_as_builder_begin_map(parser->builder, 0);
+	}
 
-	// splitting up the different hosts, separated using ",".
-	char *temp = strtok(arg, ",");
-	while(temp!=NULL)
-	{
-		// copying the current host ip and port string into the temp_host array.
-		strcpy(temp_hosts[pos], temp);
-		pos++;
+	parser->state = NGX_HTTP_AS_JSON_FIRST_VALUE;
+	return ngx_http_as_builder_begin_list(parser->builder, 0);
+}
 
-		temp = strtok(NULL, ",");
-	}
+/* This function ends the innermost container, if it was begun with the matching bracket. */
+static bool ngx_http_as_json_pop(ngx_http_as_json_parser_t *parser, u_char c)
+{
+	bool rc;
 
-	// setting the number of hosts as the value obtained above.
-	hosts->n = pos;
+	if(parser->depth==0 || parser->containers[parser->depth-1]!=(c=='}' ? '{' : '['))
+		return false;
 
-	// For each host, separating the address and port.
-	for(i=0; i<pos; i++)
-	{
-		temp = strtok(temp_hosts[i], ":");
-		strcpy(hosts->address[i], temp);
+	parser->depth--;
 
-		temp = strtok(NULL, ":");
+	if(c=='}')
+		rc = ngx_http_as_builder_end_map(parser->builder);
+	else
+		rc = ngx_http_as_builder_end_list(parser->builder);
 
-		hosts->port[i] = atoi(temp);
-	}
+	ngx_http_as_json_value_done(parser);
+	return rc;
 }
 
-bool ngx_http_as_utils_get_parsed_url_arguement(ngx_str_t url, char* arg, char value[])
+/* This function parses the next buffer of the json body, from p to last.
+ * The parser keeps its state between buffers, so tokens may be split across them.
+ * It returns NGX_OK when the json value is complete, NGX_AGAIN if more input is needed, and NGX_ERROR if it is invalid.
+ */
+ngx_int_t ngx_http_as_json_parse(ngx_http_as_json_parser_t *parser, u_char *p, u_char *last)
 {
-	char temp2[1000], temp3[1000];
-	char temp_args[100][1000];
-	int pos = 0, i;
-	bool flag = false;
-	bool is_str = false;
-	int len = url.len;
-	char url_string[len];
+	u_char c;
+	ngx_int_t digit;
+	bool rc;
 
-	if(len>0)
+	for(; p<last; p++)
 	{
-		char *temp = strtok((char*)url.data, " ");
-		strcpy(url_string, temp);
-		while(temp!=NULL)
-			temp = strtok(NULL, " ");
+		c = *p;
 
-
-		temp = strtok(url_string, "&");
-		while(temp!=NULL)
+		switch(parser->state)
 		{
-			strcpy(temp_args[pos], temp);
-			pos++;
+			case NGX_HTTP_AS_JSON_STRING:
+				if(c=='"')
+				{
+					if(!ngx_http_as_json_string_done(parser))
+						return NGX_ERROR;
+					break;
+				}
+
+				if(c=='\\')
+				{
+					parser->state = NGX_HTTP_AS_JSON_ESCAPE;
+					break;
+				}
+
+				if(c<0x20)
+					return NGX_ERROR;
+
+				// a lone high surrogate is replaced.
+				if(parser->high_surrogate)
+				{
+					parser->high_surrogate = 0;
+					if(!ngx_http_as_json_put_code(parser, 0xfffd))
+						return NGX_ERROR;
+				}
+
+				if(!ngx_http_as_json_put_char(parser, c))
+					return NGX_ERROR;
+				break;
 
-			temp = strtok(NULL, "&");
-		}
+			case NGX_HTTP_AS_JSON_ESCAPE:
+				parser->state = NGX_HTTP_AS_JSON_STRING;
+
+				if(c=='u')
+				{
+					parser->state = NGX_HTTP_AS_JSON_UNICODE;
+					parser->code = 0;
+					parser->code_digits = 0;
+					break;
+				}
+
+				if(parser->high_surrogate)
+				{
+					parser->high_surrogate = 0;
+					if(!ngx_http_as_json_put_code(parser, 0xfffd))
+						return NGX_ERROR;
+				}
+
+				switch(c)
+				{
+					case '"': case '\\': case '/': break;
+					case 'b': c = '\b'; break;
+					case 'f': c = '\f'; break;
+					case 'n': c = '\n'; break;
+					case 'r': c = '\r'; break;
+					case 't': c = '\t'; break;
+					default: return NGX_ERROR;
+				}
+
+				if(!ngx_http_as_json_put_char(parser, c))
+					return NGX_ERROR;
+				break;
 
-		for(i=0; i<pos; i++)
-		{
-			temp = strtok(temp_args[i], "=");
-			strcpy(temp2, temp);
+			case NGX_HTTP_AS_JSON_UNICODE:
+				if(c>='0' && c<='9')
+					digit = c - '0';
+				else if((c|0x20)>='a' && (c|0x20)<='f')
+					digit = (c|0x20) - 'a' + 10;
+				else
+					return NGX_ERROR;
+
+				parser->code = (parser->code << 4) | digit;
+				if(++parser->code_digits<4)
+					break;
+
+				parser->state = NGX_HTTP_AS_JSON_STRING;
+
+				// a high surrogate is kept until its low surrogate follows.
+				if(parser->code>=0xd800 && parser->code<=0xdbff)
+				{
+					if(parser->high_surrogate && !ngx_http_as_json_put_code(parser, 0xfffd))
+						return NGX_ERROR;
+					parser->high_surrogate = parser->code;
+					break;
+				}
+
+				if(parser->code>=0xdc00 && parser->code<=0xdfff)
+				{
+					if(parser->high_surrogate==0)
+						parser->code = 0xfffd;
+					else
+						parser->code = 0x10000 + ((parser->high_surrogate - 0xd800) << 10) + (parser->code - 0xdc00);
+				}
+				else if(parser->high_surrogate && !ngx_http_as_json_put_code(parser, 0xfffd))
+					return NGX_ERROR;
+
+				parser->high_surrogate = 0;
+				if(!ngx_http_as_json_put_code(parser, parser->code))
+					return NGX_ERROR;
+				break;
 
-			temp = strtok(NULL, "=");
+			case NGX_HTTP_AS_JSON_NUMBER:
+				if((c>='0' && c<='9') || c=='-' || c=='+' || c=='.' || c=='e' || c=='E')
+				{
+					if(parser->number_len==NGX_HTTP_AS_JSON_NUMBER_LEN - 1)
+						return NGX_ERROR;
+
+					parser->number[parser->number_len++] = c;
+					if(c=='.' || c=='e' || c=='E')
+						parser->is_double = true;
+					break;
+				}
+
+				// the number ends at this character, which is parsed again in the next state.
+				if(!ngx_http_as_json_number_done(parser))
+					return NGX_ERROR;
+				p--;
+				break;
 
-			if(strcmp(temp2, arg)==0)
-			{
-				flag = 1;
-				strcpy(temp3, temp);
+			case NGX_HTTP_AS_JSON_LITERAL:
+				if(c!=(u_char)parser->literal[parser->literal_pos++])
+					return NGX_ERROR;
+
+				if(parser->literal[parser->literal_pos]!='\0')
+					break;
+
+				if(parser->literal[0]=='t')
+					rc = ngx_http_as_builder_boolean(parser->builder, true);
+				else if(parser->literal[0]=='f')
+					rc = ngx_http_as_builder_boolean(parser->builder, false);
+				else
+					rc = ngx_http_as_builder_nil(parser->builder);
+
+				if(!rc)
+					return NGX_ERROR;
+
+				ngx_http_as_json_value_done(parser);
 				break;
-			}
-		}
-		
-		if(flag && (strcmp(temp2,"bin")!=0 && strcmp(temp2,"value")!=0))
-		{
-			is_str = (temp3[0]=='%')?true:false;
 
-			ngx_http_as_utils_replace(temp3, "%22", "");
-			//temp = strtok(temp3, "\"");
-			strcpy(value, temp3);
-		
+			default:
+				// skipping the white space between the tokens.
+				if(c==' ' || c=='\t' || c=='\n' || c=='\r')
+					break;
+
+				switch(parser->state)
+				{
+					case NGX_HTTP_AS_JSON_FIRST_KEY:
+						if(c=='}')
+						{
+							if(!ngx_http_as_json_pop(parser, c))
+								return NGX_ERROR;
+							break;
+						}
+						/* fall through */
+
+					case NGX_HTTP_AS_JSON_KEY:
+						if(c!='"')
+							return NGX_ERROR;
+
+						parser->state = NGX_HTTP_AS_JSON_STRING;
+						parser->is_key = true;
+						parser->start = parser->dst = p + 1;
+						break;
+
+					case NGX_HTTP_AS_JSON_COLON:
+						if(c!=':')
+							return NGX_ERROR;
+						parser->state = NGX_HTTP_AS_JSON_VALUE;
+						break;
+
+					case NGX_HTTP_AS_JSON_AFTER_VALUE:
+						if(c==',')
+						{
+							parser->state = (parser->containers[parser->depth-1]=='{') ? NGX_HTTP_AS_JSON_KEY : NGX_HTTP_AS_JSON_VALUE;
+							break;
+						}
+
+						if(!ngx_http_as_json_pop(parser, c))
+							return NGX_ERROR;
+						break;
+
+					case NGX_HTTP_AS_JSON_FIRST_VALUE:
+						if(c==']')
+						{
+							if(!ngx_http_as_json_pop(parser, c))
+								return NGX_ERROR;
+							break;
+						}
+						/* fall through */
+
+					case NGX_HTTP_AS_JSON_VALUE:
+						if(c=='{' || c=='[')
+						{
+							if(!ngx_http_as_json_push(parser, c))
+								return NGX_ERROR;
+						}
+						else if(c=='"')
+						{
+							parser->state = NGX_HTTP_AS_JSON_STRING;
+							parser->is_key = false;
+							parser->start = parser->dst = p + 1;
+						}
+						else if(c=='-' || (c>='0' && c<='9'))
+						{
+							parser->state = NGX_HTTP_AS_JSON_NUMBER;
+							parser->number[0] = c;
+							parser->number_len = 1;
+							parser->is_double = false;
+						}
+						else if(c=='t' || c=='f' || c=='n')
+						{
+							parser->state = NGX_HTTP_AS_JSON_LITERAL;
+							parser->literal = (c=='t') ? "true" : (c=='f') ? "false" : "null";
+							parser->literal_pos = 1;
+						}
+						else
+							return NGX_ERROR;
+						break;
+
+					default:
+						// nothing but white space may follow the value.
+						return NGX_ERROR;
+				}
 		}
-		else if(flag && (strcmp(temp2,"bin")==0 || strcmp(temp2,"value")==0))
-			strcpy(value,temp3);
 	}
 
-	return is_str;
+	// a string split across buffers continues in the spill buffer, in the next call.
+	if((parser->state==NGX_HTTP_AS_JSON_STRING || parser->state==NGX_HTTP_AS_JSON_ESCAPE || parser->state==NGX_HTTP_AS_JSON_UNICODE)
+		&& !parser->spilled && !ngx_http_as_json_spill(parser))
+		return NGX_ERROR;
+
+	return (parser->state==NGX_HTTP_AS_JSON_DONE) ? NGX_OK : NGX_AGAIN;
 }
 
-void ngx_http_as_utils_put(ngx_str_t url, aerospike *as, char response[])
+/* This function is called at the end of the body. It completes a number at the end of the input. */
+ngx_int_t ngx_http_as_json_finish(ngx_http_as_json_parser_t *parser)
 {
-	as_error err_res;
-	if(as==NULL)
-	{
-		err_res.code = -1;
-		strcpy(err_res.message,"AEROSPIKE_INSTANCE_NULL");
-		strncat(response, "{\n", strlen("{\n"));
-		ngx_http_as_utils_dump_error(err_res,response,NULL);
-		return;
-	}
-	int i,countbin=0,countval=0;
-	
-	char key[1000], namespace[40], set[100], bin[(int)url.len], value[(int)url.len];
-	ngx_http_as_utils_get_parsed_url_arguement(url, "ns", namespace);
-	ngx_http_as_utils_get_parsed_url_arguement(url, "set", set);
-	ngx_http_as_utils_get_parsed_url_arguement(url, "key", key);
-	ngx_http_as_utils_get_parsed_url_arguement(url, "bin", bin);
-	ngx_http_as_utils_get_parsed_url_arguement(url, "value", value);
-	int len = strlen(bin);
-	for(i=0;i<len;i++)
-	{
-    	if((int)bin[i]==',')
-        	countbin++;
-	}
-	len = strlen(value);
-	for(i=0;i<len;i++)
-	{
-		if((int)value[i]==',')
-			countval++;
-	}
-	if(countbin!=countval)
-	{
-		//char response[129000] = "\0";
-		err_res.code = -1;
-		strcpy(err_res.message,"NUM_OF_BINS_AND_VALUES_MISMATCH");
-		strncat(response, "{\n", strlen("{\n"));
-		ngx_http_as_utils_dump_error(err_res,response,NULL);
-		return;
+	if(parser->state==NGX_HTTP_AS_JSON_NUMBER && !ngx_http_as_json_number_done(parser))
+		return NGX_ERROR;
 
-	}
-    
-	ngx_http_binvalue binvalue[countbin+1];
-	ngx_http_as_utils_get_bin_value_pair(bin,value,binvalue,countbin+1);
+	return (parser->state==NGX_HTTP_AS_JSON_DONE) ? NGX_OK : NGX_ERROR;
+}
 
-	as_key put_key;
-	as_key_init(&put_key, namespace, set, key);
+/* This function feeds the request body to a parser, one buffer at a time.
+ * The body buffers in memory are parsed in place. Buffers in the temporary file are read in chunks,
+ * each into its own buffer from the request pool, as the values of the record point into them.
+ * It returns the last result of the parser, or NGX_ERROR if the body could not be read.
+ */
+ngx_int_t ngx_http_as_utils_parse_body(ngx_http_request_t *r, ngx_http_as_body_parse_pt parse, void *parser)
+{
+	ngx_chain_t *cl;
+	ngx_buf_t *b;
+	off_t offset;
+	size_t size;
+	ssize_t n;
+	u_char *chunk;
+	ngx_int_t rc = NGX_AGAIN;
 
-	as_record rec;
-	as_record_inita(&rec, countbin+1);
-	for(i=0;i<countbin+1;i++)
+	if(r->request_body==NULL)
+		return NGX_ERROR;
+
+	for(cl=r->request_body->bufs; cl && rc!=NGX_ERROR; cl=cl->next)
 	{
+		b = cl->buf;
 
-		if(binvalue[i].is_str)
+		if(!b->in_file)
 		{
-			strcpy(key,binvalue[i].bin);
-			
-			as_record_set_str(&rec, key, binvalue[i].value);
+			rc = parse(parser, b->pos, b->last);
+			continue;
 		}
-		else
+
+		for(offset=b->file_pos; offset<b->file_last && rc!=NGX_ERROR; offset+=n)
 		{
-			int value_int = atoi(binvalue[i].value);
-			as_record_set_int64(&rec, binvalue[i].bin, value_int);
+			size = (size_t)ngx_min(b->file_last - offset, NGX_HTTP_AS_BODY_FILE_CHUNK);
+
+			chunk = ngx_pnalloc(r->pool, size);
+			if(chunk==NULL)
+				return NGX_ERROR;
+
+			n = ngx_read_file(b->file, chunk, size, offset);
+			if(n!=(ssize_t)size)
+				return NGX_ERROR;
+
+			rc = parse(parser, chunk, chunk + n);
 		}
 	}
 
-	as_error err;
-	if(aerospike_key_put(as, &err, NULL, &put_key, &rec)!=AEROSPIKE_OK)
-	{
-		strncat(response, "{\n", strlen("{\n"));
-		ngx_http_as_utils_dump_error(err,response,NULL);
-		return;
-	}
-	else
-	{
-		strncat(response, "{\n", strlen("{\n"));
-		ngx_http_as_utils_dump_error(err,response,NULL);
-		return ;
-	}
+	return rc;
 }
 
-void ngx_http_as_operate_get(ngx_str_t url, aerospike *as, char response[])
+static ngx_int_t ngx_http_as_json_parse_buf(void *parser, u_char *p, u_char *last)
 {
-	as_error err_res;
-	if(as==NULL)
-	{
-		err_res.code = -1;
-		strcpy(err_res.message,"AEROSPIKE_INSTANCE_NULL");
-		strncat(response, "{\n", strlen("{\n"));
-		ngx_http_as_utils_dump_error(err_res,response,NULL);
-		return;
-	}
+	return ngx_http_as_json_parse(parser, p, last);
+}
 
-	char key[1000], namespace[40], set[100];
+/* This function parses the json request body into the record builder. */
+bool ngx_http_as_json_parse_body(ngx_http_request_t *r, ngx_http_as_record_builder_t *builder)
+{
+	ngx_http_as_json_parser_t parser;
+	ngx_int_t rc;
 
-	ngx_http_as_utils_get_parsed_url_arguement(url, "ns", namespace);
-	ngx_http_as_utils_get_parsed_url_arguement(url, "set", set);
-	ngx_http_as_utils_get_parsed_url_arguement(url, "key", key);
+	ngx_http_as_json_init(&parser, r->pool, builder);
 
-	as_key get_key;
-	as_key_init_str(&get_key, namespace, set, key);
+	rc = ngx_http_as_utils_parse_body(r, ngx_http_as_json_parse_buf, &parser);
 
-	as_error err;
-	as_record* p_rec = NULL;
+	if(rc==NGX_AGAIN)
+		rc = ngx_http_as_json_finish(&parser);
 
-	// Starting the json formatted string.
-	strncat(response, "{\n", strlen("{\n"));
+	// if the builder did not reject a value, the json itself is invalid.
+	if(rc==NGX_ERROR && builder->error==NULL)
+		builder->error = "INVALID_JSON";
 
-	// Read the (whole) test record from the database.
-	if (aerospike_key_get(as, &err, NULL, &get_key, &p_rec) != AEROSPIKE_OK)
-	{
-		ngx_http_as_utils_dump_error(err, response, "");
-	}
-	else
-	{
-		ngx_http_as_utils_dump_error(err, response, ",");
-		ngx_http_as_utils_dump_record(p_rec, err, response);
-	}
+	return rc==NGX_OK;
 }
 
-void ngx_http_as_operate_del(ngx_str_t url, aerospike *as, char response[])
+/* This function initialises the msgpack parser, which passes the values it decodes to the builder.
+ * A payload is never larger than the body, and for a chunked body, than client_max_body_size and NGX_HTTP_AS_VALUE_MAX_SIZE,
+ * so a length in a string or blob header cannot make it allocate more.
+ */
+void ngx_http_as_msgpack_init(ngx_http_as_msgpack_parser_t *parser, ngx_http_request_t *r, ngx_http_as_record_builder_t *builder)
 {
-	as_error err_res;
-	if(as==NULL)
+	ngx_http_core_loc_conf_t *clcf;
+
+	ngx_memzero(parser, sizeof(ngx_http_as_msgpack_parser_t));
+	parser->state = NGX_HTTP_AS_MSGPACK_TYPE;
+	parser->pool = r->pool;
+	parser->builder = builder;
+
+	if(r->headers_in.content_length_n>=0)
 	{
-		err_res.code = -1;
-		strcpy(err_res.message,"AEROSPIKE_INSTANCE_NULL");
-		strncat(response, "{\n", strlen("{\n"));
-		ngx_http_as_utils_dump_error(err_res,response,NULL);
+		parser->limit = r->headers_in.content_length_n;
 		return;
 	}
 
-	char key[1000], namespace[40], set[100];
+	clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 
-	ngx_http_as_utils_get_parsed_url_arguement(url, "ns", namespace);
-	ngx_http_as_utils_get_parsed_url_arguement(url, "set", set);
-	ngx_http_as_utils_get_parsed_url_arguement(url, "key", key);
+	parser->limit = NGX_HTTP_AS_VALUE_MAX_SIZE;
+	if(clcf->client_max_body_size && clcf->client_max_body_size<parser->limit)
+		parser->limit = clcf->client_max_body_size;
+}
 
-	as_key del_key;
-	as_key_init_str(&del_key, namespace, set, key);
-	ngx_write_stderr(namespace);
-	ngx_write_stderr("\n");
-	ngx_write_stderr(set);
-	ngx_write_stderr("\n");
-	ngx_write_stderr(key);
-	ngx_write_stderr("\n");
-	// Starting the json formatted string.
-	strncat(response, "{\n", strlen("{\n"));
+/* This function returns the number of bytes following a type byte, before the payload if any. */
+static size_t ngx_http_as_msgpack_header_size(u_char type)
+{
+	switch(type)
+	{
+		case 0xc4: case 0xcc: case 0xd0: case 0xd9:
+		case 0xd4: case 0xd5: case 0xd6: case 0xd7: case 0xd8:
+			return 1;
 
-	as_error err;
+		case 0xc5: case 0xcd: case 0xd1: case 0xda: case 0xdc: case 0xde:
+		case 0xc7:
+			return 2;
 
-	// Delete the (whole) test record from the database.
-	aerospike_key_remove(as, &err, NULL, &del_key);
-	
-	ngx_http_as_utils_dump_error(err, response, "");
-}
-
-
-void ngx_http_as_utils_replace(char * o_string, char * s_string, char * r_string)
-{
-      //a buffer variable to do all replace things
-      char buffer[MAX_L];
-      //to store the pointer returned from strstr
-      char * ch;
- 
-      //first exit condition
-      if(!(ch = strstr(o_string, s_string)))
-              return;
- 
-      //copy all the content to buffer before the first occurrence of the search string
-      strncpy(buffer, o_string, ch-o_string);
- 
-      //prepare the buffer for appending by adding a null to the end of it
-      buffer[ch-o_string] = 0;
- 
-      //append using sprintf function
-      sprintf(buffer+(ch - o_string), "%s%s", r_string, ch + strlen(s_string));
- 
-      //empty o_string for copying
-      o_string[0] = 0;
-      strcpy(o_string, buffer);
-      //pass recursively to replace other occurrences
-      return ngx_http_as_utils_replace(o_string, s_string, r_string);
- }
+		case 0xc8:
+			return 3;
 
- bool ngx_http_as_utils_compare_prev_new_hosts(ngx_http_as_hosts current_hosts, ngx_http_as_hosts hosts)
+		case 0xc6: case 0xca: case 0xce: case 0xd2: case 0xdb: case 0xdd: case 0xdf:
+			return 4;
+
+		case 0xc9:
+			return 5;
+
+		case 0xcb: case 0xcf: case 0xd3:
+			return 8;
+
+		default:
+			return 0;
+	}
+}
+
+/* This function loads a big endian value of n bytes. */
+static uint64_t ngx_http_as_msgpack_load(u_char *p, size_t n)
 {
-	if(current_hosts.n < hosts.n || current_hosts.n > hosts.n)
-		return false;
-	int i,j;
-	bool flag = false;
-	for(i=0;i<hosts.n;i++)
+	uint64_t value = 0;
+
+	while(n--)
+		value = (value << 8) | *p++;
+
+	return value;
+}
+
+/* This function is called once a value is complete. It closes the containers which are complete with it. */
+static bool ngx_http_as_msgpack_value_done(ngx_http_as_msgpack_parser_t *parser)
+{
+	ngx_http_as_record_builder_t *builder = parser->builder;
+	ngx_uint_t depth;
+
+	for( ;; )
 	{
-		for(j=0;j<current_hosts.n;j++)
+		if(parser->depth==0)
 		{
-			if((strcmp(current_hosts.address[j], hosts.address[i])==0))
-			{
-				if(current_hosts.port[j]==hosts.port[i])
-					flag = true;
-			}
+			parser->state = NGX_HTTP_AS_MSGPACK_DONE;
+			return true;
 		}
-		if(!flag)
-			break;
+
+		depth = parser->depth - 1;
+		if(--parser->remaining[depth]>0)
+		{
+			parser->state = NGX_HTTP_AS_MSGPACK_TYPE;
+			return true;
+		}
+
+		parser->depth--;
+		if(!(parser->is_map[depth] ? ngx_http_as_builder_end_map(builder) : ngx_http_as_builder_end_list(builder)))
+			return false;
 	}
-	if(flag)
-		return true;
-	else
+}
+
+/* This function begins a map or a list of n entries. An empty container is complete at once. */
+static bool ngx_http_as_msgpack_container(ngx_http_as_msgpack_parser_t *parser, bool is_map, uint32_t n)
+{
+	ngx_http_as_record_builder_t *builder = parser->builder;
+
+	if(parser->depth==NGX_HTTP_AS_MSGPACK_MAX_DEPTH)
+		return false;
+
+	if(!(is_map ? ngx_http_as_builder_begin_map(builder, n) : ngx_http_as_builder_begin_list(builder, n)))
 		return false;
 
+	if(n==0)
+		return (is_map ? ngx_http_as_builder_end_map(builder) : ngx_http_as_builder_end_list(builder))
+			&& ngx_http_as_msgpack_value_done(parser);
+
+	parser->remaining[parser->depth] = is_map ? 2 * (uint64_t)n : n;
+	parser->is_map[parser->depth] = is_map;
+	parser->depth++;
+	parser->state = NGX_HTTP_AS_MSGPACK_TYPE;
+	return true;
 }
 
-void ngx_http_as_utils_get_bin_value_pair(char b[], char v[],ngx_http_binvalue bv[], int size)
+/* This function passes a complete string, blob or extension to the builder.
+ * A string in the key position of a map is the name of a bin, or the key of a map in a bin.
+ * The geojson extension holds the text of a geojson value, as in the aerospike wire format.
+ */
+static bool ngx_http_as_msgpack_payload_done(ngx_http_as_msgpack_parser_t *parser, u_char *data, size_t len)
 {
-	int i=0;
-	char *value,*bin;
-	value = strtok(v,",");
-	while(value)
+	ngx_http_as_record_builder_t *builder = parser->builder;
+	u_char type = parser->type;
+	bool rc;
+
+	if((type>=0xa0 && type<=0xbf) || (type>=0xd9 && type<=0xdb))
+		rc = parser->is_key ? ngx_http_as_builder_key(builder, data, len) : ngx_http_as_builder_string(builder, data, len);
+	else if(type>=0xc4 && type<=0xc6)
+		rc = ngx_http_as_builder_bytes(builder, data, len);
+	else if(parser->header[parser->header_need - 1]==AS_BYTES_GEOJSON)
+		rc = ngx_http_as_builder_geojson(builder, data, len);
+	else
 	{
-		bv[i].is_str = (*value =='%')?true:false;
-		ngx_http_as_utils_replace(value, "%22", "");
-		strcpy(bv[i].value, value);
-		value = strtok(NULL,",");
-		i++;
+		// other extensions have no aerospike type.
+		builder->error = "UNSUPPORTED_VALUE_TYPE";
+		rc = false;
 	}
-	bin = strtok(b,",");
-	i=0;
-	while(bin)
+
+	return rc && ngx_http_as_msgpack_value_done(parser);
+}
+
+/* This function starts the payload of len bytes of a string, blob or extension, at p.
+ * If the payload lies in the buffer it is passed in place, else the part in the buffer is copied to the payload buffer.
+ */
+static bool ngx_http_as_msgpack_payload(ngx_http_as_msgpack_parser_t *parser, uint64_t len, u_char **p, u_char *last)
+{
+	u_char *data = *p;
+	size_t n = last - data;
+
+	if(len>(uint64_t)parser->limit)
+		return false;
+
+	if(len<=n)
 	{
-		ngx_http_as_utils_replace(bin, "%22", "");
-		strcpy(bv[i].bin, bin);
-		bin = strtok(NULL,",");
-		i++;
+		*p += len;
+		return ngx_http_as_msgpack_payload_done(parser, data, len);
 	}
 
+	parser->payload = ngx_pnalloc(parser->pool, len);
+	if(parser->payload==NULL)
+		return false;
+
+	ngx_memcpy(parser->payload, data, n);
+	parser->payload_len = len;
+	parser->payload_have = n;
+	parser->state = NGX_HTTP_AS_MSGPACK_PAYLOAD;
+
+	*p = last;
+	return true;
 }
 
-/*This function generates the error or the reponse json 
-which is then send to the client*/
+/* This function decodes a value, once its type byte and the header following it are read.
+ * The payload of a string, blob or extension starts at p.
+ */
+static bool ngx_http_as_msgpack_value(ngx_http_as_msgpack_parser_t *parser, u_char **p, u_char *last)
+{
+	ngx_http_as_record_builder_t *builder = parser->builder;
+	u_char type = parser->type;
+	u_char *h = parser->header;
+	uint64_t n;
+	uint32_t bits32;
+	float f;
+	double d;
+
+	// the keys of the record map are the names of bins, which are strings.
+	// the keys of maps in bins are passed to the builder as values.
+	if(parser->is_key && parser->depth==1 && !((type>=0xa0 && type<=0xbf) || (type>=0xd9 && type<=0xdb)))
+		return false;
 
-void ngx_http_as_utils_dump_error(as_error err, char response[], char* last_char)
- {
- 	//Starting the error block.
- 	strncat(response, "\t\"Error\":\n\t{\n", strlen("\t\"Error\":\n\t{\n"));
+	// positive and negative fixints.
+	if(type<=0x7f || type>=0xe0)
+		return ngx_http_as_builder_integer(builder, (int8_t)type) && ngx_http_as_msgpack_value_done(parser);
 
- 	// Adding the status code to the json string.
- 	char status_code[5];
- 	sprintf(status_code, "%d", err.code);
- 	strncat(response, "\t\t\"Code\":", strlen("\t\t\"Code\":"));
- 	strncat(response, status_code, strlen(status_code));
- 	strncat(response, ",\n", strlen(",\n"));
+	if(type<=0x8f)
+		return ngx_http_as_msgpack_container(parser, true, type & 0x0f);
 
- 	// Adding the message to the json string.
- 	strncat(response, "\t\t\"Message\":\"", strlen("\t\t\"Message\":\""));
- 	strncat(response, err.message, strlen(err.message));
- 	strncat(response, "\",\n", strlen("\",\n"));
+	if(type<=0x9f)
+		return ngx_http_as_msgpack_container(parser, false, type & 0x0f);
 
- 	// Adding the funtion where the error occured.
- 	strncat(response, "\t\t\"Function\":\"", strlen("\t\t\"Function\":\""));
- 	if(err.func==NULL)
- 		strncat(response, "Null", strlen("Null"));
- 	else
- 		strncat(response, err.func, strlen(err.func));
- 	strncat(response, "\",\n", strlen("\",\n"));
+	if(type<=0xbf)
+		return ngx_http_as_msgpack_payload(parser, type & 0x1f, p, last);
 
- 	// Adding the file where the error occured.
- 	strncat(response, "\t\t\"File\":\"", strlen("\t\t\"File\":\""));
- 	if(err.func==NULL)
- 		strncat(response, "Null", strlen("Null"));
- 	else
- 		strncat(response, err.file, strlen(err.file));
- 	strncat(response, "\",\n", strlen("\",\n"));
+	switch(type)
+	{
+		case 0xc0:
+			return ngx_http_as_builder_nil(builder) && ngx_http_as_msgpack_value_done(parser);
 
- 	// Adding the line where the error occured.
- 	strncat(response, "\t\t\"Line\":", strlen("\t\t\"Line\":"));
- 	if(err.func==NULL)
- 		strncat(response, "\"Null\"", strlen("\"Null\""));
- 	else
- 	{
- 		char line[10000] = "";
- 		sprintf(line, "%d", (int)err.line);
- 		strncat(response, line, strlen(line));
- 	}
- 	strncat(response, "\n", strlen("\n"));
+		case 0xc2:
+		case 0xc3:
+			return ngx_http_as_builder_boolean(builder, type==0xc3) && ngx_http_as_msgpack_value_done(parser);
 
- 	// Ending the error block
- 	if(last_char && strcmp(last_char, ",")==0)
- 		strncat(response, "\t},\n", strlen("\t},\n"));
- 	else
- 		strncat(response, "\t}\n}", strlen("\t}\n}"));
- 	ngx_write_stderr("IN the last fucntion\n");
- 	ngx_write_stderr(response);
- }
+		case 0xc4: case 0xc7: case 0xd9:
+			return ngx_http_as_msgpack_payload(parser, h[0], p, last);
 
- /* This function formats a bin as a json in the response string.
- * The first parameter is the bin to be formatted.
- * The second parameter is the response string.
- */
-void ngx_http_as_utils_dump_bin(const as_bin* p_bin, char response[])
-{
-	// if the bin is null, writing to the log file.
- 	if (! p_bin)
- 	{
-		ngx_write_stderr("Bin passed to dump_bin is null.\n");
-		return;
-	}
+		case 0xc5: case 0xc8: case 0xda:
+			return ngx_http_as_msgpack_payload(parser, ngx_http_as_msgpack_load(h, 2), p, last);
 
-	// obtaing the value of bin as json formatted string.
-	char* val_as_str = as_val_tostring(as_bin_get_value(p_bin));
+		case 0xc6: case 0xc9: case 0xdb:
+			return ngx_http_as_msgpack_payload(parser, ngx_http_as_msgpack_load(h, 4), p, last);
 
-	// writing the bin name, and the bin value into the response string.
-	strncat(response, "\t\t", strlen("\t\t"));
-	strncat(response, "\"", strlen("\""));
-	strncat(response, as_bin_get_name(p_bin), strlen(as_bin_get_name(p_bin)));
-	strncat(response, "\"", strlen("\""));
-	strncat(response, ":", strlen(":"));
-	strncat(response, val_as_str, strlen(val_as_str));
+		case 0xd4: case 0xd5: case 0xd6: case 0xd7: case 0xd8:
+			return ngx_http_as_msgpack_payload(parser, 1 << (type - 0xd4), p, last);
 
-	free(val_as_str);
- }
+		case 0xca:
+			bits32 = (uint32_t)ngx_http_as_msgpack_load(h, 4);
+			ngx_memcpy(&f, &bits32, sizeof(f));
+			return ngx_http_as_builder_double(builder, f) && ngx_http_as_msgpack_value_done(parser);
 
- /* This function creates the json formatted string for a record.
- * The first parameter is the record, whose json formatting is to be done.
- * The second parameter is a character array, which stores the json of the record.
- */
-void ngx_http_as_utils_dump_record(as_record *p_rec, as_error err, char response[])
-{
-	// If the record is null, write to the log file.
-	if (! p_rec) {
-		ngx_write_stderr("The record object passed to dump_record is null.");
-		return;
-	}
+		case 0xcb:
+			n = ngx_http_as_msgpack_load(h, 8);
+			ngx_memcpy(&d, &n, sizeof(d));
+			return ngx_http_as_builder_double(builder, d) && ngx_http_as_msgpack_value_done(parser);
 
-	// Obtaining the number of bins in the record.
-	uint16_t num_bins = as_record_numbins(p_rec);
+		case 0xcc: case 0xcd: case 0xce: case 0xcf:
+			n = ngx_http_as_msgpack_load(h, 1 << (type - 0xcc));
 
-	// Starting metadata block.
-	strncat(response, "\t\"Metadata\":\n\t{\n", strlen("\t\"Meta-data\":\n\t{\n"));
+			// aerospike integers are signed.
+			if(n>INT64_MAX)
+			{
+				builder->error = "UNSUPPORTED_VALUE_TYPE";
+				return false;
+			}
+			return ngx_http_as_builder_integer(builder, (int64_t)n) && ngx_http_as_msgpack_value_done(parser);
 
-	// Appending the number of bins.
-	char temp_json_string[100];
-	sprintf(temp_json_string, "%d", (int)num_bins);
-	strncat(response, "\t\t\"Num_bins\": ", strlen("\t\t\"Num_bins\": "));
-	strncat(response, temp_json_string, strlen(temp_json_string));
-	strncat(response, ",\n", strlen(",\n"));
+		case 0xd0:
+			return ngx_http_as_builder_integer(builder, (int8_t)h[0]) && ngx_http_as_msgpack_value_done(parser);
 
-	// Appending the generation of the record
-	sprintf(temp_json_string, "%d", (int)p_rec->gen);
-	strncat(response, "\t\t\"Generation\": ", strlen("\t\t\"Generation\": "));
-	strncat(response, temp_json_string, strlen(temp_json_string));
-	strncat(response, ",\n", strlen(",\n"));
+		case 0xd1:
+			return ngx_http_as_builder_integer(builder, (int16_t)ngx_http_as_msgpack_load(h, 2)) && ngx_http_as_msgpack_value_done(parser);
 
-	// appending the ttl.
-	sprintf(temp_json_string, "%d", (int)p_rec->ttl);
-	strncat(response, "\t\t\"Ttl\": ", strlen("\t\t\"Ttl\": "));
-	strncat(response, temp_json_string, strlen(temp_json_string));
-	strncat(response, "\n", strlen("\n"));
+		case 0xd2:
+			return ngx_http_as_builder_integer(builder, (int32_t)ngx_http_as_msgpack_load(h, 4)) && ngx_http_as_msgpack_value_done(parser);
 
-	// Ending metadata.
-	strncat(response, "\t},\n", strlen("\t},\n"));
+		case 0xd3:
+			return ngx_http_as_builder_integer(builder, (int64_t)ngx_http_as_msgpack_load(h, 8)) && ngx_http_as_msgpack_value_done(parser);
 
-	// Starting the bins block
-	strncat(response, "\t\"Bins\":\n\t{\n", strlen("\t\"Bins\":\n\t{\n"));
-	as_record_iterator it;
-	as_record_iterator_init(&it, p_rec);
+		case 0xdc:
+			return ngx_http_as_msgpack_container(parser, false, ngx_http_as_msgpack_load(h, 2));
 
-	// for json formatting, excluding the first bin.
-	int ctr = 0;
+		case 0xdd:
+			return ngx_http_as_msgpack_container(parser, false, ngx_http_as_msgpack_load(h, 4));
 
-	// for each bin in the record.
-	while (as_record_iterator_has_next(&it))
+		case 0xde:
+			return ngx_http_as_msgpack_container(parser, true, ngx_http_as_msgpack_load(h, 2));
+
+		case 0xdf:
+			return ngx_http_as_msgpack_container(parser, true, ngx_http_as_msgpack_load(h, 4));
+
+		default:
+			// 0xc1 is never used.
+			return false;
+	}
+}
+
+/* This function parses a buffer of the msgpack body.
+ * It returns NGX_OK once the record is complete, NGX_AGAIN if more of the body is expected, and NGX_ERROR on an invalid body.
+ */
+ngx_int_t ngx_http_as_msgpack_parse(ngx_http_as_msgpack_parser_t *parser, u_char *p, u_char *last)
+{
+	size_t n;
+
+	while(p<last)
 	{
+		switch(parser->state)
+		{
+			case NGX_HTTP_AS_MSGPACK_TYPE:
+				parser->type = *p++;
+				parser->header_len = 0;
+				parser->header_need = ngx_http_as_msgpack_header_size(parser->type);
+				parser->is_key = parser->depth>0 && parser->is_map[parser->depth - 1] && parser->remaining[parser->depth - 1] % 2==0;
+
+				if(parser->header_need>0)
+					parser->state = NGX_HTTP_AS_MSGPACK_HEADER;
+				else if(!ngx_http_as_msgpack_value(parser, &p, last))
+					return NGX_ERROR;
+				break;
 
-		// print "," after each record except the last one.
-		if(ctr)
-			strncat(response, ",\n", strlen(",\n"));
+			case NGX_HTTP_AS_MSGPACK_HEADER:
+				n = ngx_min(parser->header_need - parser->header_len, (size_t)(last - p));
+				ngx_memcpy(parser->header + parser->header_len, p, n);
+				parser->header_len += n;
+				p += n;
 
-		// format the bin as json.
-		ngx_http_as_utils_dump_bin(as_record_iterator_next(&it), response);
-		ctr = 1;
+				if(parser->header_len==parser->header_need && !ngx_http_as_msgpack_value(parser, &p, last))
+					return NGX_ERROR;
+				break;
+
+			case NGX_HTTP_AS_MSGPACK_PAYLOAD:
+				n = ngx_min(parser->payload_len - parser->payload_have, (size_t)(last - p));
+				ngx_memcpy(parser->payload + parser->payload_have, p, n);
+				parser->payload_have += n;
+				p += n;
+
+				if(parser->payload_have==parser->payload_len && !ngx_http_as_msgpack_payload_done(parser, parser->payload, parser->payload_len))
+					return NGX_ERROR;
+				break;
+
+			case NGX_HTTP_AS_MSGPACK_DONE:
+				// the body holds a single record, unless it is a stream of them.
+				if(!parser->stream)
+					return NGX_ERROR;
+
+				parser->end = p;
+				return NGX_OK;
+		}
 	}
 
-	// not appending "," at the end of last bin.
-	strncat(response, "\n", strlen("\n"));
+	parser->end = p;
+	return (parser->state==NGX_HTTP_AS_MSGPACK_DONE) ? NGX_OK : NGX_AGAIN;
+}
 
-	as_record_iterator_destroy(&it);
+static ngx_int_t ngx_http_as_msgpack_parse_buf(void *parser, u_char *p, u_char *last)
+{
+	return ngx_http_as_msgpack_parse(parser, p, last);
+}
 
-	// Ending bin block
-	strncat(response, "\t}\n", strlen("\t},\n"));
+/* This function parses the msgpack request body into the record builder. */
+bool ngx_http_as_msgpack_parse_body(ngx_http_request_t *r, ngx_http_as_record_builder_t *builder)
+{
+	ngx_http_as_msgpack_parser_t parser;
+	ngx_int_t rc;
 
-	// Ending string
-	strncat(response, "}", strlen("}"));
- }
\ No newline at end of file
+	ngx_http_as_msgpack_init(&parser, r, builder);
+
+	rc = ngx_http_as_utils_parse_body(r, ngx_http_as_msgpack_parse_buf, &parser);
+
+	// a body which ends within the record is invalid.
+	if(rc==NGX_AGAIN)
+		rc = NGX_ERROR;
+
+	// if the builder did not reject a value, the msgpack itself is invalid.
+	if(rc==NGX_ERROR && builder->error==NULL)
+		builder->error = "INVALID_MSGPACK";
+
+	return rc==NGX_OK;
+}